@@ -55,7 +55,8 @@ let
     runPhase unpackPhase
     sh scripts/gen_nvs.sh \
       --cache-cert=${./cache.nixos.lv.pem} \
-      --cache-upstream=cache.nixos.lv \
+      --cache-cert=${./cache.nixos.org.pem} \
+      --cache-upstream=cache.nixos.lv,cache.nixos.org \
       --router-ssid=NixVegas \
       --router-passwd=RebuildTheWorld \
       --output=$out
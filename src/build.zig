@@ -23,10 +23,17 @@ pub fn build(b: *std.Build) !void {
 
     const optimize = b.standardOptimizeOption(.{});
 
+    addHost(b, optimize);
+
     const board_rev = b.option(Revision, "board-rev", "Hardware board revision") orelse .@"0.5";
 
-    const esp_idf_source_path = b.option(std.Build.LazyPath, "esp-idf-source", "Path to the esp-idf source directory") orelse @panic("Missing esp-idf source directory");
-    const esp_idf_build_path = b.option(std.Build.LazyPath, "esp-idf-build", "Path to the esp-idf build directory") orelse @panic("Missing esp-idf build directory");
+    const esp_idf_source_path = b.option(std.Build.LazyPath, "esp-idf-source", "Path to the esp-idf source directory");
+    const esp_idf_build_path = b.option(std.Build.LazyPath, "esp-idf-build", "Path to the esp-idf build directory");
+    if (esp_idf_source_path == null or esp_idf_build_path == null) {
+        // Only the firmware needs esp-idf, the host build does not.
+        b.getInstallStep().dependOn(&b.addFail("Missing esp-idf source or build directory").step);
+        return;
+    }
 
     const options = b.addOptions();
     options.addOption(Revision, "board_rev", board_rev);
@@ -41,11 +48,11 @@ pub fn build(b: *std.Build) !void {
                 .{
                     .name = "esp-idf",
                     .module = importIdf(b, .{
-        .target = target,
-        .optimize = optimize,
-        .source_path = esp_idf_source_path,
-        .build_path = esp_idf_build_path,
-    }),
+                        .target = target,
+                        .optimize = optimize,
+                        .source_path = esp_idf_source_path.?,
+                        .build_path = esp_idf_build_path.?,
+                    }),
                 },
                 .{
                     .name = "options",
@@ -59,6 +66,230 @@ pub fn build(b: *std.Build) !void {
     b.installArtifact(lib);
 }
 
+/// Builds the proxy, tests, simulators and benchmarks for the machine running
+/// the build, so that they run without a badge.
+fn addHost(b: *std.Build, optimize: std.builtin.OptimizeMode) void {
+    const exe = b.addExecutable(.{
+        .name = "nixbadge-proxy",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    exe.root_module.addIncludePath(b.path("main"));
+    exe.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_proxy.c",
+            "main/nixbadge_pipe.c",
+            "main/nixbadge_cache.c",
+            "main/nixbadge_cache_posix.c",
+            "host/nixbadge_host.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const host = b.step("host", "Build the proxy for this machine, for load tests");
+    host.dependOn(&b.addInstallArtifact(exe, .{}).step);
+
+    const sim = b.addExecutable(.{
+        .name = "nixbadge-sched-sim",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    sim.root_module.addIncludePath(b.path("main"));
+    sim.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_sched.c",
+            "host/nixbadge_sched_sim.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const run_sim = b.addRunArtifact(sim);
+    if (b.args) |args| run_sim.addArgs(args);
+    const sim_step = b.step("sim", "Simulate the request scheduler, pass options after --");
+    sim_step.dependOn(&run_sim.step);
+
+    const cache_test = b.addExecutable(.{
+        .name = "nixbadge-cache-test",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    cache_test.root_module.addIncludePath(b.path("main"));
+    cache_test.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_cache.c",
+            "main/nixbadge_cache_posix.c",
+            "host/nixbadge_cache_test.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const cache_step = b.step("cache", "Check the cache against a scratch directory");
+    cache_step.dependOn(&b.addRunArtifact(cache_test).step);
+
+    const flight_test = b.addExecutable(.{
+        .name = "nixbadge-flight-test",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    flight_test.root_module.addIncludePath(b.path("main"));
+    flight_test.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_flight.c",
+            "main/nixbadge_cache.c",
+            "main/nixbadge_cache_posix.c",
+            "host/nixbadge_flight_test.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const flight_step = b.step("flight", "Check coalesced fetches replaying the cache");
+    flight_step.dependOn(&b.addRunArtifact(flight_test).step);
+
+    const periodic_test = b.addExecutable(.{
+        .name = "nixbadge-periodic-test",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    periodic_test.root_module.addIncludePath(b.path("main"));
+    periodic_test.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_periodic.c",
+            "host/nixbadge_periodic_test.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const periodic_step = b.step("periodic", "Check periodic jobs against a fake clock");
+    periodic_step.dependOn(&b.addRunArtifact(periodic_test).step);
+
+    const button_sim = b.addExecutable(.{
+        .name = "nixbadge-button-sim",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = optimize,
+            .link_libc = true,
+        }),
+    });
+    button_sim.root_module.addIncludePath(b.path("main"));
+    button_sim.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_button.c",
+            "host/nixbadge_button_sim.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const run_button_sim = b.addRunArtifact(button_sim);
+    if (b.args) |args| run_button_sim.addArgs(args);
+    const button_step = b.step("button", "Replay button edge traces through the gesture detector, -v after -- prints the gestures");
+    button_step.dependOn(&run_button_sim.step);
+
+    const bench = b.addExecutable(.{
+        .name = "nixbadge-bench",
+        .root_module = b.createModule(.{
+            .root_source_file = b.path("host/bench.zig"),
+            .target = b.graph.host,
+            .optimize = .ReleaseFast,
+            .imports = &.{
+                .{
+                    .name = "proto",
+                    .module = b.createModule(.{
+                        .root_source_file = b.path("main/proto.zig"),
+                        .target = b.graph.host,
+                        .optimize = .ReleaseFast,
+                    }),
+                },
+                .{
+                    .name = "render",
+                    .module = b.createModule(.{
+                        .root_source_file = b.path("main/nixbadge/render.zig"),
+                        .target = b.graph.host,
+                        .optimize = .ReleaseFast,
+                    }),
+                },
+            },
+        }),
+    });
+
+    const ws2812_bench = b.addExecutable(.{
+        .name = "nixbadge-ws2812-bench",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = .ReleaseFast,
+            .link_libc = true,
+        }),
+    });
+    ws2812_bench.root_module.addIncludePath(b.path("main"));
+    ws2812_bench.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_ws2812.c",
+            "host/nixbadge_ws2812_bench.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const anim_bench = b.addExecutable(.{
+        .name = "nixbadge-anim-bench",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = .ReleaseFast,
+            .link_libc = true,
+        }),
+    });
+    anim_bench.root_module.addIncludePath(b.path("main"));
+    anim_bench.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_anim.c",
+            "host/nixbadge_anim_bench.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const bench_step = b.step("bench", "Benchmark hot code paths on this machine");
+    bench_step.dependOn(&b.addRunArtifact(bench).step);
+    bench_step.dependOn(&b.addRunArtifact(ws2812_bench).step);
+    bench_step.dependOn(&b.addRunArtifact(anim_bench).step);
+
+    // Debug, so that the C sanitizer traps on undefined behaviour.
+    const anim_fuzz = b.addExecutable(.{
+        .name = "nixbadge-anim-fuzz",
+        .root_module = b.createModule(.{
+            .target = b.graph.host,
+            .optimize = .Debug,
+            .link_libc = true,
+            .sanitize_c = true,
+        }),
+    });
+    anim_fuzz.root_module.addIncludePath(b.path("main"));
+    anim_fuzz.root_module.addCSourceFiles(.{
+        .files = &.{
+            "main/nixbadge_anim.c",
+            "host/nixbadge_anim_fuzz.c",
+        },
+        .flags = &.{ "-std=gnu11", "-Wall" },
+    });
+
+    const run_fuzz = b.addRunArtifact(anim_fuzz);
+    if (b.args) |args| run_fuzz.addArgs(args);
+    const fuzz_step = b.step("fuzz", "Fuzz the animation loader, pass iterations and a seed after --");
+    fuzz_step.dependOn(&run_fuzz.step);
+}
+
 pub fn importIdf(b: *std.Build, options: struct {
     target: std.Build.ResolvedTarget,
     optimize: std.builtin.OptimizeMode,
@@ -0,0 +1,201 @@
+//! Micro benchmarks of code that runs on every mesh packet or LED frame,
+//! built for the machine running the build with `zig build bench`.
+
+const std = @import("std");
+const builtin = @import("builtin");
+const proto = @import("proto");
+const render = @import("render");
+const der = std.crypto.asn1.der;
+
+const iterations = 1_000_000;
+
+/// The DER encoding mesh packets used before the fixed layout, kept to
+/// compare against. Encoding needs scratch space for the DER encoder and
+/// the result is cut off at the packet size.
+const DerPacket = struct {
+    packet: proto.Packet,
+
+    pub fn encodeDer(self: DerPacket, encoder: *der.Encoder) !void {
+        switch (self.packet) {
+            inline else => |payload| if (@TypeOf(payload) != void) try encoder.any(payload),
+        }
+        try encoder.any(std.meta.activeTag(self.packet));
+    }
+
+    pub fn decodeDer(decoder: *der.Decoder) !DerPacket {
+        const tag = try decoder.any(proto.Tag);
+        switch (tag) {
+            inline else => |t| {
+                const T = std.meta.TagPayload(proto.Packet, t);
+                const value: T = if (T == void) {} else try decoder.any(T);
+                return .{ .packet = @unionInit(proto.Packet, @tagName(t), value) };
+            },
+        }
+    }
+
+    fn encode(packet: proto.Packet, buff: *[proto.packet_size]u8) ![]const u8 {
+        var tmpbuff = [_]u8{0} ** (proto.packet_size * 2);
+        var fba = std.heap.FixedBufferAllocator.init(&tmpbuff);
+
+        var encoder = der.Encoder.init(fba.allocator());
+        try encoder.buffer.ensureCapacity(proto.packet_size);
+
+        try encoder.any(DerPacket{ .packet = packet });
+
+        buff.* = [_]u8{0} ** proto.packet_size;
+        const i: usize = @min(buff.len, encoder.buffer.data.len);
+        @memcpy(buff[0..i], encoder.buffer.data[0..i]);
+        return buff;
+    }
+
+    fn decode(buff: []const u8) !proto.Packet {
+        var decoder = der.Decoder{ .bytes = buff };
+        return (try decoder.any(DerPacket)).packet;
+    }
+};
+
+const FixedPacket = struct {
+    fn encode(packet: proto.Packet, buff: *[proto.packet_size]u8) ![]const u8 {
+        return packet.encode(buff);
+    }
+
+    fn decode(buff: []const u8) !proto.Packet {
+        return proto.Packet.decode(buff);
+    }
+};
+
+fn benchCodec(comptime Codec: type, name: []const u8, writer: anytype) !void {
+    const packets = [_]proto.Packet{
+        .{ .reload_config = {} },
+        .{ .digest = .{ .ip = 0x0105a8c0, .generation = 17, .count = 4321 } },
+    };
+
+    var buffs: [packets.len][proto.packet_size]u8 = undefined;
+    var encoded: [packets.len][]const u8 = undefined;
+    for (packets, 0..) |packet, i| {
+        encoded[i] = try Codec.encode(packet, &buffs[i]);
+        if (!std.meta.eql(try Codec.decode(encoded[i]), packet)) {
+            return error.RoundTripFailed;
+        }
+    }
+
+    var buff: [proto.packet_size]u8 = undefined;
+    var timer = try std.time.Timer.start();
+    for (0..iterations) |i| {
+        const data = try Codec.encode(packets[i % packets.len], &buff);
+        std.mem.doNotOptimizeAway(data.ptr);
+    }
+    const encode_ns = timer.lap();
+    for (0..iterations) |i| {
+        const packet = try Codec.decode(encoded[i % packets.len]);
+        std.mem.doNotOptimizeAway(packet);
+    }
+    const decode_ns = timer.read();
+
+    try writer.print("{s}: encode {d:.1} ns, decode {d:.1} ns, digest {d} bytes\n", .{
+        name,
+        @as(f64, @floatFromInt(encode_ns)) / iterations,
+        @as(f64, @floatFromInt(decode_ns)) / iterations,
+        encoded[1].len,
+    });
+}
+
+const leds = 12;
+const frames = 100_000;
+
+/// The float renderer LED frames were drawn with before, kept to compare
+/// against. The badge has no FPU, so every sine here is soft-float there.
+const FloatFrame = struct {
+    fn render(pixels: *[leds * 3]u8, p: u32) void {
+        const offset: f32 = @floatCast(@as(f64, @floatFromInt(p)) * 2 * std.math.pi / (1 << 32));
+        for (0..leds) |led| {
+            const angle = offset + @as(f32, @floatFromInt(led)) * 0.3;
+            const color_off: f32 = std.math.pi * 2.0 / 3.0;
+            const mul: f32 = if (led == 4) 127 else 64;
+            const off: f32 = if (led == 4) 128 else 0;
+            for (0..3) |i| {
+                const v = @sin(angle + color_off * @as(f32, @floatFromInt(i))) * mul + off;
+                // The C code converted through int, negative values wrap.
+                pixels[led * 3 + i] = @truncate(@as(u32, @bitCast(@as(i32, @intFromFloat(v)))));
+            }
+        }
+    }
+};
+
+const FixedFrame = struct {
+    fn render(pixels: *[leds * 3]u8, p: u32) void {
+        var chase: render.Chase = .{ .phase = p };
+        render.render(render.Effect.init(&chase), .{ .pixels = pixels }, false);
+    }
+};
+
+/// Cycles of the time stamp counter where there is one, for a figure that
+/// does not depend on the clock speed.
+fn cycles() u64 {
+    switch (builtin.cpu.arch) {
+        .x86_64 => {
+            var lo: u32 = undefined;
+            var hi: u32 = undefined;
+            asm volatile ("rdtsc"
+                : [lo] "={eax}" (lo),
+                  [hi] "={edx}" (hi),
+            );
+            return @as(u64, hi) << 32 | lo;
+        },
+        else => return 0,
+    }
+}
+
+fn benchFrames(comptime Renderer: type, name: []const u8, writer: anytype) !void {
+    var pixels: [leds * 3]u8 = undefined;
+    const step = (render.Chase{}).step;
+    var timer = try std.time.Timer.start();
+    const start = cycles();
+    for (0..frames) |i| {
+        Renderer.render(&pixels, @as(u32, @truncate(i)) *% step);
+        std.mem.doNotOptimizeAway(&pixels);
+    }
+    const ns = timer.read();
+    const ticks = cycles() - start;
+
+    try writer.print("{s}: {d:.1} ns, {d} cycles per frame\n", .{
+        name,
+        @as(f64, @floatFromInt(ns)) / frames,
+        ticks / frames,
+    });
+}
+
+/// Draws the same frames both ways, which may differ by one where the
+/// float sine lands right on a step.
+fn compareFrames(writer: anytype) !void {
+    var expected: [leds * 3]u8 = undefined;
+    var actual: [leds * 3]u8 = undefined;
+    const step = (render.Chase{}).step;
+    var differ: usize = 0;
+    for (0..frames) |i| {
+        const p = @as(u32, @truncate(i)) *% step;
+        FloatFrame.render(&expected, p);
+        FixedFrame.render(&actual, p);
+        for (expected, actual) |e, a| {
+            // Off by one across the wrap of a negative value is still one.
+            const diff = @min(e -% a, a -% e);
+            if (diff > 1) return error.FramesDiffer;
+            if (diff != 0) differ += 1;
+        }
+    }
+    try writer.print("fixed point matches float in {d:.3}% of channels, the rest are off by one\n", .{
+        100 - @as(f64, @floatFromInt(differ)) * 100 / (frames * leds * 3),
+    });
+}
+
+pub fn main() !void {
+    const stdout = std.io.getStdOut().writer();
+    try stdout.print("Mesh packets, per packet over {d} packets:\n", .{iterations});
+    try benchCodec(DerPacket, "DER         ", stdout);
+    try benchCodec(FixedPacket, "fixed layout", stdout);
+
+    try stdout.print("LED frames of {d} LEDs, over {d} frames:\n", .{ leds, frames });
+    try benchFrames(FloatFrame, "float      ", stdout);
+    try benchFrames(FixedFrame, "fixed point", stdout);
+    try compareFrames(stdout);
+}
@@ -0,0 +1,120 @@
+/*
+ * Times drawing a keyframe animation on strips of different lengths, to
+ * see what an animation costs the LED task against its frame period.
+ *
+ * The animation has a wave over the whole strip and a few tracks over
+ * parts of it, each with as many keyframes and easings as it can use, so
+ * that every LED is drawn more than once and looks its keyframes up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "nixbadge_anim.h"
+
+#define BENCH_COLOURS 16
+#define BENCH_TRACKS 8
+#define BENCH_KEYFRAMES 32
+#define BENCH_FRAME_MS 20
+#define BENCH_RUN_US 200000
+
+static const size_t bench_chains[] = {12, 60, 150, 300, 600, 1024};
+
+static uint8_t* bench_put16(uint8_t* p, uint16_t value) {
+  *p++ = value;
+  *p++ = value >> 8;
+  return p;
+}
+
+static uint8_t* bench_put32(uint8_t* p, uint32_t value) {
+  p = bench_put16(p, value);
+  return bench_put16(p, value >> 16);
+}
+
+static size_t bench_build(uint8_t* data) {
+  uint8_t* p = data;
+  *p++ = 'N';
+  *p++ = 'A';
+  *p++ = NIXBADGE_ANIM_VERSION;
+  *p++ = BENCH_COLOURS;
+  *p++ = BENCH_TRACKS;
+  *p++ = 0;
+  p = bench_put32(p, 0);
+  p = bench_put32(p, BENCH_KEYFRAMES * 250);
+  for (int i = 0; i < BENCH_COLOURS * NIXBADGE_ANIM_CHANNELS; i++) {
+    *p++ = rand();
+  }
+  for (int t = 0; t < BENCH_TRACKS; t++) {
+    // The first track covers the whole strip, the others a part of it.
+    p = bench_put16(p, t == 0 ? 0 : t * 37);
+    p = bench_put16(p, t == 0 ? 0 : 100 + t * 50);
+    p = bench_put16(p, (uint16_t)(int16_t)(t % 2 ? -20 - t : 15 + t));
+    *p++ = BENCH_KEYFRAMES;
+    *p++ = 0;
+    for (int k = 0; k < BENCH_KEYFRAMES; k++) {
+      p = bench_put16(p, k == 0 ? 0 : 250);
+      *p++ = rand() % BENCH_COLOURS;
+      *p++ = k % NIXBADGE_ANIM_EASINGS;
+    }
+  }
+  return p - data;
+}
+
+static uint64_t bench_cycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint64_t bench_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main() {
+  static uint8_t data[NIXBADGE_ANIM_HEADER_SIZE +
+                      BENCH_COLOURS * NIXBADGE_ANIM_CHANNELS +
+                      BENCH_TRACKS * (NIXBADGE_ANIM_TRACK_SIZE +
+                                      BENCH_KEYFRAMES *
+                                          NIXBADGE_ANIM_KEYFRAME_SIZE)];
+  srand(1);
+  size_t len = bench_build(data);
+  const char* error = NULL;
+  nixbadge_anim_t* anim = nixbadge_anim_new(data, len, &error);
+  if (!anim) {
+    fprintf(stderr, "the animation is not valid: %s\n", error);
+    return 1;
+  }
+  printf("%zu bytes, %d tracks of %d keyframes\n", len, BENCH_TRACKS,
+         BENCH_KEYFRAMES);
+
+  for (size_t c = 0; c < sizeof(bench_chains) / sizeof(*bench_chains); c++) {
+    size_t size = bench_chains[c] * NIXBADGE_ANIM_CHANNELS;
+    uint8_t* pixels = malloc(size);
+    if (!pixels) return 1;
+
+    size_t frames = 0;
+    uint64_t start_ns = bench_ns(), ns;
+    uint64_t start = bench_cycles();
+    do {
+      nixbadge_anim_render(anim, frames * BENCH_FRAME_MS, pixels, size);
+      __asm__ volatile("" : : "r"(pixels) : "memory");
+      frames++;
+      ns = bench_ns() - start_ns;
+    } while (ns < BENCH_RUN_US * 1000ULL);
+    uint64_t cycles = bench_cycles() - start;
+    printf("%5zu LEDs: %8.1f ns, %llu cycles per frame\n", bench_chains[c],
+           (double)ns / frames, (unsigned long long)(cycles / frames));
+    free(pixels);
+  }
+  nixbadge_anim_free(anim);
+  return 0;
+}
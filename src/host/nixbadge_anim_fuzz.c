@@ -0,0 +1,126 @@
+/*
+ * Feeds animations the badge may be sent to the loader and the renderer,
+ * which must reject or draw any of them without reading or writing out of
+ * bounds.
+ *
+ * Built with clang -fsanitize=fuzzer,address and NIXBADGE_ANIM_LIBFUZZER
+ * defined, this is a libFuzzer target. Otherwise it has a main of its own
+ * that mutates a valid animation at random, which is what `zig build fuzz`
+ * runs with the C sanitizer on:
+ *
+ *   nixbadge-anim-fuzz [iterations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_anim.h"
+
+#define FUZZ_MAX_LEDS 300
+#define FUZZ_MAX_SIZE 4096
+
+/* @return whether the animation was loaded */
+static bool fuzz_one(const uint8_t* data, size_t size) {
+  nixbadge_anim_t* anim = nixbadge_anim_new(data, size, NULL);
+  if (!anim) return false;
+
+  static uint8_t pixels[FUZZ_MAX_LEDS * NIXBADGE_ANIM_CHANNELS];
+  // Around the loop points and either end of time, on a strip of any
+  // length.
+  int64_t duration = nixbadge_anim_duration_ms(anim);
+  const int64_t times[] = {
+      INT64_MIN,    -duration - 3,    -1,       0, 1, duration / 2,
+      duration - 1, duration,         duration + 1, 3 * duration + 7,
+      INT64_MAX,
+  };
+  size_t leds = size % FUZZ_MAX_LEDS;
+  for (size_t i = 0; i < sizeof(times) / sizeof(*times); i++) {
+    nixbadge_anim_render(anim, times[i], pixels,
+                         leds * NIXBADGE_ANIM_CHANNELS);
+  }
+  nixbadge_anim_free(anim);
+  return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  fuzz_one(data, size);
+  return 0;
+}
+
+#ifndef NIXBADGE_ANIM_LIBFUZZER
+
+/* Two colours chasing around the strip, and a blink on the first LED. */
+static const uint8_t fuzz_seed[] = {
+    'N', 'A', NIXBADGE_ANIM_VERSION, 3, 2, 0,  // header
+    0, 0, 0, 0,                                // loop start
+    0xd0, 0x07, 0, 0,                          // loop end, 2000 ms
+    0, 0, 0, 0x7e, 0x7e, 0xbf, 0xff, 0x80, 0,  // palette
+    0, 0, 0, 0, 0x9c, 0xff, 3, 0,              // track, -100 ms a LED
+    0, 0, 0, NIXBADGE_ANIM_STEP,               //
+    0xe8, 0x03, 1, NIXBADGE_ANIM_EASE_IN_OUT,  //
+    0xe8, 0x03, 0, NIXBADGE_ANIM_EASE_OUT,     //
+    0, 0, 1, 0, 0, 0, 2, 0,                    // track, first LED
+    0, 0, 2, NIXBADGE_ANIM_STEP,               //
+    0xf4, 0x01, 0, NIXBADGE_ANIM_LINEAR,       //
+};
+
+static uint8_t fuzz_buf[FUZZ_MAX_SIZE];
+
+/* Flips, sets, inserts or drops a few bytes. */
+static size_t fuzz_mutate(size_t len) {
+  int edits = 1 + rand() % 4;
+  for (int i = 0; i < edits; i++) {
+    size_t at = len ? rand() % len : 0;
+    switch (rand() % 5) {
+      case 0:
+        if (len) fuzz_buf[at] ^= 1 << (rand() % 8);
+        break;
+      case 1:
+        if (len) fuzz_buf[at] = rand();
+        break;
+      case 2:
+        if (len) fuzz_buf[at] = (const uint8_t[]){0, 1, 0x7f, 0xff}[rand() % 4];
+        break;
+      case 3:
+        if (len < FUZZ_MAX_SIZE) {
+          memmove(fuzz_buf + at + 1, fuzz_buf + at, len - at);
+          fuzz_buf[at] = rand();
+          len++;
+        }
+        break;
+      case 4:
+        if (len) {
+          memmove(fuzz_buf + at, fuzz_buf + at + 1, len - at - 1);
+          len--;
+        }
+        break;
+    }
+  }
+  return len;
+}
+
+int main(int argc, char** argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  srand(argc > 2 ? atoi(argv[2]) : 1);
+
+  if (!fuzz_one(fuzz_seed, sizeof(fuzz_seed))) {
+    fprintf(stderr, "the seed animation is not valid\n");
+    return 1;
+  }
+  long loaded = 0;
+  for (long i = 0; i < iterations; i++) {
+    // Mostly a few edits away from the seed, where the loader has to look
+    // closely, sometimes further.
+    memcpy(fuzz_buf, fuzz_seed, sizeof(fuzz_seed));
+    size_t len = sizeof(fuzz_seed);
+    int rounds = rand() % 8 == 0 ? 1 + rand() % 32 : 1;
+    for (int r = 0; r < rounds; r++) len = fuzz_mutate(len);
+
+    if (fuzz_one(fuzz_buf, len)) loaded++;
+  }
+  printf("%ld inputs, %ld loaded\n", iterations, loaded);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Replays traces of button edges through the gesture detector, the way
+ * the badge feeds it, and checks the gestures it finds against the ones
+ * each trace is meant to give.
+ *
+ * Edges are passed in order, and between them the detector is advanced
+ * whenever it asks to be, like the timer on the badge does. Traces have
+ * bounces like those of the tactile switch on the badge, a millisecond or
+ * two of edges when it is pressed or let go, and a few that no press
+ * should come out of.
+ *
+ *   nixbadge-button-sim [-v]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nixbadge_button.h"
+
+#define SIM_DEBOUNCE_MS 20
+#define SIM_LONG_PRESS_MS 800
+#define SIM_DOUBLE_CLICK_MS 300
+#define SIM_MAX_EDGES 32
+#define SIM_MAX_EVENTS 8
+
+/* The pin goes to `level` at `at_ms`. */
+typedef struct {
+  int32_t at_ms;
+  bool level;
+} sim_edge_t;
+
+typedef struct {
+  const char* name;
+  sim_edge_t edges[SIM_MAX_EDGES];
+  /* Gestures it gives, and when the first press of each began. */
+  nixbadge_button_gesture_t gestures[SIM_MAX_EVENTS];
+  int32_t pressed_ms[SIM_MAX_EVENTS];
+  size_t events;
+} sim_trace_t;
+
+/* A press or a release at `t` ms, bouncing for a few ms. */
+#define DOWN(t) {(t), true}, {(t) + 1, false}, {(t) + 2, true}
+#define UP(t) {(t), false}, {(t) + 1, true}, {(t) + 3, false}
+#define END {-1, false}
+
+static const sim_trace_t sim_traces[] = {
+    {"clean click", {{100, true}, {200, false}, END},
+     {NIXBADGE_BUTTON_PRESS}, {100}, 1},
+    {"bouncing click", {DOWN(100), UP(250), END},
+     {NIXBADGE_BUTTON_PRESS}, {100}, 1},
+    {"glitch", {{100, true}, {105, false}, {400, true}, {403, false}, END},
+     {0}, {0}, 0},
+    {"dropout while held", {DOWN(100), {400, false}, {401, true}, UP(600),
+                            END},
+     {NIXBADGE_BUTTON_PRESS}, {100}, 1},
+    {"long press", {DOWN(100), UP(1500), END},
+     {NIXBADGE_BUTTON_LONG_PRESS}, {100}, 1},
+    {"let go just before long", {DOWN(100), UP(895), END},
+     {NIXBADGE_BUTTON_PRESS}, {100}, 1},
+    {"double click", {DOWN(100), UP(200), DOWN(350), UP(450), END},
+     {NIXBADGE_BUTTON_DOUBLE_CLICK}, {100}, 1},
+    {"two clicks too far apart", {DOWN(100), UP(200), DOWN(520), UP(600), END},
+     {NIXBADGE_BUTTON_PRESS, NIXBADGE_BUTTON_PRESS}, {100, 520}, 2},
+    {"click then long press", {DOWN(100), UP(200), DOWN(350), UP(1400), END},
+     {NIXBADGE_BUTTON_PRESS, NIXBADGE_BUTTON_LONG_PRESS}, {100, 350}, 2},
+    {"triple click", {DOWN(100), UP(180), DOWN(300), UP(380), DOWN(500),
+                      UP(580), END},
+     {NIXBADGE_BUTTON_DOUBLE_CLICK, NIXBADGE_BUTTON_PRESS}, {100, 500}, 2},
+    {"missed edge", {{100, true}, {101, true}, {200, false}, END},
+     {NIXBADGE_BUTTON_PRESS}, {100}, 1},
+};
+
+static const char* const sim_names[] = {"press", "long press",
+                                        "double click"};
+
+typedef struct {
+  nixbadge_button_event_t events[SIM_MAX_EVENTS];
+  size_t len;
+  bool verbose;
+} sim_result_t;
+
+static void sim_event(void* arg, const nixbadge_button_event_t* event) {
+  sim_result_t* result = arg;
+  if (result->verbose) {
+    printf("  %6lld ms: %s, pressed at %lld ms\n",
+           (long long)(event->at_us / 1000), sim_names[event->gesture],
+           (long long)(event->pressed_us / 1000));
+  }
+  if (result->len < SIM_MAX_EVENTS) result->events[result->len] = *event;
+  result->len++;
+}
+
+/* Advances the detector through everything due by `until_us`. */
+static void sim_run_until(nixbadge_button_t* button, int64_t until_us) {
+  int64_t next;
+  while ((next = nixbadge_button_next_us(button)) <= until_us) {
+    nixbadge_button_advance(button, next);
+  }
+}
+
+static bool sim_trace(const sim_trace_t* trace, bool verbose) {
+  sim_result_t result = {.verbose = verbose};
+  nixbadge_button_config_t config = {
+      .debounce_us = SIM_DEBOUNCE_MS * 1000,
+      .long_press_us = SIM_LONG_PRESS_MS * 1000,
+      .double_click_us = SIM_DOUBLE_CLICK_MS * 1000,
+      .active_high = true,
+      .cb = sim_event,
+      .arg = &result,
+  };
+  if (verbose) printf("%s\n", trace->name);
+  nixbadge_button_t* button = nixbadge_button_new(&config, false, 0);
+  if (!button) return false;
+
+  int64_t last_us = 0;
+  for (const sim_edge_t* edge = trace->edges; edge->at_ms >= 0; edge++) {
+    last_us = edge->at_ms * 1000LL;
+    sim_run_until(button, last_us);
+    nixbadge_button_edge(button, edge->level, last_us);
+  }
+  // Long enough after the last edge for whatever is pending.
+  sim_run_until(button, last_us + (SIM_DEBOUNCE_MS + SIM_LONG_PRESS_MS +
+                                   SIM_DOUBLE_CLICK_MS) *
+                                      1000LL);
+
+  bool ok = result.len == trace->events &&
+            nixbadge_button_next_us(button) == INT64_MAX;
+  for (size_t i = 0; ok && i < trace->events; i++) {
+    ok = result.events[i].gesture == trace->gestures[i] &&
+         result.events[i].pressed_us == trace->pressed_ms[i] * 1000LL;
+  }
+  nixbadge_button_stats_t stats;
+  nixbadge_button_get_stats(button, &stats);
+  printf("%-4s %-28s %2lu edges, %2lu bounces, %lu gestures\n",
+         ok ? "ok" : "FAIL", trace->name, (unsigned long)stats.edges,
+         (unsigned long)stats.bounces, (unsigned long)stats.events);
+  nixbadge_button_free(button);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(sim_traces) / sizeof(*sim_traces); i++) {
+    if (!sim_trace(&sim_traces[i], verbose)) failed++;
+  }
+  if (failed) fprintf(stderr, "%d traces failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Runs the cache over its POSIX backend in a scratch directory through the
+ * cases that take more than one client to reach: an object evicted while a
+ * reader still has it open, and fetched again before and after that reader
+ * is done with it.
+ *
+ *   nixbadge-cache-test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nixbadge_cache.h"
+#include "nixbadge_cache_posix.h"
+
+#define TEST_BUDGET 1024
+/* Few enough entries that a handful of objects fills them. */
+#define TEST_ENTRIES 3
+
+static int test_failed = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      test_failed++;                                                 \
+    }                                                                \
+  } while (0)
+
+static int test_put(nixbadge_cache_t* cache, const char* key,
+                    const char* data) {
+  nixbadge_cache_writer_t writer;
+  int err = nixbadge_cache_begin(cache, key, &writer);
+  if (err < 0) return err;
+  err = nixbadge_cache_append(&writer, data, strlen(data));
+  if (err < 0) return err;
+  return nixbadge_cache_commit(&writer);
+}
+
+/* @return whether `key` holds exactly `data` */
+static bool test_holds(nixbadge_cache_t* cache, const char* key,
+                       const char* data) {
+  nixbadge_cache_reader_t reader;
+  if (nixbadge_cache_open(cache, key, &reader) < 0) return false;
+  char buf[64];
+  ssize_t n = nixbadge_cache_read(&reader, buf, sizeof(buf));
+  nixbadge_cache_close(&reader);
+  return n == (ssize_t)strlen(data) && memcmp(buf, data, n) == 0;
+}
+
+static void test_doomed_refetch(const nixbadge_cache_backend_t* backend) {
+  nixbadge_cache_t* cache =
+      nixbadge_cache_new(backend, TEST_BUDGET, TEST_ENTRIES);
+  CHECK(cache != NULL);
+  if (!cache) return;
+
+  CHECK(test_put(cache, "old", "first download") == 0);
+  nixbadge_cache_reader_t reader;
+  CHECK(nixbadge_cache_open(cache, "old", &reader) == 0);
+
+  // With every entry taken, "old" is the least recently used and is evicted
+  // while open, so it is doomed, and "other" goes to make room.
+  CHECK(test_put(cache, "other", "something else") == 0);
+  CHECK(test_put(cache, "third", "and another") == 0);
+  CHECK(test_put(cache, "fourth", "one more") == 0);
+  CHECK(!nixbadge_cache_contains(cache, "old"));
+  CHECK(!nixbadge_cache_contains(cache, "other"));
+  nixbadge_cache_reader_t missed;
+  CHECK(nixbadge_cache_open(cache, "old", &missed) == -ENOENT);
+
+  // Fetching it again meanwhile is served without being cached.
+  nixbadge_cache_writer_t writer;
+  CHECK(nixbadge_cache_begin(cache, "old", &writer) == -EBUSY);
+
+  // The reader still has the old bytes, and closing it deletes them.
+  char buf[64];
+  ssize_t n = nixbadge_cache_read(&reader, buf, sizeof(buf));
+  CHECK(n == 14 && memcmp(buf, "first download", 14) == 0);
+  nixbadge_cache_close(&reader);
+
+  // Now it can be cached again, and the new object stays.
+  CHECK(test_put(cache, "old", "second download") == 0);
+  CHECK(nixbadge_cache_contains(cache, "old"));
+  CHECK(test_holds(cache, "old", "second download"));
+
+  nixbadge_cache_stats_t stats;
+  nixbadge_cache_get_stats(cache, &stats);
+  CHECK(stats.entries == 3);
+  CHECK(stats.used == strlen("and another") + strlen("one more") +
+                          strlen("second download"));
+  nixbadge_cache_free(cache);
+
+  // And it is still there for the next boot.
+  cache = nixbadge_cache_new(backend, TEST_BUDGET, TEST_ENTRIES);
+  CHECK(cache != NULL);
+  if (!cache) return;
+  CHECK(test_holds(cache, "old", "second download"));
+  nixbadge_cache_free(cache);
+}
+
+static void test_doomed_two_readers(const nixbadge_cache_backend_t* backend) {
+  nixbadge_cache_t* cache =
+      nixbadge_cache_new(backend, TEST_BUDGET, TEST_ENTRIES);
+  CHECK(cache != NULL);
+  if (!cache) return;
+
+  // The key of a doomed object is only freed by the last of its readers.
+  CHECK(test_put(cache, "shared", "pinned twice") == 0);
+  nixbadge_cache_reader_t first, second;
+  CHECK(nixbadge_cache_open(cache, "shared", &first) == 0);
+  CHECK(nixbadge_cache_open(cache, "shared", &second) == 0);
+  CHECK(test_put(cache, "filler", "x") == 0);
+  CHECK(test_put(cache, "filler2", "y") == 0);
+  CHECK(test_put(cache, "filler3", "z") == 0);
+  CHECK(!nixbadge_cache_contains(cache, "shared"));
+
+  nixbadge_cache_writer_t writer;
+  nixbadge_cache_close(&first);
+  CHECK(nixbadge_cache_begin(cache, "shared", &writer) == -EBUSY);
+  nixbadge_cache_close(&second);
+  CHECK(test_put(cache, "shared", "refetched") == 0);
+  CHECK(test_holds(cache, "shared", "refetched"));
+  nixbadge_cache_free(cache);
+}
+
+int main(void) {
+  char root[] = "/tmp/nixbadge-cache-XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  struct {
+    const char* name;
+    void (*run)(const nixbadge_cache_backend_t* backend);
+  } tests[] = {
+      {"doomed object fetched again", test_doomed_refetch},
+      {"doomed object with two readers", test_doomed_two_readers},
+  };
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/%zu", root, i);
+    nixbadge_cache_backend_t backend;
+    if (nixbadge_cache_posix_init(&backend, dir) < 0) {
+      perror(dir);
+      return 1;
+    }
+    int before = test_failed;
+    tests[i].run(&backend);
+    // The backend has no free of its own, it lives as long as the badge.
+    free(backend.ctx);
+    printf("%-4s %s\n", test_failed == before ? "ok" : "FAIL",
+           tests[i].name);
+  }
+
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+  if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", root);
+  return test_failed ? 1 : 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Runs coalesced fetches over the cache's POSIX backend in a scratch
+ * directory, from a single thread: readers the ring lapped, or that joined
+ * late, reading back what they missed from the object being written and
+ * then from the committed one, and a leader going on without its client.
+ *
+ *   nixbadge-flight-test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_cache.h"
+#include "nixbadge_cache_posix.h"
+#include "nixbadge_flight.h"
+
+#define TEST_BUDGET 4096
+#define TEST_ENTRIES 8
+/* Small enough that a few pieces of the body wrap it. */
+#define TEST_RING_SIZE 16
+#define TEST_BODY_LEN 80
+
+static int test_failed = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      test_failed++;                                                 \
+    }                                                                \
+  } while (0)
+
+static char test_body[TEST_BODY_LEN];
+
+static void test_publish(nixbadge_flight_t* flight, size_t from, size_t to) {
+  for (size_t at = from; at < to; at += 8) {
+    nixbadge_flight_publish(flight, test_body + at, to - at < 8 ? to - at : 8);
+  }
+}
+
+/**
+ * Reads what is there without waiting.
+ * @return the last result of nixbadge_flight_read
+ */
+static ssize_t test_drain(nixbadge_flight_reader_t* reader, char* buf,
+                          size_t* len) {
+  ssize_t n;
+  while ((n = nixbadge_flight_read(reader, buf + *len, 5, 0)) > 0) *len += n;
+  return n;
+}
+
+static void test_late_replay(nixbadge_cache_t* cache) {
+  nixbadge_flight_table_t* table =
+      nixbadge_flight_table_new(2, TEST_RING_SIZE);
+  bool leader;
+  nixbadge_flight_reader_t own, early, late;
+  nixbadge_flight_t* flight = nixbadge_flight_join(table, "/nar/a", &leader,
+                                                   &own);
+  CHECK(flight && leader);
+  if (!flight) return;
+  nixbadge_flight_leave(&own);
+
+  CHECK(nixbadge_flight_cache(flight, cache, "a"));
+  nixbadge_flight_start(flight, 200);
+  CHECK(nixbadge_flight_join(table, "/nar/a", &leader, &early) == flight);
+  test_publish(flight, 0, 40);
+
+  // Long past the ring, and still served from the start.
+  CHECK(nixbadge_flight_join(table, "/nar/a", &leader, &late) == flight);
+  CHECK(!leader);
+  char got[TEST_BODY_LEN];
+  size_t late_len = 0;
+  CHECK(nixbadge_flight_read(&late, got, 8, 0) == 8);
+  late_len = 8;
+
+  // The early one was lapped and reads the object being written.
+  char early_got[TEST_BODY_LEN];
+  size_t early_len = 0;
+  CHECK(test_drain(&early, early_got, &early_len) == -ETIMEDOUT);
+  CHECK(early_len == 40);
+
+  test_publish(flight, 40, TEST_BODY_LEN);
+  CHECK(nixbadge_flight_finish(flight, true) == 0);
+  CHECK(nixbadge_cache_contains(cache, "a"));
+
+  // The rest of what the ring lost now comes from the committed object.
+  CHECK(test_drain(&late, got, &late_len) == 0);
+  CHECK(late_len == TEST_BODY_LEN);
+  CHECK(memcmp(got, test_body, TEST_BODY_LEN) == 0);
+  CHECK(test_drain(&early, early_got, &early_len) == 0);
+  CHECK(early_len == TEST_BODY_LEN);
+  CHECK(memcmp(early_got, test_body, TEST_BODY_LEN) == 0);
+  nixbadge_flight_leave(&late);
+  nixbadge_flight_leave(&early);
+
+  nixbadge_flight_stats_t stats;
+  nixbadge_flight_get_stats(table, &stats);
+  CHECK(stats.followers == 2 && stats.replayed == 1 && stats.late == 0);
+  CHECK(stats.lapped == 0);
+}
+
+static void test_uncached(nixbadge_cache_t* cache) {
+  nixbadge_flight_table_t* table =
+      nixbadge_flight_table_new(2, TEST_RING_SIZE);
+  bool leader;
+  nixbadge_flight_reader_t own, early, late;
+  nixbadge_flight_t* flight = nixbadge_flight_join(table, "/nar/b", &leader,
+                                                   &own);
+  CHECK(flight && leader);
+  if (!flight) return;
+  CHECK(nixbadge_flight_join(table, "/nar/b", &leader, &early) == flight);
+
+  // Nothing is cached for an error, so there is nothing to fall back on.
+  CHECK(nixbadge_flight_cache(flight, cache, "b"));
+  nixbadge_flight_start(flight, 404);
+  CHECK(!nixbadge_flight_replayable(flight));
+  test_publish(flight, 0, 40);
+  CHECK(nixbadge_flight_join(table, "/nar/b", &leader, &late) == NULL);
+
+  char got[TEST_BODY_LEN];
+  CHECK(nixbadge_flight_read(&early, got, sizeof(got), 0) == -ENOBUFS);
+
+  // Without its client, the leader goes on for as long as a reader is left.
+  nixbadge_flight_leave(&own);
+  CHECK(nixbadge_flight_wanted(flight));
+  nixbadge_flight_leave(&early);
+  CHECK(!nixbadge_flight_wanted(flight));
+  CHECK(nixbadge_flight_finish(flight, true) == 0);
+  CHECK(!nixbadge_cache_contains(cache, "b"));
+
+  nixbadge_flight_stats_t stats;
+  nixbadge_flight_get_stats(table, &stats);
+  CHECK(stats.late == 1 && stats.lapped == 1);
+}
+
+static void test_cache_only(nixbadge_cache_t* cache) {
+  nixbadge_flight_table_t* table =
+      nixbadge_flight_table_new(2, TEST_RING_SIZE);
+  bool leader;
+  nixbadge_flight_reader_t own;
+  nixbadge_flight_t* flight = nixbadge_flight_join(table, "/nar/c", &leader,
+                                                   &own);
+  CHECK(flight && leader);
+  if (!flight) return;
+
+  // The cache wants the body even once every client is gone.
+  CHECK(nixbadge_flight_cache(flight, cache, "c"));
+  nixbadge_flight_start(flight, 200);
+  test_publish(flight, 0, 24);
+  nixbadge_flight_leave(&own);
+  CHECK(nixbadge_flight_wanted(flight));
+  test_publish(flight, 24, TEST_BODY_LEN);
+
+  // A failed fetch leaves nothing behind.
+  CHECK(nixbadge_flight_finish(flight, false) == 0);
+  CHECK(!nixbadge_cache_contains(cache, "c"));
+}
+
+int main(void) {
+  for (size_t i = 0; i < TEST_BODY_LEN; i++) test_body[i] = 'A' + i % 53;
+
+  char root[] = "/tmp/nixbadge-flight-XXXXXX";
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  struct {
+    const char* name;
+    void (*run)(nixbadge_cache_t* cache);
+  } tests[] = {
+      {"late and lapped readers replay the cache", test_late_replay},
+      {"readers without the cache are cut loose", test_uncached},
+      {"the cache alone keeps a fetch going", test_cache_only},
+  };
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/%zu", root, i);
+    nixbadge_cache_backend_t backend;
+    if (nixbadge_cache_posix_init(&backend, dir) < 0) {
+      perror(dir);
+      return 1;
+    }
+    nixbadge_cache_t* cache =
+        nixbadge_cache_new(&backend, TEST_BUDGET, TEST_ENTRIES);
+    if (!cache) {
+      perror("nixbadge_cache_new");
+      return 1;
+    }
+    int before = test_failed;
+    tests[i].run(cache);
+    nixbadge_cache_free(cache);
+    // The backend has no free of its own, it lives as long as the badge.
+    free(backend.ctx);
+    printf("%-4s %s\n", test_failed == before ? "ok" : "FAIL",
+           tests[i].name);
+  }
+
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+  if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", root);
+  return test_failed ? 1 : 0;
+}
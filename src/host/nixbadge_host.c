@@ -0,0 +1,294 @@
+/*
+ * Runs the proxy engine on Linux against a plain HTTP upstream, to load
+ * test it with far more clients than a badge can be reached by.
+ *
+ * Every request is deferred to a worker, which serves it from the cache or
+ * fetches it from the upstream and stores what it got.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "nixbadge_cache.h"
+#include "nixbadge_cache_posix.h"
+#include "nixbadge_proxy.h"
+
+#define HOST_BUFFER_SIZE 4096
+#define HOST_MAX_ENTRIES 4096
+
+typedef struct {
+  const char* upstream_host;
+  const char* upstream_port;
+  nixbadge_cache_t* cache;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  nixbadge_proxy_req_t** queue;
+  size_t queue_len;
+} host_t;
+
+static const char* host_key(const char* uri) {
+  const char* key = strrchr(uri, '/');
+  return key ? key + 1 : uri;
+}
+
+static int host_connect(host_t* host) {
+  struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+  struct addrinfo* addrs;
+  if (getaddrinfo(host->upstream_host, host->upstream_port, &hints, &addrs)) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+/**
+ * Fetches a path from the upstream and streams it to the client, storing
+ * it in the cache on the way.
+ */
+static bool host_fetch(host_t* host, nixbadge_proxy_req_t* req) {
+  const char* uri = nixbadge_proxy_req_uri(req);
+  int fd = host_connect(host);
+  if (fd < 0) {
+    return nixbadge_proxy_resp_send_err(req, "502 Bad Gateway",
+                                        "Upstream unreachable\n") == 0;
+  }
+
+  char buf[HOST_BUFFER_SIZE];
+  int len = snprintf(buf, sizeof(buf),
+                     "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                     uri, host->upstream_host);
+  if (send(fd, buf, len, MSG_NOSIGNAL) != len) {
+    close(fd);
+    return false;
+  }
+
+  // Read up to the end of the response head.
+  size_t have = 0;
+  char* body = NULL;
+  while (!body && have < sizeof(buf) - 1) {
+    ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+    if (n <= 0) break;
+    have += n;
+    buf[have] = 0;
+    body = strstr(buf, "\r\n\r\n");
+  }
+  int status = 0;
+  if (!body || sscanf(buf, "HTTP/1.%*d %d", &status) != 1) {
+    close(fd);
+    return nixbadge_proxy_resp_send_err(req, "502 Bad Gateway",
+                                        "Bad upstream response\n") == 0;
+  }
+  // Without a length a dropped connection looks like the end of the body.
+  const char* length = strcasestr(buf, "\r\nContent-Length:");
+  int64_t remaining = length ? strtoll(length + 17, NULL, 10) : -1;
+  body += 4;
+  if (status != 200) {
+    close(fd);
+    return nixbadge_proxy_resp_send_err(req, "404 Not Found",
+                                        "Not found\n") == 0;
+  }
+
+  nixbadge_cache_writer_t writer;
+  bool caching =
+      nixbadge_cache_begin(host->cache, host_key(uri), &writer) == 0;
+
+  bool ok = true;
+  size_t n = have - (body - buf);
+  memmove(buf, body, n);
+  while (true) {
+    if (n > 0) {
+      if (remaining >= 0) remaining -= n;
+      if (caching && nixbadge_cache_append(&writer, buf, n) < 0) {
+        caching = false;
+      }
+      if (nixbadge_proxy_resp_send_chunk(req, buf, n) < 0) {
+        ok = false;
+        break;
+      }
+    }
+    ssize_t got = recv(fd, buf, sizeof(buf), 0);
+    if (got < 0) ok = false;
+    if (got <= 0) break;
+    n = got;
+  }
+  close(fd);
+  if (remaining > 0) ok = false;
+
+  if (ok) ok = nixbadge_proxy_resp_send_chunk(req, NULL, 0) == 0;
+  if (caching) {
+    if (ok) {
+      nixbadge_cache_commit(&writer);
+    } else {
+      nixbadge_cache_abort(&writer);
+    }
+  }
+  return ok;
+}
+
+static void* host_worker(void* arg) {
+  host_t* host = arg;
+  while (true) {
+    pthread_mutex_lock(&host->lock);
+    while (host->queue_len == 0) pthread_cond_wait(&host->cond, &host->lock);
+    nixbadge_proxy_req_t* req = host->queue[0];
+    memmove(host->queue, host->queue + 1,
+            --host->queue_len * sizeof(*host->queue));
+    pthread_mutex_unlock(&host->lock);
+
+    nixbadge_cache_reader_t reader;
+    bool ok;
+    if (nixbadge_cache_open(host->cache,
+                            host_key(nixbadge_proxy_req_uri(req)),
+                            &reader) == 0) {
+      ok = nixbadge_proxy_resp_send_cache(req, &reader, reader.size) == 0;
+    } else {
+      ok = host_fetch(host, req);
+    }
+    nixbadge_proxy_req_complete(req, ok);
+  }
+  return NULL;
+}
+
+static void host_route(void* ctx, nixbadge_proxy_req_t* req) {
+  host_t* host = ctx;
+  if (nixbadge_proxy_req_method(req) != NIXBADGE_PROXY_GET) {
+    nixbadge_proxy_resp_send_err(req, "405 Method Not Allowed",
+                                 "Method not allowed\n");
+    return;
+  }
+
+  if (!nixbadge_proxy_req_defer(req)) {
+    nixbadge_proxy_resp_send_err(req, "503 Service Unavailable",
+                                 "Too many requests\n");
+    return;
+  }
+  pthread_mutex_lock(&host->lock);
+  host->queue[host->queue_len++] = req;
+  pthread_cond_signal(&host->cond);
+  pthread_mutex_unlock(&host->lock);
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s --upstream HOST:PORT --cache DIR [--port PORT]\n"
+          "          [--budget BYTES] [--workers N] [--clients N]\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  static const struct option options[] = {
+      {"port", required_argument, NULL, 'p'},
+      {"upstream", required_argument, NULL, 'u'},
+      {"cache", required_argument, NULL, 'c'},
+      {"budget", required_argument, NULL, 'b'},
+      {"workers", required_argument, NULL, 'w'},
+      {"clients", required_argument, NULL, 'n'},
+      {0},
+  };
+
+  nixbadge_proxy_config_t config = {
+      .port = 8080,
+      .max_conns = 512,
+      .max_deferred = 8,
+      .pipe_buffers = 3,
+      .buffer_size = HOST_BUFFER_SIZE,
+      .idle_timeout_ms = 30000,
+      .send_timeout_ms = 30000,
+      .route = host_route,
+  };
+  char* upstream = NULL;
+  const char* root = NULL;
+  uint64_t budget = 1ULL << 30;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        config.port = atoi(optarg);
+        break;
+      case 'u':
+        upstream = optarg;
+        break;
+      case 'c':
+        root = optarg;
+        break;
+      case 'b':
+        budget = strtoull(optarg, NULL, 10);
+        break;
+      case 'w':
+        config.max_deferred = atoi(optarg);
+        break;
+      case 'n':
+        config.max_conns = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  char* colon = upstream ? strrchr(upstream, ':') : NULL;
+  if (!colon || !root || config.max_deferred == 0 || config.max_conns == 0) {
+    usage(argv[0]);
+  }
+  *colon = 0;
+
+  host_t host = {
+      .upstream_host = upstream,
+      .upstream_port = colon + 1,
+      .queue = calloc(config.max_deferred, sizeof(nixbadge_proxy_req_t*)),
+  };
+  pthread_mutex_init(&host.lock, NULL);
+  pthread_cond_init(&host.cond, NULL);
+
+  nixbadge_cache_backend_t backend;
+  int err = nixbadge_cache_posix_init(&backend, root);
+  if (err < 0) {
+    fprintf(stderr, "%s: %s\n", root, strerror(-err));
+    return 1;
+  }
+  host.cache = nixbadge_cache_new(&backend, budget, HOST_MAX_ENTRIES);
+  if (!host.cache) {
+    fprintf(stderr, "Failed to create the cache\n");
+    return 1;
+  }
+
+  config.ctx = &host;
+  nixbadge_proxy_t* proxy = nixbadge_proxy_new(&config);
+  if (!proxy) {
+    fprintf(stderr, "Failed to listen on port %u: %s\n", config.port,
+            strerror(errno));
+    return 1;
+  }
+
+  // Every deferred request has a worker, the pipes are the only limit.
+  for (size_t i = 0; i < config.max_deferred; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, host_worker, &host);
+    pthread_detach(thread);
+  }
+
+  printf("Listening on port %u, upstream %s:%s\n", config.port,
+         host.upstream_host, host.upstream_port);
+  fflush(stdout);
+  nixbadge_proxy_run(proxy);
+  return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Drives periodic jobs with a fake clock: due jobs running in the order of
+ * their deadlines, periods staying within their jitter, and a job that fell
+ * far behind skipping what it missed rather than catching up.
+ *
+ *   nixbadge-periodic-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nixbadge_periodic.h"
+
+#define TEST_MAX_JOBS 4
+#define TEST_MAX_RUNS 1024
+
+static int test_failed = 0;
+
+#define CHECK(cond)                                                  \
+  do {                                                               \
+    if (!(cond)) {                                                   \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+      test_failed++;                                                 \
+    }                                                                \
+  } while (0)
+
+/* What the jobs did, in the order they did it. */
+static struct {
+  int job;
+  int64_t at_ms;
+} test_runs[TEST_MAX_RUNS];
+static size_t test_nruns;
+/* The fake clock, for jobs to note when they ran. */
+static int64_t test_now_ms;
+
+static void test_job(void* arg) {
+  if (test_nruns == TEST_MAX_RUNS) return;
+  test_runs[test_nruns].job = (int)(intptr_t)arg;
+  test_runs[test_nruns].at_ms = test_now_ms;
+  test_nruns++;
+}
+
+static nixbadge_periodic_job_t test_job_every(int job, uint32_t period_ms,
+                                              uint32_t jitter_ms) {
+  return (nixbadge_periodic_job_t){
+      .name = "test",
+      .period_ms = period_ms,
+      .jitter_ms = jitter_ms,
+      .fn = test_job,
+      .arg = (void*)(intptr_t)job,
+  };
+}
+
+/* @return what nixbadge_periodic_run returned */
+static uint32_t test_run(nixbadge_periodic_t* periodic, int64_t now_ms) {
+  test_now_ms = now_ms;
+  return nixbadge_periodic_run(periodic, now_ms);
+}
+
+static void test_heap_order(void) {
+  nixbadge_periodic_t* periodic = nixbadge_periodic_new(TEST_MAX_JOBS, 1);
+  CHECK(periodic != NULL);
+  if (!periodic) return;
+
+  // Added out of order, without jitter, so each is due as it is added.
+  static const int64_t added_ms[] = {30, 10, 20, 0};
+  for (int i = 0; i < TEST_MAX_JOBS; i++) {
+    nixbadge_periodic_job_t job = test_job_every(i, 1000, 0);
+    CHECK(nixbadge_periodic_add(periodic, &job, added_ms[i]) == i);
+  }
+  nixbadge_periodic_job_t extra = test_job_every(TEST_MAX_JOBS, 1000, 0);
+  CHECK(nixbadge_periodic_add(periodic, &extra, 0) == -1);
+
+  CHECK(test_run(periodic, 50) == 950);
+  CHECK(test_nruns == TEST_MAX_JOBS);
+  static const int order[] = {3, 1, 2, 0};
+  for (size_t i = 0; i < test_nruns && i < TEST_MAX_JOBS; i++) {
+    CHECK(test_runs[i].job == order[i]);
+  }
+
+  // They come back a period after their deadline, not after they ran.
+  test_nruns = 0;
+  CHECK(test_run(periodic, 999) == 1);
+  CHECK(test_nruns == 0);
+  CHECK(test_run(periodic, 1000) == 10);
+  CHECK(test_nruns == 1 && test_runs[0].job == 3);
+  nixbadge_periodic_free(periodic);
+}
+
+static void test_rejected(void) {
+  nixbadge_periodic_t* periodic = nixbadge_periodic_new(TEST_MAX_JOBS, 1);
+  CHECK(periodic != NULL);
+  if (!periodic) return;
+
+  nixbadge_periodic_job_t job = test_job_every(0, 0, 0);
+  CHECK(nixbadge_periodic_add(periodic, &job, 0) == -1);
+  job = test_job_every(0, 100, 100);
+  CHECK(nixbadge_periodic_add(periodic, &job, 0) == -1);
+  job = test_job_every(0, 100, 99);
+  CHECK(nixbadge_periodic_add(periodic, &job, 0) == 0);
+  nixbadge_periodic_free(periodic);
+}
+
+static void test_jitter_bounds(void) {
+  nixbadge_periodic_t* periodic = nixbadge_periodic_new(TEST_MAX_JOBS, 7);
+  CHECK(periodic != NULL);
+  if (!periodic) return;
+
+  nixbadge_periodic_job_t job = test_job_every(0, 100, 20);
+  CHECK(nixbadge_periodic_add(periodic, &job, 0) == 0);
+  test_nruns = 0;
+  for (int64_t now = 0; now < 50000; now++) test_run(periodic, now);
+
+  CHECK(test_nruns > 400);
+  CHECK(test_runs[0].at_ms <= 20);
+  int64_t shortest = INT64_MAX, longest = 0;
+  for (size_t i = 1; i < test_nruns; i++) {
+    int64_t period = test_runs[i].at_ms - test_runs[i - 1].at_ms;
+    if (period < shortest) shortest = period;
+    if (period > longest) longest = period;
+  }
+  CHECK(shortest >= 80 && longest <= 120);
+  // And it does move them, both ways.
+  CHECK(shortest < 90 && longest > 110);
+
+  nixbadge_periodic_stats_t stats;
+  CHECK(nixbadge_periodic_get_stats(periodic, 0, &stats));
+  CHECK(stats.runs == test_nruns && stats.skipped == 0);
+  CHECK(stats.max_late_ms == 0);
+  CHECK(!nixbadge_periodic_get_stats(periodic, 1, &stats));
+  nixbadge_periodic_free(periodic);
+}
+
+static void test_skip_missed(void) {
+  nixbadge_periodic_t* periodic = nixbadge_periodic_new(TEST_MAX_JOBS, 1);
+  CHECK(periodic != NULL);
+  if (!periodic) return;
+
+  nixbadge_periodic_job_t job = test_job_every(0, 100, 0);
+  CHECK(nixbadge_periodic_add(periodic, &job, 0) == 0);
+  test_nruns = 0;
+  CHECK(test_run(periodic, 0) == 100);
+
+  // Asleep through the deadlines from 100 to 1000: one run, not ten, and
+  // back on the beat it had.
+  CHECK(test_run(periodic, 1050) == 50);
+  CHECK(test_nruns == 2);
+  CHECK(test_run(periodic, 1100) == 100);
+  CHECK(test_nruns == 3);
+
+  nixbadge_periodic_stats_t stats;
+  CHECK(nixbadge_periodic_get_stats(periodic, 0, &stats));
+  CHECK(stats.runs == 3 && stats.skipped == 9);
+  CHECK(stats.max_late_ms == 950);
+  nixbadge_periodic_free(periodic);
+}
+
+int main(void) {
+  struct {
+    const char* name;
+    void (*run)(void);
+  } tests[] = {
+      {"due jobs run by deadline", test_heap_order},
+      {"jobs that can't be kept are refused", test_rejected},
+      {"periods stay within the jitter", test_jitter_bounds},
+      {"missed periods are skipped", test_skip_missed},
+  };
+  for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
+    int before = test_failed;
+    test_nruns = 0;
+    tests[i].run();
+    printf("%-4s %s\n", test_failed == before ? "ok" : "FAIL",
+           tests[i].name);
+  }
+  return test_failed ? 1 : 0;
+}
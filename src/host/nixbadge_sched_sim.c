@@ -0,0 +1,394 @@
+/*
+ * Runs the request scheduler against simulated clients in virtual time,
+ * to see what a policy does to narinfo latency while NARs are downloaded.
+ *
+ * Every millisecond, clients submit requests, idle workers take the next
+ * one from the scheduler, and the uplink is shared evenly between the
+ * responses being received, less those held back by the bandwidth limit.
+ * Each response starts one round trip after its worker took it on.
+ * Downloaders keep a number of NAR requests going, like Nix does with its
+ * substitution jobs, and lookup clients ask for one narinfo after the
+ * other. With --no-lanes every request goes through a single FIFO, which
+ * is how workers were handed requests before there were lanes.
+ *
+ * The run fails if the 99th percentile of narinfo latency goes past
+ * --max-p99, two round trips unless given, or the slowest downloader gets
+ * less than --min-fair percent of what the fastest one gets.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_sched.h"
+
+#define SIM_CHUNK_SIZE 4096
+#define SIM_NARINFO_SIZE 1024
+#define SIM_THINK_MS 10
+#define SIM_RETRY_MS 1000
+#define SIM_P99_RTTS 2
+#define SIM_MIN_FAIR 80
+
+typedef struct {
+  bool downloader;
+  uint32_t addr;
+  uint32_t outstanding;
+  int64_t next_ms;
+  uint32_t done;
+  /* Received so far, counting NARs still coming in. */
+  double bytes;
+} sim_client_t;
+
+typedef struct {
+  sim_client_t* client;
+  bool nar;
+  double size;
+  double received;
+  int64_t submitted_ms;
+  int64_t start_ms;
+  int64_t blocked_ms;
+  /* What is left of the piece charged to the client's bandwidth. */
+  double charged;
+  nixbadge_sched_job_t job;
+  bool running;
+} sim_req_t;
+
+typedef struct {
+  uint32_t workers;
+  uint32_t uplink;
+  uint32_t rtt_ms;
+  uint32_t seconds;
+  uint32_t downloaders;
+  uint32_t parallel;
+  uint32_t lookups;
+  bool lanes;
+  nixbadge_sched_policy_t policy;
+  uint32_t seed;
+  uint32_t max_p99_ms;
+  uint32_t min_fair;
+} sim_options_t;
+
+static uint32_t sim_random(uint32_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static int sim_compare(const void* a, const void* b) {
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return (x > y) - (x < y);
+}
+
+/* Sizes of NARs as they come, most small and a few large ones. */
+static double sim_nar_size(uint32_t* state) {
+  static const double sizes[] = {
+      16 << 10, 64 << 10, 128 << 10, 512 << 10, 2 << 20, 8 << 20, 32 << 20,
+  };
+  static const uint32_t weights[] = {30, 25, 15, 15, 8, 5, 2};
+  uint32_t pick = sim_random(state) % 100;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    if (pick < weights[i]) return sizes[i];
+    pick -= weights[i];
+  }
+  return sizes[0];
+}
+
+/* @return whether lookups and downloaders got what they are owed */
+static bool sim_run(const sim_options_t* options) {
+  size_t nclients = options->downloaders + options->lookups;
+  size_t max_deferred = options->workers * 2;
+  sim_client_t* clients = calloc(nclients, sizeof(*clients));
+  sim_req_t* reqs = calloc(max_deferred, sizeof(*reqs));
+  int64_t* latencies = NULL;
+  size_t nlatencies = 0, latencies_size = 0;
+  uint32_t rejected = 0;
+  uint32_t state = options->seed ? options->seed : 1;
+
+  nixbadge_sched_config_t config = {
+      .queue_len = max_deferred,
+      .clients = nclients,
+      .policy = options->policy,
+  };
+  if (!options->lanes) {
+    config.policy.fast_slots = options->workers;
+    config.policy.client_rate = 0;
+  }
+  nixbadge_sched_t* sched = nixbadge_sched_new(&config);
+  if (!clients || !reqs || !sched) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < nclients; i++) {
+    clients[i].downloader = i < options->downloaders;
+    clients[i].addr = 0x0a000001 + i;
+  }
+
+  uint32_t busy = 0;
+  int64_t end_ms = options->seconds * 1000LL;
+  double per_ms = options->uplink * 1024.0 / 1000;
+  for (int64_t now = 0; now < end_ms; now++) {
+    // Clients ask for what they want next, and back off when turned away.
+    for (size_t i = 0; i < nclients; i++) {
+      sim_client_t* client = &clients[i];
+      uint32_t want = client->downloader ? options->parallel : 1;
+      while (client->outstanding < want && now >= client->next_ms) {
+        sim_req_t* req = NULL;
+        for (size_t j = 0; j < max_deferred && !req; j++) {
+          if (!reqs[j].client) req = &reqs[j];
+        }
+        nixbadge_sched_lane_t lane = client->downloader && options->lanes
+                                         ? NIXBADGE_SCHED_BULK
+                                         : NIXBADGE_SCHED_FAST;
+        if (!req ||
+            !nixbadge_sched_submit(sched, lane, client->addr, req, now)) {
+          rejected++;
+          client->next_ms = now + SIM_RETRY_MS;
+          break;
+        }
+        *req = (sim_req_t){
+            .client = client,
+            .nar = client->downloader,
+            .size = client->downloader ? sim_nar_size(&state)
+                                       : SIM_NARINFO_SIZE,
+            .submitted_ms = now,
+        };
+        client->outstanding++;
+      }
+    }
+
+    nixbadge_sched_job_t job;
+    while (busy < options->workers &&
+           nixbadge_sched_next(sched, &job, now, 0)) {
+      sim_req_t* req = job.arg;
+      req->job = job;
+      req->running = true;
+      req->start_ms = now + options->rtt_ms;
+      busy++;
+    }
+
+    // Share the uplink between whatever is receiving right now.
+    size_t receiving = 0;
+    for (size_t j = 0; j < max_deferred; j++) {
+      sim_req_t* req = &reqs[j];
+      if (!req->running || now < req->start_ms || now < req->blocked_ms) {
+        continue;
+      }
+      if (req->nar && req->charged <= 0) {
+        double left = req->size - req->received;
+        size_t len = left < SIM_CHUNK_SIZE ? (size_t)left + 1 : SIM_CHUNK_SIZE;
+        req->charged = len;
+        uint32_t delay =
+            nixbadge_sched_throttle(sched, req->client->addr, len, now);
+        if (delay) {
+          req->blocked_ms = now + delay;
+          continue;
+        }
+      }
+      receiving++;
+    }
+
+    for (size_t j = 0; j < max_deferred && receiving; j++) {
+      sim_req_t* req = &reqs[j];
+      if (!req->running || now < req->start_ms || now < req->blocked_ms) {
+        continue;
+      }
+      double n = per_ms / receiving;
+      if (req->nar && n > req->charged) n = req->charged;
+      req->received += n;
+      req->charged -= n;
+      req->client->bytes += n;
+      if (req->received < req->size) continue;
+
+      sim_client_t* client = req->client;
+      client->outstanding--;
+      client->done++;
+      if (!client->downloader) {
+        client->next_ms = now + SIM_THINK_MS;
+        if (nlatencies == latencies_size) {
+          latencies_size = latencies_size ? latencies_size * 2 : 1024;
+          latencies = realloc(latencies, latencies_size * sizeof(*latencies));
+        }
+        latencies[nlatencies++] = now - req->submitted_ms;
+      }
+      nixbadge_sched_done(sched, &req->job);
+      memset(req, 0, sizeof(*req));
+      busy--;
+    }
+  }
+
+  const nixbadge_sched_policy_t* policy = &config.policy;
+  if (options->lanes) {
+    printf("Lanes: %u narinfo and %u NAR workers of %u, ", policy->fast_slots,
+           policy->bulk_slots, options->workers);
+    if (policy->client_slots) {
+      printf("NARs per client: %u", policy->client_slots);
+    } else {
+      printf("NARs split evenly between clients");
+    }
+    if (policy->client_rate) {
+      printf(", %u KiB/s per client\n", policy->client_rate / 1024);
+    } else {
+      printf(", no rate limit\n");
+    }
+  } else {
+    printf("No lanes: %u workers taking requests in arrival order\n",
+           options->workers);
+  }
+
+  bool ok = true;
+  if (nlatencies) {
+    qsort(latencies, nlatencies, sizeof(*latencies), sim_compare);
+    int64_t p99 = latencies[nlatencies * 99 / 100];
+    printf("narinfo lookups: %zu, latency p50 %lld ms, p99 %lld ms, "
+           "max %lld ms\n",
+           nlatencies, (long long)latencies[nlatencies / 2], (long long)p99,
+           (long long)latencies[nlatencies - 1]);
+    if (p99 > options->max_p99_ms) {
+      printf("FAIL narinfo p99 over %u ms\n", options->max_p99_ms);
+      ok = false;
+    }
+  } else if (options->lookups) {
+    printf("FAIL no narinfo lookup went through\n");
+    ok = false;
+  }
+
+  double slowest = 0, fastest = 0;
+  for (size_t i = 0; i < options->downloaders; i++) {
+    printf("downloader %zu: %u NARs, %.1f KiB/s\n", i + 1, clients[i].done,
+           clients[i].bytes / 1024.0 / options->seconds);
+    if (i == 0 || clients[i].bytes < slowest) slowest = clients[i].bytes;
+    if (clients[i].bytes > fastest) fastest = clients[i].bytes;
+  }
+  if (slowest * 100 < fastest * options->min_fair) {
+    printf("FAIL slowest downloader under %u%% of the fastest\n",
+           options->min_fair);
+    ok = false;
+  }
+  nixbadge_sched_stats_t stats;
+  nixbadge_sched_get_stats(sched, &stats);
+  printf("turned away: %u, NARs passed over for another client's: %u, "
+         "throttled: %u\n",
+         rejected, stats.passed_over, stats.throttled);
+
+  nixbadge_sched_free(sched);
+  free(latencies);
+  free(reqs);
+  free(clients);
+  return ok;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+          "usage: %s [--workers N] [--uplink KIBPS] [--rtt MS] [--seconds S]\n"
+          "          [--downloaders N] [--parallel N] [--lookups N]\n"
+          "          [--fast N] [--bulk N] [--bulk-queue N]\n"
+          "          [--client-slots N] [--rate KIBPS]\n"
+          "          [--no-lanes] [--seed N] [--max-p99 MS] [--min-fair PCT]\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  static const struct option long_options[] = {
+      {"workers", required_argument, NULL, 'w'},
+      {"uplink", required_argument, NULL, 'u'},
+      {"rtt", required_argument, NULL, 'r'},
+      {"seconds", required_argument, NULL, 's'},
+      {"downloaders", required_argument, NULL, 'd'},
+      {"parallel", required_argument, NULL, 'p'},
+      {"lookups", required_argument, NULL, 'l'},
+      {"fast", required_argument, NULL, 'f'},
+      {"bulk", required_argument, NULL, 'b'},
+      {"bulk-queue", required_argument, NULL, 'q'},
+      {"client-slots", required_argument, NULL, 'c'},
+      {"rate", required_argument, NULL, 'R'},
+      {"no-lanes", no_argument, NULL, 'n'},
+      {"seed", required_argument, NULL, 'S'},
+      {"max-p99", required_argument, NULL, 'P'},
+      {"min-fair", required_argument, NULL, 'F'},
+      {0},
+  };
+
+  // The badge's defaults, with an uplink shared by a hall full of people.
+  sim_options_t options = {
+      .workers = 3,
+      .uplink = 256,
+      .rtt_ms = 80,
+      .seconds = 300,
+      .downloaders = 2,
+      .parallel = 8,
+      .lookups = 1,
+      .lanes = true,
+      .seed = 1,
+      .min_fair = SIM_MIN_FAIR,
+  };
+  uint32_t rate = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'w':
+        options.workers = atoi(optarg);
+        break;
+      case 'u':
+        options.uplink = atoi(optarg);
+        break;
+      case 'r':
+        options.rtt_ms = atoi(optarg);
+        break;
+      case 's':
+        options.seconds = atoi(optarg);
+        break;
+      case 'd':
+        options.downloaders = atoi(optarg);
+        break;
+      case 'p':
+        options.parallel = atoi(optarg);
+        break;
+      case 'l':
+        options.lookups = atoi(optarg);
+        break;
+      case 'f':
+        options.policy.fast_slots = atoi(optarg);
+        break;
+      case 'b':
+        options.policy.bulk_slots = atoi(optarg);
+        break;
+      case 'q':
+        options.policy.bulk_queue = atoi(optarg);
+        break;
+      case 'c':
+        options.policy.client_slots = atoi(optarg);
+        break;
+      case 'R':
+        rate = atoi(optarg);
+        break;
+      case 'n':
+        options.lanes = false;
+        break;
+      case 'S':
+        options.seed = atoi(optarg);
+        break;
+      case 'P':
+        options.max_p99_ms = atoi(optarg);
+        break;
+      case 'F':
+        options.min_fair = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (options.workers == 0 || options.uplink == 0 || options.seconds == 0) {
+    usage(argv[0]);
+  }
+
+  if (!options.max_p99_ms) options.max_p99_ms = SIM_P99_RTTS * options.rtt_ms;
+  options.policy.client_rate = rate * 1024;
+  nixbadge_sched_policy_defaults(&options.policy, options.workers);
+
+  return sim_run(&options) ? 0 : 1;
+}
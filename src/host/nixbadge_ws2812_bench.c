@@ -0,0 +1,251 @@
+/*
+ * Checks the table-driven WS2812 encoder against one that decides every
+ * bit, like the RMT bytes encoder it replaced, and times a refill of each.
+ *
+ * Both encode random frames into refills of the sizes the RMT channel
+ * hands out, and every symbol has to match, reset code included. The
+ * reference stops in the middle of a byte when a refill is full, the
+ * table-driven one leaves the rest for the next.
+ *
+ * It then streams frames of longer chains through a refill the size of
+ * half the RMT memory, as the channel does while the other half drains,
+ * and reports the frame rate the wire allows and how long a refill takes
+ * here against the time the channel takes to send one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "nixbadge_ws2812.h"
+
+#define BENCH_RESOLUTION_HZ 10000000
+#define BENCH_LEDS 12
+#define BENCH_FRAMES 20000
+#define BENCH_MAX_SYMBOLS (BENCH_LEDS * 4 * NIXBADGE_WS2812_BITS + 1)
+/* Half of the 64 symbols of RMT memory the badge's channel has. */
+#define BENCH_STREAM_REFILL 32
+#define BENCH_STREAM_US 200000
+
+static const size_t bench_refills[] = {32, 64};
+static const size_t bench_chains[] = {12, 60, 150, 300, 600, 1024, 2048};
+
+/*
+ * Symbols of a 0 and a 1 bit and the reset code, worked out as the bytes
+ * encoder was configured rather than taken from the table's.
+ */
+static uint32_t bench_bits[2];
+static uint32_t bench_reset_code;
+
+/* Packs an rmt_symbol_word_t. */
+static uint32_t bench_symbol(uint32_t level0, uint32_t duration0,
+                             uint32_t level1, uint32_t duration1) {
+  return duration0 | level0 << 15 | duration1 << 16 | level1 << 31;
+}
+
+static void bench_reference_init(uint32_t resolution) {
+  // T0H and T1L 0.3 us, T0L and T1H 0.9 us.
+  bench_bits[0] = bench_symbol(1, 0.3 * resolution / 1000000, 0,
+                               0.9 * resolution / 1000000);
+  bench_bits[1] = bench_symbol(1, 0.9 * resolution / 1000000, 0,
+                               0.3 * resolution / 1000000);
+  // 50 us low in two halves.
+  uint32_t reset_ticks = resolution / 1000000 * 50 / 2;
+  bench_reset_code = bench_symbol(0, reset_ticks, 0, reset_ticks);
+}
+
+/* Encodes a bit at a time in the order the strip takes the channels. */
+static size_t bench_reference(const nixbadge_ws2812_t* ws2812,
+                              const uint8_t* order, const uint8_t* pixels,
+                              size_t len, size_t written, uint32_t* symbols,
+                              size_t space, bool* done) {
+  size_t channels = nixbadge_ws2812_channels(ws2812);
+  size_t bits = len / channels * channels * NIXBADGE_WS2812_BITS;
+  size_t count = 0;
+  *done = false;
+  for (; written < bits && count < space; written++) {
+    size_t byte = written / NIXBADGE_WS2812_BITS;
+    size_t pixel = byte / channels, channel = byte % channels;
+    uint8_t value = pixels[pixel * channels + order[channel]];
+    int bit = NIXBADGE_WS2812_BITS - 1 - written % NIXBADGE_WS2812_BITS;
+    symbols[count++] = bench_bits[value >> bit & 1];
+  }
+  if (written == bits && count < space) {
+    symbols[count++] = bench_reset_code;
+    *done = true;
+  }
+  return count;
+}
+
+typedef size_t (*bench_encode_t)(const nixbadge_ws2812_t* ws2812,
+                                 const uint8_t* order, const uint8_t* pixels,
+                                 size_t len, size_t written, uint32_t* symbols,
+                                 size_t space, bool* done);
+
+static size_t bench_table(const nixbadge_ws2812_t* ws2812,
+                          const uint8_t* order, const uint8_t* pixels,
+                          size_t len, size_t written, uint32_t* symbols,
+                          size_t space, bool* done) {
+  (void)order;
+  return nixbadge_ws2812_encode(ws2812, pixels, len, written, symbols, space,
+                                done);
+}
+
+/* Encodes a whole frame in refills of `refill` symbols. */
+static size_t bench_frame(bench_encode_t encode,
+                          const nixbadge_ws2812_t* ws2812,
+                          const uint8_t* order, const uint8_t* pixels,
+                          size_t len, size_t refill, uint32_t* symbols,
+                          size_t* refills) {
+  size_t written = 0;
+  bool done = false;
+  while (!done) {
+    uint32_t chunk[64];
+    size_t count = encode(ws2812, order, pixels, len, written, chunk, refill,
+                          &done);
+    if (written + count > BENCH_MAX_SYMBOLS) break;
+    memcpy(symbols + written, chunk, count * sizeof(*chunk));
+    written += count;
+    (*refills)++;
+  }
+  return written;
+}
+
+static uint64_t bench_cycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static uint64_t bench_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_time(const char* name, bench_encode_t encode,
+                       const nixbadge_ws2812_t* ws2812, const uint8_t* order,
+                       const uint8_t* pixels, size_t len, size_t refill) {
+  static uint32_t symbols[BENCH_MAX_SYMBOLS];
+  size_t refills = 0;
+  uint64_t start_ns = bench_ns();
+  uint64_t start = bench_cycles();
+  for (int i = 0; i < BENCH_FRAMES; i++) {
+    bench_frame(encode, ws2812, order, pixels, len, refill, symbols, &refills);
+    __asm__ volatile("" : : "r"(symbols) : "memory");
+  }
+  uint64_t cycles = bench_cycles() - start;
+  uint64_t ns = bench_ns() - start_ns;
+  printf("%s, %zu symbols: %.1f ns, %llu cycles per refill\n", name, refill,
+         (double)ns / refills, (unsigned long long)(cycles / refills));
+}
+
+/*
+ * Streams frames of `leds` pixels in refills of BENCH_STREAM_REFILL
+ * symbols, which go nowhere, so that no buffer grows with the chain.
+ */
+static void bench_stream(const nixbadge_ws2812_config_t* config,
+                         const nixbadge_ws2812_t* ws2812, size_t leds) {
+  size_t len = leds * nixbadge_ws2812_channels(ws2812);
+  uint8_t* pixels = malloc(len);
+  if (!pixels) return;
+  for (size_t i = 0; i < len; i++) pixels[i] = rand();
+
+  uint32_t symbols[BENCH_STREAM_REFILL];
+  size_t frames = 0, refills = 0;
+  uint64_t start = bench_ns(), ns;
+  do {
+    size_t written = 0;
+    bool done = false;
+    while (!done) {
+      written += nixbadge_ws2812_encode(ws2812, pixels, len, written, symbols,
+                                        BENCH_STREAM_REFILL, &done);
+      __asm__ volatile("" : : "r"(symbols) : "memory");
+      refills++;
+    }
+    frames++;
+    ns = bench_ns() - start;
+  } while (ns < BENCH_STREAM_US * 1000ULL);
+  free(pixels);
+
+  uint32_t wire_us = nixbadge_ws2812_frame_us(config, len);
+  // The channel sends a refill's worth while the next one is written.
+  uint32_t bit = nixbadge_ws2812_bit(ws2812, false);
+  uint32_t bit_ticks = (bit & 0x7fff) + (bit >> 16 & 0x7fff);
+  double budget_ns =
+      1e9 * bit_ticks * BENCH_STREAM_REFILL / config->resolution_hz;
+  printf("%5zu LEDs: %6u us on the wire, %6.1f fps, encoded in %7.1f us, "
+         "%5.1f of %6.1f ns per refill\n",
+         leds, wire_us, 1e6 / wire_us, (double)ns / 1000 / frames,
+         (double)ns / refills, budget_ns);
+}
+
+int main() {
+  static const struct {
+    const char* name;
+    nixbadge_ws2812_order_t order;
+    uint8_t channels[4];
+  } orders[] = {
+      {"RGB", NIXBADGE_WS2812_RGB, {0, 1, 2}},
+      {"GRB", NIXBADGE_WS2812_GRB, {1, 0, 2}},
+      {"RGBW", NIXBADGE_WS2812_RGBW, {0, 1, 2, 3}},
+      {"GRBW", NIXBADGE_WS2812_GRBW, {1, 0, 2, 3}},
+  };
+  static uint32_t expected[BENCH_MAX_SYMBOLS], actual[BENCH_MAX_SYMBOLS];
+  uint8_t pixels[BENCH_LEDS * 4];
+  int failed = 0;
+  srand(1);
+  bench_reference_init(BENCH_RESOLUTION_HZ);
+
+  for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); o++) {
+    nixbadge_ws2812_config_t config = {
+        .resolution_hz = BENCH_RESOLUTION_HZ,
+        .order = orders[o].order,
+    };
+    nixbadge_ws2812_t* ws2812 = nixbadge_ws2812_new(&config);
+    if (!ws2812) return 1;
+    const uint8_t* order = orders[o].channels;
+    size_t len = BENCH_LEDS * nixbadge_ws2812_channels(ws2812);
+
+    size_t mismatched = 0;
+    for (int frame = 0; frame < 1000; frame++) {
+      for (size_t i = 0; i < len; i++) pixels[i] = rand();
+      for (size_t r = 0; r < sizeof(bench_refills) / sizeof(*bench_refills);
+           r++) {
+        size_t refills = 0;
+        size_t want = bench_frame(bench_reference, ws2812, order, pixels, len,
+                                  bench_refills[r], expected, &refills);
+        size_t got = bench_frame(bench_table, ws2812, order, pixels, len,
+                                 bench_refills[r], actual, &refills);
+        if (want != got ||
+            memcmp(expected, actual, want * sizeof(*expected)) != 0) {
+          mismatched++;
+        }
+      }
+    }
+    printf("%s: %zu of 2000 frames differ\n", orders[o].name, mismatched);
+    if (mismatched) failed = 1;
+
+    if (orders[o].order == NIXBADGE_WS2812_GRB) {
+      for (size_t r = 0; r < sizeof(bench_refills) / sizeof(*bench_refills);
+           r++) {
+        bench_time("per bit", bench_reference, ws2812, order, pixels, len,
+                   bench_refills[r]);
+        bench_time("table", bench_table, ws2812, order, pixels, len,
+                   bench_refills[r]);
+      }
+      for (size_t c = 0; c < sizeof(bench_chains) / sizeof(*bench_chains);
+           c++) {
+        bench_stream(&config, ws2812, bench_chains[c]);
+      }
+    }
+    nixbadge_ws2812_free(ws2812);
+  }
+  return failed;
+}
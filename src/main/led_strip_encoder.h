@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include "driver/rmt_encoder.h"
+#include "nixbadge_ws2812.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,6 +18,7 @@ extern "C" {
  */
 typedef struct {
     uint32_t resolution; /*!< Encoder resolution, in Hz */
+    nixbadge_ws2812_order_t order; /*!< Order the strip takes the channels in */
 } led_strip_encoder_config_t;
 
 /**
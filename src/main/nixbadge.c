@@ -3,7 +3,6 @@
  * Nix Vegas - Rebuild the world!
  */
 
-#include <math.h>
 #include <string.h>
 
 #include "driver/gpio.h"
@@ -12,17 +11,26 @@
 #include "esp_mac.h"
 #include "esp_mesh.h"
 #include "esp_mesh_internal.h"
+#include "esp_random.h"
 #include "esp_wifi.h"
+#include "nixbadge_config.h"
 #include "nixbadge_gpio.h"
 #include "nixbadge_http.h"
+#include "nixbadge_input.h"
 #include "nixbadge_leds.h"
 #include "nixbadge_mesh.h"
+#include "nixbadge_p2p.h"
+#include "nixbadge_periodic.h"
+#include "nixbadge_show.h"
+#include "nixbadge_storage.h"
 #include "nixbadge_utils.h"
 #include "nvs_flash.h"
 
-#define EXAMPLE_ANGLE_INC_FRAME 0.02
-#define EXAMPLE_FRAME_DURATION_MS 20
-
+#define PERIODIC_JOBS 5
+#define PING_INTERVAL_MS 5000
+#define METRICS_SAMPLE_MS 10000
+/* How often to look whether the root wants the next report yet. */
+#define TELEMETRY_CHECK_MS 1000
 
 /**
  * Log tag.
@@ -35,11 +43,25 @@ void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
   ESP_LOGI(TAG, "<IP_EVENT_STA_GOT_IP>IP:" IPSTR, IP2STR(&event->ip_info.ip));
 }
 
+static void nixbadge_ping(void *arg) { nixbadge_mesh_ping(); }
+
+static void nixbadge_gossip(void *arg) {
+  nixbadge_p2p_gossip();
+  nixbadge_show_gossip();
+}
+
+static void nixbadge_telemetry(void *arg) { nixbadge_mesh_telemetry(); }
+
+static void nixbadge_time_sync(void *arg) { nixbadge_mesh_time_sync(); }
+
+static void nixbadge_sample(void *arg) { nixbadge_system_sample(); }
+
 /**
  * Application main function.
  */
 void app_main(void) {
   ESP_LOGI(TAG, "Hello world %llu", nixbadge_timestamp_now());
+  nixbadge_task_register(xTaskGetCurrentTaskHandle());
 
   esp_err_t ret = nvs_flash_init();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
@@ -48,6 +70,7 @@ void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+  ESP_ERROR_CHECK(nixbadge_config_init());
 
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
@@ -59,47 +82,46 @@ void app_main(void) {
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
   ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_FLASH));
 
-  uint8_t boot_mesh = 0;
-
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
-
-  ESP_ERROR_CHECK(nvs_get_u8(flashcfg_handle, "boot_mesh", &boot_mesh));
-
-  nvs_close(flashcfg_handle);
-
-  int wireless_enable = boot_mesh || gpio_get_level(GPIO_INPUT_PIN);
+  const nixbadge_config_t* config = nixbadge_config_get();
+  int wireless_enable = config->boot_mesh || gpio_get_level(GPIO_INPUT_PIN);
+  nixbadge_config_unref(config);
 
   if (wireless_enable) {
     nixbadge_mesh_init();
+    nixbadge_storage_init();
     nixbadge_http_init();
+    nixbadge_p2p_init();
   }
 
+  nixbadge_show_init();
   ESP_LOGI(TAG, "Start LED rainbow chase");
   nixbadge_leds_init();
+  nixbadge_input_init();
 
-  float offset = 0;
-  int64_t last_ping = nixbadge_timestamp_now();
   ESP_LOGI(TAG, "Mesh is %s", nixbadge_has_mesh() ? "enabled" : "disabled");
 
-  while (true) {
-    if (nixbadge_has_mesh()) {
-      nixbadge_leds_pull();
-      int64_t now = nixbadge_timestamp_now();
-      int64_t time_delta = now - last_ping;
-      if (((time_delta / 1000) % 5) == 0) {
-        nixbadge_mesh_broadcast(0);
-        last_ping = nixbadge_timestamp_now();
-      }
-    } else {
-      nixbadge_leds_pulse(offset);
-      offset += EXAMPLE_ANGLE_INC_FRAME;
-      if (offset > 2 * M_PI) {
-        offset -= 2 * M_PI;
-      }
+  // Jitter keeps badges switched on together from sending at the same time.
+  // The LEDs have a task of their own, which is not held up by these.
+  static const nixbadge_periodic_job_t jobs[] = {
+      {"ping", PING_INTERVAL_MS, PING_INTERVAL_MS / 5, nixbadge_ping},
+      {"gossip", CONFIG_BADGE_P2P_ANNOUNCE_INTERVAL * 1000,
+       CONFIG_BADGE_P2P_ANNOUNCE_INTERVAL * 200, nixbadge_gossip},
+      {"telemetry", TELEMETRY_CHECK_MS, TELEMETRY_CHECK_MS / 5,
+       nixbadge_telemetry},
+      {"time", CONFIG_BADGE_TIME_SYNC_INTERVAL * 1000,
+       CONFIG_BADGE_TIME_SYNC_INTERVAL * 200, nixbadge_time_sync},
+      {"metrics", METRICS_SAMPLE_MS, 0, nixbadge_sample},
+  };
+  nixbadge_periodic_t *periodic =
+      nixbadge_periodic_new(PERIODIC_JOBS, esp_random());
+  if (!periodic) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+  int64_t now = nixbadge_periodic_clock_ms();
+  size_t njobs = nixbadge_has_mesh() ? sizeof(jobs) / sizeof(jobs[0]) : 0;
+  for (size_t i = 0; i < njobs; i++) {
+    if (nixbadge_periodic_add(periodic, &jobs[i], now) < 0) {
+      ESP_LOGE(TAG, "Could not schedule %s", jobs[i].name);
     }
-
-    nixbadge_leds_sync();
-    vTaskDelay(pdMS_TO_TICKS(EXAMPLE_FRAME_DURATION_MS));
   }
+  nixbadge_periodic_loop(periodic);
 }
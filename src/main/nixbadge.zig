@@ -1,5 +1,6 @@
 const std = @import("std");
 const esp_idf = @import("esp-idf");
+const proto = @import("proto.zig");
 const log = std.log.scoped(.nixbadge);
 
 pub const std_options = esp_idf.std_options;
@@ -8,14 +9,92 @@ pub const panic = esp_idf.panic;
 pub const mesh = @import("nixbadge/mesh.zig");
 pub const leds = @import("nixbadge/leds.zig");
 
-export fn nixbadge_mesh_create_packet(kind: u8, size_ptr: *u32) [*]const u8 {
-    const buff = mesh.createPacket(@enumFromInt(kind)) catch |err| @panic(@errorName(err));
+export fn nixbadge_mesh_create_packet(kind: u8, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createPacket(@enumFromInt(kind)) catch |err| {
+        log.warn("Failed to create packet: {}", .{err});
+        return null;
+    };
+    size_ptr.* = @intCast(buff.len);
+    return buff.ptr;
+}
+
+export fn nixbadge_mesh_create_digest_packet(ip: u32, generation: u32, count: u32, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createDigestPacket(.{
+        .ip = ip,
+        .generation = generation,
+        .count = count,
+    }) catch |err| {
+        log.warn("Failed to create digest packet: {}", .{err});
+        return null;
+    };
+    size_ptr.* = @intCast(buff.len);
+    return buff.ptr;
+}
+
+export fn nixbadge_mesh_create_show_packet(ip: u32, seq: u32, id: u32, start_ms: i64, size: u32, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createShowPacket(.{
+        .ip = ip,
+        .seq = seq,
+        .id = id,
+        .start_ms = start_ms,
+        .size = size,
+    }) catch |err| {
+        log.warn("Failed to create show packet: {}", .{err});
+        return null;
+    };
+    size_ptr.* = @intCast(buff.len);
+    return buff.ptr;
+}
+
+export fn nixbadge_mesh_create_ping_packet(seq: u32, origin: *const [6]u8, sent_us: u32, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createPingPacket(.{
+        .seq = seq,
+        .origin = origin.*,
+        .sent_us = sent_us,
+    }) catch |err| {
+        log.warn("Failed to create ping packet: {}", .{err});
+        return null;
+    };
+    size_ptr.* = @intCast(buff.len);
+    return buff.ptr;
+}
+
+export fn nixbadge_mesh_create_time_request_packet(sent_us: u32, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createTimeRequestPacket(.{ .sent_us = sent_us }) catch |err| {
+        log.warn("Failed to create time request packet: {}", .{err});
+        return null;
+    };
+    size_ptr.* = @intCast(buff.len);
+    return buff.ptr;
+}
+
+export fn nixbadge_mesh_create_telemetry_packet(telemetry: *const proto.Telemetry, size_ptr: *u32) ?[*]const u8 {
+    const buff = mesh.createTelemetryPacket(telemetry.*) catch |err| {
+        log.warn("Failed to create telemetry packet: {}", .{err});
+        return null;
+    };
     size_ptr.* = @intCast(buff.len);
     return buff.ptr;
 }
 
-export fn nixbadge_mesh_action_cb(data: [*]const u8, len: u32, out_data: *[*]const u8, out_len: *u32, seq: u32) esp_idf.sys.Error {
-    mesh.actionCallback(data[0..len], out_data, out_len, seq) catch |err| {
+export fn nixbadge_mesh_tx_retain(data: [*]const u8) void {
+    mesh.tx_buffers.retain(data);
+}
+
+export fn nixbadge_mesh_tx_release(data: [*]const u8) void {
+    mesh.tx_buffers.release(data);
+}
+
+export fn nixbadge_mesh_tx_lease(data: [*]const u8, ms: u32) void {
+    mesh.tx_buffers.lease(data, mesh.now(), ms);
+}
+
+export fn nixbadge_mesh_get_tx_stats(stats: *mesh.TxStats) void {
+    stats.* = mesh.tx_buffers.getStats(mesh.now());
+}
+
+export fn nixbadge_mesh_action_cb(data: [*]const u8, len: u32, out_data: *[*]const u8, out_len: *u32, _: u32) esp_idf.sys.Error {
+    mesh.actionCallback(data[0..len], out_data, out_len) catch |err| {
         log.err("Failed to read packet {any}: {}", .{
             data[0..len],
             err,
@@ -29,6 +108,15 @@ export fn nixbadge_leds_config_gpios() void {
     leds.configGpios() catch |err| @panic(@errorName(err));
 }
 
-export fn nixbadge_mesh_ping_measure(i: u8) f32 {
-    return mesh.pingMeasure(i);
+export fn nixbadge_leds_render_chase(pixels: [*]u8, len: u32, gamma: bool) void {
+    leds.renderChase(pixels[0..len], gamma);
+}
+
+export fn nixbadge_leds_render_links(pixels: [*]u8, len: u32, phases: [*]const u32, count: u32, gamma: bool) void {
+    leds.renderLinks(pixels[0..len], phases[0..count], gamma);
+}
+
+export fn nixbadge_wifi_get_sta_rssi(rssi: *c_int) bool {
+    rssi.* = esp_idf.wifi.getStaRssi() catch return false;
+    return true;
 }
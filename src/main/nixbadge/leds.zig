@@ -1,9 +1,24 @@
 const esp_idf = @import("esp-idf");
 const options = @import("options");
+const render = @import("render.zig");
+
+/// The hue chase shown without the mesh, which goes on from frame to frame.
+var chase: render.Chase = .{};
+
+/// Draws the next frame of the hue chase.
+pub fn renderChase(pixels: []u8, gamma: bool) void {
+    render.render(render.Effect.init(&chase), .{ .pixels = pixels }, gamma);
+}
+
+/// Draws the links to the neighbours, each turned by its phase.
+pub fn renderLinks(pixels: []u8, phases: []const u32, gamma: bool) void {
+    var links: render.Links = .{ .phases = phases };
+    render.render(render.Effect.init(&links), .{ .pixels = pixels }, gamma);
+}
 
 pub fn configGpios() !void {
     try esp_idf.drivers.gpio.Config.config(&.{
-        .intr_type = .posedge,
+        .intr_type = .anyedge,
         .pin_bit_mask = 1 << @as(comptime_int, switch (options.board_rev) {
             .@"0.5" => 15,
             .@"1.0" => 3,
@@ -24,6 +39,5 @@ pub fn configGpios() !void {
         .pull_up_en = .disable,
     });
 
-    // TODO: create queue
     try esp_idf.drivers.gpio.installIsrService(0);
 }
@@ -2,36 +2,31 @@ const std = @import("std");
 const esp_idf = @import("esp-idf");
 const proto = @import("../proto.zig");
 const utils = @import("../utils.zig");
+const tx_pool = @import("tx_pool.zig");
 const log = std.log.scoped(.nixbadge_mesh);
 
-extern var last_ping_timestamp: i64;
+extern fn nixbadge_config_reload() esp_idf.sys.Error;
+extern fn nixbadge_p2p_announce(ip: u32, generation: u32, count: u32) void;
+extern fn nixbadge_show_announce(ip: u32, seq: u32, id: u32, start_ms: i64, size: u32) void;
+extern fn nixbadge_mesh_get_mac(mac: *[6]u8) void;
+extern fn nixbadge_mesh_telemetry_received(telemetry: *const proto.Telemetry) u32;
+extern fn nixbadge_mesh_telemetry_ack(interval_ms: u32) void;
+extern fn nixbadge_mesh_time_now(mesh_us: *i64, error_us: *u32) bool;
+extern fn nixbadge_mesh_time_epoch() u32;
+extern fn nixbadge_mesh_time_answer(sent_us: u32, received_us: i64, answered_us: i64, error_us: u32, epoch: u32) void;
+extern fn nixbadge_mesh_pong(origin: *const [6]u8, responder: *const [6]u8, seq: u32, sent_us: u32) void;
 
-const PingEntry = struct {
-    seq: u32 = 0,
-    timestamp: i64 = 0,
+/// Enough for a broadcast every second and the replies to a mesh of
+/// badges pinging, all within their leases.
+const tx_slots = 32;
 
-    pub fn isEmpty(self: *const PingEntry) bool {
-        return self.seq == 0 and self.timestamp == 0;
-    }
-};
-
-const max_packets = 50;
+/// How long the mesh may go on reading a reply after the callback that
+/// returned it.
+const reply_lease_ms = 1000;
 
-var packet_queue_tx_buff = [_]u8{0} ** (max_packets * proto.packet_size);
-var packet_queue_tx = std.RingBuffer{
-    .data = &packet_queue_tx_buff,
-    .write_index = 0,
-    .read_index = 0,
-};
+pub const TxStats = tx_pool.Stats;
 
-var ping_index: usize = 0;
-var ping_map = [_]PingEntry{.{}} ** 12;
-
-fn findFreePing() *PingEntry {
-    const i = ping_index % ping_map.len;
-    ping_index = i + 1;
-    return &ping_map[i];
-}
+pub var tx_buffers: tx_pool.Pool(tx_slots, proto.packet_size) = .{};
 
 extern fn nixbadge_mesh_send_packet(addr: ?*const esp_idf.wifi.Addr, kind: u8) esp_idf.sys.Error;
 
@@ -39,43 +34,102 @@ pub fn sendPacket(addr: ?*const esp_idf.wifi.Addr, tag: proto.Tag) !void {
     return nixbadge_mesh_send_packet(addr, @intFromEnum(tag)).throw();
 }
 
+pub fn now() u32 {
+    return @truncate(@as(u64, @bitCast(utils.getUptime())));
+}
+
+/// Returns a packet in a buffer of `tx_buffers` with a reference for the
+/// caller to release.
 pub fn createPacket(tag: proto.Tag) ![]const u8 {
-    const packet = proto.Packet.init(tag);
-    const buff = try packet.encode();
+    return queuePacket(proto.Packet.init(tag));
+}
 
-    if (packet_queue_tx.len() + buff.len >= packet_queue_tx_buff.len) {
-        packet_queue_tx.write_index = 0;
-    }
+pub fn createDigestPacket(digest: proto.Digest) ![]const u8 {
+    return queuePacket(.{ .digest = digest });
+}
+
+pub fn createShowPacket(show: proto.Show) ![]const u8 {
+    return queuePacket(.{ .show = show });
+}
 
-    const data_start = packet_queue_tx.mask(packet_queue_tx.write_index);
-    packet_queue_tx.writeSliceAssumeCapacity(&buff);
-    const data_end = data_start + buff.len;
-    return packet_queue_tx.data[data_start..data_end];
+pub fn createPingPacket(req: proto.PingRequest) ![]const u8 {
+    return queuePacket(.{ .req_ping = req });
 }
 
-pub fn actionCallback(data: []const u8, out_data: *[*]const u8, out_len: *u32, seq: u32) !void {
+pub fn createTimeRequestPacket(req: proto.TimeRequest) ![]const u8 {
+    return queuePacket(.{ .req_time = req });
+}
+
+pub fn createTelemetryPacket(telemetry: proto.Telemetry) ![]const u8 {
+    return queuePacket(.{ .telemetry = telemetry });
+}
+
+fn queuePacket(packet: proto.Packet) ![]const u8 {
+    const buff = tx_buffers.acquire(now()) orelse return error.OutOfBuffers;
+    errdefer tx_buffers.release(buff);
+    return packet.encode(buff);
+}
+
+pub fn actionCallback(data: []const u8, out_data: *[*]const u8, out_len: *u32) !void {
     const packet = try proto.Packet.decode(data);
 
     switch (packet) {
-        .req_ping => {
-            last_ping_timestamp = utils.getTimestamp();
-            const resp = try createPacket(.ping);
-            out_data.* = resp.ptr;
-            out_len.* = resp.len;
-        },
-        .ping => {
-            const ping = findFreePing();
-            ping.* = .{
-                .seq = seq,
-                .timestamp = utils.getTimestamp(),
+        .req_ping => |req| {
+            var ping: proto.Ping = .{
+                .seq = req.seq,
+                .origin = req.origin,
+                .sent_us = req.sent_us,
+                .responder = undefined,
             };
+            nixbadge_mesh_get_mac(&ping.responder);
+            try reply(.{ .ping = ping }, out_data, out_len);
+        },
+        .ping => |ping| {
+            nixbadge_mesh_pong(&ping.origin, &ping.responder, ping.seq, ping.sent_us);
+        },
+        .reload_config => {
+            log.info("Reloading the configuration on request of the mesh", .{});
+            try nixbadge_config_reload().throw();
+        },
+        .digest => |digest| {
+            nixbadge_p2p_announce(digest.ip, digest.generation, digest.count);
+        },
+        .telemetry => |telemetry| {
+            // Only the root keeps the reports, and answers them.
+            const interval_ms = nixbadge_mesh_telemetry_received(&telemetry);
+            if (interval_ms != 0) {
+                try reply(.{ .telemetry_ack = .{ .interval_ms = interval_ms } }, out_data, out_len);
+            }
+        },
+        .telemetry_ack => |ack| {
+            nixbadge_mesh_telemetry_ack(ack.interval_ms);
+        },
+        .req_time => |req| {
+            var time = proto.Time.init();
+            time.sent_us = req.sent_us;
+            time.epoch = nixbadge_mesh_time_epoch();
+            // A badge without the mesh time yet has none to pass on.
+            if (!nixbadge_mesh_time_now(&time.received_us, &time.error_us)) return;
+            _ = nixbadge_mesh_time_now(&time.answered_us, &time.error_us);
+            // Times from either side of a step are not comparable, the
+            // next request gets an answer.
+            if (nixbadge_mesh_time_epoch() != time.epoch) return;
+            try reply(.{ .time = time }, out_data, out_len);
+        },
+        .time => |time| {
+            nixbadge_mesh_time_answer(time.sent_us, time.received_us, time.answered_us, time.error_us, time.epoch);
+        },
+        .show => |show| {
+            nixbadge_show_announce(show.ip, show.seq, show.id, show.start_ms, show.size);
         },
     }
 }
 
-pub fn pingMeasure(i: u8) f32 {
-    if (i > ping_map.len) return 0.0;
-
-    const entry = &ping_map[i];
-    return @as(f32, @floatFromInt(entry.seq)) / (@as(f32, @floatFromInt(@abs(entry.timestamp - last_ping_timestamp))) * 1000);
+fn reply(packet: proto.Packet, out_data: *[*]const u8, out_len: *u32) !void {
+    const resp = try queuePacket(packet);
+    // The mesh sends the reply once the callback returns.
+    tx_buffers.lease(resp.ptr, now(), reply_lease_ms);
+    tx_buffers.release(resp.ptr);
+    out_data.* = resp.ptr;
+    out_len.* = @intCast(resp.len);
 }
@@ -0,0 +1,153 @@
+//! Renders LED frames in fixed point, since the badge has no FPU and every
+//! float sine is a call into soft-float code that takes its time from the
+//! proxy.
+//!
+//! Angles are phases, where 2^32 is a full turn and adding wraps around.
+//! Sines come from a table generated at compile time, with the steps
+//! between its entries interpolated, in Q15.
+
+const std = @import("std");
+
+/// Bits of the phase that pick a table entry, the rest interpolate.
+const sine_bits = 10;
+
+/// A full turn of sines in Q15, with the first repeated at the end so that
+/// the last entry can be interpolated to it.
+const sine_table: [(1 << sine_bits) + 1]i16 = blk: {
+    @setEvalBranchQuota(100_000);
+    var table: [(1 << sine_bits) + 1]i16 = undefined;
+    for (&table, 0..) |*entry, i| {
+        const radians = 2 * std.math.pi * @as(f64, @floatFromInt(i)) / (1 << sine_bits);
+        entry.* = @intFromFloat(@round(@sin(radians) * std.math.maxInt(i16)));
+    }
+    break :blk table;
+};
+
+/// Brightness as the eye sees it, for a gamma of 2.2.
+pub const gamma_table: [256]u8 = blk: {
+    @setEvalBranchQuota(100_000);
+    var table: [256]u8 = undefined;
+    for (&table, 0..) |*entry, i| {
+        const linear = std.math.pow(f64, @as(f64, @floatFromInt(i)) / 255, 2.2);
+        entry.* = @intFromFloat(@round(linear * 255));
+    }
+    break :blk table;
+};
+
+/// The phase of an angle in radians.
+pub fn angle(comptime radians: f64) u32 {
+    const turns = @mod(radians / (2 * std.math.pi), 1);
+    return @truncate(@as(u64, @intFromFloat(@round(turns * (1 << 32)))));
+}
+
+/// Sine of a phase in Q15.
+pub fn sin(p: u32) i32 {
+    const i = p >> (32 - sine_bits);
+    const frac: i32 = @intCast((p >> (16 - sine_bits)) & 0xffff);
+    const a: i32 = sine_table[i];
+    const b: i32 = sine_table[i + 1];
+    return a + ((b - a) * frac >> 16);
+}
+
+/// Pixels of a frame, three bytes each in the order the strip takes them.
+pub const Frame = struct {
+    pixels: []u8,
+
+    pub fn len(self: Frame) usize {
+        return self.pixels.len / 3;
+    }
+
+    pub fn pixel(self: Frame, led: usize) *[3]u8 {
+        return self.pixels[led * 3 ..][0..3];
+    }
+};
+
+/// Something that draws frames, like the hue chase or the links to the
+/// neighbours.
+pub const Effect = struct {
+    ptr: *anyopaque,
+    vtable: *const VTable,
+
+    pub const VTable = struct {
+        render: *const fn (ptr: *anyopaque, frame: Frame) void,
+    };
+
+    pub fn render(self: Effect, frame: Frame) void {
+        self.vtable.render(self.ptr, frame);
+    }
+
+    /// An effect from a pointer to a type with a `render` method.
+    pub fn init(ptr: anytype) Effect {
+        const T = @typeInfo(@TypeOf(ptr)).pointer.child;
+        const gen = struct {
+            fn render(p: *anyopaque, frame: Frame) void {
+                const self: *T = @ptrCast(@alignCast(p));
+                self.render(frame);
+            }
+        };
+        return .{
+            .ptr = ptr,
+            .vtable = &.{ .render = gen.render },
+        };
+    }
+};
+
+/// Draws a frame with an effect, and corrects it for the eye if asked.
+pub fn render(effect: Effect, frame: Frame, gamma: bool) void {
+    effect.render(frame);
+    if (gamma) {
+        for (frame.pixels) |*c| c.* = gamma_table[c.*];
+    }
+}
+
+/// How far the hue turns from one LED to the next.
+pub const led_step = angle(0.3);
+
+/// Between the sines of the colours of an LED.
+const colour_step = angle(2 * std.math.pi / 3);
+
+/// The LED that stands out, brighter than the rest.
+const highlight_led = 4;
+
+/// Colours an LED with three sines a third of a turn apart, which gives a
+/// hue that turns with the phase.
+fn hue(pixel: *[3]u8, p: u32, led: usize) void {
+    const bright = led == highlight_led;
+    const mul: i32 = if (bright) 127 else 64;
+    const off: i32 = if (bright) 128 else 0;
+    for (pixel, 0..) |*c, i| {
+        const v = sin(p +% @as(u32, @intCast(i)) *% colour_step) * mul + (off << 15);
+        // Cut like the float conversion of the renderer before, negative
+        // values wrap.
+        c.* = @truncate(@as(u32, @bitCast(@divTrunc(v, 1 << 15))));
+    }
+}
+
+/// The hue chasing around the badge.
+pub const Chase = struct {
+    phase: u32 = 0,
+    step: u32 = angle(0.02),
+
+    pub fn render(self: *Chase, frame: Frame) void {
+        for (0..frame.len()) |led| {
+            hue(frame.pixel(led), self.phase +% @as(u32, @intCast(led)) *% led_step, led);
+        }
+        self.phase +%= self.step;
+    }
+};
+
+/// An LED for each neighbour, with the hue turned by how badly its link
+/// does, the rest off.
+pub const Links = struct {
+    phases: []const u32,
+
+    pub fn render(self: *Links, frame: Frame) void {
+        for (0..frame.len()) |led| {
+            if (led < self.phases.len) {
+                hue(frame.pixel(led), self.phases[led] +% @as(u32, @intCast(led)) *% led_step, led);
+            } else {
+                frame.pixel(led).* = .{ 0, 0, 0 };
+            }
+        }
+    }
+};
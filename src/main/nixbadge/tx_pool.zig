@@ -0,0 +1,107 @@
+//! Fixed buffers for packets handed to the mesh, which may still read them
+//! after the send returns when it resends a broadcast nobody acknowledged.
+//!
+//! A buffer is held by references and by a lease. References are taken by
+//! whoever is filling or sending the buffer, the lease covers the time the
+//! mesh may come back to it, for which nobody is around to let go. A buffer
+//! is taken again only once both are over. All of it is atomics on the
+//! slots, so it may be used from any task and from mesh callbacks alike.
+
+const std = @import("std");
+
+pub const Stats = extern struct {
+    slots: u32,
+    in_use: u32,
+    acquired: u32,
+    exhausted: u32,
+};
+
+/// Longest lease, so that one left over from long ago, which the wrapping
+/// clock can make look like it is still ahead, counts as over.
+pub const max_lease_ms = 60_000;
+
+pub fn Pool(comptime slots: usize, comptime size: usize) type {
+    return struct {
+        const Self = @This();
+
+        buffs: [slots][size]u8 = undefined,
+        refs: [slots]std.atomic.Value(u32) = [_]std.atomic.Value(u32){.init(0)} ** slots,
+        /// Milliseconds, wrapping, until which the mesh may still read.
+        leases: [slots]std.atomic.Value(u32) = [_]std.atomic.Value(u32){.init(0)} ** slots,
+        /// Where the next search for a free slot starts, so that freed
+        /// slots rest for a while before they are taken again.
+        next: std.atomic.Value(u32) = .init(0),
+        acquired: std.atomic.Value(u32) = .init(0),
+        exhausted: std.atomic.Value(u32) = .init(0),
+
+        /// Takes a free buffer with one reference, or counts the pool as
+        /// exhausted.
+        pub fn acquire(self: *Self, now_ms: u32) ?*[size]u8 {
+            const start = self.next.fetchAdd(1, .monotonic);
+            for (0..slots) |n| {
+                const i = (start +% n) % slots;
+                if (self.refs[i].cmpxchgStrong(0, 1, .acquire, .monotonic) != null) continue;
+                if (!leased(self.leases[i].load(.monotonic), now_ms)) {
+                    _ = self.acquired.fetchAdd(1, .monotonic);
+                    return &self.buffs[i];
+                }
+                self.refs[i].store(0, .release);
+            }
+            _ = self.exhausted.fetchAdd(1, .monotonic);
+            return null;
+        }
+
+        /// Adds a reference to a buffer the caller holds one of.
+        pub fn retain(self: *Self, buff: [*]const u8) void {
+            _ = self.refs[self.index(buff)].fetchAdd(1, .monotonic);
+        }
+
+        pub fn release(self: *Self, buff: [*]const u8) void {
+            const prev = self.refs[self.index(buff)].fetchSub(1, .release);
+            std.debug.assert(prev > 0);
+        }
+
+        /// Keeps a buffer the caller holds a reference of from being taken
+        /// again for `ms` after `now_ms`, or longer if already leased so.
+        pub fn lease(self: *Self, buff: [*]const u8, now_ms: u32, ms: u32) void {
+            std.debug.assert(ms <= max_lease_ms);
+            const until = now_ms +% ms;
+            const slot = &self.leases[self.index(buff)];
+            var current = slot.load(.monotonic);
+            while (!leased(current, now_ms) or until -% now_ms > current -% now_ms) {
+                current = slot.cmpxchgWeak(current, until, .monotonic, .monotonic) orelse return;
+            }
+        }
+
+        pub fn getStats(self: *Self, now_ms: u32) Stats {
+            var in_use: u32 = 0;
+            for (&self.refs, &self.leases) |*refs, *until| {
+                if (refs.load(.monotonic) != 0 or leased(until.load(.monotonic), now_ms)) in_use += 1;
+            }
+            return .{
+                .slots = slots,
+                .in_use = in_use,
+                .acquired = self.acquired.load(.monotonic),
+                .exhausted = self.exhausted.load(.monotonic),
+            };
+        }
+
+        /// Whether a pointer into a buffer belongs to this pool.
+        pub fn owns(self: *const Self, buff: [*]const u8) bool {
+            const addr = @intFromPtr(buff);
+            const base = @intFromPtr(&self.buffs);
+            return addr >= base and addr < base + @sizeOf(@TypeOf(self.buffs));
+        }
+
+        fn index(self: *const Self, buff: [*]const u8) usize {
+            std.debug.assert(self.owns(buff));
+            return (@intFromPtr(buff) - @intFromPtr(&self.buffs)) / size;
+        }
+
+        /// Whether a lease until `until` is still running at `now_ms`.
+        fn leased(until: u32, now_ms: u32) bool {
+            const left = until -% now_ms;
+            return left > 0 and left <= max_lease_ms;
+        }
+    };
+}
@@ -0,0 +1,240 @@
+#include "nixbadge_anim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Tracks an animation may have, which bounds the work of a frame. */
+#define ANIM_MAX_TRACKS 32
+/* Fractions between keyframes are in Q16. */
+#define ANIM_ONE 65536
+/* Times are kept within this, so that shifting them cannot overflow. */
+#define ANIM_MAX_MS ((int64_t)1 << 48)
+
+typedef struct {
+  uint16_t first;
+  uint16_t count;
+  int16_t spread_ms;
+  uint8_t len;
+  /* Palette index and easing of each keyframe, and when it is reached. */
+  const uint8_t* keyframes;
+  uint32_t* at_ms;
+} nixbadge_anim_track_t;
+
+struct nixbadge_anim {
+  uint32_t loop_start_ms;
+  uint32_t loop_end_ms;
+  uint32_t duration_ms;
+  const uint8_t* palette;
+  size_t ntracks;
+  nixbadge_anim_track_t tracks[];
+};
+
+static uint16_t nixbadge_anim_u16(const uint8_t* p) {
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t nixbadge_anim_u32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Walks the tracks of an animation, checking them, and fills them in when
+ * `anim` is set. Keyframe times are written from `at_ms` on.
+ * @param keyframes set to the keyframes of all tracks
+ * @return NULL if they are valid, or what is wrong with them
+ */
+static const char* nixbadge_anim_walk(const uint8_t* data, size_t len,
+                                      nixbadge_anim_t* anim, uint32_t* at_ms,
+                                      size_t* keyframes) {
+  size_t colours = data[3], ntracks = data[4];
+  size_t offset = NIXBADGE_ANIM_HEADER_SIZE + colours * NIXBADGE_ANIM_CHANNELS;
+  uint32_t duration = 0;
+  *keyframes = 0;
+  for (size_t i = 0; i < ntracks; i++) {
+    if (len - offset < NIXBADGE_ANIM_TRACK_SIZE) return "truncated track";
+    const uint8_t* track = data + offset;
+    size_t nkeys = track[6];
+    if (nkeys == 0) return "track without keyframes";
+    if (track[7] != 0) return "reserved track byte set";
+    offset += NIXBADGE_ANIM_TRACK_SIZE;
+    if ((len - offset) / NIXBADGE_ANIM_KEYFRAME_SIZE < nkeys) {
+      return "truncated keyframes";
+    }
+
+    uint32_t at = 0;
+    for (size_t k = 0; k < nkeys; k++) {
+      const uint8_t* key = data + offset + k * NIXBADGE_ANIM_KEYFRAME_SIZE;
+      if (key[2] >= colours) return "palette index out of range";
+      if (key[3] >= NIXBADGE_ANIM_EASINGS) return "unknown easing";
+      at += nixbadge_anim_u16(key);
+      if (anim) at_ms[*keyframes + k] = at;
+    }
+    if (at > duration) duration = at;
+
+    if (anim) {
+      anim->tracks[i] = (nixbadge_anim_track_t){
+          .first = nixbadge_anim_u16(track),
+          .count = nixbadge_anim_u16(track + 2),
+          .spread_ms = (int16_t)nixbadge_anim_u16(track + 4),
+          .len = nkeys,
+          .keyframes = data + offset,
+          .at_ms = at_ms + *keyframes,
+      };
+    }
+    offset += nkeys * NIXBADGE_ANIM_KEYFRAME_SIZE;
+    *keyframes += nkeys;
+  }
+  if (offset != len) return "trailing bytes";
+  if (anim) {
+    anim->duration_ms = anim->loop_end_ms ? anim->loop_end_ms : duration;
+  }
+  return NULL;
+}
+
+nixbadge_anim_t* nixbadge_anim_new(const uint8_t* data, size_t len,
+                                   const char** error) {
+  const char* why = NULL;
+  if (len < NIXBADGE_ANIM_HEADER_SIZE || data[0] != 'N' || data[1] != 'A') {
+    why = "not an animation";
+  } else if (data[2] != NIXBADGE_ANIM_VERSION) {
+    why = "unsupported version";
+  } else if (data[3] == 0) {
+    why = "empty palette";
+  } else if (data[4] > ANIM_MAX_TRACKS) {
+    why = "too many tracks";
+  } else if (data[5] != 0) {
+    why = "unknown flags";
+  } else if (len - NIXBADGE_ANIM_HEADER_SIZE <
+             (size_t)data[3] * NIXBADGE_ANIM_CHANNELS) {
+    why = "truncated palette";
+  }
+  uint32_t loop_start = 0, loop_end = 0;
+  if (!why) {
+    loop_start = nixbadge_anim_u32(data + 6);
+    loop_end = nixbadge_anim_u32(data + 10);
+    if (loop_end != 0 && loop_end <= loop_start) why = "loop ends before start";
+  }
+  size_t keyframes = 0;
+  if (!why) why = nixbadge_anim_walk(data, len, NULL, NULL, &keyframes);
+  if (why) {
+    if (error) *error = why;
+    return NULL;
+  }
+
+  // The tracks, the times of their keyframes and a copy of the data.
+  size_t ntracks = data[4];
+  size_t tracks_size = ntracks * sizeof(nixbadge_anim_track_t);
+  size_t at_size = keyframes * sizeof(uint32_t);
+  nixbadge_anim_t* anim =
+      malloc(sizeof(nixbadge_anim_t) + tracks_size + at_size + len);
+  if (!anim) {
+    if (error) *error = "out of memory";
+    return NULL;
+  }
+  uint32_t* at_ms = (uint32_t*)((uint8_t*)anim->tracks + tracks_size);
+  uint8_t* copy = (uint8_t*)at_ms + at_size;
+  memcpy(copy, data, len);
+
+  anim->loop_start_ms = loop_start;
+  anim->loop_end_ms = loop_end;
+  anim->palette = copy + NIXBADGE_ANIM_HEADER_SIZE;
+  anim->ntracks = ntracks;
+  nixbadge_anim_walk(copy, len, anim, at_ms, &keyframes);
+  return anim;
+}
+
+void nixbadge_anim_free(nixbadge_anim_t* anim) { free(anim); }
+
+uint32_t nixbadge_anim_duration_ms(const nixbadge_anim_t* anim) {
+  return anim->duration_ms;
+}
+
+/* Where `fraction` of the way to a keyframe is once eased, in Q16. */
+static uint32_t nixbadge_anim_ease(uint8_t easing, uint32_t fraction) {
+  uint32_t rest = ANIM_ONE - fraction;
+  switch (easing) {
+    case NIXBADGE_ANIM_LINEAR:
+      return fraction;
+    case NIXBADGE_ANIM_EASE_IN:
+      return (uint64_t)fraction * fraction >> 16;
+    case NIXBADGE_ANIM_EASE_OUT:
+      return ANIM_ONE - ((uint64_t)rest * rest >> 16);
+    case NIXBADGE_ANIM_EASE_IN_OUT:
+      // Smoothstep, 3f^2 - 2f^3.
+      return ((uint64_t)fraction * fraction >> 16) *
+                 (3 * ANIM_ONE - 2 * (uint64_t)fraction) >>
+             16;
+    default:
+      return 0;
+  }
+}
+
+/*
+ * Time within the animation, with the loop taken into account. LEDs that
+ * are behind the start are in the loop too when there is one, so that a
+ * chase goes all the way around from the start.
+ */
+static uint32_t nixbadge_anim_time(const nixbadge_anim_t* anim, int64_t ms) {
+  if (anim->loop_end_ms && (ms < 0 || ms >= anim->loop_end_ms)) {
+    int64_t span = anim->loop_end_ms - anim->loop_start_ms;
+    int64_t into = (ms - anim->loop_start_ms) % span;
+    return anim->loop_start_ms + (into < 0 ? into + span : into);
+  }
+  if (ms < 0) return 0;
+  return ms > UINT32_MAX ? UINT32_MAX : ms;
+}
+
+static void nixbadge_anim_colour(const nixbadge_anim_t* anim,
+                                 const nixbadge_anim_track_t* track,
+                                 uint32_t ms, uint8_t* pixel) {
+  // The first keyframe not reached yet.
+  size_t lo = 0, hi = track->len;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (track->at_ms[mid] <= ms) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  const uint8_t* keyframes = track->keyframes;
+  if (lo == 0 || lo == track->len) {
+    size_t key = lo == 0 ? 0 : lo - 1;
+    const uint8_t* colour =
+        anim->palette +
+        keyframes[key * NIXBADGE_ANIM_KEYFRAME_SIZE + 2] *
+            NIXBADGE_ANIM_CHANNELS;
+    memcpy(pixel, colour, NIXBADGE_ANIM_CHANNELS);
+    return;
+  }
+
+  const uint8_t* from = keyframes + (lo - 1) * NIXBADGE_ANIM_KEYFRAME_SIZE;
+  const uint8_t* to = from + NIXBADGE_ANIM_KEYFRAME_SIZE;
+  uint32_t span = track->at_ms[lo] - track->at_ms[lo - 1];
+  uint32_t fraction = (uint64_t)(ms - track->at_ms[lo - 1]) * ANIM_ONE / span;
+  int32_t eased = nixbadge_anim_ease(to[3], fraction);
+  const uint8_t* a = anim->palette + from[2] * NIXBADGE_ANIM_CHANNELS;
+  const uint8_t* b = anim->palette + to[2] * NIXBADGE_ANIM_CHANNELS;
+  for (int c = 0; c < NIXBADGE_ANIM_CHANNELS; c++) {
+    pixel[c] = a[c] + (((b[c] - a[c]) * eased) >> 16);
+  }
+}
+
+void nixbadge_anim_render(const nixbadge_anim_t* anim, int64_t ms,
+                          uint8_t* pixels, size_t len) {
+  size_t leds = len / NIXBADGE_ANIM_CHANNELS;
+  if (ms > ANIM_MAX_MS) ms = ANIM_MAX_MS;
+  if (ms < -ANIM_MAX_MS) ms = -ANIM_MAX_MS;
+  memset(pixels, 0, len);
+  for (size_t i = 0; i < anim->ntracks; i++) {
+    const nixbadge_anim_track_t* track = &anim->tracks[i];
+    size_t end = track->count ? (size_t)track->first + track->count : leds;
+    if (end > leds) end = leds;
+    for (size_t led = track->first; led < end; led++) {
+      int64_t shifted = ms + (int64_t)(led - track->first) * track->spread_ms;
+      nixbadge_anim_colour(anim, track, nixbadge_anim_time(anim, shifted),
+                           pixels + led * NIXBADGE_ANIM_CHANNELS);
+    }
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keyframe animations for the LEDs, uploaded once and drawn on the badge
+ * without anything going over the network per frame.
+ *
+ * An animation is a palette and tracks. A track covers a run of LEDs and
+ * moves through keyframes, each a palette colour at a point in time and
+ * the easing that leads into it. Every LED of a track is shifted in time
+ * by as much again as the one before it, so that a chase or a wave is a
+ * single track. Later tracks draw over earlier ones, and LEDs that no
+ * track covers are off. Once past the loop end, time goes back to the loop
+ * start.
+ *
+ * The format, little endian throughout:
+ *
+ *   header    "NA", version, palette colours, tracks, flags (0),
+ *             loop start ms (u32), loop end ms (u32, 0 for no loop)
+ *   palette   red, green, blue for each colour
+ *   track     first LED (u16), LEDs (u16, 0 for the rest of the strip),
+ *             ms each LED is ahead of the one before (i16), keyframes
+ *             (u8), reserved (0), then the keyframes
+ *   keyframe  ms since the one before (u16), palette index, easing
+ *
+ * Everything is checked when an animation is loaded, so that drawing one
+ * cannot read out of it. Nothing here depends on ESP-IDF, so it builds and
+ * runs on the host too.
+ */
+
+#define NIXBADGE_ANIM_VERSION 1
+#define NIXBADGE_ANIM_HEADER_SIZE 14
+#define NIXBADGE_ANIM_TRACK_SIZE 8
+#define NIXBADGE_ANIM_KEYFRAME_SIZE 4
+#define NIXBADGE_ANIM_CHANNELS 3
+
+/* How a colour goes over into the one of the next keyframe. */
+typedef enum {
+  /* Jumps to it when the keyframe is reached. */
+  NIXBADGE_ANIM_STEP,
+  NIXBADGE_ANIM_LINEAR,
+  NIXBADGE_ANIM_EASE_IN,
+  NIXBADGE_ANIM_EASE_OUT,
+  NIXBADGE_ANIM_EASE_IN_OUT,
+  NIXBADGE_ANIM_EASINGS,
+} nixbadge_anim_easing_t;
+
+typedef struct nixbadge_anim nixbadge_anim_t;
+
+/**
+ * Checks an animation and copies it.
+ * @param error set to why it was rejected, when it was
+ * @return NULL if it is not valid or out of memory
+ */
+nixbadge_anim_t* nixbadge_anim_new(const uint8_t* data, size_t len,
+                                   const char** error);
+void nixbadge_anim_free(nixbadge_anim_t* anim);
+
+/**
+ * @return milliseconds until it loops or holds its last keyframes
+ */
+uint32_t nixbadge_anim_duration_ms(const nixbadge_anim_t* anim);
+
+/**
+ * Draws the animation as it is `ms` after it started, which may be before
+ * it did: that is in the loop too when there is one, or the first frame.
+ * @param len bytes of pixels, three for each LED
+ */
+void nixbadge_anim_render(const nixbadge_anim_t* anim, int64_t ms,
+                          uint8_t* pixels, size_t len);
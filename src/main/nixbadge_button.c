@@ -0,0 +1,180 @@
+#include "nixbadge_button.h"
+
+#include <stdlib.h>
+
+typedef enum {
+  BUTTON_IDLE,
+  /* Pressed, and a long press if held on. */
+  BUTTON_DOWN,
+  /* Let go of a click, waiting for a second one. */
+  BUTTON_UP,
+  /* Pressed again after a click. */
+  BUTTON_DOWN_AGAIN,
+  /* Long pressed, or held since boot, until let go. */
+  BUTTON_HELD,
+} nixbadge_button_state_t;
+
+struct nixbadge_button {
+  nixbadge_button_config_t config;
+  /* The pin since its last edge, which counts once it held long enough. */
+  bool raw;
+  int64_t raw_us;
+  /* When the pin first left the level that counts, bounces and all. */
+  int64_t left_us;
+  bool pressed;
+  nixbadge_button_state_t state;
+  /* When the gesture began, and when the button last went down or up. */
+  int64_t first_us;
+  int64_t changed_us;
+  nixbadge_button_stats_t stats;
+};
+
+static void nixbadge_button_emit(nixbadge_button_t* button,
+                                 nixbadge_button_gesture_t gesture,
+                                 int64_t pressed_us, int64_t at_us) {
+  button->stats.events++;
+  if (!button->config.cb) return;
+
+  nixbadge_button_event_t event = {
+      .gesture = gesture,
+      .pressed_us = pressed_us,
+      .at_us = at_us,
+  };
+  button->config.cb(button->config.arg, &event);
+}
+
+/* When the gesture under way times out, INT64_MAX if it cannot. */
+static int64_t nixbadge_button_timeout_us(const nixbadge_button_t* button) {
+  switch (button->state) {
+    case BUTTON_DOWN:
+    case BUTTON_DOWN_AGAIN:
+      return button->changed_us + button->config.long_press_us;
+    case BUTTON_UP:
+      return button->changed_us + button->config.double_click_us;
+    default:
+      return INT64_MAX;
+  }
+}
+
+static void nixbadge_button_timeout(nixbadge_button_t* button, int64_t at_us) {
+  switch (button->state) {
+    case BUTTON_DOWN:
+      nixbadge_button_emit(button, NIXBADGE_BUTTON_LONG_PRESS,
+                           button->first_us, at_us);
+      button->state = BUTTON_HELD;
+      break;
+    case BUTTON_DOWN_AGAIN:
+      // The click before stands on its own.
+      nixbadge_button_emit(button, NIXBADGE_BUTTON_PRESS, button->first_us,
+                           at_us);
+      nixbadge_button_emit(button, NIXBADGE_BUTTON_LONG_PRESS,
+                           button->changed_us, at_us);
+      button->state = BUTTON_HELD;
+      break;
+    case BUTTON_UP:
+      nixbadge_button_emit(button, NIXBADGE_BUTTON_PRESS, button->first_us,
+                           at_us);
+      button->state = BUTTON_IDLE;
+      break;
+    default:
+      break;
+  }
+}
+
+/* The button went down or up at `at_us`, bounces left out. */
+static void nixbadge_button_settle(nixbadge_button_t* button, bool pressed,
+                                   int64_t at_us) {
+  button->pressed = pressed;
+  switch (button->state) {
+    case BUTTON_IDLE:
+      if (!pressed) break;
+      button->state = BUTTON_DOWN;
+      button->first_us = at_us;
+      button->changed_us = at_us;
+      break;
+    case BUTTON_DOWN:
+      if (pressed) break;
+      button->state = BUTTON_UP;
+      button->changed_us = at_us;
+      break;
+    case BUTTON_UP:
+      if (!pressed) break;
+      button->state = BUTTON_DOWN_AGAIN;
+      button->changed_us = at_us;
+      break;
+    case BUTTON_DOWN_AGAIN:
+      if (pressed) break;
+      nixbadge_button_emit(button, NIXBADGE_BUTTON_DOUBLE_CLICK,
+                           button->first_us, at_us);
+      button->state = BUTTON_IDLE;
+      break;
+    case BUTTON_HELD:
+      if (!pressed) button->state = BUTTON_IDLE;
+      break;
+  }
+}
+
+nixbadge_button_t* nixbadge_button_new(const nixbadge_button_config_t* config,
+                                       bool level, int64_t now_us) {
+  nixbadge_button_t* button = calloc(1, sizeof(*button));
+  if (!button) return NULL;
+
+  button->config = *config;
+  button->raw = level == config->active_high;
+  button->raw_us = now_us;
+  button->left_us = now_us;
+  button->pressed = button->raw;
+  // A button held since boot is only a press once let go and pressed again.
+  button->state = button->pressed ? BUTTON_HELD : BUTTON_IDLE;
+  return button;
+}
+
+void nixbadge_button_free(nixbadge_button_t* button) { free(button); }
+
+void nixbadge_button_advance(nixbadge_button_t* button, int64_t now_us) {
+  while (true) {
+    bool pending = button->raw != button->pressed;
+    // A timeout after an edge that may yet count waits for it to.
+    int64_t timeout = nixbadge_button_timeout_us(button);
+    if (timeout <= now_us && (!pending || timeout < button->left_us)) {
+      nixbadge_button_timeout(button, timeout);
+    } else if (pending &&
+               button->raw_us + button->config.debounce_us <= now_us) {
+      nixbadge_button_settle(button, button->raw, button->left_us);
+    } else {
+      break;
+    }
+  }
+}
+
+void nixbadge_button_edge(nixbadge_button_t* button, bool level,
+                          int64_t at_us) {
+  if (at_us < button->raw_us) at_us = button->raw_us;
+  nixbadge_button_advance(button, at_us);
+
+  button->stats.edges++;
+  if (button->raw != button->pressed) button->stats.bounces++;
+  bool raw = level == button->config.active_high;
+  // Leaving the level that counts again soon after a bounce back to it is
+  // the same press or release.
+  if (raw != button->pressed && button->raw == button->pressed &&
+      at_us - button->raw_us >= button->config.debounce_us) {
+    button->left_us = at_us;
+  }
+  // An edge to the level the pin was at means one in between was missed,
+  // which restarts the wait all the same.
+  button->raw = raw;
+  button->raw_us = at_us;
+}
+
+int64_t nixbadge_button_next_us(const nixbadge_button_t* button) {
+  int64_t timeout = nixbadge_button_timeout_us(button);
+  if (button->raw == button->pressed) return timeout;
+  if (timeout < button->left_us) return timeout;
+  return button->raw_us + button->config.debounce_us;
+}
+
+void nixbadge_button_get_stats(const nixbadge_button_t* button,
+                               nixbadge_button_stats_t* stats) {
+  *stats = button->stats;
+}
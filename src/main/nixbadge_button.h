@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Turns the raw edges of a button into presses, long presses and double
+ * clicks.
+ *
+ * A level counts once the pin held it for the debounce time since its
+ * last edge, and then from the edge that first left the level before, so
+ * that bounces neither show up as presses nor shift when a press began.
+ * A press that is held for the long press time is a long press, right away
+ * and whether or not it is let go. One that is let go sooner is a click,
+ * which is a press once no second click began within the double click
+ * time, or a double click with it.
+ *
+ * Nothing is polled: the caller passes every edge with when it happened
+ * and calls nixbadge_button_advance when nixbadge_button_next_us is due,
+ * from a timer. Times are taken as parameters, so that this can be driven
+ * by traces of edges off the badge.
+ */
+
+typedef enum {
+  NIXBADGE_BUTTON_PRESS,
+  NIXBADGE_BUTTON_LONG_PRESS,
+  NIXBADGE_BUTTON_DOUBLE_CLICK,
+} nixbadge_button_gesture_t;
+
+typedef struct {
+  nixbadge_button_gesture_t gesture;
+  /* When the first press of the gesture began. */
+  int64_t pressed_us;
+  /* When it was recognised. */
+  int64_t at_us;
+} nixbadge_button_event_t;
+
+typedef void (*nixbadge_button_cb_t)(void* arg,
+                                     const nixbadge_button_event_t* event);
+
+typedef struct {
+  uint32_t debounce_us;
+  uint32_t long_press_us;
+  /* Most between letting go of a click and beginning the second. */
+  uint32_t double_click_us;
+  /* Whether the pin is high while the button is pressed. */
+  bool active_high;
+
+  nixbadge_button_cb_t cb;
+  void* arg;
+} nixbadge_button_config_t;
+
+typedef struct {
+  uint32_t edges;
+  /* Edges that came before the level they left counted. */
+  uint32_t bounces;
+  uint32_t events;
+} nixbadge_button_stats_t;
+
+typedef struct nixbadge_button nixbadge_button_t;
+
+/**
+ * @param level the pin as it is at `now_us`, taken as settled
+ */
+nixbadge_button_t* nixbadge_button_new(const nixbadge_button_config_t* config,
+                                       bool level, int64_t now_us);
+void nixbadge_button_free(nixbadge_button_t* button);
+
+/**
+ * Adds an edge of the pin to `level` at `at_us`, after any that came
+ * before it. Events that were due before it are passed to the callback
+ * first.
+ */
+void nixbadge_button_edge(nixbadge_button_t* button, bool level,
+                          int64_t at_us);
+
+/**
+ * Passes the events due by `now_us` to the callback.
+ */
+void nixbadge_button_advance(nixbadge_button_t* button, int64_t now_us);
+
+/**
+ * @return when nixbadge_button_advance is next due, INT64_MAX when nothing
+ *         is pending
+ */
+int64_t nixbadge_button_next_us(const nixbadge_button_t* button);
+
+void nixbadge_button_get_stats(const nixbadge_button_t* button,
+                               nixbadge_button_stats_t* stats);
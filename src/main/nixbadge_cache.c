@@ -0,0 +1,509 @@
+#include "nixbadge_cache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_hash.h"
+
+enum {
+  ENTRY_FREE = 0,
+  ENTRY_WRITING,
+  ENTRY_READY,
+  ENTRY_DOOMED,
+};
+
+struct nixbadge_cache_entry {
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  uint64_t size;
+  uint32_t hash;
+  uint16_t readers;
+  uint8_t state;
+  nixbadge_cache_entry_t* hash_next;
+  nixbadge_cache_entry_t* lru_prev;
+  nixbadge_cache_entry_t* lru_next;
+};
+
+struct nixbadge_cache {
+  nixbadge_cache_backend_t backend;
+  pthread_mutex_t lock;
+  uint64_t budget;
+  uint64_t used;
+
+  nixbadge_cache_entry_t* entries;
+  size_t max_entries;
+  nixbadge_cache_entry_t* free_list;
+
+  nixbadge_cache_entry_t** buckets;
+  size_t bucket_count;
+
+  // Most recently used at the head, eviction candidates at the tail.
+  nixbadge_cache_entry_t* lru_head;
+  nixbadge_cache_entry_t* lru_tail;
+  // Doomed objects no reader has open, linked through lru_next, waiting for
+  // nixbadge_cache_reap to delete them without the lock.
+  nixbadge_cache_entry_t* doomed;
+
+  nixbadge_cache_stats_t stats;
+};
+
+bool nixbadge_cache_key_valid(const char* key) {
+  size_t len = strnlen(key, NIXBADGE_CACHE_KEY_MAX + 1);
+  if (len == 0 || len > NIXBADGE_CACHE_KEY_MAX || key[0] == '.') return false;
+
+  for (size_t i = 0; i < len; i++) {
+    char c = key[i];
+    bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '.' || c == '-' || c == '_' ||
+              c == '+';
+    if (!ok) return false;
+  }
+  return strstr(key, "..") == NULL;
+}
+
+static nixbadge_cache_entry_t* nixbadge_cache_find(nixbadge_cache_t* cache,
+                                                   const char* key,
+                                                   uint32_t hash) {
+  nixbadge_cache_entry_t* entry = cache->buckets[hash % cache->bucket_count];
+  for (; entry; entry = entry->hash_next) {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0) return entry;
+  }
+  return NULL;
+}
+
+static void nixbadge_cache_unhash(nixbadge_cache_t* cache,
+                                  nixbadge_cache_entry_t* entry) {
+  nixbadge_cache_entry_t** link =
+      &cache->buckets[entry->hash % cache->bucket_count];
+  while (*link && *link != entry) link = &(*link)->hash_next;
+  if (*link) *link = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+static void nixbadge_cache_lru_unlink(nixbadge_cache_t* cache,
+                                      nixbadge_cache_entry_t* entry) {
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else if (cache->lru_head == entry) {
+    cache->lru_head = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else if (cache->lru_tail == entry) {
+    cache->lru_tail = entry->lru_prev;
+  }
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void nixbadge_cache_lru_push(nixbadge_cache_t* cache,
+                                    nixbadge_cache_entry_t* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+  if (cache->lru_head) cache->lru_head->lru_prev = entry;
+  cache->lru_head = entry;
+  if (!cache->lru_tail) cache->lru_tail = entry;
+}
+
+static nixbadge_cache_entry_t* nixbadge_cache_alloc(nixbadge_cache_t* cache,
+                                                    const char* key,
+                                                    uint32_t hash) {
+  nixbadge_cache_entry_t* entry = cache->free_list;
+  if (!entry) return NULL;
+  cache->free_list = entry->hash_next;
+
+  memset(entry, 0, sizeof(*entry));
+  snprintf(entry->key, sizeof(entry->key), "%s", key);
+  entry->hash = hash;
+
+  size_t bucket = hash % cache->bucket_count;
+  entry->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  return entry;
+}
+
+static void nixbadge_cache_release(nixbadge_cache_t* cache,
+                                   nixbadge_cache_entry_t* entry) {
+  cache->used -= entry->size;
+  entry->state = ENTRY_FREE;
+  entry->hash_next = cache->free_list;
+  cache->free_list = entry;
+}
+
+/* Queues a doomed object for deletion. nixbadge_cache_reap pins it until it
+ * is gone, so that its key cannot be written again meanwhile. */
+static void nixbadge_cache_doom(nixbadge_cache_t* cache,
+                                nixbadge_cache_entry_t* entry) {
+  entry->readers = 1;
+  entry->lru_next = cache->doomed;
+  cache->doomed = entry;
+}
+
+/* Removes an object from the index. It stays hashed, so that its key cannot
+ * be written again, until it is deleted from the backend, which waits for
+ * its last reader to close it. */
+static void nixbadge_cache_drop(nixbadge_cache_t* cache,
+                                nixbadge_cache_entry_t* entry) {
+  nixbadge_cache_lru_unlink(cache, entry);
+  cache->stats.entries--;
+  entry->state = ENTRY_DOOMED;
+  if (entry->readers == 0) nixbadge_cache_doom(cache, entry);
+}
+
+static void nixbadge_cache_unpin(nixbadge_cache_t* cache,
+                                 nixbadge_cache_entry_t* entry) {
+  if (--entry->readers == 0 && entry->state == ENTRY_DOOMED) {
+    nixbadge_cache_doom(cache, entry);
+  }
+}
+
+/* Deletes the queued doomed objects, taking the lock only to unqueue and
+ * free them so that slow storage holds up no other client. */
+static void nixbadge_cache_reap(nixbadge_cache_t* cache) {
+  pthread_mutex_lock(&cache->lock);
+  while (cache->doomed) {
+    nixbadge_cache_entry_t* entry = cache->doomed;
+    cache->doomed = entry->lru_next;
+    entry->lru_next = NULL;
+    pthread_mutex_unlock(&cache->lock);
+
+    cache->backend.ops->remove(cache->backend.ctx, entry->key, false);
+
+    pthread_mutex_lock(&cache->lock);
+    entry->readers = 0;
+    nixbadge_cache_unhash(cache, entry);
+    nixbadge_cache_release(cache, entry);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static bool nixbadge_cache_evict_one(nixbadge_cache_t* cache) {
+  nixbadge_cache_entry_t* victim = cache->lru_tail;
+  if (!victim) return false;
+
+  nixbadge_cache_drop(cache, victim);
+  cache->stats.evictions++;
+  return true;
+}
+
+/* Evicts until `len` more bytes fit. Doomed objects count against the budget
+ * until they are deleted, so this can fail while readers hold evicted
+ * objects open.
+ * @return 0, -EAGAIN to reap the evicted objects and try again, or -ENOSPC
+ */
+static int nixbadge_cache_reserve(nixbadge_cache_t* cache, uint64_t len) {
+  if (len > cache->budget) return -ENOSPC;
+  while (cache->used + len > cache->budget) {
+    if (cache->doomed) return -EAGAIN;
+    if (!nixbadge_cache_evict_one(cache)) return -ENOSPC;
+  }
+  cache->used += len;
+  return 0;
+}
+
+static void nixbadge_cache_scan_cb(void* arg, const char* key, uint64_t size) {
+  nixbadge_cache_t* cache = arg;
+  uint32_t hash = nixbadge_hash_str(key);
+
+  if (!nixbadge_cache_key_valid(key) || nixbadge_cache_find(cache, key, hash))
+    return;
+
+  if (!cache->free_list && nixbadge_cache_evict_one(cache)) {
+    nixbadge_cache_reap(cache);
+  }
+  nixbadge_cache_entry_t* entry = nixbadge_cache_alloc(cache, key, hash);
+  if (!entry) {
+    cache->backend.ops->remove(cache->backend.ctx, key, false);
+    return;
+  }
+
+  entry->state = ENTRY_READY;
+  entry->size = size;
+  cache->used += size;
+  cache->stats.entries++;
+  nixbadge_cache_lru_push(cache, entry);
+}
+
+nixbadge_cache_t* nixbadge_cache_new(const nixbadge_cache_backend_t* backend,
+                                     uint64_t budget, size_t max_entries) {
+  if (!backend || !backend->ops || max_entries == 0) return NULL;
+
+  nixbadge_cache_t* cache = calloc(1, sizeof(nixbadge_cache_t));
+  if (!cache) return NULL;
+
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->backend = *backend;
+  cache->budget = budget;
+  cache->max_entries = max_entries;
+  cache->bucket_count = max_entries;
+  cache->entries = calloc(max_entries, sizeof(nixbadge_cache_entry_t));
+  cache->buckets = calloc(cache->bucket_count, sizeof(nixbadge_cache_entry_t*));
+  if (!cache->entries || !cache->buckets) {
+    nixbadge_cache_free(cache);
+    return NULL;
+  }
+
+  for (size_t i = max_entries; i > 0; i--) {
+    cache->entries[i - 1].hash_next = cache->free_list;
+    cache->free_list = &cache->entries[i - 1];
+  }
+
+  backend->ops->scan(backend->ctx, nixbadge_cache_scan_cb, cache);
+  while (cache->used > cache->budget && nixbadge_cache_evict_one(cache)) {
+    nixbadge_cache_reap(cache);
+  }
+  return cache;
+}
+
+void nixbadge_cache_free(nixbadge_cache_t* cache) {
+  if (!cache) return;
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->buckets);
+  free(cache->entries);
+  free(cache);
+}
+
+bool nixbadge_cache_contains(nixbadge_cache_t* cache, const char* key) {
+  pthread_mutex_lock(&cache->lock);
+  nixbadge_cache_entry_t* entry =
+      nixbadge_cache_find(cache, key, nixbadge_hash_str(key));
+  bool found = entry && entry->state == ENTRY_READY;
+  pthread_mutex_unlock(&cache->lock);
+  return found;
+}
+
+void nixbadge_cache_get_stats(nixbadge_cache_t* cache,
+                              nixbadge_cache_stats_t* stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  stats->used = cache->used;
+  stats->budget = cache->budget;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void nixbadge_cache_foreach(nixbadge_cache_t* cache,
+                            nixbadge_cache_scan_cb_t cb, void* arg) {
+  pthread_mutex_lock(&cache->lock);
+  for (nixbadge_cache_entry_t* entry = cache->lru_head; entry;
+       entry = entry->lru_next) {
+    if (entry->state == ENTRY_READY) cb(arg, entry->key, entry->size);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+int nixbadge_cache_open(nixbadge_cache_t* cache, const char* key,
+                        nixbadge_cache_reader_t* reader) {
+  if (!nixbadge_cache_key_valid(key)) return -EINVAL;
+
+  pthread_mutex_lock(&cache->lock);
+  nixbadge_cache_entry_t* entry =
+      nixbadge_cache_find(cache, key, nixbadge_hash_str(key));
+  if (!entry || entry->state != ENTRY_READY) {
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return -ENOENT;
+  }
+  entry->readers++;
+  nixbadge_cache_lru_unlink(cache, entry);
+  nixbadge_cache_lru_push(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+
+  int err = cache->backend.ops->open_read(cache->backend.ctx, key,
+                                          &reader->file);
+
+  pthread_mutex_lock(&cache->lock);
+  if (err < 0) {
+    // The object went missing underneath us, forget about it.
+    cache->stats.misses++;
+    if (entry->state == ENTRY_READY) nixbadge_cache_drop(cache, entry);
+    nixbadge_cache_unpin(cache, entry);
+  } else {
+    cache->stats.hits++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (err < 0) {
+    nixbadge_cache_reap(cache);
+    return err;
+  }
+
+  reader->cache = cache;
+  reader->entry = entry;
+  reader->size = entry->size;
+  return 0;
+}
+
+ssize_t nixbadge_cache_read(nixbadge_cache_reader_t* reader, void* buf,
+                            size_t len) {
+  nixbadge_cache_t* cache = reader->cache;
+  return cache->backend.ops->read(cache->backend.ctx, reader->file, buf, len);
+}
+
+int nixbadge_cache_seek(nixbadge_cache_reader_t* reader, uint64_t offset) {
+  nixbadge_cache_t* cache = reader->cache;
+  if (offset > reader->size) return -EINVAL;
+  return cache->backend.ops->seek(cache->backend.ctx, reader->file, offset);
+}
+
+void nixbadge_cache_close(nixbadge_cache_reader_t* reader) {
+  nixbadge_cache_t* cache = reader->cache;
+  nixbadge_cache_entry_t* entry = reader->entry;
+  if (!cache || !entry) return;
+
+  cache->backend.ops->close(cache->backend.ctx, reader->file);
+
+  pthread_mutex_lock(&cache->lock);
+  nixbadge_cache_unpin(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+  nixbadge_cache_reap(cache);
+
+  reader->cache = NULL;
+  reader->entry = NULL;
+}
+
+int nixbadge_cache_begin(nixbadge_cache_t* cache, const char* key,
+                         nixbadge_cache_writer_t* writer) {
+  if (!nixbadge_cache_key_valid(key)) return -EINVAL;
+
+  uint32_t hash = nixbadge_hash_str(key);
+
+  pthread_mutex_lock(&cache->lock);
+  nixbadge_cache_entry_t* entry = NULL;
+  int err = 0;
+  while (!entry && err == 0) {
+    nixbadge_cache_entry_t* found = nixbadge_cache_find(cache, key, hash);
+    if (found) {
+      // A doomed object is still open under its key, which a new one would
+      // take over and then lose when the last reader deletes the old one.
+      err = found->state == ENTRY_DOOMED ? -EBUSY : -EEXIST;
+    } else if (cache->free_list) {
+      entry = nixbadge_cache_alloc(cache, key, hash);
+      entry->state = ENTRY_WRITING;
+    } else if (cache->doomed) {
+      // Someone may begin the same key while the lock is let go.
+      pthread_mutex_unlock(&cache->lock);
+      nixbadge_cache_reap(cache);
+      pthread_mutex_lock(&cache->lock);
+    } else if (!nixbadge_cache_evict_one(cache)) {
+      // Evicting an object still open does not free its entry.
+      err = -ENOSPC;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (err < 0) return err;
+
+  err =
+      cache->backend.ops->open_write(cache->backend.ctx, key, &writer->file);
+  if (err < 0) {
+    pthread_mutex_lock(&cache->lock);
+    nixbadge_cache_unhash(cache, entry);
+    nixbadge_cache_release(cache, entry);
+    cache->stats.write_failures++;
+    pthread_mutex_unlock(&cache->lock);
+    return err;
+  }
+
+  writer->cache = cache;
+  writer->entry = entry;
+  writer->written = 0;
+  return 0;
+}
+
+/* Drops an object being written, counting a write failure if the backend
+ * failed it. */
+static void nixbadge_cache_discard(nixbadge_cache_writer_t* writer,
+                                   bool failed) {
+  nixbadge_cache_t* cache = writer->cache;
+  nixbadge_cache_entry_t* entry = writer->entry;
+  if (!cache) return;
+
+  cache->backend.ops->close(cache->backend.ctx, writer->file);
+  cache->backend.ops->remove(cache->backend.ctx, entry->key, true);
+
+  pthread_mutex_lock(&cache->lock);
+  nixbadge_cache_unhash(cache, entry);
+  nixbadge_cache_release(cache, entry);
+  if (failed) cache->stats.write_failures++;
+  pthread_mutex_unlock(&cache->lock);
+
+  writer->cache = NULL;
+  writer->entry = NULL;
+}
+
+int nixbadge_cache_append(nixbadge_cache_writer_t* writer, const void* data,
+                          size_t len) {
+  nixbadge_cache_t* cache = writer->cache;
+  if (!cache) return -EBADF;
+
+  pthread_mutex_lock(&cache->lock);
+  int err;
+  while ((err = nixbadge_cache_reserve(cache, len)) == -EAGAIN) {
+    pthread_mutex_unlock(&cache->lock);
+    nixbadge_cache_reap(cache);
+    pthread_mutex_lock(&cache->lock);
+  }
+  if (err == 0) writer->entry->size += len;
+  pthread_mutex_unlock(&cache->lock);
+
+  if (err < 0) {
+    nixbadge_cache_discard(writer, false);
+    return -ENOSPC;
+  }
+
+  const uint8_t* bytes = data;
+  size_t remaining = len;
+  while (remaining > 0) {
+    ssize_t n = cache->backend.ops->write(cache->backend.ctx, writer->file,
+                                          bytes, remaining);
+    if (n <= 0) {
+      nixbadge_cache_discard(writer, true);
+      return n < 0 ? (int)n : -EIO;
+    }
+    bytes += n;
+    remaining -= n;
+  }
+
+  writer->written += len;
+  return 0;
+}
+
+ssize_t nixbadge_cache_peek(const nixbadge_cache_writer_t* writer,
+                            uint64_t offset, void* buf, size_t len) {
+  nixbadge_cache_t* cache = writer->cache;
+  if (!cache) return -EBADF;
+  if (offset >= writer->written) return 0;
+  if (len > writer->written - offset) len = writer->written - offset;
+  return cache->backend.ops->read_at(cache->backend.ctx, writer->file, offset,
+                                     buf, len);
+}
+
+int nixbadge_cache_commit(nixbadge_cache_writer_t* writer) {
+  nixbadge_cache_t* cache = writer->cache;
+  nixbadge_cache_entry_t* entry = writer->entry;
+  if (!cache) return -EBADF;
+
+  cache->backend.ops->close(cache->backend.ctx, writer->file);
+  int err = cache->backend.ops->commit(cache->backend.ctx, entry->key);
+  if (err < 0) cache->backend.ops->remove(cache->backend.ctx, entry->key, true);
+
+  pthread_mutex_lock(&cache->lock);
+  if (err < 0) {
+    nixbadge_cache_unhash(cache, entry);
+    nixbadge_cache_release(cache, entry);
+    cache->stats.write_failures++;
+  } else {
+    entry->state = ENTRY_READY;
+    nixbadge_cache_lru_push(cache, entry);
+    cache->stats.entries++;
+    cache->stats.insertions++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  writer->cache = NULL;
+  writer->entry = NULL;
+  return err;
+}
+
+void nixbadge_cache_abort(nixbadge_cache_writer_t* writer) {
+  nixbadge_cache_discard(writer, false);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Content-addressed object cache with an LRU index and a byte budget.
+ *
+ * Objects are keyed by the last path component of the URI they were fetched
+ * from, the NAR file hash, which makes them immutable: a key is written once
+ * and only ever replaced by eviction. The index and
+ * eviction logic are plain C; the bytes live behind a swappable backend so
+ * the same code runs on the badge's FAT mount and on a directory on Linux.
+ */
+
+#define NIXBADGE_CACHE_KEY_MAX 72
+
+typedef struct nixbadge_cache nixbadge_cache_t;
+typedef struct nixbadge_cache_entry nixbadge_cache_entry_t;
+
+typedef void (*nixbadge_cache_scan_cb_t)(void* arg, const char* key,
+                                         uint64_t size);
+
+/**
+ * Storage backend operations. All return 0 or a negative errno.
+ * Objects are written under a partial name and only become visible
+ * under their key once committed.
+ */
+typedef struct {
+  int (*open_read)(void* ctx, const char* key, intptr_t* file);
+  int (*open_write)(void* ctx, const char* key, intptr_t* file);
+  ssize_t (*read)(void* ctx, intptr_t file, void* buf, size_t len);
+  /* Reads at an offset without moving the position, also while writing. */
+  ssize_t (*read_at)(void* ctx, intptr_t file, uint64_t offset, void* buf,
+                     size_t len);
+  int (*seek)(void* ctx, intptr_t file, uint64_t offset);
+  ssize_t (*write)(void* ctx, intptr_t file, const void* buf, size_t len);
+  void (*close)(void* ctx, intptr_t file);
+  int (*commit)(void* ctx, const char* key);
+  int (*remove)(void* ctx, const char* key, bool partial);
+  int (*scan)(void* ctx, nixbadge_cache_scan_cb_t cb, void* arg);
+} nixbadge_cache_backend_ops_t;
+
+typedef struct {
+  const nixbadge_cache_backend_ops_t* ops;
+  void* ctx;
+} nixbadge_cache_backend_t;
+
+typedef struct {
+  nixbadge_cache_t* cache;
+  nixbadge_cache_entry_t* entry;
+  intptr_t file;
+  uint64_t size;
+} nixbadge_cache_reader_t;
+
+typedef struct {
+  nixbadge_cache_t* cache;
+  nixbadge_cache_entry_t* entry;
+  intptr_t file;
+  uint64_t written;
+} nixbadge_cache_writer_t;
+
+typedef struct {
+  uint32_t entries;
+  uint64_t used;
+  uint64_t budget;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t insertions;
+  uint32_t evictions;
+  uint32_t write_failures;
+} nixbadge_cache_stats_t;
+
+/**
+ * Creates a cache over a backend and loads the index from what the backend
+ * already holds, evicting down to the budget if needed.
+ * @param budget maximum number of bytes stored
+ * @param max_entries maximum number of objects indexed
+ */
+nixbadge_cache_t* nixbadge_cache_new(const nixbadge_cache_backend_t* backend,
+                                     uint64_t budget, size_t max_entries);
+void nixbadge_cache_free(nixbadge_cache_t* cache);
+
+bool nixbadge_cache_key_valid(const char* key);
+bool nixbadge_cache_contains(nixbadge_cache_t* cache, const char* key);
+void nixbadge_cache_get_stats(nixbadge_cache_t* cache,
+                              nixbadge_cache_stats_t* stats);
+/**
+ * Calls `cb` for every committed object, most recently used first, with
+ * the cache locked. `cb` must not call back into the cache.
+ */
+void nixbadge_cache_foreach(nixbadge_cache_t* cache,
+                            nixbadge_cache_scan_cb_t cb, void* arg);
+
+/**
+ * Opens a committed object for reading and pins it against eviction
+ * until nixbadge_cache_close.
+ * @return 0, -ENOENT on a miss or another negative errno
+ */
+int nixbadge_cache_open(nixbadge_cache_t* cache, const char* key,
+                        nixbadge_cache_reader_t* reader);
+ssize_t nixbadge_cache_read(nixbadge_cache_reader_t* reader, void* buf,
+                            size_t len);
+/**
+ * Moves the read position of a reader.
+ * @return 0, -EINVAL past the end of the object or another negative errno
+ */
+int nixbadge_cache_seek(nixbadge_cache_reader_t* reader, uint64_t offset);
+void nixbadge_cache_close(nixbadge_cache_reader_t* reader);
+
+/**
+ * Starts writing an object. Only one writer may exist per key.
+ * @return 0, -EEXIST if the key is present or being written, -EBUSY if it
+ *         was evicted while still open for reading, or another negative
+ *         errno
+ */
+int nixbadge_cache_begin(nixbadge_cache_t* cache, const char* key,
+                         nixbadge_cache_writer_t* writer);
+/**
+ * Appends to an object, evicting least recently used objects to make room.
+ * On failure the writer is aborted, and a failed write counts in
+ * write_failures.
+ */
+int nixbadge_cache_append(nixbadge_cache_writer_t* writer, const void* data,
+                          size_t len);
+/**
+ * Reads back part of what a writer appended so far, for a reader that
+ * cannot wait for the object to be committed. Must not run concurrently
+ * with the writer.
+ * @return the number of bytes read, 0 past what was written, or a negative
+ *         errno
+ */
+ssize_t nixbadge_cache_peek(const nixbadge_cache_writer_t* writer,
+                            uint64_t offset, void* buf, size_t len);
+int nixbadge_cache_commit(nixbadge_cache_writer_t* writer);
+/**
+ * Drops an object being written, for example after an upstream error. Only
+ * failures of the backend count in write_failures, not aborts.
+ */
+void nixbadge_cache_abort(nixbadge_cache_writer_t* writer);
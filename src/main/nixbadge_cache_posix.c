@@ -0,0 +1,163 @@
+#include "nixbadge_cache_posix.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define POSIX_PATH_MAX 128
+#define POSIX_PARTIAL_SUFFIX "~"
+
+typedef struct {
+  char root[POSIX_PATH_MAX - NIXBADGE_CACHE_KEY_MAX - 8];
+} nixbadge_cache_posix_t;
+
+static int nixbadge_cache_posix_path(nixbadge_cache_posix_t* posix,
+                                     const char* key, bool partial, char* path) {
+  int len = snprintf(path, POSIX_PATH_MAX, "%s/%s%s", posix->root, key,
+                     partial ? POSIX_PARTIAL_SUFFIX : "");
+  return (len < 0 || len >= POSIX_PATH_MAX) ? -ENAMETOOLONG : 0;
+}
+
+static int nixbadge_cache_posix_open_read(void* ctx, const char* key,
+                                          intptr_t* file) {
+  char path[POSIX_PATH_MAX];
+  int err = nixbadge_cache_posix_path(ctx, key, false, path);
+  if (err < 0) return err;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -errno;
+  *file = fd;
+  return 0;
+}
+
+static int nixbadge_cache_posix_open_write(void* ctx, const char* key,
+                                           intptr_t* file) {
+  char path[POSIX_PATH_MAX];
+  int err = nixbadge_cache_posix_path(ctx, key, true, path);
+  if (err < 0) return err;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -errno;
+  *file = fd;
+  return 0;
+}
+
+static ssize_t nixbadge_cache_posix_read(void* ctx, intptr_t file, void* buf,
+                                         size_t len) {
+  ssize_t n = read((int)file, buf, len);
+  return n < 0 ? -errno : n;
+}
+
+static ssize_t nixbadge_cache_posix_read_at(void* ctx, intptr_t file,
+                                            uint64_t offset, void* buf,
+                                            size_t len) {
+  ssize_t n = pread((int)file, buf, len, (off_t)offset);
+  return n < 0 ? -errno : n;
+}
+
+static int nixbadge_cache_posix_seek(void* ctx, intptr_t file,
+                                     uint64_t offset) {
+  return lseek((int)file, (off_t)offset, SEEK_SET) < 0 ? -errno : 0;
+}
+
+static ssize_t nixbadge_cache_posix_write(void* ctx, intptr_t file,
+                                          const void* buf, size_t len) {
+  ssize_t n = write((int)file, buf, len);
+  return n < 0 ? -errno : n;
+}
+
+static void nixbadge_cache_posix_close(void* ctx, intptr_t file) {
+  close((int)file);
+}
+
+static int nixbadge_cache_posix_commit(void* ctx, const char* key) {
+  char partial[POSIX_PATH_MAX];
+  char path[POSIX_PATH_MAX];
+  int err = nixbadge_cache_posix_path(ctx, key, true, partial);
+  if (err == 0) err = nixbadge_cache_posix_path(ctx, key, false, path);
+  if (err < 0) return err;
+
+  // FAT can't rename over an existing file.
+  unlink(path);
+  return rename(partial, path) < 0 ? -errno : 0;
+}
+
+static int nixbadge_cache_posix_remove(void* ctx, const char* key,
+                                       bool partial) {
+  char path[POSIX_PATH_MAX];
+  int err = nixbadge_cache_posix_path(ctx, key, partial, path);
+  if (err < 0) return err;
+  return unlink(path) < 0 ? -errno : 0;
+}
+
+static int nixbadge_cache_posix_scan(void* ctx, nixbadge_cache_scan_cb_t cb,
+                                     void* arg) {
+  nixbadge_cache_posix_t* posix = ctx;
+  DIR* dir = opendir(posix->root);
+  if (!dir) return -errno;
+
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    const char* name = ent->d_name;
+    size_t len = strlen(name);
+    if (len == 0 || name[0] == '.') continue;
+
+    char path[POSIX_PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", posix->root, name) >=
+        (int)sizeof(path))
+      continue;
+
+    if (name[len - 1] == POSIX_PARTIAL_SUFFIX[0]) {
+      // Left behind by a transfer that never completed.
+      unlink(path);
+      continue;
+    }
+
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+    cb(arg, name, (uint64_t)st.st_size);
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+static const nixbadge_cache_backend_ops_t nixbadge_cache_posix_ops = {
+    .open_read = nixbadge_cache_posix_open_read,
+    .open_write = nixbadge_cache_posix_open_write,
+    .read = nixbadge_cache_posix_read,
+    .read_at = nixbadge_cache_posix_read_at,
+    .seek = nixbadge_cache_posix_seek,
+    .write = nixbadge_cache_posix_write,
+    .close = nixbadge_cache_posix_close,
+    .commit = nixbadge_cache_posix_commit,
+    .remove = nixbadge_cache_posix_remove,
+    .scan = nixbadge_cache_posix_scan,
+};
+
+int nixbadge_cache_posix_init(nixbadge_cache_backend_t* backend,
+                              const char* root) {
+  nixbadge_cache_posix_t* posix = calloc(1, sizeof(nixbadge_cache_posix_t));
+  if (!posix) return -ENOMEM;
+
+  int len = snprintf(posix->root, sizeof(posix->root), "%s", root);
+  if (len < 0 || len >= (int)sizeof(posix->root)) {
+    free(posix);
+    return -ENAMETOOLONG;
+  }
+
+  if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+    int err = -errno;
+    free(posix);
+    return err;
+  }
+
+  backend->ops = &nixbadge_cache_posix_ops;
+  backend->ctx = posix;
+  return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "nixbadge_cache.h"
+
+/**
+ * Initializes a cache backend that stores one file per object in `root`.
+ * Partially written objects carry a trailing '~' and are removed on scan.
+ * Works against any POSIX directory, including a FAT mount on the badge.
+ * @return 0 or a negative errno
+ */
+int nixbadge_cache_posix_init(nixbadge_cache_backend_t* backend,
+                              const char* root);
@@ -0,0 +1,298 @@
+#include "nixbadge_clock.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Exchanges kept to choose from. */
+#define CLOCK_EXCHANGES 8
+/* Least time between the exchanges the drift is worked out from. */
+#define CLOCK_DRIFT_SPAN_US 60000000LL
+/* Most the local clock is believed to be off, in parts per billion. */
+#define CLOCK_MAX_DRIFT_PPB 200000
+/* How fast the error grows before the drift is known, and after. */
+#define CLOCK_TOLERANCE_PPB 100000
+#define CLOCK_RESIDUAL_PPB 20000
+
+typedef struct {
+  /* Halfway between sending and getting the answer, on the local clock. */
+  int64_t local_us;
+  /* Mesh time less local time. */
+  int64_t offset_us;
+  uint32_t error_us;
+} nixbadge_clock_sample_t;
+
+struct nixbadge_clock {
+  pthread_mutex_t lock;
+
+  nixbadge_clock_sample_t samples[CLOCK_EXCHANGES];
+  size_t len;
+  size_t next;
+
+  /* The mesh time is base_offset_us ahead at base_local_us, plus drift. */
+  int64_t base_local_us;
+  int64_t base_offset_us;
+  uint32_t base_error_us;
+  int32_t drift_ppb;
+  bool drift_known;
+  bool synced;
+  bool leading;
+  /* Of the reference, bumped whenever it steps the mesh time. */
+  uint32_t epoch;
+
+  /* The sample the drift was last worked out from. */
+  nixbadge_clock_sample_t anchor;
+  bool anchored;
+
+  /* Last time returned, which the mesh time does not go back from. */
+  int64_t last_local_us;
+  int64_t last_mesh_us;
+  bool returned;
+
+  uint32_t exchanges;
+  uint32_t rejected;
+};
+
+nixbadge_clock_t* nixbadge_clock_new() {
+  nixbadge_clock_t* clock = calloc(1, sizeof(*clock));
+  if (!clock) return NULL;
+  pthread_mutex_init(&clock->lock, NULL);
+  return clock;
+}
+
+void nixbadge_clock_free(nixbadge_clock_t* clock) {
+  if (!clock) return;
+  pthread_mutex_destroy(&clock->lock);
+  free(clock);
+}
+
+static uint32_t nixbadge_clock_error(uint64_t error_us) {
+  return error_us > UINT32_MAX ? UINT32_MAX : error_us;
+}
+
+/* How far a sample may be off by `local_us`, with the lock held. */
+static uint32_t nixbadge_clock_aged(nixbadge_clock_t* clock,
+                                    const nixbadge_clock_sample_t* sample,
+                                    int64_t local_us) {
+  int64_t age = local_us - sample->local_us;
+  if (age < 0) age = -age;
+  int64_t ppb = clock->drift_known ? CLOCK_RESIDUAL_PPB : CLOCK_TOLERANCE_PPB;
+  return nixbadge_clock_error(sample->error_us + age * ppb / 1000000000);
+}
+
+/*
+ * Works out the drift from the samples taken as the base, with the lock
+ * held. Those close together are too noisy, so it waits for the next that
+ * is far enough from the last.
+ */
+static void nixbadge_clock_drift(nixbadge_clock_t* clock,
+                                 const nixbadge_clock_sample_t* sample) {
+  if (!clock->anchored) {
+    clock->anchor = *sample;
+    clock->anchored = true;
+    return;
+  }
+  int64_t span = sample->local_us - clock->anchor.local_us;
+  if (span < CLOCK_DRIFT_SPAN_US) return;
+
+  int64_t drift =
+      (sample->offset_us - clock->anchor.offset_us) * 1000000000 / span;
+  if (drift > CLOCK_MAX_DRIFT_PPB) drift = CLOCK_MAX_DRIFT_PPB;
+  if (drift < -CLOCK_MAX_DRIFT_PPB) drift = -CLOCK_MAX_DRIFT_PPB;
+  clock->drift_ppb =
+      clock->drift_known ? clock->drift_ppb + (drift - clock->drift_ppb) / 4
+                         : drift;
+  clock->drift_known = true;
+  clock->anchor = *sample;
+}
+
+bool nixbadge_clock_exchange(nixbadge_clock_t* clock,
+                             const nixbadge_clock_exchange_t* exchange) {
+  int64_t round_trip = exchange->returned_us - exchange->sent_us;
+  int64_t held = exchange->answered_us - exchange->received_us;
+  pthread_mutex_lock(&clock->lock);
+  if (clock->leading) {
+    pthread_mutex_unlock(&clock->lock);
+    return true;
+  }
+  if (round_trip < 0 || held < 0 || held > round_trip) {
+    clock->rejected++;
+    pthread_mutex_unlock(&clock->lock);
+    return false;
+  }
+  clock->exchanges++;
+
+  if (exchange->epoch != clock->epoch) {
+    // The reference stepped its time, or is another one, so the exchanges
+    // before are off by the step and no drift can be taken across it. The
+    // mesh time follows the step, back if need be.
+    clock->epoch = exchange->epoch;
+    clock->len = 0;
+    clock->next = 0;
+    clock->anchored = false;
+    clock->drift_ppb = 0;
+    clock->drift_known = false;
+    clock->synced = false;
+    clock->returned = false;
+  }
+
+  nixbadge_clock_sample_t* sample = &clock->samples[clock->next];
+  clock->next = (clock->next + 1) % CLOCK_EXCHANGES;
+  if (clock->len < CLOCK_EXCHANGES) clock->len++;
+  *sample = (nixbadge_clock_sample_t){
+      .local_us = exchange->sent_us + round_trip / 2,
+      .offset_us = ((exchange->received_us - exchange->sent_us) +
+                    (exchange->answered_us - exchange->returned_us)) /
+                   2,
+      .error_us = nixbadge_clock_error((uint64_t)(round_trip - held) / 2 +
+                                       exchange->error_us),
+  };
+
+  // Answers that were held up have a larger error, even when aged less.
+  const nixbadge_clock_sample_t* best = sample;
+  uint32_t best_error = sample->error_us;
+  for (size_t i = 0; i < clock->len; i++) {
+    uint32_t error =
+        nixbadge_clock_aged(clock, &clock->samples[i], sample->local_us);
+    if (error < best_error) {
+      best = &clock->samples[i];
+      best_error = error;
+    }
+  }
+
+  if (!clock->synced || best->local_us != clock->base_local_us) {
+    nixbadge_clock_drift(clock, best);
+    clock->base_local_us = best->local_us;
+    clock->base_offset_us = best->offset_us;
+    clock->base_error_us = best->error_us;
+    clock->synced = true;
+  }
+  pthread_mutex_unlock(&clock->lock);
+  return true;
+}
+
+/*
+ * The mesh time at `local_us`, going back no further than half the time
+ * since the last one returned, with the lock held.
+ */
+static void nixbadge_clock_now_locked(nixbadge_clock_t* clock,
+                                      int64_t local_us, int64_t* mesh_us,
+                                      uint32_t* error_us) {
+  int64_t since = local_us - clock->base_local_us;
+  int64_t mesh = local_us + clock->base_offset_us +
+                 since * clock->drift_ppb / 1000000000;
+  uint64_t error = UINT32_MAX;
+  if (clock->synced) {
+    nixbadge_clock_sample_t base = {
+        .local_us = clock->base_local_us,
+        .error_us = clock->base_error_us,
+    };
+    error = clock->leading ? clock->base_error_us
+                           : nixbadge_clock_aged(clock, &base, local_us);
+  }
+
+  if (clock->returned) {
+    int64_t least = clock->last_mesh_us;
+    if (local_us > clock->last_local_us) {
+      least += (local_us - clock->last_local_us) / 2;
+    }
+    if (mesh < least) {
+      error += least - mesh;
+      mesh = least;
+    }
+  }
+  // Callers racing may pass a local time before the last one.
+  if (!clock->returned || local_us > clock->last_local_us) {
+    clock->last_local_us = local_us;
+  }
+  if (!clock->returned || mesh > clock->last_mesh_us) {
+    clock->last_mesh_us = mesh;
+  }
+  clock->returned = true;
+  *mesh_us = mesh;
+  *error_us = nixbadge_clock_error(error);
+}
+
+bool nixbadge_clock_now(nixbadge_clock_t* clock, int64_t local_us,
+                        int64_t* mesh_us, uint32_t* error_us) {
+  pthread_mutex_lock(&clock->lock);
+  nixbadge_clock_now_locked(clock, local_us, mesh_us, error_us);
+  bool synced = clock->synced;
+  pthread_mutex_unlock(&clock->lock);
+  return synced;
+}
+
+/*
+ * Takes the mesh time at `local_us` as the base of a new epoch, with the
+ * lock held.
+ */
+static void nixbadge_clock_rebase(nixbadge_clock_t* clock, int64_t local_us,
+                                  int64_t mesh_us, uint32_t error_us) {
+  clock->base_local_us = local_us;
+  clock->base_offset_us = mesh_us - local_us;
+  clock->base_error_us = error_us;
+  clock->len = 0;
+  clock->next = 0;
+  clock->anchored = false;
+  clock->synced = true;
+  clock->epoch++;
+}
+
+void nixbadge_clock_lead(nixbadge_clock_t* clock, int64_t local_us) {
+  pthread_mutex_lock(&clock->lock);
+  if (!clock->leading) {
+    int64_t mesh;
+    uint32_t error;
+    nixbadge_clock_now_locked(clock, local_us, &mesh, &error);
+    // The mesh time is what the reference says it is from now on.
+    nixbadge_clock_rebase(clock, local_us, mesh, 0);
+    clock->drift_ppb = 0;
+    clock->drift_known = true;
+    clock->leading = true;
+  }
+  pthread_mutex_unlock(&clock->lock);
+}
+
+bool nixbadge_clock_set(nixbadge_clock_t* clock, int64_t local_us,
+                        int64_t mesh_us, uint32_t error_us) {
+  pthread_mutex_lock(&clock->lock);
+  bool leading = clock->leading;
+  if (leading) {
+    nixbadge_clock_rebase(clock, local_us, mesh_us, error_us);
+    // A step is taken, back if need be.
+    clock->returned = false;
+  }
+  pthread_mutex_unlock(&clock->lock);
+  return leading;
+}
+
+void nixbadge_clock_follow(nixbadge_clock_t* clock) {
+  pthread_mutex_lock(&clock->lock);
+  if (clock->leading) {
+    // The old reference ran at its own rate, which the parent may not.
+    clock->leading = false;
+    clock->drift_known = false;
+    clock->anchored = false;
+  }
+  pthread_mutex_unlock(&clock->lock);
+}
+
+uint32_t nixbadge_clock_epoch(nixbadge_clock_t* clock) {
+  pthread_mutex_lock(&clock->lock);
+  uint32_t epoch = clock->epoch;
+  pthread_mutex_unlock(&clock->lock);
+  return epoch;
+}
+
+void nixbadge_clock_get_stats(nixbadge_clock_t* clock,
+                              nixbadge_clock_stats_t* stats) {
+  pthread_mutex_lock(&clock->lock);
+  *stats = (nixbadge_clock_stats_t){
+      .exchanges = clock->exchanges,
+      .rejected = clock->rejected,
+      .drift_ppb = clock->drift_ppb,
+      .epoch = clock->epoch,
+      .leading = clock->leading,
+  };
+  pthread_mutex_unlock(&clock->lock);
+}
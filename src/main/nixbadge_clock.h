@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Time shared by the badges of a mesh, in microseconds.
+ *
+ * The root is the reference. It keeps its own clock, or the time of day
+ * once SNTP set it. Every other badge follows its parent by two-way
+ * exchanges: it notes when it sent a request (t1) and got the answer (t4),
+ * and the parent notes the mesh time it got the request (t2) and answered
+ * (t3). Each exchange tells the offset to the parent's time to within half
+ * its round trip, plus the parent's own error.
+ *
+ * The last few exchanges are kept and the one with the least error, which
+ * grows with its age, is taken, so that answers held up on a busy mesh are
+ * left out. How fast the local clock runs against the mesh is worked out
+ * from exchanges a minute or more apart, and the mesh time is carried on
+ * at that rate between them.
+ *
+ * Mesh time never goes back: when an exchange sets it back, it runs at half
+ * speed until the estimate catches up, and the error bound covers the
+ * difference. The one exception is a step of the reference, when SNTP sets
+ * it or another badge becomes the root. That starts a new epoch, which the
+ * answers carry, and a badge that sees one drops the exchanges it had and
+ * takes the time of the new epoch as it is, instead of mistaking the step
+ * for drift. Times are taken as parameters, so that this can be driven by a
+ * fake clock.
+ */
+
+typedef struct nixbadge_clock nixbadge_clock_t;
+
+typedef struct {
+  /* On the local clock. */
+  int64_t sent_us;
+  /* On the parent's mesh clock. */
+  int64_t received_us;
+  int64_t answered_us;
+  /* On the local clock. */
+  int64_t returned_us;
+  /* Error of the parent's mesh time. */
+  uint32_t error_us;
+  /* Epoch of the parent's mesh time. */
+  uint32_t epoch;
+} nixbadge_clock_exchange_t;
+
+typedef struct {
+  uint32_t exchanges;
+  /* Exchanges whose times could not be right. */
+  uint32_t rejected;
+  /* How much faster the mesh runs than the local clock. */
+  int32_t drift_ppb;
+  uint32_t epoch;
+  bool leading;
+} nixbadge_clock_stats_t;
+
+nixbadge_clock_t* nixbadge_clock_new();
+void nixbadge_clock_free(nixbadge_clock_t* clock);
+
+/**
+ * Adds an exchange with the parent. Ignored while leading.
+ * @return false if it was rejected
+ */
+bool nixbadge_clock_exchange(nixbadge_clock_t* clock,
+                             const nixbadge_clock_exchange_t* exchange);
+
+/**
+ * Makes the local clock the reference for the mesh, carrying on from the
+ * mesh time at `local_us` in a new epoch. Nothing happens if it already is.
+ */
+void nixbadge_clock_lead(nixbadge_clock_t* clock, int64_t local_us);
+
+/**
+ * Sets the mesh time at `local_us` on the reference, from SNTP, in a new
+ * epoch.
+ * @return false if this clock is not leading
+ */
+bool nixbadge_clock_set(nixbadge_clock_t* clock, int64_t local_us,
+                        int64_t mesh_us, uint32_t error_us);
+
+/**
+ * Follows the parent again, carrying on from the mesh time until the first
+ * exchange. Nothing happens if it already does.
+ */
+void nixbadge_clock_follow(nixbadge_clock_t* clock);
+
+/**
+ * The mesh time at `local_us`, which is never less than the last returned.
+ * @param error_us how far the mesh time may be off, UINT32_MAX before the
+ *                 first exchange
+ * @return false before the first exchange, when the mesh time is the local
+ *         clock
+ */
+bool nixbadge_clock_now(nixbadge_clock_t* clock, int64_t local_us,
+                        int64_t* mesh_us, uint32_t* error_us);
+
+/**
+ * The epoch of the mesh time, to pass on with it.
+ */
+uint32_t nixbadge_clock_epoch(nixbadge_clock_t* clock);
+
+void nixbadge_clock_get_stats(nixbadge_clock_t* clock,
+                              nixbadge_clock_stats_t* stats);
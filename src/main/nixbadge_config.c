@@ -0,0 +1,219 @@
+#include "nixbadge_config.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <nvs_flash.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char TAG[] = "nixbadge_config";
+
+typedef struct {
+  /* First, so that readers' pointers lead back to the snapshot. */
+  nixbadge_config_t config;
+  atomic_int refs;
+} nixbadge_config_snapshot_t;
+
+/* Swapped and referenced under the lock, which is never held for long. */
+static nixbadge_config_snapshot_t* current = NULL;
+static portMUX_TYPE current_lock = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t reload_lock = NULL;
+static uint32_t generation = 0;
+
+static void nixbadge_config_free(nixbadge_config_snapshot_t* snapshot) {
+  free(snapshot->config.cache_store);
+  free(snapshot->config.cache_upstream);
+  free(snapshot->config.cache_cert);
+  free(snapshot->config.nix_cache_info);
+  free(snapshot);
+}
+
+/**
+ * Reads a string key into a new buffer.
+ * @param len set to the string length including its NUL terminator
+ */
+static esp_err_t nixbadge_config_read_str(nvs_handle handle, const char* key,
+                                          char** value, size_t* len) {
+  size_t size;
+  esp_err_t err = nvs_get_str(handle, key, NULL, &size);
+  if (err != ESP_OK) return err;
+
+  *value = malloc(size);
+  if (!*value) return ESP_ERR_NO_MEM;
+
+  err = nvs_get_str(handle, key, *value, &size);
+  if (err != ESP_OK) {
+    free(*value);
+    *value = NULL;
+    return err;
+  }
+
+  if (len) *len = size;
+  return ESP_OK;
+}
+
+static esp_err_t nixbadge_config_read_buf(nvs_handle handle, const char* key,
+                                          char* value, size_t size) {
+  esp_err_t err = nvs_get_str(handle, key, value, &size);
+  if (err == ESP_ERR_NVS_NOT_FOUND) {
+    value[0] = 0;
+    return ESP_OK;
+  }
+  return err;
+}
+
+/**
+ * Reads an optional u32 key, which is left 0 when not set.
+ */
+static esp_err_t nixbadge_config_read_u32(nvs_handle handle, const char* key,
+                                          uint32_t* value) {
+  esp_err_t err = nvs_get_u32(handle, key, value);
+  if (err == ESP_ERR_NVS_NOT_FOUND) {
+    *value = 0;
+    return ESP_OK;
+  }
+  return err;
+}
+
+static esp_err_t nixbadge_config_load(nvs_handle handle,
+                                      nixbadge_config_t* config) {
+  uint8_t value = 0;
+  esp_err_t err = nvs_get_u8(handle, "boot_mesh", &value);
+  if (err != ESP_OK) return err;
+  config->boot_mesh = value;
+
+  err = nvs_get_u8(handle, "cache_p2p", &value);
+  if (err != ESP_OK) return err;
+  config->cache_p2p = value;
+
+  err = nvs_get_u8(handle, "cache_use_https", &value);
+  if (err != ESP_OK) return err;
+  config->cache_use_https = value;
+
+  err = nvs_get_u32(handle, "cache_priority", &config->cache_priority);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_str(handle, "cache_store", &config->cache_store,
+                                 NULL);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_str(handle, "cache_upstream",
+                                 &config->cache_upstream, NULL);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_str(handle, "cache_cert", &config->cache_cert,
+                                 &config->cache_cert_len);
+  if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) return err;
+
+  err = nixbadge_config_read_buf(handle, "router_ssid", config->router_ssid,
+                                 sizeof(config->router_ssid));
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_buf(handle, "router_passwd",
+                                 config->router_passwd,
+                                 sizeof(config->router_passwd));
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_buf(handle, "reload_token", config->reload_token,
+                                 sizeof(config->reload_token));
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_u32(handle, "sched_fast", &config->sched_fast);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_u32(handle, "sched_bulk", &config->sched_bulk);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_u32(handle, "sched_client", &config->sched_client);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_u32(handle, "sched_rate", &config->sched_rate);
+  if (err != ESP_OK) return err;
+
+  err = nixbadge_config_read_u32(handle, "leds_count", &config->leds_count);
+  if (err != ESP_OK) return err;
+
+  int len = asprintf(&config->nix_cache_info,
+                     "StoreDir: %s\nWantMassQuery: 1\nPriority: %lu\n",
+                     config->cache_store, config->cache_priority);
+  if (len < 0) {
+    config->nix_cache_info = NULL;
+    return ESP_ERR_NO_MEM;
+  }
+  config->nix_cache_info_len = len;
+  return ESP_OK;
+}
+
+esp_err_t nixbadge_config_reload() {
+  nixbadge_config_snapshot_t* snapshot =
+      calloc(1, sizeof(nixbadge_config_snapshot_t));
+  if (!snapshot) return ESP_ERR_NO_MEM;
+
+  xSemaphoreTake(reload_lock, portMAX_DELAY);
+
+  nvs_handle flashcfg_handle;
+  esp_err_t err = nvs_open("config", NVS_READONLY, &flashcfg_handle);
+  if (err == ESP_OK) {
+    err = nixbadge_config_load(flashcfg_handle, &snapshot->config);
+    nvs_close(flashcfg_handle);
+  }
+
+  if (err != ESP_OK) {
+    xSemaphoreGive(reload_lock);
+    ESP_LOGE(TAG, "Failed to load the configuration: %s",
+             esp_err_to_name(err));
+    nixbadge_config_free(snapshot);
+    return err;
+  }
+
+  snapshot->config.generation = ++generation;
+  atomic_init(&snapshot->refs, 1);
+  taskENTER_CRITICAL(&current_lock);
+  nixbadge_config_snapshot_t* old = current;
+  current = snapshot;
+  taskEXIT_CRITICAL(&current_lock);
+  ESP_LOGI(TAG, "Loaded configuration generation %lu (upstream %s)",
+           snapshot->config.generation, snapshot->config.cache_upstream);
+  xSemaphoreGive(reload_lock);
+
+  // Freed once the last reader is done with it.
+  if (old) nixbadge_config_unref(&old->config);
+  return ESP_OK;
+}
+
+esp_err_t nixbadge_config_init() {
+  reload_lock = xSemaphoreCreateMutex();
+  if (!reload_lock) return ESP_ERR_NO_MEM;
+  return nixbadge_config_reload();
+}
+
+const nixbadge_config_t* nixbadge_config_get() {
+  taskENTER_CRITICAL(&current_lock);
+  nixbadge_config_snapshot_t* snapshot = current;
+  atomic_fetch_add(&snapshot->refs, 1);
+  taskEXIT_CRITICAL(&current_lock);
+  return &snapshot->config;
+}
+
+const nixbadge_config_t* nixbadge_config_ref(const nixbadge_config_t* config) {
+  nixbadge_config_snapshot_t* snapshot = (nixbadge_config_snapshot_t*)config;
+  atomic_fetch_add(&snapshot->refs, 1);
+  return config;
+}
+
+void nixbadge_config_unref(const nixbadge_config_t* config) {
+  nixbadge_config_snapshot_t* snapshot = (nixbadge_config_snapshot_t*)config;
+  if (!snapshot || atomic_fetch_sub(&snapshot->refs, 1) != 1) return;
+  nixbadge_config_free(snapshot);
+}
+
+bool nixbadge_config_same_cert(const nixbadge_config_t* a,
+                               const nixbadge_config_t* b) {
+  const char* cert_a = a ? a->cache_cert : NULL;
+  const char* cert_b = b ? b->cache_cert : NULL;
+  if (!cert_a || !cert_b) return cert_a == cert_b;
+  return a->cache_cert_len == b->cache_cert_len &&
+         memcmp(cert_a, cert_b, a->cache_cert_len) == 0;
+}
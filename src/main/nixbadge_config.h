@@ -0,0 +1,75 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Runtime configuration from the "config" NVS namespace (see
+ * scripts/gen_nvs.sh), loaded once into an immutable snapshot.
+ *
+ * Readers take a reference to the current snapshot. A reload builds a new
+ * snapshot and swaps it in, and the old one is freed once its last reader
+ * drops its reference, so that readers may keep it, and pointers into it
+ * like the upstream certificate, for as long as they need.
+ */
+
+typedef struct {
+  uint32_t generation;
+
+  bool boot_mesh;
+  char router_ssid[33];
+  char router_passwd[65];
+
+  /* Bearer token for POST /badge/reload, empty to refuse reloads. */
+  char reload_token[65];
+
+  bool cache_p2p;
+  bool cache_use_https;
+  uint32_t cache_priority;
+  char* cache_store;
+  char* cache_upstream;
+  /* PEM including its NUL terminator, or NULL when not set. */
+  char* cache_cert;
+  size_t cache_cert_len;
+
+  /*
+   * Scheduling of requests that go upstream, 0 for the defaults: workers
+   * for narinfos and for NARs, NARs per client, and KiB/s per client.
+   */
+  uint32_t sched_fast;
+  uint32_t sched_bulk;
+  uint32_t sched_client;
+  uint32_t sched_rate;
+
+  /* LEDs on the strip, 0 for the badge's own. Only taken at boot. */
+  uint32_t leds_count;
+
+  /* Pre-rendered body of /nix-cache-info. */
+  char* nix_cache_info;
+  size_t nix_cache_info_len;
+} nixbadge_config_t;
+
+/**
+ * Loads the configuration from NVS. Must be called after nvs_flash_init
+ * and before anything reads the configuration.
+ */
+esp_err_t nixbadge_config_init();
+/**
+ * Re-reads NVS and atomically replaces the current snapshot. On failure
+ * the current snapshot is kept.
+ */
+esp_err_t nixbadge_config_reload();
+/**
+ * Takes a reference to the current snapshot, which stays valid across
+ * reloads until nixbadge_config_unref.
+ */
+const nixbadge_config_t* nixbadge_config_get();
+const nixbadge_config_t* nixbadge_config_ref(const nixbadge_config_t* config);
+void nixbadge_config_unref(const nixbadge_config_t* config);
+/**
+ * Whether two snapshots trust the same upstream certificate, or both none.
+ */
+bool nixbadge_config_same_cert(const nixbadge_config_t* a,
+                               const nixbadge_config_t* b);
@@ -0,0 +1,425 @@
+#include "nixbadge_flight.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "nixbadge_hash.h"
+
+enum {
+  FLIGHT_RUNNING = 0,
+  FLIGHT_DONE,
+  FLIGHT_FAILED,
+};
+
+struct nixbadge_flight {
+  nixbadge_flight_table_t* table;
+  char* key;
+  uint32_t hash;
+
+  uint8_t* ring;
+  uint64_t head;
+  int status_code;
+  uint8_t state;
+  bool listed;
+  /* The leader until it finishes, and the readers. */
+  int refs;
+  int readers;
+  /* Whether readers the ring lapped can read the cache instead. */
+  bool replayable;
+
+  pthread_cond_t cond;
+
+  /*
+   * The object the response goes into, under a lock of its own so that
+   * the file system does not hold up the table.
+   */
+  pthread_mutex_t io;
+  nixbadge_cache_t* cache;
+  char cache_key[NIXBADGE_CACHE_KEY_MAX + 1];
+  nixbadge_cache_writer_t writer;
+  bool caching;
+  bool committed;
+};
+
+struct nixbadge_flight_table {
+  pthread_mutex_t lock;
+  size_t ring_size;
+  size_t max_flights;
+  nixbadge_flight_t** flights;
+  nixbadge_flight_stats_t stats;
+};
+
+/* Waits on the flight's condition with the table lock held. */
+static int nixbadge_flight_wait(nixbadge_flight_t* flight, int timeout_ms) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  int64_t nsec = now.tv_usec * 1000LL + (timeout_ms % 1000) * 1000000LL;
+  struct timespec deadline = {
+      .tv_sec = now.tv_sec + timeout_ms / 1000 + nsec / 1000000000LL,
+      .tv_nsec = nsec % 1000000000LL,
+  };
+  return pthread_cond_timedwait(&flight->cond, &flight->table->lock,
+                                &deadline);
+}
+
+nixbadge_flight_table_t* nixbadge_flight_table_new(size_t max_flights,
+                                                   size_t ring_size) {
+  nixbadge_flight_table_t* table = calloc(1, sizeof(*table));
+  if (!table) return NULL;
+
+  table->flights = calloc(max_flights, sizeof(nixbadge_flight_t*));
+  if (!table->flights) {
+    free(table);
+    return NULL;
+  }
+
+  pthread_mutex_init(&table->lock, NULL);
+  table->max_flights = max_flights;
+  table->ring_size = ring_size;
+  return table;
+}
+
+static nixbadge_flight_t* nixbadge_flight_new(nixbadge_flight_table_t* table,
+                                              const char* key,
+                                              uint32_t hash) {
+  nixbadge_flight_t* flight = calloc(1, sizeof(*flight));
+  if (!flight) return NULL;
+
+  flight->key = strdup(key);
+  flight->ring = malloc(table->ring_size);
+  if (!flight->key || !flight->ring) {
+    free(flight->key);
+    free(flight->ring);
+    free(flight);
+    return NULL;
+  }
+
+  flight->table = table;
+  flight->hash = hash;
+  flight->listed = true;
+  // The leader's reference and its reader's.
+  flight->refs = 2;
+  flight->readers = 1;
+  pthread_cond_init(&flight->cond, NULL);
+  pthread_mutex_init(&flight->io, NULL);
+  return flight;
+}
+
+static void nixbadge_flight_free(nixbadge_flight_t* flight) {
+  if (flight->caching) nixbadge_cache_abort(&flight->writer);
+  pthread_mutex_destroy(&flight->io);
+  pthread_cond_destroy(&flight->cond);
+  free(flight->ring);
+  free(flight->key);
+  free(flight);
+}
+
+static void nixbadge_flight_unlist(nixbadge_flight_t* flight) {
+  nixbadge_flight_table_t* table = flight->table;
+  if (!flight->listed) return;
+
+  for (size_t i = 0; i < table->max_flights; i++) {
+    if (table->flights[i] == flight) {
+      table->flights[i] = NULL;
+      break;
+    }
+  }
+  flight->listed = false;
+}
+
+nixbadge_flight_t* nixbadge_flight_join(nixbadge_flight_table_t* table,
+                                        const char* key, bool* leader,
+                                        nixbadge_flight_reader_t* reader) {
+  uint32_t hash = nixbadge_hash_str(key);
+  nixbadge_flight_t** free_slot = NULL;
+  *leader = false;
+
+  pthread_mutex_lock(&table->lock);
+  for (size_t i = 0; i < table->max_flights; i++) {
+    nixbadge_flight_t* flight = table->flights[i];
+    if (!flight) {
+      if (!free_slot) free_slot = &table->flights[i];
+      continue;
+    }
+    if (flight->hash != hash || strcmp(flight->key, key) != 0) continue;
+
+    if (flight->head > table->ring_size) {
+      if (!flight->replayable) {
+        // The start of the response has already been overwritten.
+        table->stats.late++;
+        pthread_mutex_unlock(&table->lock);
+        return NULL;
+      }
+      table->stats.replayed++;
+    }
+
+    flight->refs++;
+    flight->readers++;
+    *reader = (nixbadge_flight_reader_t){.flight = flight};
+    table->stats.followers++;
+    pthread_mutex_unlock(&table->lock);
+    return flight;
+  }
+
+  nixbadge_flight_t* flight =
+      free_slot ? nixbadge_flight_new(table, key, hash) : NULL;
+  if (!flight) {
+    table->stats.full++;
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+  }
+
+  *free_slot = flight;
+  *leader = true;
+  *reader = (nixbadge_flight_reader_t){.flight = flight};
+  table->stats.leaders++;
+  pthread_mutex_unlock(&table->lock);
+  return flight;
+}
+
+/* Drops a reference, with the table lock held, and unlocks it. */
+static void nixbadge_flight_unref(nixbadge_flight_t* flight) {
+  nixbadge_flight_table_t* table = flight->table;
+  bool last = --flight->refs == 0;
+  if (last) nixbadge_flight_unlist(flight);
+  pthread_mutex_unlock(&table->lock);
+
+  if (last) nixbadge_flight_free(flight);
+}
+
+void nixbadge_flight_leave(nixbadge_flight_reader_t* reader) {
+  nixbadge_flight_t* flight = reader->flight;
+  nixbadge_cache_close(&reader->cached);
+
+  pthread_mutex_lock(&flight->table->lock);
+  flight->readers--;
+  nixbadge_flight_unref(flight);
+  reader->flight = NULL;
+}
+
+/* Sets whether the cache can stand in for the ring, with the io lock held. */
+static void nixbadge_flight_set_replayable(nixbadge_flight_t* flight) {
+  pthread_mutex_lock(&flight->table->lock);
+  flight->replayable = flight->caching || flight->committed;
+  pthread_mutex_unlock(&flight->table->lock);
+}
+
+bool nixbadge_flight_cache(nixbadge_flight_t* flight, nixbadge_cache_t* cache,
+                           const char* key) {
+  pthread_mutex_lock(&flight->io);
+  flight->caching = nixbadge_cache_begin(cache, key, &flight->writer) == 0;
+  if (flight->caching) {
+    flight->cache = cache;
+    snprintf(flight->cache_key, sizeof(flight->cache_key), "%s", key);
+  }
+  nixbadge_flight_set_replayable(flight);
+  bool caching = flight->caching;
+  pthread_mutex_unlock(&flight->io);
+  return caching;
+}
+
+void nixbadge_flight_start(nixbadge_flight_t* flight, int status_code) {
+  // Only complete responses are cached.
+  if (status_code != 200) {
+    pthread_mutex_lock(&flight->io);
+    if (flight->caching) {
+      nixbadge_cache_abort(&flight->writer);
+      flight->caching = false;
+      nixbadge_flight_set_replayable(flight);
+    }
+    pthread_mutex_unlock(&flight->io);
+  }
+
+  pthread_mutex_lock(&flight->table->lock);
+  flight->status_code = status_code;
+  pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&flight->table->lock);
+}
+
+void nixbadge_flight_publish(nixbadge_flight_t* flight, const void* data,
+                             size_t len) {
+  size_t ring_size = flight->table->ring_size;
+  const uint8_t* bytes = data;
+
+  // Into the cache first, so that it holds everything the ring lost.
+  pthread_mutex_lock(&flight->io);
+  if (flight->caching &&
+      nixbadge_cache_append(&flight->writer, data, len) < 0) {
+    flight->caching = false;
+    nixbadge_flight_set_replayable(flight);
+  }
+  pthread_mutex_unlock(&flight->io);
+
+  pthread_mutex_lock(&flight->table->lock);
+
+  // Only the tail of an oversized chunk can ever be read.
+  if (len > ring_size) {
+    bytes += len - ring_size;
+    flight->head += len - ring_size;
+    len = ring_size;
+  }
+
+  size_t pos = flight->head % ring_size;
+  size_t first = len < ring_size - pos ? len : ring_size - pos;
+  memcpy(flight->ring + pos, bytes, first);
+  memcpy(flight->ring, bytes + first, len - first);
+  flight->head += len;
+  pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&flight->table->lock);
+}
+
+bool nixbadge_flight_replayable(nixbadge_flight_t* flight) {
+  pthread_mutex_lock(&flight->table->lock);
+  bool replayable = flight->replayable;
+  pthread_mutex_unlock(&flight->table->lock);
+  return replayable;
+}
+
+bool nixbadge_flight_wanted(nixbadge_flight_t* flight) {
+  pthread_mutex_lock(&flight->table->lock);
+  bool wanted = flight->readers > 0 || flight->replayable;
+  pthread_mutex_unlock(&flight->table->lock);
+  return wanted;
+}
+
+int nixbadge_flight_finish(nixbadge_flight_t* flight, bool ok) {
+  int err = 0;
+  pthread_mutex_lock(&flight->io);
+  if (flight->caching) {
+    flight->caching = false;
+    if (ok) {
+      err = nixbadge_cache_commit(&flight->writer);
+      flight->committed = err == 0;
+    } else {
+      nixbadge_cache_abort(&flight->writer);
+    }
+    nixbadge_flight_set_replayable(flight);
+  }
+  pthread_mutex_unlock(&flight->io);
+
+  pthread_mutex_lock(&flight->table->lock);
+  flight->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+  // New requests for the key start a fresh flight from here on.
+  nixbadge_flight_unlist(flight);
+  pthread_cond_broadcast(&flight->cond);
+  nixbadge_flight_unref(flight);
+  return err;
+}
+
+int nixbadge_flight_wait_start(nixbadge_flight_reader_t* reader,
+                               int timeout_ms) {
+  nixbadge_flight_t* flight = reader->flight;
+  int ret;
+
+  pthread_mutex_lock(&flight->table->lock);
+  while (true) {
+    if (flight->status_code != 0) {
+      ret = flight->status_code;
+      break;
+    }
+    if (flight->state != FLIGHT_RUNNING) {
+      ret = -EPIPE;
+      break;
+    }
+    if (nixbadge_flight_wait(flight, timeout_ms) == ETIMEDOUT) {
+      ret = -ETIMEDOUT;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&flight->table->lock);
+  return ret;
+}
+
+/**
+ * Reads what the ring no longer holds back from the object being cached,
+ * or from the committed one.
+ */
+static ssize_t nixbadge_flight_replay(nixbadge_flight_reader_t* reader,
+                                      void* buf, size_t len) {
+  nixbadge_flight_t* flight = reader->flight;
+  if (reader->cached.cache) {
+    return nixbadge_cache_read(&reader->cached, buf, len);
+  }
+
+  pthread_mutex_lock(&flight->io);
+  ssize_t ret = -ENOBUFS;
+  if (flight->caching) {
+    ret = nixbadge_cache_peek(&flight->writer, reader->offset, buf, len);
+  } else if (flight->committed &&
+             nixbadge_cache_open(flight->cache, flight->cache_key,
+                                 &reader->cached) == 0) {
+    ret = nixbadge_cache_seek(&reader->cached, reader->offset);
+  }
+  pthread_mutex_unlock(&flight->io);
+
+  if (ret == 0 && reader->cached.cache) {
+    ret = nixbadge_cache_read(&reader->cached, buf, len);
+  }
+  return ret;
+}
+
+ssize_t nixbadge_flight_read(nixbadge_flight_reader_t* reader, void* buf,
+                             size_t len, int timeout_ms) {
+  nixbadge_flight_t* flight = reader->flight;
+  nixbadge_flight_table_t* table = flight->table;
+  size_t ring_size = table->ring_size;
+  ssize_t ret;
+
+  pthread_mutex_lock(&table->lock);
+  while (true) {
+    uint64_t available = flight->head - reader->offset;
+    if (available > ring_size && flight->replayable) {
+      pthread_mutex_unlock(&table->lock);
+      uint64_t behind = available - ring_size;
+      ret = nixbadge_flight_replay(reader, buf, behind < len ? behind : len);
+      if (ret > 0) {
+        reader->offset += ret;
+        return ret;
+      }
+      // Evicted or never stored after all.
+      pthread_mutex_lock(&table->lock);
+    }
+    if (available > ring_size) {
+      table->stats.lapped++;
+      ret = -ENOBUFS;
+      break;
+    }
+    if (available > 0) {
+      size_t n = available < len ? available : len;
+      size_t pos = reader->offset % ring_size;
+      size_t first = n < ring_size - pos ? n : ring_size - pos;
+      memcpy(buf, flight->ring + pos, first);
+      memcpy((uint8_t*)buf + first, flight->ring, n - first);
+      reader->offset += n;
+      ret = n;
+      break;
+    }
+    if (flight->state == FLIGHT_DONE) {
+      ret = 0;
+      break;
+    }
+    if (flight->state == FLIGHT_FAILED) {
+      ret = -EPIPE;
+      break;
+    }
+    if (nixbadge_flight_wait(flight, timeout_ms) == ETIMEDOUT) {
+      ret = -ETIMEDOUT;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+  return ret;
+}
+
+void nixbadge_flight_get_stats(nixbadge_flight_table_t* table,
+                               nixbadge_flight_stats_t* stats) {
+  pthread_mutex_lock(&table->lock);
+  *stats = table->stats;
+  pthread_mutex_unlock(&table->lock);
+}
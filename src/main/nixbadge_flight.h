@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nixbadge_cache.h"
+
+/*
+ * Single-flight coalescing of identical upstream fetches.
+ *
+ * The first request for a key becomes the leader and fetches upstream,
+ * publishing the response into a ring buffer owned by the flight and, when
+ * it is cacheable, into the cache. Every client reads the ring with its own
+ * cursor, the leader's included, so that the upstream is read at the pace
+ * of the flight rather than of whichever client happened to ask first, and
+ * a leader whose client goes away only drops its reader.
+ *
+ * Nobody waits for a slow reader: one that falls a whole ring behind reads
+ * what it missed back from the object being cached, and from the committed
+ * object once the fetch is done, which also lets requests that arrive late
+ * join from the start. Without the cache it is cut loose with -ENOBUFS
+ * instead of holding everybody else back, and late requests fetch on their
+ * own.
+ */
+
+typedef struct nixbadge_flight_table nixbadge_flight_table_t;
+typedef struct nixbadge_flight nixbadge_flight_t;
+
+typedef struct {
+  nixbadge_flight_t* flight;
+  uint64_t offset;
+  /* The committed object, once reading back from it. */
+  nixbadge_cache_reader_t cached;
+} nixbadge_flight_reader_t;
+
+typedef struct {
+  uint32_t leaders;
+  uint32_t followers;
+  /* Followers that joined after the ring moved on, and read the cache. */
+  uint32_t replayed;
+  uint32_t late;
+  uint32_t lapped;
+  uint32_t full;
+} nixbadge_flight_stats_t;
+
+nixbadge_flight_table_t* nixbadge_flight_table_new(size_t max_flights,
+                                                   size_t ring_size);
+
+/**
+ * Joins the flight for `key` with a reader, starting the flight if there
+ * is none.
+ * @param leader set when the caller started the flight and has to fetch
+ * @return the flight, or NULL when the request can't be coalesced (too
+ *         late to follow, or no free flight) and should fetch on its own
+ */
+nixbadge_flight_t* nixbadge_flight_join(nixbadge_flight_table_t* table,
+                                        const char* key, bool* leader,
+                                        nixbadge_flight_reader_t* reader);
+/**
+ * Stops reading and drops the reader's reference to the flight, which the
+ * leader may do before it finishes.
+ */
+void nixbadge_flight_leave(nixbadge_flight_reader_t* reader);
+
+/* Leader side */
+
+/**
+ * Writes the response into `cache` under `key` as it is published, if it
+ * is 200 OK. To be called before nixbadge_flight_start.
+ * @return whether the object is being written
+ */
+bool nixbadge_flight_cache(nixbadge_flight_t* flight, nixbadge_cache_t* cache,
+                           const char* key);
+void nixbadge_flight_start(nixbadge_flight_t* flight, int status_code);
+void nixbadge_flight_publish(nixbadge_flight_t* flight, const void* data,
+                             size_t len);
+/**
+ * Whether readers the ring laps read the cache instead, so that none of
+ * them has to be waited for.
+ */
+bool nixbadge_flight_replayable(nixbadge_flight_t* flight);
+/**
+ * Whether anything still needs the response: a reader or the cache.
+ */
+bool nixbadge_flight_wanted(nixbadge_flight_t* flight);
+/**
+ * Ends the response, commits the cached object if `ok` and drops the
+ * leader's reference to the flight.
+ * @return 0, or the error storing a complete response in the cache
+ */
+int nixbadge_flight_finish(nixbadge_flight_t* flight, bool ok);
+
+/* Reader side */
+
+/**
+ * Waits for the leader to receive the response status.
+ * @return the status code, -EPIPE if the leader failed before that or
+ *         -ETIMEDOUT
+ */
+int nixbadge_flight_wait_start(nixbadge_flight_reader_t* reader,
+                               int timeout_ms);
+/**
+ * Reads the next bytes of the response. With a timeout of 0 it does not
+ * wait.
+ * @return the number of bytes read, 0 at the end of a complete response,
+ *         -EPIPE if the leader failed, -ENOBUFS if the reader was lapped or
+ *         -ETIMEDOUT
+ */
+ssize_t nixbadge_flight_read(nixbadge_flight_reader_t* reader, void* buf,
+                             size_t len, int timeout_ms);
+
+void nixbadge_flight_get_stats(nixbadge_flight_table_t* table,
+                               nixbadge_flight_stats_t* stats);
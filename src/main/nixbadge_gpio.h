@@ -26,3 +26,11 @@
 #define GPIO_SDET_PIN 8
 #define GPIO_VSEL2 2
 #endif
+
+#ifdef CONFIG_BADGE_CACHE_SDCARD
+/* Not checked against the schematic yet. */
+#define GPIO_SD_CS_PIN 4
+#define GPIO_SD_MISO_PIN 5
+#define GPIO_SD_CLK_PIN 6
+#define GPIO_SD_MOSI_PIN 7
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Hashing for the tables keyed by store paths. Header only and free of
+ * ESP-IDF, unlike nixbadge_utils, so that the host builds can use it too.
+ */
+
+/**
+ * FNV-1a of a NUL-terminated string.
+ */
+static inline uint32_t nixbadge_hash_str(const char* str) {
+  uint32_t hash = 2166136261u;
+  for (const char* c = str; *c; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
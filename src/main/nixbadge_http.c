@@ -1,40 +1,600 @@
 #include "nixbadge_http.h"
 
+#include <errno.h>
 #include <esp_http_client.h>
-#include <esp_http_server.h>
 #include <esp_log.h>
 #include <esp_mesh_lite.h>
+#include <esp_timer.h>
 #include <esp_tls.h>
-#include <nvs_flash.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
 
+#include "nixbadge_cache.h"
+#include "nixbadge_config.h"
+#include "nixbadge_flight.h"
+#include "nixbadge_input.h"
+#include "nixbadge_leds.h"
 #include "nixbadge_mesh.h"
+#include "nixbadge_metrics.h"
+#include "nixbadge_narinfo_cache.h"
+#include "nixbadge_p2p.h"
+#include "nixbadge_prefetch.h"
+#include "nixbadge_proxy.h"
+#include "nixbadge_sched.h"
+#include "nixbadge_show.h"
+#include "nixbadge_storage.h"
+#include "nixbadge_upstream.h"
+#include "nixbadge_upstream_pool.h"
+#include "nixbadge_utils.h"
+
+#define CACHE_CHUNK_SIZE 4096
+#define FLIGHT_TIMEOUT_MS 60000
+/* Each badge reads NVS on a reload, so the mesh is asked at most this often. */
+#define RELOAD_BROADCAST_MIN_MS 10000
+#define WORKER_STACK_SIZE 8192
+#define PROXY_STACK_SIZE 6144
+#define PROXY_IDLE_TIMEOUT_MS 30000
+#define PROXY_SEND_TIMEOUT_MS 30000
+#define RANGE_HEADER_MAX 64
+#define HEDGE_STACK_SIZE 8192
+#define HEDGE_BODY_MAX 8192
+/* Enough for every request to be waiting on every upstream. */
+#define HEDGE_QUEUE_LEN (CONFIG_BADGE_HTTP_WORKERS * NIXBADGE_UPSTREAM_MAX)
+#define HEDGE_ATTEMPT_TIMEOUT_MS 15000
+#define HEDGE_MIN_MS 50
+#define HEDGE_INITIAL_MS 500
+#define UPSTREAM_DOWN_SCORE 3.0f
+#define PEER_CANDIDATES 3
+#define PEER_TIMEOUT_MS 5000
+#define LOCAL_ONLY_HEADER "X-Nixbadge-Local-Only"
+#define PREFETCH_HEADER "X-Nixbadge-Prefetch"
+#define PREFETCH_STACK_SIZE 8192
+#define PREFETCH_QUEUE_LEN 64
+#define PREFETCH_SEEN_ENTRIES 256
+#define PREFETCH_IDLE_MS 200
+#define PREFETCH_WAIT_MS 60000
+#define SCHED_WAIT_MS 60000
 
 static const char TAG[] = "nixbadge_http";
 
+/* Zig functions */
+extern bool nixbadge_wifi_get_sta_rssi(int* rssi);
+
+/* What a request is for, which it is counted under. */
+typedef enum {
+  HTTP_CLASS_NARINFO,
+  HTTP_CLASS_NAR,
+  HTTP_CLASS_OTHER,
+  HTTP_CLASSES,
+} nixbadge_http_class_t;
+
+static const char* const http_class_labels[HTTP_CLASSES] = {
+    "class=\"narinfo\"",
+    "class=\"nar\"",
+    "class=\"other\"",
+};
+
+/* Where the body bytes sent to clients came from. */
+typedef enum {
+  HTTP_SOURCE_UPSTREAM,
+  HTTP_SOURCE_FLIGHT,
+  HTTP_SOURCE_CACHE,
+  HTTP_SOURCES,
+} nixbadge_http_source_t;
+
+static const char* const http_source_labels[HTTP_SOURCES] = {
+    "source=\"upstream\"",
+    "source=\"flight\"",
+    "source=\"cache\"",
+};
+
+static const char* const http_lane_labels[NIXBADGE_SCHED_LANES] = {
+    [NIXBADGE_SCHED_FAST] = "lane=\"fast\"",
+    [NIXBADGE_SCHED_BULK] = "lane=\"bulk\"",
+};
+
+/* Updated on every request, read by /metrics. */
+static struct {
+  nixbadge_counter_t requests[HTTP_CLASSES];
+  nixbadge_counter_t deferred[HTTP_CLASSES];
+  nixbadge_counter_t failed[HTTP_CLASSES];
+  nixbadge_histogram_t duration[HTTP_CLASSES];
+  nixbadge_histogram_t queued[NIXBADGE_SCHED_LANES];
+  nixbadge_counter64_t sent_bytes[HTTP_SOURCES];
+  nixbadge_counter64_t received_bytes;
+  nixbadge_histogram_t upstream_connect;
+  nixbadge_histogram_t upstream_ttfb;
+} http_metrics;
+
+static nixbadge_narinfo_cache_t* narinfo_cache = NULL;
+static nixbadge_flight_table_t* flights = NULL;
+static nixbadge_proxy_t* http_proxy = NULL;
+static nixbadge_prefetch_t* prefetcher = NULL;
+/* Prefetched narinfos, apart so that they never push out requested ones. */
+static nixbadge_narinfo_cache_t* prefetch_store = NULL;
+static nixbadge_sched_t* http_sched = NULL;
+/* Configuration the scheduling policy was taken from, on the proxy task. */
+static uint32_t http_sched_generation = 0;
+/* Attempts of hedged lookups waiting for a worker. */
+static QueueHandle_t hedge_attempts = NULL;
+
+static SemaphoreHandle_t upstreams_lock = NULL;
+static nixbadge_upstream_set_t* upstreams = NULL;
+static char* upstreams_list = NULL;
+
+/**
+ * Handles a request. On the proxy task `local` is set and only what is at
+ * hand may be answered, anything that needs the network or NVS returns
+ * ESP_ERR_NOT_FOUND and is run again on a worker.
+ */
+typedef esp_err_t (*nixbadge_http_handler_t)(nixbadge_proxy_req_t* req,
+                                             bool local);
+
+/**
+ * A request handed off from the proxy task to a worker, so that slow
+ * upstream fetches don't hold up every other client. Which one a worker
+ * takes on next is up to the scheduler.
+ */
+typedef struct {
+  nixbadge_proxy_req_t* req;
+  nixbadge_http_handler_t handler;
+  nixbadge_http_class_t cls;
+  int64_t started_ms;
+} nixbadge_http_job_t;
+
+/**
+ * State for one upstream fetch that is proxied to a client and, for a NAR,
+ * written into the NAR cache along the way. Small bodies can additionally
+ * be captured in memory.
+ *
+ * The body goes out through the proxy engine, which sends it on to the
+ * client while the next piece is being received. Prefetches have no client
+ * and only fill the caches.
+ */
+typedef struct {
+  nixbadge_proxy_req_t* req;
+  const char* uri;
+  /*
+   * A NAR, which is named by the hash of its contents and kept in the NAR
+   * cache. Narinfos can change upstream and are only kept in memory, for
+   * as long as their TTL.
+   */
+  bool nar;
+  /* Nobody is waiting for it, which the parent is told as well. */
+  bool prefetch;
+  /* Held for the upstream certificate while fetching. */
+  const nixbadge_config_t* config;
+  /* Held to the client's share of the bandwidth. */
+  bool throttled;
+  /* Not sent more before this, to keep it to that share. */
+  int64_t held_until_ms;
+  /* Written here when there is no flight to do it. */
+  nixbadge_cache_writer_t writer;
+  bool caching;
+  /*
+   * Led by this fetch, which the client reads like any follower, from
+   * `pump` as the body comes in, as far as it takes it without waiting.
+   */
+  nixbadge_flight_t* flight;
+  nixbadge_flight_reader_t reader;
+  char* pump;
+  /* The client went away, there is no point in going on for it. */
+  bool abandoned;
+
+  int status_code;
+  int64_t started_ms;
+  bool received;
+  int64_t received_ms;
+  bool responding;
+  bool finished;
+  char status[32];
+
+  /* Range and If-Range of the client request, forwarded as is. */
+  char range[RANGE_HEADER_MAX];
+  char if_range[RANGE_HEADER_MAX];
+  /* Upstream headers passed on to the client. */
+  char content_range[RANGE_HEADER_MAX];
+  char etag[RANGE_HEADER_MAX];
+  char last_modified[RANGE_HEADER_MAX];
+
+  bool hedged;
+  /* Asking a peer, which may not have it after all. */
+  bool probing;
+  /*
+   * Resuming an interrupted body: where the first response started and
+   * ended (inclusive, -1 if unknown) and how much of it went out so far.
+   */
+  bool resumable;
+  bool resuming;
+  bool resume_checked;
+  bool resume_valid;
+  uint64_t body_start;
+  int64_t body_end;
+  uint64_t delivered;
+
+  char* capture;
+  size_t capture_size;
+  size_t capture_len;
+  bool capture_overflow;
+} nixbadge_http_fetch_t;
+
+static int64_t nixbadge_http_now_ms() { return esp_timer_get_time() / 1000; }
+
+static const char* nixbadge_http_reason(int status_code) {
+  switch (status_code) {
+    case 200:
+      return "OK";
+    case 206:
+      return "Partial Content";
+    case 400:
+      return "Bad Request";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 416:
+      return "Range Not Satisfiable";
+    case 500:
+      return "Internal Server Error";
+    case 503:
+      return "Service Unavailable";
+    default:
+      return "Bad Gateway";
+  }
+}
+
+/**
+ * Parses a single byte range like "bytes=0-499", "bytes=500-" or
+ * "bytes=-500". Lists of ranges are not supported.
+ * @param first set to the first byte, or -1 for a suffix range
+ * @param last set to the last byte (or suffix length), or -1 if open
+ */
+static bool nixbadge_http_parse_range(const char* value, int64_t* first,
+                                      int64_t* last) {
+  if (strncmp(value, "bytes=", 6) != 0) return false;
+  value += 6;
+  if (strchr(value, ',')) return false;
+
+  char* end;
+  *first = -1;
+  *last = -1;
+  if (*value != '-') {
+    *first = strtoll(value, &end, 10);
+    if (end == value || *first < 0) return false;
+    value = end;
+  }
+  if (*value++ != '-') return false;
+  if (*value) {
+    *last = strtoll(value, &end, 10);
+    if (end == value || *end || *last < 0) return false;
+  }
+
+  if (*first < 0) return *last > 0;
+  return *last < 0 || *last >= *first;
+}
+
+/**
+ * Resolves a range against the size of the whole body.
+ * @return false if the range is not satisfiable
+ */
+static bool nixbadge_http_resolve_range(int64_t first, int64_t last,
+                                        uint64_t size, uint64_t* start,
+                                        uint64_t* end) {
+  if (size == 0) return false;
+  if (first < 0) {
+    *start = (uint64_t)last >= size ? 0 : size - last;
+    *end = size - 1;
+    return true;
+  }
+  if ((uint64_t)first >= size) return false;
+  *start = first;
+  *end = last < 0 || (uint64_t)last >= size ? size - 1 : (uint64_t)last;
+  return true;
+}
+
+/**
+ * Parses the start and end of "Content-Range: bytes 0-499/1234".
+ */
+static bool nixbadge_http_parse_content_range(const char* value,
+                                              uint64_t* start, int64_t* end) {
+  unsigned long long first, last;
+  if (sscanf(value, "bytes %llu-%llu", &first, &last) != 2) return false;
+  if (last < first) return false;
+  *start = first;
+  *end = last;
+  return true;
+}
+
+/**
+ * Forwards the upstream status line once the response starts, so that
+ * errors like a missing narinfo reach the client instead of a 200.
+ */
+static void nixbadge_http_respond(nixbadge_http_fetch_t* fetch,
+                                  int status_code, int64_t length) {
+  if (fetch->responding) return;
+  fetch->responding = true;
+
+  if (fetch->probing && fetch->req) {
+    if (fetch->content_range[0]) {
+      nixbadge_proxy_resp_set_hdr(fetch->req, "Content-Range",
+                                  fetch->content_range);
+    }
+    if (fetch->etag[0]) {
+      nixbadge_proxy_resp_set_hdr(fetch->req, "ETag", fetch->etag);
+    }
+    if (fetch->last_modified[0]) {
+      nixbadge_proxy_resp_set_hdr(fetch->req, "Last-Modified",
+                                  fetch->last_modified);
+    }
+  }
+
+  fetch->status_code = status_code;
+  if (fetch->status_code != 200 && fetch->req) {
+    snprintf(fetch->status, sizeof(fetch->status), "%d %s", fetch->status_code,
+             nixbadge_http_reason(fetch->status_code));
+    nixbadge_proxy_resp_set_status(fetch->req, fetch->status);
+  }
+
+  if (fetch->status_code == 206) {
+    if (!nixbadge_http_parse_content_range(fetch->content_range,
+                                           &fetch->body_start,
+                                           &fetch->body_end)) {
+      fetch->resumable = false;
+    }
+  } else {
+    fetch->body_start = 0;
+    fetch->body_end = length > 0 ? length - 1 : -1;
+  }
+
+  if (fetch->flight) nixbadge_flight_start(fetch->flight, fetch->status_code);
+}
+
+static void nixbadge_http_capture(nixbadge_http_fetch_t* fetch,
+                                  const void* data, size_t len) {
+  if (!fetch->capture || fetch->capture_overflow) return;
+
+  if (fetch->capture_len + len > fetch->capture_size) {
+    fetch->capture_overflow = true;
+    return;
+  }
+  memcpy(fetch->capture + fetch->capture_len, data, len);
+  fetch->capture_len += len;
+}
+
+static void nixbadge_http_cache_append(nixbadge_http_fetch_t* fetch,
+                                       const void* data, size_t len) {
+  if (!fetch->caching) return;
+
+  if (fetch->status_code != 200 ||
+      nixbadge_cache_append(&fetch->writer, data, len) < 0) {
+    nixbadge_cache_abort(&fetch->writer);
+    fetch->caching = false;
+  }
+}
+
+static void nixbadge_http_cache_finish(nixbadge_http_fetch_t* fetch) {
+  if (!fetch->caching) return;
+  fetch->caching = false;
+
+  if (fetch->status_code != 200) {
+    nixbadge_cache_abort(&fetch->writer);
+    return;
+  }
+
+  int err = nixbadge_cache_commit(&fetch->writer);
+  if (err < 0) {
+    ESP_LOGW(TAG, "Failed to store %s in the cache: %d", fetch->uri, err);
+  }
+}
+
+/**
+ * Charges the client for a piece of the body sent to it, and notes when it
+ * may be sent more if that took it over its share of the bandwidth.
+ */
+static void nixbadge_http_throttle(nixbadge_http_fetch_t* fetch, size_t len) {
+  if (!fetch->throttled) return;
+  int64_t now = nixbadge_http_now_ms();
+  fetch->held_until_ms =
+      now + nixbadge_sched_throttle(http_sched,
+                                    nixbadge_proxy_req_client(fetch->req),
+                                    len, now);
+}
+
+/* Waits until the client may be sent more. */
+static void nixbadge_http_hold(nixbadge_http_fetch_t* fetch) {
+  int64_t wait = fetch->held_until_ms - nixbadge_http_now_ms();
+  if (wait > 0) vTaskDelay(pdMS_TO_TICKS(wait));
+}
+
+/**
+ * Whether the body is still needed, by the client or, for a flight, by a
+ * follower or the cache.
+ */
+static bool nixbadge_http_wanted(nixbadge_http_fetch_t* fetch) {
+  if (!fetch->abandoned) return true;
+  return fetch->flight && nixbadge_flight_wanted(fetch->flight);
+}
+
+/* Lets the flight go on without the leader's client. */
+static void nixbadge_http_drop(nixbadge_http_fetch_t* fetch, int err) {
+  ESP_LOGW(TAG, "Lost the client of %s: %d", fetch->uri, err);
+  fetch->abandoned = true;
+  nixbadge_flight_leave(&fetch->reader);
+}
+
+/**
+ * Sends the leader's client what it has not had of the flight yet. Without
+ * `wait` only as much as it takes right away, so that a slow client holds
+ * up neither the upstream nor the followers. That is waited for when
+ * nothing can stand in for the ring if the client falls behind it.
+ */
+static void nixbadge_http_pump(nixbadge_http_fetch_t* fetch, bool wait) {
+  while (fetch->reader.flight) {
+    size_t len = CACHE_CHUNK_SIZE;
+    if (wait) {
+      nixbadge_http_hold(fetch);
+    } else {
+      if (nixbadge_http_now_ms() < fetch->held_until_ms) break;
+      size_t room = nixbadge_proxy_resp_room(fetch->req);
+      if (room == 0) break;
+      if (room < len) len = room;
+    }
+
+    ssize_t n = nixbadge_flight_read(&fetch->reader, fetch->pump, len, 0);
+    // Caught up with what came in so far.
+    if (n == -ETIMEDOUT || n == 0) break;
+    int err = n;
+    if (n > 0) err = nixbadge_proxy_resp_send_chunk(fetch->req, fetch->pump, n);
+    if (err < 0) {
+      nixbadge_http_drop(fetch, err);
+      break;
+    }
+    nixbadge_http_throttle(fetch, n);
+    nixbadge_counter64_add(&http_metrics.sent_bytes[HTTP_SOURCE_UPSTREAM], n);
+  }
+}
+
+/**
+ * Passes a piece of the body on to the client, the cache and any
+ * coalesced followers. Without a flight, blocks while the client is
+ * behind, which holds back reading from upstream.
+ */
+static esp_err_t nixbadge_http_deliver(nixbadge_http_fetch_t* fetch,
+                                       const void* data, size_t len) {
+  nixbadge_http_capture(fetch, data, len);
+  nixbadge_counter64_add(&http_metrics.received_bytes, len);
+  if (fetch->flight) {
+    nixbadge_flight_publish(fetch->flight, data, len);
+    fetch->delivered += len;
+    nixbadge_http_pump(fetch, !nixbadge_flight_replayable(fetch->flight));
+    return nixbadge_http_wanted(fetch) ? ESP_OK : ESP_FAIL;
+  }
+
+  nixbadge_http_cache_append(fetch, data, len);
+  if (fetch->req) {
+    nixbadge_http_hold(fetch);
+    if (nixbadge_proxy_resp_send_chunk(fetch->req, data, len) < 0) {
+      fetch->abandoned = true;
+      return ESP_FAIL;
+    }
+    nixbadge_http_throttle(fetch, len);
+    nixbadge_counter64_add(&http_metrics.sent_bytes[HTTP_SOURCE_UPSTREAM],
+                           len);
+  }
+  fetch->delivered += len;
+  return ESP_OK;
+}
+
+static void nixbadge_http_complete(nixbadge_http_fetch_t* fetch) {
+  fetch->finished = true;
+}
+
+/**
+ * Keeps a copy of upstream headers worth passing on, since the client
+ * reuses its buffer for the body before ours are sent.
+ */
+static void nixbadge_http_forward_header(nixbadge_http_fetch_t* fetch,
+                                         const char* key, const char* value) {
+  char* copy;
+  if (strcasecmp(key, "Content-Range") == 0) {
+    copy = fetch->content_range;
+    key = "Content-Range";
+  } else if (fetch->resuming) {
+    return;
+  } else if (strcasecmp(key, "ETag") == 0) {
+    copy = fetch->etag;
+    key = "ETag";
+  } else if (strcasecmp(key, "Last-Modified") == 0) {
+    copy = fetch->last_modified;
+    key = "Last-Modified";
+  } else {
+    return;
+  }
+
+  if (strlen(value) >= RANGE_HEADER_MAX) return;
+  strlcpy(copy, value, RANGE_HEADER_MAX);
+  // A peer's are held back until nixbadge_http_respond.
+  if (!fetch->resuming && !fetch->probing && fetch->req) {
+    nixbadge_proxy_resp_set_hdr(fetch->req, key, copy);
+  }
+}
+
+/**
+ * Whether the body of the current response can be passed on: always for
+ * the first response, and for a resumed one only if it continues exactly
+ * where the interrupted one stopped.
+ */
+static bool nixbadge_http_resume_check(nixbadge_http_fetch_t* fetch,
+                                       esp_http_client_handle_t client) {
+  if (!fetch->resuming) return true;
+  if (fetch->resume_checked) return fetch->resume_valid;
+  fetch->resume_checked = true;
+
+  uint64_t start;
+  int64_t end;
+  fetch->resume_valid =
+      esp_http_client_get_status_code(client) == 206 &&
+      nixbadge_http_parse_content_range(fetch->content_range, &start, &end) &&
+      start == fetch->body_start + fetch->delivered;
+  if (!fetch->resume_valid) {
+    ESP_LOGW(TAG, "Upstream did not resume %s at byte %llu", fetch->uri,
+             fetch->body_start + fetch->delivered);
+  }
+  return fetch->resume_valid;
+}
+
+/**
+ * Whether a response is to be passed on. A peer that answers anything but
+ * the body did not have it, which is not for the client to see.
+ */
+static bool nixbadge_http_probe_check(nixbadge_http_fetch_t* fetch,
+                                      esp_http_client_handle_t client) {
+  if (!fetch->probing) return true;
+  int status_code = esp_http_client_get_status_code(client);
+  return status_code == 200 || status_code == 206;
+}
+
 static esp_err_t http_client_get_serve(esp_http_client_event_t* evt) {
-  httpd_req_t* req = evt->user_data;
+  nixbadge_http_fetch_t* fetch = evt->user_data;
+  const char* uri = fetch->uri;
   switch (evt->event_id) {
     case HTTP_EVENT_ERROR:
-      ESP_LOGI(TAG, "Received error while fetching %s", req->uri);
+      ESP_LOGI(TAG, "Received error while fetching %s", uri);
       break;
     case HTTP_EVENT_ON_CONNECTED:
-      ESP_LOGI(TAG, "Connected to upstream cache at %s", req->uri);
+      ESP_LOGI(TAG, "Connected to upstream cache at %s", uri);
+      nixbadge_histogram_observe(&http_metrics.upstream_connect,
+                                 nixbadge_http_now_ms() - fetch->started_ms);
       break;
     case HTTP_EVENT_ON_HEADER:
-      ESP_LOGI(TAG, "Received header \"%s: %s\" for %s", evt->header_key,
-               evt->header_value, req->uri);
-      httpd_resp_set_hdr(req, evt->header_key, evt->header_value);
+      ESP_LOGD(TAG, "Received header \"%s: %s\" for %s", evt->header_key,
+               evt->header_value, uri);
+      if (!fetch->received) fetch->received_ms = nixbadge_http_now_ms();
+      fetch->received = true;
+      nixbadge_http_forward_header(fetch, evt->header_key, evt->header_value);
       break;
     case HTTP_EVENT_ON_DATA:
-      ESP_LOGI(TAG, "Received chunk %d for %s", evt->data_len, req->uri);
-      return httpd_resp_send_chunk(req, evt->data, evt->data_len);
+      fetch->received = true;
+      if (!nixbadge_http_probe_check(fetch, evt->client)) break;
+      if (!nixbadge_http_resume_check(fetch, evt->client)) break;
+      nixbadge_http_respond(fetch, esp_http_client_get_status_code(evt->client),
+                            esp_http_client_get_content_length(evt->client));
+      return nixbadge_http_deliver(fetch, evt->data, evt->data_len);
     case HTTP_EVENT_ON_FINISH:
-      ESP_LOGI(TAG, "Connection to upstream cache at %s is complete", req->uri);
-      httpd_resp_sendstr_chunk(req, NULL);
+      ESP_LOGI(TAG, "Connection to upstream cache at %s is complete", uri);
+      if (!nixbadge_http_probe_check(fetch, evt->client)) break;
+      if (!nixbadge_http_resume_check(fetch, evt->client)) break;
+      nixbadge_http_respond(fetch, esp_http_client_get_status_code(evt->client),
+                            esp_http_client_get_content_length(evt->client));
+      nixbadge_http_complete(fetch);
       break;
     case HTTP_EVENT_DISCONNECTED: {
-      ESP_LOGI(TAG, "Got disconnected while fetching %s", req->uri);
+      ESP_LOGI(TAG, "Got disconnected while fetching %s", uri);
       int mbedtls_err = 0;
       esp_err_t err = esp_tls_get_and_clear_last_error(
           (esp_tls_error_handle_t)evt->data, &mbedtls_err, NULL);
@@ -49,207 +609,1899 @@ static esp_err_t http_client_get_serve(esp_http_client_event_t* evt) {
   return ESP_OK;
 }
 
-static char* get_cache_host() {
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
-
-  uint8_t cache_p2p = 1;
-  ESP_ERROR_CHECK(nvs_get_u8(flashcfg_handle, "cache_p2p", &cache_p2p));
-  if (esp_mesh_lite_get_level() == ROOT || cache_p2p) {
-    size_t cache_store_len;
-    ESP_ERROR_CHECK(
-        nvs_get_str(flashcfg_handle, "cache_upstream", NULL, &cache_store_len));
+/**
+ * Returns the upstream set for the current configuration, keeping health
+ * state across reloads that leave the list alone.
+ */
+static nixbadge_upstream_set_t* nixbadge_http_upstreams(
+    const nixbadge_config_t* config) {
+  xSemaphoreTake(upstreams_lock, portMAX_DELAY);
+  if (!upstreams_list || strcmp(upstreams_list, config->cache_upstream) != 0) {
+    nixbadge_upstream_config_t upstream_config = {
+        .hedge_percentile = CONFIG_BADGE_UPSTREAM_HEDGE_PERCENTILE,
+        .hedge_min_ms = HEDGE_MIN_MS,
+        .hedge_initial_ms = HEDGE_INITIAL_MS,
+        .health_half_life_ms = CONFIG_BADGE_UPSTREAM_HEALTH_HALF_LIFE * 1000,
+        .down_score = UPSTREAM_DOWN_SCORE,
+        .nar_routes = CONFIG_BADGE_NARINFO_CACHE_ENTRIES * 2,
+    };
+    nixbadge_upstream_set_t* set =
+        nixbadge_upstream_set_new(config->cache_upstream, &upstream_config);
+    char* list = strdup(config->cache_upstream);
+    if (set && list) {
+      nixbadge_upstream_set_unref(upstreams);
+      free(upstreams_list);
+      upstreams = set;
+      upstreams_list = list;
+    } else {
+      nixbadge_upstream_set_unref(set);
+      free(list);
+    }
+  }
 
-    char* cache_store = malloc(cache_store_len);
-    ESP_ERROR_CHECK(nvs_get_str(flashcfg_handle, "cache_upstream", cache_store,
-                                &cache_store_len));
+  nixbadge_upstream_set_t* set =
+      upstreams ? nixbadge_upstream_set_ref(upstreams) : NULL;
+  xSemaphoreGive(upstreams_lock);
+  return set;
+}
 
-    nvs_close(flashcfg_handle);
-    return cache_store;
+/**
+ * Fills in where to fetch from: an upstream cache from the set on the root
+ * or with peer-to-peer caching, otherwise the parent node.
+ */
+static void nixbadge_http_target(nixbadge_upstream_set_t* set, size_t index,
+                                 bool https, const nixbadge_config_t* config,
+                                 char* gateway,
+                                 nixbadge_upstream_target_t* target) {
+  target->config = config;
+  if (set) {
+    target->host = nixbadge_upstream_set_host(set, index, &target->port);
+    target->https = https;
   } else {
     esp_ip4_addr_t addr = nixbadge_mesh_get_gateway();
-    char* str = NULL;
-    asprintf(&str, IPSTR, IP2STR(&addr));
-    nvs_close(flashcfg_handle);
-    return str;
+    snprintf(gateway, 16, IPSTR, IP2STR(&addr));
+    target->host = gateway;
+    target->port = 1008;
+    target->https = false;
+  }
+}
+
+static esp_err_t nixbadge_http_result(int err) {
+  return err < 0 ? ESP_FAIL : ESP_OK;
+}
+
+static esp_err_t nixbadge_http_send_404(nixbadge_proxy_req_t* req) {
+  return nixbadge_http_result(nixbadge_proxy_resp_send_err(
+      req, "404 Not Found", "This URI does not exist\n"));
+}
+
+static esp_err_t nix_cache_info_get_handler(nixbadge_proxy_req_t* req,
+                                            bool local) {
+  const nixbadge_config_t* config = nixbadge_config_get();
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type", "text/x-nix-cache-info");
+  esp_err_t err = nixbadge_http_result(nixbadge_proxy_resp_send(
+      req, config->nix_cache_info, config->nix_cache_info_len));
+  nixbadge_config_unref(config);
+  return err;
+}
+
+/**
+ * Whether the request carries the reload token from NVS as a bearer token.
+ * The comparison takes the same time however much of the token matches.
+ */
+static bool nixbadge_http_reload_authorized(nixbadge_proxy_req_t* req,
+                                            const char* token) {
+  char auth[sizeof("Bearer ") + 64];
+  if (nixbadge_proxy_req_get_hdr(req, "Authorization", auth, sizeof(auth)) !=
+      0) {
+    return false;
+  }
+  if (strncasecmp(auth, "Bearer ", 7) != 0) return false;
+
+  const char* given = auth + 7;
+  size_t len = strlen(token);
+  if (strlen(given) != len) return false;
+
+  uint8_t diff = 0;
+  for (size_t i = 0; i < len; i++) diff |= given[i] ^ token[i];
+  return diff == 0;
+}
+
+static esp_err_t reload_post_handler(nixbadge_proxy_req_t* req, bool local) {
+  static _Atomic int64_t broadcast_ms = -RELOAD_BROADCAST_MIN_MS;
+
+  const nixbadge_config_t* config = nixbadge_config_get();
+  bool enabled = config->reload_token[0] != 0;
+  bool authorized =
+      enabled && nixbadge_http_reload_authorized(req, config->reload_token);
+  nixbadge_config_unref(config);
+  if (!enabled) {
+    return nixbadge_http_result(nixbadge_proxy_resp_send_err(
+        req, "403 Forbidden", "Reloading is off without a reload token\n"));
+  }
+  if (!authorized) {
+    nixbadge_proxy_resp_set_hdr(req, "WWW-Authenticate", "Bearer");
+    return nixbadge_http_result(nixbadge_proxy_resp_send_err(
+        req, "401 Unauthorized", "The reload token is missing or wrong\n"));
+  }
+
+  // Reading the configuration from NVS takes a while.
+  if (local) return ESP_ERR_NOT_FOUND;
+
+  esp_err_t err = nixbadge_config_reload();
+  if (err != ESP_OK) {
+    return nixbadge_http_result(
+        nixbadge_proxy_resp_send_err(req, "500 Internal Server Error",
+                                     "Failed to reload the configuration\n"));
+  }
+
+  if (nixbadge_has_mesh()) {
+    int64_t now = nixbadge_http_now_ms();
+    int64_t last = atomic_load_explicit(&broadcast_ms, memory_order_relaxed);
+    if (now - last < RELOAD_BROADCAST_MIN_MS ||
+        !atomic_compare_exchange_strong(&broadcast_ms, &last, now)) {
+      const char* msg = "Configuration reloaded, the mesh was asked recently\n";
+      return nixbadge_http_result(
+          nixbadge_proxy_resp_send(req, msg, strlen(msg)));
+    }
+    nixbadge_mesh_broadcast(NIXBADGE_MESH_RELOAD_CONFIG);
+  }
+  return nixbadge_http_result(
+      nixbadge_proxy_resp_send(req, "Configuration reloaded\n",
+                               strlen("Configuration reloaded\n")));
+}
+
+static esp_err_t digest_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  uint8_t* bloom;
+  size_t len;
+  esp_err_t err = nixbadge_p2p_get_digest(&bloom, &len);
+  if (err != ESP_OK) return nixbadge_http_send_404(req);
+
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type", "application/octet-stream");
+  err = nixbadge_http_result(nixbadge_proxy_resp_send(req, bloom, len));
+  free(bloom);
+  return err;
+}
+
+static esp_err_t show_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  uint8_t* data;
+  size_t len;
+  esp_err_t err = nixbadge_show_get(&data, &len);
+  if (err != ESP_OK) return nixbadge_http_send_404(req);
+
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type", "application/octet-stream");
+  err = nixbadge_http_result(nixbadge_proxy_resp_send(req, data, len));
+  free(data);
+  return err;
+}
+
+static esp_err_t show_post_handler(nixbadge_proxy_req_t* req, bool local) {
+  // Storing the show in NVS takes a while.
+  if (local) return ESP_ERR_NOT_FOUND;
+
+  size_t len = 0;
+  const uint8_t* data = nixbadge_proxy_req_body(req, &len);
+  const char* error = NULL;
+  esp_err_t err = nixbadge_show_upload(data, data ? len : 0, &error);
+  if (err != ESP_OK) {
+    char msg[96];
+    snprintf(msg, sizeof(msg), "Not a show: %s\n",
+             error ? error : esp_err_to_name(err));
+    return nixbadge_http_result(
+        nixbadge_proxy_resp_send_err(req, "400 Bad Request", msg));
+  }
+  const char* msg = len ? "Show uploaded\n" : "Show cleared\n";
+  return nixbadge_http_result(nixbadge_proxy_resp_send(req, msg, strlen(msg)));
+}
+
+/**
+ * Derives the cache key from a request URI: its last path component without
+ * the query string, which is the narinfo or NAR file hash plus extension.
+ */
+static bool nixbadge_http_cache_key(const char* uri, char* key, size_t len) {
+  const char* name = strrchr(uri, '/');
+  name = name ? name + 1 : uri;
+
+  size_t name_len = strcspn(name, "?#");
+  if (name_len >= len) return false;
+
+  memcpy(key, name, name_len);
+  key[name_len] = 0;
+  return nixbadge_cache_key_valid(key);
+}
+
+/**
+ * Serves an object from the cache, or the requested range of it. NAR URLs
+ * name the hash of their contents, so If-Range can never refer to other
+ * bytes and ranges are served regardless of it.
+ */
+static esp_err_t nixbadge_http_serve_cached(nixbadge_http_fetch_t* fetch,
+                                            nixbadge_cache_reader_t* reader) {
+  nixbadge_proxy_req_t* req = fetch->req;
+  ESP_LOGI(TAG, "Serving %s from the cache (%llu bytes)",
+           nixbadge_proxy_req_uri(req), reader->size);
+
+  bool ranged = false;
+  uint64_t start = 0;
+  uint64_t remaining = reader->size;
+  int64_t first, last;
+  nixbadge_proxy_resp_set_hdr(req, "Accept-Ranges", "bytes");
+  if (fetch->range[0] &&
+      nixbadge_http_parse_range(fetch->range, &first, &last)) {
+    uint64_t end;
+    if (!nixbadge_http_resolve_range(first, last, reader->size, &start,
+                                     &end)) {
+      nixbadge_cache_close(reader);
+      snprintf(fetch->content_range, sizeof(fetch->content_range),
+               "bytes */%llu", reader->size);
+      nixbadge_proxy_resp_set_hdr(req, "Content-Range", fetch->content_range);
+      nixbadge_proxy_resp_set_status(req, "416 Range Not Satisfiable");
+      fetch->status_code = 416;
+      return nixbadge_http_result(nixbadge_proxy_resp_send(req, NULL, 0));
+    }
+
+    if (nixbadge_cache_seek(reader, start) < 0) {
+      nixbadge_cache_close(reader);
+      return ESP_FAIL;
+    }
+    remaining = end - start + 1;
+    ranged = true;
+
+    snprintf(fetch->content_range, sizeof(fetch->content_range),
+             "bytes %llu-%llu/%llu", start, end, reader->size);
+    nixbadge_proxy_resp_set_hdr(req, "Content-Range", fetch->content_range);
+    nixbadge_proxy_resp_set_status(req, "206 Partial Content");
   }
+
+  // The engine sends the rest as the client takes it.
+  esp_err_t err = nixbadge_http_result(
+      nixbadge_proxy_resp_send_cache(req, reader, remaining));
+  if (err == ESP_OK) {
+    fetch->status_code = ranged ? 206 : 200;
+    nixbadge_counter64_add(&http_metrics.sent_bytes[HTTP_SOURCE_CACHE],
+                           remaining);
+  }
+  return err;
 }
 
-static esp_err_t nix_cache_info_get_handler(httpd_req_t* req) {
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
+/**
+ * Streams the rest of a flight to the client through `buff`, of
+ * CACHE_CHUNK_SIZE bytes.
+ * @param source what the bytes sent are counted as
+ * @param sent set once any part of the body went out to the client
+ */
+static esp_err_t nixbadge_http_relay(nixbadge_http_fetch_t* fetch,
+                                     nixbadge_flight_reader_t* reader,
+                                     char* buff, nixbadge_http_source_t source,
+                                     bool* sent) {
+  nixbadge_proxy_req_t* req = fetch->req;
+  esp_err_t err = ESP_OK;
+  ssize_t n;
+  while ((n = nixbadge_flight_read(reader, buff, CACHE_CHUNK_SIZE,
+                                   FLIGHT_TIMEOUT_MS)) > 0) {
+    *sent = true;
+    // The leader captured the body as it came in.
+    if (source == HTTP_SOURCE_FLIGHT) nixbadge_http_capture(fetch, buff, n);
+    nixbadge_http_hold(fetch);
+    err = nixbadge_http_result(nixbadge_proxy_resp_send_chunk(req, buff, n));
+    if (err != ESP_OK) break;
+    nixbadge_http_throttle(fetch, n);
+    nixbadge_counter64_add(&http_metrics.sent_bytes[source], n);
+  }
 
-  size_t cache_store_len;
-  ESP_ERROR_CHECK(
-      nvs_get_str(flashcfg_handle, "cache_store", NULL, &cache_store_len));
+  if (n < 0) {
+    ESP_LOGW(TAG, "Lost the coalesced fetch of %s: %d", fetch->uri, n);
+    err = ESP_FAIL;
+  }
+  if (err == ESP_OK) {
+    err = nixbadge_http_result(nixbadge_proxy_resp_send_chunk(req, NULL, 0));
+  }
+  return err;
+}
 
-  char* cache_store = malloc(cache_store_len);
-  ESP_ERROR_CHECK(nvs_get_str(flashcfg_handle, "cache_store", cache_store,
-                              &cache_store_len));
+/**
+ * Streams the response of a coalesced fetch led by another request.
+ * @param sent set once any part of the body went out to the client
+ */
+static esp_err_t nixbadge_http_follow(nixbadge_http_fetch_t* fetch,
+                                      nixbadge_flight_reader_t* reader,
+                                      bool* sent) {
+  nixbadge_proxy_req_t* req = fetch->req;
 
-  uint32_t cache_priority;
-  ESP_ERROR_CHECK(
-      nvs_get_u32(flashcfg_handle, "cache_priority", &cache_priority));
+  int status_code = nixbadge_flight_wait_start(reader, FLIGHT_TIMEOUT_MS);
+  if (status_code < 0) return ESP_FAIL;
 
-  char* value;
-  int len = asprintf(&value, "StoreDir: %s\nWantMassQuery: 1\nPriority: %lu\n",
-                     cache_store, cache_priority);
+  fetch->status_code = status_code;
+  if (status_code != 200) {
+    snprintf(fetch->status, sizeof(fetch->status), "%d %s", status_code,
+             nixbadge_http_reason(status_code));
+    nixbadge_proxy_resp_set_status(req, fetch->status);
+  }
 
-  httpd_resp_set_hdr(req, "Content-Type", "text/x-nix-cache-info");
-  esp_err_t err = httpd_resp_send(req, value, len);
+  char* buff = malloc(CACHE_CHUNK_SIZE);
+  if (!buff) return ESP_ERR_NO_MEM;
 
-  nvs_close(flashcfg_handle);
-  free(value);
+  ESP_LOGI(TAG, "Following the upstream fetch of %s", fetch->uri);
+  esp_err_t err =
+      nixbadge_http_relay(fetch, reader, buff, HTTP_SOURCE_FLIGHT, sent);
+  free(buff);
   return err;
 }
 
-static esp_err_t narinfo_get_handler(httpd_req_t* req) {
-  char* cache_host = get_cache_host();
+/**
+ * Asks for the part of the body still missing when resuming, or for the
+ * range the client asked for otherwise.
+ */
+static esp_err_t nixbadge_http_set_range(nixbadge_http_fetch_t* fetch,
+                                         esp_http_client_handle_t client) {
+  if (!fetch->resuming) {
+    if (!fetch->range[0]) return ESP_OK;
+
+    esp_err_t err = esp_http_client_set_header(client, "Range", fetch->range);
+    if (err == ESP_OK && fetch->if_range[0]) {
+      err = esp_http_client_set_header(client, "If-Range", fetch->if_range);
+    }
+    return err;
+  }
+
+  char range[RANGE_HEADER_MAX];
+  uint64_t start = fetch->body_start + fetch->delivered;
+  if (fetch->body_end < 0) {
+    snprintf(range, sizeof(range), "bytes=%llu-", start);
+  } else {
+    snprintf(range, sizeof(range), "bytes=%llu-%lld", start, fetch->body_end);
+  }
+
+  esp_err_t err = esp_http_client_set_header(client, "Range", range);
+  if (err != ESP_OK) return err;
+
+  // Make sure the rest comes from the same version of the body.
+  if (fetch->etag[0] && strncmp(fetch->etag, "W/", 2) != 0) {
+    err = esp_http_client_set_header(client, "If-Range", fetch->etag);
+  } else if (fetch->last_modified[0]) {
+    err = esp_http_client_set_header(client, "If-Range", fetch->last_modified);
+  }
+  return err;
+}
+
+/**
+ * Whether an interrupted transfer can be picked up where it stopped: the
+ * client already has part of a successful response and the upstream has
+ * not refused to resume before.
+ */
+static bool nixbadge_http_can_resume(nixbadge_http_fetch_t* fetch) {
+  if (!fetch->resumable || !fetch->responding || fetch->finished) return false;
+  if (!nixbadge_http_wanted(fetch)) return false;
+  if (fetch->status_code != 200 && fetch->status_code != 206) return false;
+  if (fetch->resume_checked && !fetch->resume_valid) return false;
+  return fetch->body_end < 0 ||
+         fetch->body_start + fetch->delivered <= (uint64_t)fetch->body_end;
+}
+
+/**
+ * Streams a response from upstream, failing over to the next upstream when
+ * one does not answer at all and resuming when one drops mid-body.
+ * @param key cache key of the request, used to find where its narinfo came
+ *        from
+ */
+static esp_err_t nixbadge_http_fetch(nixbadge_http_fetch_t* fetch,
+                                     nixbadge_upstream_set_t* set, bool https,
+                                     const char* key) {
+  const char* uri = fetch->uri;
+
+  size_t order[NIXBADGE_UPSTREAM_MAX] = {0};
+  size_t candidates = 1;
+  if (set) {
+    int routed = nixbadge_upstream_set_lookup_route(set, key);
+    candidates = nixbadge_upstream_set_order(set, routed,
+                                             nixbadge_http_now_ms(), order);
+  }
+
+  char gateway[16];
+  size_t candidate = 0;
+  nixbadge_upstream_target_t target;
+  nixbadge_http_target(set, order[candidate], https, fetch->config, gateway,
+                       &target);
+
+  esp_err_t err = ESP_ERR_NO_MEM;
+  bool retried = false;
+  int resumes = 0;
+  while (true) {
+    nixbadge_upstream_conn_t* conn =
+        nixbadge_upstream_pool_borrow(&target, http_client_get_serve, fetch);
+    if (!conn) {
+      err = ESP_ERR_NO_MEM;
+      break;
+    }
+
+    fetch->started_ms = nixbadge_http_now_ms();
+    esp_http_client_handle_t client = nixbadge_upstream_conn_client(conn);
+    esp_http_client_set_url(client, uri);
+    err = nixbadge_http_set_range(fetch, client);
+    if (err == ESP_OK && fetch->prefetch) {
+      err = esp_http_client_set_header(client, PREFETCH_HEADER, "1");
+    }
+    if (err == ESP_OK) err = esp_http_client_perform(client);
+    if (err == ESP_OK && !fetch->finished) err = ESP_FAIL;
+    int status_code = esp_http_client_get_status_code(client);
+    esp_http_client_delete_header(client, "Range");
+    esp_http_client_delete_header(client, "If-Range");
+    esp_http_client_delete_header(client, PREFETCH_HEADER);
+    if (fetch->received) {
+      nixbadge_histogram_observe(&http_metrics.upstream_ttfb,
+                                 fetch->received_ms - fetch->started_ms);
+    }
+
+    // A kept-alive connection may have been closed by the upstream while it
+    // sat in the pool; that is only safe to retry if nothing came back.
+    bool stale = err != ESP_OK && !fetch->received &&
+                 nixbadge_upstream_conn_reused(conn);
+    nixbadge_upstream_pool_return(conn, err == ESP_OK);
+
+    if (set && !stale) {
+      nixbadge_upstream_set_report(
+          set, order[candidate], fetch->received && status_code < 500,
+          fetch->received_ms - fetch->started_ms, nixbadge_http_now_ms());
+    }
+    if (err == ESP_OK) break;
+
+    if (stale && !retried) {
+      retried = true;
+      ESP_LOGI(TAG, "Retrying %s on a fresh connection", uri);
+    } else if (!fetch->responding && candidate + 1 < candidates) {
+      nixbadge_http_target(set, order[++candidate], https, fetch->config,
+                           gateway, &target);
+      retried = false;
+      ESP_LOGW(TAG, "Failing over to %s for %s", target.host, uri);
+    } else if (nixbadge_http_can_resume(fetch) &&
+               resumes++ < CONFIG_BADGE_HTTP_RESUME_ATTEMPTS) {
+      ESP_LOGW(TAG, "Resuming %s at byte %llu", uri,
+               fetch->body_start + fetch->delivered);
+      fetch->resuming = true;
+      fetch->resume_checked = false;
+    } else {
+      break;
+    }
+    fetch->received = false;
+  }
+
+  return err;
+}
+
+/**
+ * Tries to stream a NAR from the nearest peers that have it in their cache.
+ * @return ESP_ERR_NOT_FOUND when the rest has to come from elsewhere, which
+ *         includes resuming a body a peer stopped sending midway
+ */
+static esp_err_t nixbadge_http_fetch_peers(nixbadge_http_fetch_t* fetch,
+                                           const char* key) {
+  const char* uri = fetch->uri;
+
+  uint32_t ips[PEER_CANDIDATES];
+  size_t count = nixbadge_p2p_lookup(key, ips, PEER_CANDIDATES);
+  for (size_t i = 0; i < count; i++) {
+    char host[16];
+    esp_ip4_addr_t addr = {.addr = ips[i]};
+    snprintf(host, sizeof(host), IPSTR, IP2STR(&addr));
+    nixbadge_upstream_target_t target = {
+        .host = host,
+        .port = 1008,
+        .oneshot = true,
+    };
+
+    nixbadge_upstream_conn_t* conn =
+        nixbadge_upstream_pool_borrow(&target, http_client_get_serve, fetch);
+    if (!conn) return ESP_ERR_NO_MEM;
+
+    ESP_LOGI(TAG, "Asking peer %s for %s", host, uri);
+    fetch->probing = true;
+    fetch->received = false;
+    fetch->content_range[0] = 0;
+    fetch->etag[0] = 0;
+    fetch->last_modified[0] = 0;
+    esp_http_client_handle_t client = nixbadge_upstream_conn_client(conn);
+    esp_http_client_set_url(client, uri);
+    esp_http_client_set_timeout_ms(client, PEER_TIMEOUT_MS);
+    fetch->started_ms = nixbadge_http_now_ms();
+    esp_err_t err = esp_http_client_set_header(client, LOCAL_ONLY_HEADER, "1");
+    if (err == ESP_OK) err = nixbadge_http_set_range(fetch, client);
+    if (err == ESP_OK) err = esp_http_client_perform(client);
+    nixbadge_upstream_pool_return(conn, err == ESP_OK);
+    fetch->probing = false;
+
+    if (fetch->finished) return ESP_OK;
+    if (fetch->responding) {
+      nixbadge_p2p_failed(ips[i]);
+      if (!nixbadge_http_can_resume(fetch)) return ESP_FAIL;
+
+      ESP_LOGW(TAG, "Peer %s stopped sending %s at byte %llu", host, uri,
+               fetch->body_start + fetch->delivered);
+      fetch->resuming = true;
+      fetch->resume_checked = false;
+      break;
+    }
+    // Anything but no answer at all is just a false positive.
+    if (!fetch->received) nixbadge_p2p_failed(ips[i]);
+  }
+
+  fetch->received = false;
+  return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * A narinfo lookup sent to several upstreams, shared between the request
+ * and the workers doing the attempts. The first 200 wins, and its body is
+ * copied out of the worker's buffer.
+ */
+typedef struct {
+  SemaphoreHandle_t lock;
+  /* Given once by every attempt that is done. */
+  SemaphoreHandle_t done;
+  int refs;
+
+  nixbadge_upstream_set_t* set;
+  char* uri;
+  bool https;
+  const nixbadge_config_t* config;
+
+  int winner;
+  char* body;
+  size_t body_len;
+  bool not_found;
+  bool too_large;
+} nixbadge_http_hedge_t;
+
+/* Queued for the attempt workers, which fill in the rest. */
+typedef struct {
+  nixbadge_http_hedge_t* hedge;
+  size_t upstream;
+
+  /* The worker's own, HEDGE_BODY_MAX long. */
+  char* body;
+  size_t body_len;
+  bool overflow;
+  int64_t started_ms;
+  bool received;
+  int64_t received_ms;
+} nixbadge_http_attempt_t;
+
+static void nixbadge_http_hedge_unref(nixbadge_http_hedge_t* hedge) {
+  xSemaphoreTake(hedge->lock, portMAX_DELAY);
+  int refs = --hedge->refs;
+  xSemaphoreGive(hedge->lock);
+  if (refs > 0) return;
+
+  vSemaphoreDelete(hedge->lock);
+  vSemaphoreDelete(hedge->done);
+  nixbadge_upstream_set_unref(hedge->set);
+  nixbadge_config_unref(hedge->config);
+  free(hedge->uri);
+  free(hedge->body);
+  free(hedge);
+}
+
+static esp_err_t nixbadge_http_attempt_event(esp_http_client_event_t* evt) {
+  nixbadge_http_attempt_t* attempt = evt->user_data;
+  switch (evt->event_id) {
+    case HTTP_EVENT_ON_CONNECTED:
+      nixbadge_histogram_observe(&http_metrics.upstream_connect,
+                                 nixbadge_http_now_ms() - attempt->started_ms);
+      break;
+    case HTTP_EVENT_ON_HEADER:
+    case HTTP_EVENT_ON_DATA:
+      if (!attempt->received) attempt->received_ms = nixbadge_http_now_ms();
+      attempt->received = true;
+      if (evt->event_id != HTTP_EVENT_ON_DATA || attempt->overflow) break;
+
+      if (attempt->body_len + evt->data_len > HEDGE_BODY_MAX) {
+        attempt->overflow = true;
+        break;
+      }
+      memcpy(attempt->body + attempt->body_len, evt->data, evt->data_len);
+      attempt->body_len += evt->data_len;
+      break;
+    default:
+      break;
+  }
+  return ESP_OK;
+}
+
+/**
+ * Sends one attempt of a hedged lookup, unless another one has won
+ * already while it waited for a worker.
+ */
+static void nixbadge_http_attempt(nixbadge_http_attempt_t* attempt) {
+  nixbadge_http_hedge_t* hedge = attempt->hedge;
+  xSemaphoreTake(hedge->lock, portMAX_DELAY);
+  bool won = hedge->winner >= 0;
+  xSemaphoreGive(hedge->lock);
+  if (won) {
+    xSemaphoreGive(hedge->done);
+    nixbadge_http_hedge_unref(hedge);
+    return;
+  }
+
+  nixbadge_upstream_target_t target = {
+      .https = hedge->https,
+      .config = hedge->config,
+  };
+  target.host =
+      nixbadge_upstream_set_host(hedge->set, attempt->upstream, &target.port);
+
+  esp_err_t err = ESP_ERR_NO_MEM;
+  int status_code = 0;
+  int64_t started = nixbadge_http_now_ms();
+  for (int i = 0; i < 2; i++) {
+    nixbadge_upstream_conn_t* conn = nixbadge_upstream_pool_borrow(
+        &target, nixbadge_http_attempt_event, attempt);
+    if (!conn) break;
+
+    esp_http_client_handle_t client = nixbadge_upstream_conn_client(conn);
+    esp_http_client_set_url(client, hedge->uri);
+    esp_http_client_set_timeout_ms(client, HEDGE_ATTEMPT_TIMEOUT_MS);
+    attempt->started_ms = nixbadge_http_now_ms();
+    err = esp_http_client_perform(client);
+    status_code = esp_http_client_get_status_code(client);
+
+    bool stale = err != ESP_OK && !attempt->received &&
+                 nixbadge_upstream_conn_reused(conn);
+    nixbadge_upstream_pool_return(conn, err == ESP_OK);
+    if (!stale) break;
+  }
 
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
+  if (attempt->received) {
+    nixbadge_histogram_observe(&http_metrics.upstream_ttfb,
+                               attempt->received_ms - attempt->started_ms);
+  }
+  bool answered = err == ESP_OK && (status_code == 200 || status_code == 404);
+  nixbadge_upstream_set_report(hedge->set, attempt->upstream, answered,
+                               attempt->received_ms - started,
+                               nixbadge_http_now_ms());
 
-  ESP_LOGI(TAG, "Querying %s on level %d", req->uri, esp_mesh_lite_get_level());
+  xSemaphoreTake(hedge->lock, portMAX_DELAY);
+  if (answered && status_code == 404) {
+    hedge->not_found = true;
+  } else if (answered && attempt->overflow) {
+    hedge->too_large = true;
+  } else if (answered && hedge->winner < 0) {
+    hedge->body = malloc(attempt->body_len ? attempt->body_len : 1);
+    if (hedge->body) {
+      memcpy(hedge->body, attempt->body, attempt->body_len);
+      hedge->body_len = attempt->body_len;
+      hedge->winner = attempt->upstream;
+    }
+  }
+  xSemaphoreGive(hedge->lock);
+  xSemaphoreGive(hedge->done);
+  nixbadge_http_hedge_unref(hedge);
+}
+
+/**
+ * Takes attempts off the queue one after the other, into the body buffer
+ * it was given at boot.
+ */
+static void nixbadge_http_attempt_task(void* arg) {
+  char* body = arg;
+  while (true) {
+    nixbadge_http_attempt_t attempt;
+    if (!xQueueReceive(hedge_attempts, &attempt, portMAX_DELAY)) continue;
+    attempt.body = body;
+    nixbadge_http_attempt(&attempt);
+  }
+}
 
-  esp_http_client_config_t config = {
-      .host = cache_host,
-      .path = req->uri,
-      .event_handler = http_client_get_serve,
-      .user_data = req,
-      .buffer_size = 16 * 1024,
-      .is_async = false,
-      .timeout_ms = 3000000,
+static bool nixbadge_http_hedge_launch(nixbadge_http_hedge_t* hedge,
+                                       size_t upstream) {
+  nixbadge_http_attempt_t attempt = {
+      .hedge = hedge,
+      .upstream = upstream,
   };
 
-  uint8_t cache_use_https = 0;
-  ESP_ERROR_CHECK(
-      nvs_get_u8(flashcfg_handle, "cache_use_https", &cache_use_https));
+  xSemaphoreTake(hedge->lock, portMAX_DELAY);
+  hedge->refs++;
+  xSemaphoreGive(hedge->lock);
+
+  if (!xQueueSend(hedge_attempts, &attempt, 0)) {
+    nixbadge_http_hedge_unref(hedge);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Remembers which upstream the NAR of a narinfo should come from, going by
+ * its "URL: nar/..." line.
+ */
+static void nixbadge_http_route_narinfo(nixbadge_upstream_set_t* set,
+                                        const char* body, size_t len,
+                                        size_t upstream) {
+  const char* end = body + len;
+  for (const char* line = body; line < end;) {
+    const char* eol = memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+
+    if (eol - line > 5 && memcmp(line, "URL: ", 5) == 0) {
+      char url[NIXBADGE_CACHE_KEY_MAX + 8];
+      size_t url_len = eol - line - 5;
+      if (url_len >= sizeof(url)) return;
+      memcpy(url, line + 5, url_len);
+      url[url_len] = 0;
+
+      char key[NIXBADGE_CACHE_KEY_MAX + 1];
+      if (nixbadge_http_cache_key(url, key, sizeof(key))) {
+        nixbadge_upstream_set_route(set, key, upstream);
+      }
+      return;
+    }
+    line = eol + 1;
+  }
+}
+
+/**
+ * Looks a narinfo up on the upstreams in order, asking the next one
+ * whenever the current one takes longer than it usually does or fails, and
+ * answers with the first one found.
+ * @return ESP_ERR_INVALID_SIZE when the narinfo is too large to hold, so
+ *         it should be streamed instead
+ */
+static esp_err_t nixbadge_http_hedge(nixbadge_http_fetch_t* fetch,
+                                     nixbadge_upstream_set_t* set,
+                                     bool https) {
+  nixbadge_http_hedge_t* hedge = calloc(1, sizeof(*hedge));
+  if (!hedge) return ESP_ERR_NO_MEM;
+  hedge->lock = xSemaphoreCreateMutex();
+  hedge->done = xSemaphoreCreateCounting(NIXBADGE_UPSTREAM_MAX, 0);
+  hedge->uri = strdup(fetch->uri);
+  hedge->set = nixbadge_upstream_set_ref(set);
+  hedge->https = https;
+  hedge->winner = -1;
+  hedge->refs = 1;
+  if (!hedge->lock || !hedge->done || !hedge->uri) {
+    if (hedge->lock) vSemaphoreDelete(hedge->lock);
+    if (hedge->done) vSemaphoreDelete(hedge->done);
+    nixbadge_upstream_set_unref(hedge->set);
+    free(hedge->uri);
+    free(hedge);
+    return ESP_ERR_NO_MEM;
+  }
+  hedge->config = nixbadge_config_ref(fetch->config);
+
+  size_t order[NIXBADGE_UPSTREAM_MAX];
+  size_t count =
+      nixbadge_upstream_set_order(set, -1, nixbadge_http_now_ms(), order);
+  int64_t deadline = nixbadge_http_now_ms() + FLIGHT_TIMEOUT_MS;
+  size_t launched = 0;
+  size_t finished = 0;
+
+  while (true) {
+    xSemaphoreTake(hedge->lock, portMAX_DELAY);
+    bool won = hedge->winner >= 0;
+    xSemaphoreGive(hedge->lock);
+    if (won) break;
+
+    int64_t now = nixbadge_http_now_ms();
+    if (finished == launched) {
+      // Nothing in flight: move on to the next upstream right away.
+      if (launched == count || now >= deadline) break;
+      if (!nixbadge_http_hedge_launch(hedge, order[launched++])) finished++;
+      continue;
+    }
+
+    int64_t wait = deadline - now;
+    if (launched < count) {
+      uint32_t delay =
+          nixbadge_upstream_set_hedge_delay(set, order[launched - 1]);
+      if (delay < wait) wait = delay;
+    }
+
+    if (xSemaphoreTake(hedge->done, pdMS_TO_TICKS(wait > 0 ? wait : 0))) {
+      finished++;
+    } else if (nixbadge_http_now_ms() >= deadline) {
+      break;
+    } else if (launched < count) {
+      int port;
+      ESP_LOGI(TAG, "Hedging %s to %s", hedge->uri,
+               nixbadge_upstream_set_host(set, order[launched], &port));
+      nixbadge_upstream_set_count_hedge(set, order[launched]);
+      if (!nixbadge_http_hedge_launch(hedge, order[launched++])) finished++;
+    }
+  }
+
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(hedge->lock, portMAX_DELAY);
+  if (hedge->winner >= 0) {
+    nixbadge_http_respond(fetch, 200, hedge->body_len);
+    err = nixbadge_http_deliver(fetch, hedge->body, hedge->body_len);
+    nixbadge_http_route_narinfo(set, hedge->body, hedge->body_len,
+                                hedge->winner);
+  } else if (hedge->not_found) {
+    nixbadge_http_respond(fetch, 404, 0);
+  } else if (hedge->too_large) {
+    err = ESP_ERR_INVALID_SIZE;
+  } else {
+    ESP_LOGW(TAG, "No upstream answered for %s", hedge->uri);
+    err = ESP_FAIL;
+  }
+  xSemaphoreGive(hedge->lock);
+
+  if (err == ESP_OK) nixbadge_http_complete(fetch);
+  nixbadge_http_hedge_unref(hedge);
+  return err;
+}
 
-  if (cache_use_https && esp_mesh_lite_get_level() == ROOT) {
-    config.transport_type = HTTP_TRANSPORT_OVER_SSL;
+/**
+ * Gets the response from wherever it is to be had: the upstreams all at
+ * once for narinfos, otherwise a peer that has it, then the upstream or
+ * parent.
+ */
+static esp_err_t nixbadge_http_produce(nixbadge_http_fetch_t* fetch,
+                                       nixbadge_upstream_set_t* set,
+                                       bool https, const char* key) {
+  esp_err_t err = ESP_ERR_INVALID_SIZE;
+  if (set && fetch->hedged) err = nixbadge_http_hedge(fetch, set, https);
+  if (!fetch->hedged && key[0] && nixbadge_has_mesh()) {
+    err = nixbadge_http_fetch_peers(fetch, key);
+    if (err == ESP_ERR_NOT_FOUND) err = ESP_ERR_INVALID_SIZE;
+  }
+  // Also taken when a hedged body did not fit, to stream it instead, and
+  // when no peer had it.
+  if (err == ESP_ERR_INVALID_SIZE) {
+    err = nixbadge_http_fetch(fetch, set, https, key);
+  }
+  return err;
+}
 
-    size_t cache_cert_len;
+/**
+ * Answers a narinfo from memory, if it is in `store`.
+ * @return ESP_ERR_NOT_FOUND if it is not
+ */
+static esp_err_t nixbadge_http_serve_narinfo(nixbadge_http_fetch_t* fetch,
+                                             nixbadge_narinfo_cache_t* store,
+                                             const char* key,
+                                             const char* content_type) {
+  nixbadge_proxy_req_t* req = fetch->req;
+  switch (nixbadge_narinfo_cache_lookup(store, key, nixbadge_http_now_ms(),
+                                        fetch->capture, &fetch->capture_len)) {
+    case NIXBADGE_NARINFO_HIT:
+      if (prefetcher) nixbadge_prefetch_used(prefetcher, key);
+      nixbadge_counter64_add(&http_metrics.sent_bytes[HTTP_SOURCE_CACHE],
+                             fetch->capture_len);
+      nixbadge_proxy_resp_set_hdr(req, "Content-Type", content_type);
+      return nixbadge_http_result(
+          nixbadge_proxy_resp_send(req, fetch->capture, fetch->capture_len));
+    case NIXBADGE_NARINFO_NEGATIVE:
+      if (prefetcher) nixbadge_prefetch_used(prefetcher, key);
+      return nixbadge_http_send_404(req);
+    default:
+      fetch->capture_len = 0;
+      return ESP_ERR_NOT_FOUND;
+  }
+}
+
+/**
+ * Answers from what the badge has at hand: the narinfo cache, prefetched
+ * narinfos, the NAR cache, or a 404 for peers, which only ask for what they
+ * think we have so that they never wait on our upstream for it.
+ * @param local on the proxy task, which leaves NARs to the workers
+ * @return ESP_ERR_NOT_FOUND when it has to be fetched
+ */
+static esp_err_t nixbadge_http_serve_local(nixbadge_http_fetch_t* fetch,
+                                           const char* key,
+                                           const char* content_type,
+                                           bool local) {
+  nixbadge_proxy_req_t* req = fetch->req;
+
+  if (fetch->capture) {
     esp_err_t err =
-        nvs_get_str(flashcfg_handle, "cache_cert", NULL, &cache_cert_len);
-    if (err != ESP_ERR_NVS_NOT_FOUND) {
-      ESP_ERROR_CHECK(err);
+        nixbadge_http_serve_narinfo(fetch, narinfo_cache, key, content_type);
+    if (err == ESP_ERR_NOT_FOUND && prefetch_store) {
+      err = nixbadge_http_serve_narinfo(fetch, prefetch_store, key,
+                                        content_type);
+    }
+    if (err != ESP_ERR_NOT_FOUND) return err;
+  }
 
-      char* cache_cert = malloc(cache_cert_len + 1);
+  // Storage may block, so NARs are only looked up on the workers.
+  if (local && fetch->nar) return ESP_ERR_NOT_FOUND;
 
-      ESP_ERROR_CHECK(nvs_get_str(flashcfg_handle, "cache_cert", cache_cert,
-                                  &cache_cert_len));
-      cache_cert[cache_cert_len] = 0;
+  nixbadge_cache_t* cache = nixbadge_storage_nar_cache();
+  nixbadge_cache_reader_t reader;
+  if (fetch->nar && cache && key[0] &&
+      nixbadge_cache_open(cache, key, &reader) == 0) {
+    if (prefetcher) nixbadge_prefetch_used(prefetcher, key);
+    nixbadge_proxy_resp_set_hdr(req, "Content-Type", content_type);
+    return nixbadge_http_serve_cached(fetch, &reader);
+  }
 
-      config.cert_pem = cache_cert;
-      config.cert_len = cache_cert_len;
-    } else {
-      config.use_global_ca_store = true;
+  char value[2];
+  if (nixbadge_proxy_req_get_hdr(req, LOCAL_ONLY_HEADER, value,
+                                 sizeof(value)) != -ENOENT) {
+    fetch->status_code = 404;
+    return nixbadge_http_send_404(req);
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * Fetches a response for the client, or for the caches alone when
+ * prefetching.
+ * @return ESP_ERR_INVALID_STATE for a prefetch that is already being
+ *         fetched
+ */
+static esp_err_t nixbadge_http_proxy(nixbadge_http_fetch_t* fetch,
+                                     const char* key,
+                                     const char* content_type) {
+  nixbadge_proxy_req_t* req = fetch->req;
+  const char* uri = fetch->uri;
+  if (req) nixbadge_proxy_resp_set_hdr(req, "Content-Type", content_type);
+
+  nixbadge_cache_t* cache = nixbadge_storage_nar_cache();
+  bool cacheable = fetch->nar && cache && key[0];
+
+  // Partial responses are neither shared nor cached.
+  bool ranged = fetch->range[0] != 0;
+  nixbadge_flight_t* flight = NULL;
+  if (!ranged) {
+    bool leader = false;
+    flight = nixbadge_flight_join(flights, uri, &leader, &fetch->reader);
+    if (flight && !leader && !req) {
+      nixbadge_flight_leave(&fetch->reader);
+      return ESP_ERR_INVALID_STATE;
+    }
+    if (flight && !leader) {
+      bool sent = false;
+      esp_err_t err = nixbadge_http_follow(fetch, &fetch->reader, &sent);
+      nixbadge_flight_leave(&fetch->reader);
+      if (err == ESP_OK || sent) return err;
+
+      // The leader failed before we sent anything, try on our own.
+      flight = NULL;
     }
-  } else if (esp_mesh_lite_get_level() != ROOT) {
-    config.port = 1008;
   }
+  fetch->flight = flight;
 
-  httpd_resp_set_hdr(req, "Content-Type", "text/x-nix-narinfo");
+  if (flight) {
+    // A prefetch has nobody to read the flight, only the cache.
+    if (req) fetch->pump = malloc(CACHE_CHUNK_SIZE);
+    if (!req || !fetch->pump) nixbadge_flight_leave(&fetch->reader);
+    if (req && !fetch->pump) {
+      nixbadge_flight_finish(flight, false);
+      return ESP_ERR_NO_MEM;
+    }
+    if (cacheable) nixbadge_flight_cache(flight, cache, key);
+  } else if (cacheable && !ranged) {
+    fetch->caching = nixbadge_cache_begin(cache, key, &fetch->writer) == 0;
+  }
+
+  const nixbadge_config_t* config = nixbadge_config_get();
+  fetch->config = config;
+  bool root = esp_mesh_lite_get_level() == ROOT;
+  bool https = config->cache_use_https && root;
+  nixbadge_upstream_set_t* set = NULL;
+  if (root || config->cache_p2p) {
+    set = nixbadge_http_upstreams(config);
+    if (!set) ESP_LOGW(TAG, "No usable upstream in %s", config->cache_upstream);
+  }
+
+  ESP_LOGI(TAG, "Querying %s on level %d", uri, esp_mesh_lite_get_level());
+
+  esp_err_t err = nixbadge_http_produce(fetch, set, https, key);
+  nixbadge_upstream_set_unref(set);
+  nixbadge_config_unref(config);
+  fetch->config = NULL;
+  if (err == ESP_OK && !fetch->finished) err = ESP_FAIL;
+
+  if (flight) {
+    int stored = nixbadge_flight_finish(flight, err == ESP_OK);
+    if (stored < 0) {
+      ESP_LOGW(TAG, "Failed to store %s in the cache: %d", uri, stored);
+    }
+    fetch->flight = NULL;
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_err_t err = esp_http_client_perform(client);
+    // The client reads the rest like any follower, unless it went away.
+    if (fetch->reader.flight) {
+      bool sent = false;
+      if (err == ESP_OK) {
+        err = nixbadge_http_relay(fetch, &fetch->reader, fetch->pump,
+                                  HTTP_SOURCE_UPSTREAM, &sent);
+      }
+      nixbadge_flight_leave(&fetch->reader);
+    } else if (fetch->abandoned) {
+      err = ESP_FAIL;
+    }
+    free(fetch->pump);
+    return err;
+  }
 
-  free(cache_host);
-  nvs_close(flashcfg_handle);
+  if (err == ESP_OK) {
+    nixbadge_http_cache_finish(fetch);
+    if (req) {
+      err = nixbadge_http_result(nixbadge_proxy_resp_send_chunk(req, NULL, 0));
+    }
+  }
 
-  if (config.cert_pem) free((void*)config.cert_pem);
-  esp_http_client_cleanup(client);
+  // Anything not committed by now is an incomplete transfer.
+  if (fetch->caching) nixbadge_cache_abort(&fetch->writer);
   return err;
 }
 
-static esp_err_t nar_get_handler(httpd_req_t* req) {
-  char* cache_host = get_cache_host();
+/**
+ * Whether a request is a prefetch of a child badge. Those are passed on as
+ * prefetches and don't start prefetches of their own, the child does.
+ */
+static bool nixbadge_http_is_prefetch(nixbadge_proxy_req_t* req) {
+  char value[2];
+  return nixbadge_proxy_req_get_hdr(req, PREFETCH_HEADER, value,
+                                    sizeof(value)) != -ENOENT;
+}
 
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
+static esp_err_t narinfo_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  nixbadge_http_fetch_t fetch = {
+      .req = req,
+      .uri = nixbadge_proxy_req_uri(req),
+      .prefetch = nixbadge_http_is_prefetch(req),
+      .hedged = true,
+  };
+
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  if (!nixbadge_http_cache_key(nixbadge_proxy_req_uri(req), key,
+                               sizeof(key))) {
+    key[0] = 0;
+  }
+
+  if (narinfo_cache && key[0]) {
+    fetch.capture_size = nixbadge_narinfo_cache_slot_size(narinfo_cache);
+    fetch.capture = malloc(fetch.capture_size);
+    if (!fetch.capture) return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t err =
+      nixbadge_http_serve_local(&fetch, key, "text/x-nix-narinfo", local);
+  if (err == ESP_ERR_NOT_FOUND && !local) {
+    err = nixbadge_http_proxy(&fetch, key, "text/x-nix-narinfo");
+    if (err == ESP_OK && fetch.capture) {
+      if (fetch.status_code == 200 && !fetch.capture_overflow) {
+        nixbadge_narinfo_cache_insert(narinfo_cache, key, fetch.capture,
+                                      fetch.capture_len,
+                                      nixbadge_http_now_ms());
+        if (prefetcher && !fetch.prefetch) {
+          nixbadge_prefetch_narinfo(prefetcher, key, fetch.capture,
+                                    fetch.capture_len, 0);
+        }
+      } else if (fetch.status_code == 404) {
+        nixbadge_narinfo_cache_insert_negative(narinfo_cache, key,
+                                               nixbadge_http_now_ms());
+      }
+    }
+  }
 
-  ESP_LOGI(TAG, "Querying %s on level %d", req->uri, esp_mesh_lite_get_level());
+  free(fetch.capture);
+  return err;
+}
 
-  esp_http_client_config_t config = {
-      .host = cache_host,
-      .path = req->uri,
-      .buffer_size = 64 * 1024,
-      .event_handler = http_client_get_serve,
-      .user_data = req,
-      .is_async = false,
-      .timeout_ms = 3000000,
+static esp_err_t nar_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  nixbadge_http_fetch_t fetch = {
+      .req = req,
+      .uri = nixbadge_proxy_req_uri(req),
+      .nar = true,
+      .prefetch = nixbadge_http_is_prefetch(req),
+      .throttled = !local,
+      .resumable = true,
   };
 
-  uint8_t cache_use_https = 0;
-  ESP_ERROR_CHECK(
-      nvs_get_u8(flashcfg_handle, "cache_use_https", &cache_use_https));
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  if (!nixbadge_http_cache_key(nixbadge_proxy_req_uri(req), key,
+                               sizeof(key))) {
+    key[0] = 0;
+  }
 
-  if (cache_use_https && esp_mesh_lite_get_level() == ROOT) {
-    config.transport_type = HTTP_TRANSPORT_OVER_SSL;
+  // Too long or malformed ones are ignored, which means a full response.
+  if (nixbadge_proxy_req_get_hdr(req, "Range", fetch.range,
+                                 sizeof(fetch.range)) == 0) {
+    int64_t first, last;
+    if (!nixbadge_http_parse_range(fetch.range, &first, &last)) {
+      fetch.range[0] = 0;
+    } else if (nixbadge_proxy_req_get_hdr(req, "If-Range", fetch.if_range,
+                                          sizeof(fetch.if_range)) != 0) {
+      fetch.if_range[0] = 0;
+    }
+  } else {
+    fetch.range[0] = 0;
+  }
 
-    size_t cache_cert_len;
-    esp_err_t err =
-        nvs_get_str(flashcfg_handle, "cache_cert", NULL, &cache_cert_len);
-    if (err != ESP_ERR_NVS_NOT_FOUND) {
-      ESP_ERROR_CHECK(err);
+  esp_err_t err =
+      nixbadge_http_serve_local(&fetch, key, "application/x-nix-nar", local);
+  if (err == ESP_ERR_NOT_FOUND && !local) {
+    err = nixbadge_http_proxy(&fetch, key, "application/x-nix-nar");
+  }
+  return err;
+}
 
-      char* cache_cert = malloc(cache_cert_len + 1);
+/**
+ * Counts the requests queued for or running on a worker, which prefetching
+ * makes way for.
+ */
+static void nixbadge_http_foreground(int delta) {
+  if (prefetcher) nixbadge_prefetch_foreground(prefetcher, delta);
+}
 
-      ESP_ERROR_CHECK(nvs_get_str(flashcfg_handle, "cache_cert", cache_cert,
-                                  &cache_cert_len));
-      cache_cert[cache_cert_len] = 0;
+/**
+ * Counts a request as done.
+ */
+static void nixbadge_http_count(nixbadge_http_class_t cls, int64_t started_ms,
+                                esp_err_t err) {
+  if (err != ESP_OK) nixbadge_counter_add(&http_metrics.failed[cls], 1);
+  nixbadge_histogram_observe(&http_metrics.duration[cls],
+                             nixbadge_http_now_ms() - started_ms);
+}
 
-      config.cert_pem = cache_cert;
-      config.cert_len = cache_cert_len;
-    } else {
-      config.use_global_ca_store = true;
+static void nixbadge_http_worker(void* arg) {
+  nixbadge_sched_job_t next;
+  while (true) {
+    if (!nixbadge_sched_next(http_sched, &next, nixbadge_http_now_ms(),
+                             SCHED_WAIT_MS)) {
+      continue;
+    }
+
+    nixbadge_http_job_t* job = next.arg;
+    nixbadge_histogram_observe(&http_metrics.queued[next.lane],
+                               nixbadge_http_now_ms() - job->started_ms);
+    // An error drops the connection, the response may be cut short.
+    esp_err_t err = job->handler(job->req, false);
+    nixbadge_proxy_req_complete(job->req, err == ESP_OK);
+    nixbadge_sched_done(http_sched, &next);
+    nixbadge_http_foreground(-1);
+    nixbadge_http_count(job->cls, job->started_ms, err);
+    free(job);
+  }
+}
+
+/**
+ * Fetches a referenced narinfo or a NAR into the caches, unless it is at
+ * hand already. Prefetched narinfos go to the prefetch store and have their
+ * own references queued in turn.
+ * @param bytes set to what was fetched
+ */
+static nixbadge_prefetch_result_t nixbadge_http_prefetch(
+    const nixbadge_prefetch_item_t* item, uint64_t* bytes) {
+  *bytes = 0;
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  if (!nixbadge_http_cache_key(item->uri, key, sizeof(key))) {
+    return NIXBADGE_PREFETCH_FAILED;
+  }
+
+  // NARs are only worth fetching into the cache.
+  nixbadge_cache_t* cache = nixbadge_storage_nar_cache();
+  if (item->nar && (!cache || nixbadge_cache_contains(cache, key))) {
+    return NIXBADGE_PREFETCH_SKIPPED;
+  }
+
+  nixbadge_http_fetch_t fetch = {
+      .uri = item->uri,
+      .nar = item->nar,
+      .prefetch = true,
+      .hedged = !item->nar,
+  };
+  if (!item->nar) {
+    fetch.capture_size = nixbadge_narinfo_cache_slot_size(prefetch_store);
+    fetch.capture = malloc(fetch.capture_size);
+    if (!fetch.capture) return NIXBADGE_PREFETCH_FAILED;
+
+    if (nixbadge_narinfo_cache_lookup(
+            prefetch_store, key, nixbadge_http_now_ms(), fetch.capture,
+            &fetch.capture_len) != NIXBADGE_NARINFO_MISS) {
+      free(fetch.capture);
+      return NIXBADGE_PREFETCH_SKIPPED;
+    }
+    fetch.capture_len = 0;
+  }
+
+  ESP_LOGD(TAG, "Prefetching %s", item->uri);
+  esp_err_t err = nixbadge_http_proxy(&fetch, key, NULL);
+  *bytes = fetch.delivered;
+  if (err == ESP_OK && fetch.capture) {
+    if (fetch.status_code == 200 && !fetch.capture_overflow) {
+      nixbadge_narinfo_cache_insert(prefetch_store, key, fetch.capture,
+                                    fetch.capture_len, nixbadge_http_now_ms());
+      nixbadge_prefetch_narinfo(prefetcher, key, fetch.capture,
+                                fetch.capture_len, item->depth);
+    } else if (fetch.status_code == 404) {
+      nixbadge_narinfo_cache_insert_negative(prefetch_store, key,
+                                             nixbadge_http_now_ms());
+    }
+  }
+  free(fetch.capture);
+
+  if (err == ESP_ERR_INVALID_STATE) return NIXBADGE_PREFETCH_SKIPPED;
+  return err == ESP_OK ? NIXBADGE_PREFETCH_FETCHED : NIXBADGE_PREFETCH_FAILED;
+}
+
+/**
+ * Runs below the workers' priority, and the prefetcher only hands out
+ * items while they are not all busy.
+ */
+static void nixbadge_http_prefetch_task(void* arg) {
+  nixbadge_prefetch_item_t item;
+  while (true) {
+    if (!nixbadge_prefetch_next(prefetcher, &item, PREFETCH_WAIT_MS)) continue;
+
+    uint64_t bytes;
+    nixbadge_prefetch_result_t result = nixbadge_http_prefetch(&item, &bytes);
+    nixbadge_prefetch_done(prefetcher, &item, result, bytes);
+  }
+}
+
+static void nixbadge_http_write_requests(nixbadge_metrics_writer_t* writer) {
+  nixbadge_metrics_family(writer, "nixbadge_http_requests_total", "counter",
+                          "Requests received.");
+  for (int i = 0; i < HTTP_CLASSES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_http_requests_total",
+                            http_class_labels[i],
+                            nixbadge_counter_get(&http_metrics.requests[i]));
+  }
+  nixbadge_metrics_family(writer, "nixbadge_http_deferred_total", "counter",
+                          "Requests handed to a worker.");
+  for (int i = 0; i < HTTP_CLASSES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_http_deferred_total",
+                            http_class_labels[i],
+                            nixbadge_counter_get(&http_metrics.deferred[i]));
+  }
+  nixbadge_metrics_family(writer, "nixbadge_http_failed_total", "counter",
+                          "Requests that failed or were turned away.");
+  for (int i = 0; i < HTTP_CLASSES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_http_failed_total",
+                            http_class_labels[i],
+                            nixbadge_counter_get(&http_metrics.failed[i]));
+  }
+  nixbadge_metrics_family(writer, "nixbadge_http_request_duration_seconds",
+                          "histogram", "Time until a response was complete.");
+  for (int i = 0; i < HTTP_CLASSES; i++) {
+    nixbadge_metrics_histogram(writer, "nixbadge_http_request_duration_seconds",
+                               http_class_labels[i], &http_metrics.duration[i]);
+  }
+
+  nixbadge_metrics_family(writer, "nixbadge_http_sent_bytes_total", "counter",
+                          "Body bytes sent to clients.");
+  for (int i = 0; i < HTTP_SOURCES; i++) {
+    nixbadge_metrics_sample(
+        writer, "nixbadge_http_sent_bytes_total", http_source_labels[i],
+        nixbadge_counter64_get(&http_metrics.sent_bytes[i]));
+  }
+  nixbadge_metrics_value(
+      writer, "nixbadge_upstream_received_bytes_total", "counter",
+      "Body bytes received from upstreams, the parent and peers.",
+      nixbadge_counter64_get(&http_metrics.received_bytes));
+  nixbadge_metrics_family(writer, "nixbadge_upstream_connect_seconds",
+                          "histogram", "Time to connect to an upstream.");
+  nixbadge_metrics_histogram(writer, "nixbadge_upstream_connect_seconds", NULL,
+                             &http_metrics.upstream_connect);
+  nixbadge_metrics_family(writer, "nixbadge_upstream_ttfb_seconds",
+                          "histogram",
+                          "Time until an upstream started to respond.");
+  nixbadge_metrics_histogram(writer, "nixbadge_upstream_ttfb_seconds", NULL,
+                             &http_metrics.upstream_ttfb);
+}
+
+static void nixbadge_http_write_upstreams(nixbadge_metrics_writer_t* writer) {
+  nixbadge_upstream_pool_stats_t pool;
+  nixbadge_upstream_pool_get_stats(&pool);
+  nixbadge_metrics_value(writer, "nixbadge_upstream_pool_borrows_total",
+                         "counter", "Upstream connections borrowed.",
+                         pool.borrows);
+  nixbadge_metrics_value(writer, "nixbadge_upstream_pool_reuses_total",
+                         "counter", "Borrowed connections that were open.",
+                         pool.reuses);
+  nixbadge_metrics_value(writer, "nixbadge_upstream_pool_connects_total",
+                         "counter", "Upstream connections opened.",
+                         pool.connects);
+  nixbadge_metrics_value(writer, "nixbadge_upstream_pool_tls_reconnects_total",
+                         "counter",
+                         "HTTPS connections opened again, offering the "
+                         "session saved from the last one.",
+                         pool.tls_reconnects);
+
+  xSemaphoreTake(upstreams_lock, portMAX_DELAY);
+  nixbadge_upstream_set_t* set =
+      upstreams ? nixbadge_upstream_set_ref(upstreams) : NULL;
+  xSemaphoreGive(upstreams_lock);
+  if (!set) return;
+
+  // One pass per family, they must not be interleaved.
+  static const char* const families[][2] = {
+      {"nixbadge_upstream_up", "Whether an upstream is considered up."},
+      {"nixbadge_upstream_latency_milliseconds",
+       "Recent latency of an upstream."},
+      {"nixbadge_upstream_failures_total", "Requests an upstream failed."},
+  };
+  size_t count = nixbadge_upstream_set_count(set);
+  int64_t now = nixbadge_http_now_ms();
+  for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+    nixbadge_metrics_family(writer, families[f][0],
+                            f == 2 ? "counter" : "gauge", families[f][1]);
+    for (size_t i = 0; i < count; i++) {
+      int port;
+      char labels[NIXBADGE_UPSTREAM_HOST_MAX + 16];
+      snprintf(labels, sizeof(labels), "upstream=\"%s\"",
+               nixbadge_upstream_set_host(set, i, &port));
+      nixbadge_upstream_stats_t stats;
+      nixbadge_upstream_set_get_stats(set, i, now, &stats);
+      int64_t values[] = {!stats.down, stats.latency_ms, stats.failures};
+      nixbadge_metrics_sample(writer, families[f][0], labels, values[f]);
+    }
+  }
+  nixbadge_upstream_set_unref(set);
+}
+
+static void nixbadge_http_write_links(nixbadge_metrics_writer_t* writer) {
+  nixbadge_link_t links[NIXBADGE_MESH_LINKS];
+  size_t count = nixbadge_mesh_get_links(links, NIXBADGE_MESH_LINKS);
+
+  static const char* const families[][2] = {
+      {"nixbadge_mesh_link_rtt_microseconds",
+       "Smoothed round trip time of pings to a neighbouring badge."},
+      {"nixbadge_mesh_link_jitter_microseconds",
+       "Mean deviation of the round trip time."},
+      {"nixbadge_mesh_link_loss_permille", "Pings not answered."},
+      {"nixbadge_mesh_link_idle_seconds", "Time since the last answer."},
+      {"nixbadge_mesh_link_replies_total", "Pings answered."},
+  };
+  int64_t now = nixbadge_http_now_ms();
+  for (size_t f = 0; f < sizeof(families) / sizeof(families[0]); f++) {
+    nixbadge_metrics_family(writer, families[f][0],
+                            f == 4 ? "counter" : "gauge", families[f][1]);
+    for (size_t i = 0; i < count; i++) {
+      const nixbadge_link_t* link = &links[i];
+      char labels[32];
+      snprintf(labels, sizeof(labels),
+               "peer=\"%02x:%02x:%02x:%02x:%02x:%02x\"", link->addr[0],
+               link->addr[1], link->addr[2], link->addr[3], link->addr[4],
+               link->addr[5]);
+      int64_t values[] = {link->rtt_us, link->jitter_us, link->loss_permille,
+                          (now - link->last_seen_ms) / 1000, link->replies};
+      nixbadge_metrics_sample(writer, families[f][0], labels, values[f]);
     }
-  } else if (esp_mesh_lite_get_level() != ROOT) {
-    config.port = 1008;
   }
+}
+
+static void nixbadge_http_write_sched(nixbadge_metrics_writer_t* writer) {
+  nixbadge_sched_stats_t stats;
+  nixbadge_sched_get_stats(http_sched, &stats);
+  nixbadge_metrics_family(writer, "nixbadge_sched_waiting", "gauge",
+                          "Requests waiting for a worker.");
+  for (int i = 0; i < NIXBADGE_SCHED_LANES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_sched_waiting",
+                            http_lane_labels[i], stats.waiting[i]);
+  }
+  nixbadge_metrics_family(writer, "nixbadge_sched_running", "gauge",
+                          "Requests running on a worker.");
+  for (int i = 0; i < NIXBADGE_SCHED_LANES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_sched_running",
+                            http_lane_labels[i], stats.running[i]);
+  }
+  nixbadge_metrics_family(writer, "nixbadge_sched_rejected_total", "counter",
+                          "Requests that found their lane full.");
+  for (int i = 0; i < NIXBADGE_SCHED_LANES; i++) {
+    nixbadge_metrics_sample(writer, "nixbadge_sched_rejected_total",
+                            http_lane_labels[i], stats.rejected[i]);
+  }
+  nixbadge_metrics_family(writer, "nixbadge_sched_wait_seconds", "histogram",
+                          "Time requests waited for a worker.");
+  for (int i = 0; i < NIXBADGE_SCHED_LANES; i++) {
+    nixbadge_metrics_histogram(writer, "nixbadge_sched_wait_seconds",
+                               http_lane_labels[i], &http_metrics.queued[i]);
+  }
+  nixbadge_metrics_value(writer, "nixbadge_sched_clients", "gauge",
+                         "Clients with NAR requests waiting or running.",
+                         stats.clients);
+  nixbadge_metrics_value(writer, "nixbadge_sched_passed_over_total", "counter",
+                         "NAR requests passed over for another client's.",
+                         stats.passed_over);
+  nixbadge_metrics_value(writer, "nixbadge_sched_throttled_total", "counter",
+                         "Times a NAR body was held to the client's rate.",
+                         stats.throttled);
+  nixbadge_metrics_value(writer, "nixbadge_sched_throttled_milliseconds_total",
+                         "counter", "Time NAR bodies were held back.",
+                         stats.throttled_ms);
+}
+
+static void nixbadge_http_write_caches(nixbadge_metrics_writer_t* writer) {
+  nixbadge_proxy_stats_t proxy;
+  nixbadge_proxy_get_stats(http_proxy, &proxy);
+  nixbadge_metrics_value(writer, "nixbadge_proxy_connections", "gauge",
+                         "Client connections open.", proxy.conns);
+  nixbadge_metrics_value(writer, "nixbadge_proxy_accepted_total", "counter",
+                         "Client connections accepted.", proxy.accepted);
+  nixbadge_metrics_value(writer, "nixbadge_proxy_busy_total", "counter",
+                         "Requests that found every pipe in use.",
+                         proxy.busy);
+  nixbadge_metrics_value(writer, "nixbadge_proxy_timeouts_total", "counter",
+                         "Client connections that timed out.",
+                         proxy.timeouts);
+
+  nixbadge_narinfo_cache_stats_t narinfos;
+  nixbadge_http_get_narinfo_stats(&narinfos);
+  nixbadge_metrics_family(writer, "nixbadge_narinfo_cache_lookups_total",
+                          "counter", "Lookups in the narinfo cache.");
+  nixbadge_metrics_sample(writer, "nixbadge_narinfo_cache_lookups_total",
+                          "result=\"hit\"", narinfos.hits);
+  nixbadge_metrics_sample(writer, "nixbadge_narinfo_cache_lookups_total",
+                          "result=\"negative\"", narinfos.negative_hits);
+  nixbadge_metrics_sample(writer, "nixbadge_narinfo_cache_lookups_total",
+                          "result=\"miss\"", narinfos.misses);
+
+  nixbadge_cache_t* cache = nixbadge_storage_nar_cache();
+  if (cache) {
+    nixbadge_cache_stats_t nars;
+    nixbadge_cache_get_stats(cache, &nars);
+    nixbadge_metrics_family(writer, "nixbadge_nar_cache_lookups_total",
+                            "counter", "Lookups in the NAR cache.");
+    nixbadge_metrics_sample(writer, "nixbadge_nar_cache_lookups_total",
+                            "result=\"hit\"", nars.hits);
+    nixbadge_metrics_sample(writer, "nixbadge_nar_cache_lookups_total",
+                            "result=\"miss\"", nars.misses);
+    nixbadge_metrics_value(writer, "nixbadge_nar_cache_used_bytes", "gauge",
+                           "Bytes stored in the NAR cache.", nars.used);
+    nixbadge_metrics_value(writer, "nixbadge_nar_cache_entries", "gauge",
+                           "Objects stored in the NAR cache.", nars.entries);
+    nixbadge_metrics_value(writer, "nixbadge_nar_cache_write_failures_total",
+                           "counter", "Objects the storage failed to write.",
+                           nars.write_failures);
+  }
+
+  nixbadge_flight_stats_t flight;
+  nixbadge_flight_get_stats(flights, &flight);
+  nixbadge_metrics_family(writer, "nixbadge_flight_joins_total", "counter",
+                          "Requests that led or followed an upstream fetch.");
+  nixbadge_metrics_sample(writer, "nixbadge_flight_joins_total",
+                          "role=\"leader\"", flight.leaders);
+  nixbadge_metrics_sample(writer, "nixbadge_flight_joins_total",
+                          "role=\"follower\"", flight.followers);
+
+  if (!prefetcher) return;
+  nixbadge_prefetch_stats_t prefetch;
+  nixbadge_prefetch_get_stats(prefetcher, &prefetch);
+  nixbadge_metrics_family(writer, "nixbadge_prefetch_items_total", "counter",
+                          "Prefetches by how they went.");
+  nixbadge_metrics_sample(writer, "nixbadge_prefetch_items_total",
+                          "result=\"fetched\"", prefetch.fetched);
+  nixbadge_metrics_sample(writer, "nixbadge_prefetch_items_total",
+                          "result=\"failed\"", prefetch.failed);
+  nixbadge_metrics_sample(writer, "nixbadge_prefetch_items_total",
+                          "result=\"skipped\"", prefetch.skipped);
+  nixbadge_metrics_sample(writer, "nixbadge_prefetch_items_total",
+                          "result=\"dropped\"", prefetch.dropped);
+  nixbadge_metrics_value(writer, "nixbadge_prefetch_hits_total", "counter",
+                         "Prefetched objects that clients asked for.",
+                         prefetch.hits);
+  nixbadge_metrics_value(writer, "nixbadge_prefetch_unused_total", "counter",
+                         "Prefetched objects nobody asked for.",
+                         prefetch.unused);
+  nixbadge_metrics_value(writer, "nixbadge_prefetch_bytes_total", "counter",
+                         "Bytes fetched ahead of clients.", prefetch.bytes);
+}
 
-  httpd_resp_set_hdr(req, "Content-Type", "application/x-nix-nar");
+/**
+ * Serves the counters of the proxy, mesh and system for Prometheus. Getting
+ * them takes locks that a worker may hold for a while, like the one on the
+ * upstreams, so it is answered from a worker rather than the proxy task.
+ */
+static esp_err_t metrics_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  if (local) return ESP_ERR_NOT_FOUND;
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
-  esp_err_t err = esp_http_client_perform(client);
+  nixbadge_metrics_writer_t writer;
+  nixbadge_metrics_writer_init(&writer);
+  nixbadge_http_write_requests(&writer);
+  nixbadge_http_write_sched(&writer);
+  nixbadge_http_write_upstreams(&writer);
+  nixbadge_http_write_caches(&writer);
 
-  free(cache_host);
-  nvs_close(flashcfg_handle);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_level", "gauge",
+                         "Level in the mesh, 1 is the root.",
+                         esp_mesh_lite_get_level());
+  nixbadge_http_write_links(&writer);
+  nixbadge_mesh_tx_stats_t tx;
+  nixbadge_mesh_get_tx_stats(&tx);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_tx_buffers", "gauge",
+                         "Buffers for packets sent over the mesh.", tx.slots);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_tx_buffers_in_use", "gauge",
+                         "Buffers mesh-lite may still send from.", tx.in_use);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_tx_packets_total", "counter",
+                         "Packets put together to send.", tx.acquired);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_tx_exhausted_total",
+                         "counter", "Packets dropped for want of a buffer.",
+                         tx.exhausted);
+  int64_t mesh_us;
+  uint32_t error_us;
+  if (nixbadge_mesh_time_now(&mesh_us, &error_us)) {
+    nixbadge_metrics_value(&writer, "nixbadge_mesh_time_error_microseconds",
+                           "gauge", "How far the mesh time may be off.",
+                           error_us);
+  }
+  nixbadge_clock_stats_t time;
+  nixbadge_mesh_get_time_stats(&time);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_time_drift_ppb", "gauge",
+                         "How much faster the mesh time runs than the badge.",
+                         time.drift_ppb);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_time_exchanges_total",
+                         "counter", "Timestamps exchanged with the parent.",
+                         time.exchanges);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_time_rejected_total",
+                         "counter", "Exchanges whose timestamps were wrong.",
+                         time.rejected);
+  nixbadge_metrics_value(&writer, "nixbadge_mesh_time_epoch", "gauge",
+                         "Bumped when the root steps the mesh time.",
+                         time.epoch);
+  nixbadge_leds_stats_t leds;
+  nixbadge_leds_get_stats(&leds);
+  nixbadge_metrics_value(&writer, "nixbadge_leds_frames_total", "counter",
+                         "LED frames drawn.", leds.frames);
+  nixbadge_metrics_value(&writer, "nixbadge_leds_dropped_frames_total",
+                         "counter", "LED frames left out for running late.",
+                         leds.dropped);
+  nixbadge_metrics_value(&writer, "nixbadge_leds_frame_jitter_microseconds",
+                         "gauge", "How far frames start from their deadline.",
+                         leds.jitter_us);
+  nixbadge_metrics_value(
+      &writer, "nixbadge_leds_frame_max_jitter_microseconds", "gauge",
+      "Most a frame started from its deadline.", leds.max_jitter_us);
+  nixbadge_metrics_value(&writer, "nixbadge_leds_count", "gauge",
+                         "LEDs on the strip.", leds.count);
+  nixbadge_metrics_value(&writer, "nixbadge_leds_frame_period_milliseconds",
+                         "gauge", "Time between frames.", leds.frame_ms);
+  nixbadge_input_stats_t input;
+  nixbadge_input_get_stats(&input);
+  nixbadge_metrics_value(&writer, "nixbadge_button_edges_total", "counter",
+                         "Edges of the button pin.", input.edges);
+  nixbadge_metrics_value(&writer, "nixbadge_button_bounces_total", "counter",
+                         "Edges of the button that were bounces.",
+                         input.bounces);
+  nixbadge_metrics_value(&writer, "nixbadge_button_dropped_edges_total",
+                         "counter", "Edges lost to a full ring.",
+                         input.dropped);
+  nixbadge_metrics_value(&writer, "nixbadge_button_gestures_total", "counter",
+                         "Presses, long presses and double clicks.",
+                         input.events);
+  nixbadge_show_stats_t show;
+  nixbadge_show_get_stats(&show);
+  nixbadge_metrics_value(&writer, "nixbadge_show_seq", "gauge",
+                         "Uploads the LED show playing is from.", show.seq);
+  nixbadge_metrics_value(&writer, "nixbadge_show_bytes", "gauge",
+                         "Size of the LED show playing.", show.size);
+  nixbadge_metrics_value(&writer, "nixbadge_show_pulls_total", "counter",
+                         "LED shows pulled from peers.", show.pulls);
+  nixbadge_metrics_value(&writer, "nixbadge_show_pull_failures_total",
+                         "counter", "LED shows that failed to pull.",
+                         show.pull_failures);
+  nixbadge_peers_stats_t p2p;
+  nixbadge_p2p_get_stats(&p2p);
+  nixbadge_metrics_value(&writer, "nixbadge_p2p_pulls_total", "counter",
+                         "Cache filters pulled from peers.", p2p.pulls);
+  nixbadge_metrics_value(&writer, "nixbadge_p2p_pull_failures_total",
+                         "counter", "Cache filters that failed to pull.",
+                         p2p.pull_failures);
+  nixbadge_metrics_value(&writer, "nixbadge_p2p_fetch_failures_total",
+                         "counter", "NARs that failed to fetch from a peer.",
+                         p2p.fetch_failures);
+  int rssi;
+  if (nixbadge_wifi_get_sta_rssi(&rssi)) {
+    nixbadge_metrics_value(&writer, "nixbadge_wifi_sta_rssi_dbm", "gauge",
+                           "Signal strength of the uplink.", rssi);
+  }
+  nixbadge_system_write_metrics(&writer);
 
-  if (config.cert_pem) free((void*)config.cert_pem);
-  esp_http_client_cleanup(client);
+  size_t len;
+  char* page = nixbadge_metrics_writer_finish(&writer, &len);
+  if (!page) {
+    return nixbadge_http_result(nixbadge_proxy_resp_send_err(
+        req, "503 Service Unavailable", "Out of memory\n"));
+  }
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type",
+                              "text/plain; version=0.0.4");
+  esp_err_t err =
+      nixbadge_http_result(nixbadge_proxy_resp_send(req, page, len));
+  free(page);
   return err;
 }
 
-static const httpd_uri_t nix_cache_info = {
-    .uri = "/nix-cache-info",
-    .method = HTTP_GET,
-    .handler = nix_cache_info_get_handler,
-};
+/**
+ * Serves the topology of the mesh as JSON, which only the root keeps. It
+ * is at hand, so it is answered from the proxy task.
+ */
+static esp_err_t topology_get_handler(nixbadge_proxy_req_t* req, bool local) {
+  nixbadge_metrics_writer_t writer;
+  nixbadge_metrics_writer_init(&writer);
+  bool root = nixbadge_has_mesh() && nixbadge_mesh_write_topology(&writer);
 
-static const httpd_uri_t nar = {
-    .uri = "/nar/*",
-    .method = HTTP_GET,
-    .handler = nar_get_handler,
-};
+  size_t len;
+  char* page = nixbadge_metrics_writer_finish(&writer, &len);
+  if (!root) {
+    free(page);
+    return nixbadge_http_send_404(req);
+  }
+  if (!page) {
+    return nixbadge_http_result(nixbadge_proxy_resp_send_err(
+        req, "503 Service Unavailable", "Out of memory\n"));
+  }
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type", "application/json");
+  esp_err_t err =
+      nixbadge_http_result(nixbadge_proxy_resp_send(req, page, len));
+  free(page);
+  return err;
+}
 
-static const httpd_uri_t narinfo = {
-    .uri = "/*",
-    .method = HTTP_GET,
-    .handler = narinfo_get_handler,
+typedef struct {
+  const char* uri;
+  nixbadge_proxy_method_t method;
+  nixbadge_http_handler_t handler;
+  nixbadge_http_class_t cls;
+} nixbadge_http_route_t;
+
+static const nixbadge_http_route_t routes[] = {
+    {"/nix-cache-info", NIXBADGE_PROXY_GET, nix_cache_info_get_handler,
+     HTTP_CLASS_NARINFO},
+    {"/metrics", NIXBADGE_PROXY_GET, metrics_get_handler, HTTP_CLASS_OTHER},
+    {"/badge/reload", NIXBADGE_PROXY_POST, reload_post_handler,
+     HTTP_CLASS_OTHER},
+    {"/badge/digest", NIXBADGE_PROXY_GET, digest_get_handler,
+     HTTP_CLASS_OTHER},
+    {"/badge/topology", NIXBADGE_PROXY_GET, topology_get_handler,
+     HTTP_CLASS_OTHER},
+    {"/badge/show", NIXBADGE_PROXY_GET, show_get_handler, HTTP_CLASS_OTHER},
+    {"/badge/show", NIXBADGE_PROXY_POST, show_post_handler, HTTP_CLASS_OTHER},
+    {"/nar/*", NIXBADGE_PROXY_GET, nar_get_handler, HTTP_CLASS_NAR},
+    {"/*", NIXBADGE_PROXY_GET, narinfo_get_handler, HTTP_CLASS_NARINFO},
 };
 
+/**
+ * Matches the path of a request URI against a route, which may end in a
+ * wildcard.
+ */
+static bool nixbadge_http_route_match(const char* route, const char* uri) {
+  size_t len = strcspn(uri, "?");
+  size_t route_len = strlen(route);
+  if (route[route_len - 1] == '*') {
+    return len >= route_len - 1 && strncmp(route, uri, route_len - 1) == 0;
+  }
+  return len == route_len && strncmp(route, uri, len) == 0;
+}
+
+/**
+ * Takes the scheduling policy from the configuration when it was reloaded.
+ * Slots left at 0 default to all workers for narinfos and all but one for
+ * NARs, so that a lookup never waits for a download to finish. NARs may
+ * take up half of the requests that can be deferred.
+ */
+static void nixbadge_http_sched_update() {
+  const nixbadge_config_t* config = nixbadge_config_get();
+  if (config->generation == http_sched_generation) {
+    nixbadge_config_unref(config);
+    return;
+  }
+  http_sched_generation = config->generation;
+
+  nixbadge_sched_policy_t policy = {
+      .fast_slots = config->sched_fast,
+      .bulk_slots = config->sched_bulk,
+      .client_slots = config->sched_client,
+      .client_rate = config->sched_rate * 1024,
+  };
+  nixbadge_sched_policy_defaults(&policy, CONFIG_BADGE_HTTP_WORKERS);
+  nixbadge_sched_set_policy(http_sched, &policy);
+  ESP_LOGI(TAG,
+           "Scheduling %lu narinfo and %lu NAR requests at once, %lu NARs "
+           "and %lu KiB/s per client",
+           policy.fast_slots, policy.bulk_slots, policy.client_slots,
+           config->sched_rate);
+  nixbadge_config_unref(config);
+}
+
+/**
+ * NARs, and whatever a child badge prefetches, go to the bulk lane.
+ */
+static nixbadge_sched_lane_t nixbadge_http_lane(nixbadge_http_class_t cls,
+                                                nixbadge_proxy_req_t* req) {
+  if (cls == HTTP_CLASS_NAR || nixbadge_http_is_prefetch(req)) {
+    return NIXBADGE_SCHED_BULK;
+  }
+  return NIXBADGE_SCHED_FAST;
+}
+
+/**
+ * Runs on the proxy task for every request: answers what can be answered
+ * right away and hands the rest to the scheduler.
+ */
+static void nixbadge_http_route(void* ctx, nixbadge_proxy_req_t* req) {
+  const char* uri = nixbadge_proxy_req_uri(req);
+  const nixbadge_http_route_t* route = NULL;
+  bool allowed = false;
+  for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]) && !allowed; i++) {
+    if (!nixbadge_http_route_match(routes[i].uri, uri)) continue;
+    route = &routes[i];
+    allowed = route->method == nixbadge_proxy_req_method(req);
+  }
+
+  if (!route) {
+    nixbadge_http_send_404(req);
+    return;
+  }
+  if (!allowed) {
+    nixbadge_proxy_resp_send_err(req, "405 Method Not Allowed",
+                                 "Request method for this URI is not "
+                                 "handled by server\n");
+    return;
+  }
+
+  nixbadge_counter_add(&http_metrics.requests[route->cls], 1);
+  int64_t started_ms = nixbadge_http_now_ms();
+  esp_err_t err = route->handler(req, true);
+  if (err != ESP_ERR_NOT_FOUND) {
+    nixbadge_http_count(route->cls, started_ms, err);
+    return;
+  }
+
+  nixbadge_counter_add(&http_metrics.deferred[route->cls], 1);
+  nixbadge_http_job_t* job = malloc(sizeof(nixbadge_http_job_t));
+  if (!job || !nixbadge_proxy_req_defer(req)) {
+    free(job);
+    nixbadge_proxy_resp_send_err(req, "503 Service Unavailable",
+                                 "All workers are busy\n");
+    nixbadge_http_count(route->cls, started_ms, ESP_ERR_NO_MEM);
+    return;
+  }
+  *job = (nixbadge_http_job_t){
+      .req = req,
+      .handler = route->handler,
+      .cls = route->cls,
+      .started_ms = started_ms,
+  };
+
+  nixbadge_http_sched_update();
+  nixbadge_http_foreground(1);
+  if (!nixbadge_sched_submit(http_sched, nixbadge_http_lane(route->cls, req),
+                             nixbadge_proxy_req_client(req), job,
+                             started_ms)) {
+    free(job);
+    nixbadge_http_foreground(-1);
+    nixbadge_proxy_resp_send_err(req, "503 Service Unavailable",
+                                 "All workers are busy\n");
+    nixbadge_proxy_req_complete(req, true);
+    nixbadge_http_count(route->cls, started_ms, ESP_ERR_NO_MEM);
+  }
+}
+
+static void nixbadge_http_proxy_task(void* arg) {
+  nixbadge_proxy_run(arg);
+}
+
+uint32_t nixbadge_http_get_load() {
+  if (!http_sched) return 0;
+  nixbadge_sched_stats_t stats;
+  nixbadge_sched_get_stats(http_sched, &stats);
+  uint32_t load = 0;
+  for (int i = 0; i < NIXBADGE_SCHED_LANES; i++) {
+    load += stats.waiting[i] + stats.running[i];
+  }
+  return load;
+}
+
+void nixbadge_http_get_narinfo_stats(nixbadge_narinfo_cache_stats_t* stats) {
+  if (narinfo_cache) {
+    nixbadge_narinfo_cache_get_stats(narinfo_cache, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+void nixbadge_http_get_prefetch_stats(nixbadge_prefetch_stats_t* stats) {
+  if (prefetcher) {
+    nixbadge_prefetch_get_stats(prefetcher, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+/**
+ * Sets up prefetching, which is left off when there isn't enough memory
+ * for it.
+ */
+static void nixbadge_http_prefetch_init() {
+  if (CONFIG_BADGE_PREFETCH_DEPTH == 0) return;
+
+  nixbadge_narinfo_cache_config_t store_config = {
+      .entries = CONFIG_BADGE_PREFETCH_ENTRIES,
+      .slot_size = CONFIG_BADGE_NARINFO_CACHE_SLOT_SIZE,
+      .ttl_ms = CONFIG_BADGE_NARINFO_CACHE_TTL * 1000,
+      .negative_ttl_ms = CONFIG_BADGE_NARINFO_CACHE_NEGATIVE_TTL * 1000,
+  };
+  nixbadge_prefetch_config_t config = {
+      .max_depth = CONFIG_BADGE_PREFETCH_DEPTH,
+      .nar_max = CONFIG_BADGE_PREFETCH_NAR_MAX * 1024ULL,
+      .queue_len = PREFETCH_QUEUE_LEN,
+      .entries = PREFETCH_SEEN_ENTRIES,
+      .rate = CONFIG_BADGE_PREFETCH_RATE * 1024,
+      .burst = CONFIG_BADGE_PREFETCH_RATE * 1024 * 4,
+      .max_foreground = CONFIG_BADGE_HTTP_WORKERS,
+      .idle_ms = PREFETCH_IDLE_MS,
+  };
+  prefetch_store = nixbadge_narinfo_cache_new(&store_config);
+  prefetcher = nixbadge_prefetch_new(&config);
+  if (!prefetch_store || !prefetcher ||
+      nixbadge_task_create(nixbadge_http_prefetch_task, "http_prefetch",
+                           PREFETCH_STACK_SIZE, NULL, 3) != pdPASS) {
+    ESP_LOGW(TAG, "Not enough memory to prefetch");
+    nixbadge_narinfo_cache_free(prefetch_store);
+    nixbadge_prefetch_free(prefetcher);
+    prefetch_store = NULL;
+    prefetcher = NULL;
+  }
+}
+
 void nixbadge_http_init() {
-  ESP_ERROR_CHECK(esp_tls_init_global_ca_store());
+  nixbadge_upstream_pool_init();
+  upstreams_lock = xSemaphoreCreateMutex();
+  if (!upstreams_lock) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
 
-  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.server_port = 1008;
-  config.uri_match_fn = httpd_uri_match_wildcard;
-  httpd_handle_t server = NULL;
+  nixbadge_narinfo_cache_config_t narinfo_config = {
+      .entries = CONFIG_BADGE_NARINFO_CACHE_ENTRIES,
+      .slot_size = CONFIG_BADGE_NARINFO_CACHE_SLOT_SIZE,
+      .ttl_ms = CONFIG_BADGE_NARINFO_CACHE_TTL * 1000,
+      .negative_ttl_ms = CONFIG_BADGE_NARINFO_CACHE_NEGATIVE_TTL * 1000,
+  };
+  narinfo_cache = nixbadge_narinfo_cache_new(&narinfo_config);
+  if (!narinfo_cache) {
+    ESP_LOGW(TAG, "Failed to allocate the narinfo cache");
+  }
 
-  ESP_ERROR_CHECK(httpd_start(&server, &config));
+  flights = nixbadge_flight_table_new(CONFIG_BADGE_HTTP_WORKERS,
+                                      CONFIG_BADGE_FLIGHT_RING_SIZE);
+  if (!flights) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  nixbadge_http_prefetch_init();
 
-  httpd_register_uri_handler(server, &nix_cache_info);
-  httpd_register_uri_handler(server, &nar);
-  httpd_register_uri_handler(server, &narinfo);
+  // As many requests again as there are workers can wait for one. The
+  // proxy bounds them all, so either lane may have them.
+  size_t deferred = CONFIG_BADGE_HTTP_WORKERS * 2;
+  nixbadge_sched_config_t sched_config = {
+      .queue_len = deferred,
+      .clients = CONFIG_BADGE_HTTP_MAX_CLIENTS,
+  };
+  http_sched = nixbadge_sched_new(&sched_config);
+  if (!http_sched) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  nixbadge_http_sched_update();
+  for (int i = 0; i < CONFIG_BADGE_HTTP_WORKERS; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "http_worker%d", i);
+    nixbadge_task_create(nixbadge_http_worker, name, WORKER_STACK_SIZE, NULL,
+                         5);
+  }
+
+  hedge_attempts =
+      xQueueCreate(HEDGE_QUEUE_LEN, sizeof(nixbadge_http_attempt_t));
+  if (!hedge_attempts) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  for (int i = 0; i < CONFIG_BADGE_UPSTREAM_HEDGE_WORKERS; i++) {
+    char* body = malloc(HEDGE_BODY_MAX);
+    if (!body) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    char name[16];
+    snprintf(name, sizeof(name), "http_hedge%d", i);
+    nixbadge_task_create(nixbadge_http_attempt_task, name, HEDGE_STACK_SIZE,
+                         body, 5);
+  }
+
+  nixbadge_proxy_config_t config = {
+      .port = 1008,
+      .max_conns = CONFIG_BADGE_HTTP_MAX_CLIENTS,
+      .max_deferred = deferred,
+      .pipe_buffers = CONFIG_BADGE_HTTP_PIPE_BUFFERS,
+      .buffer_size = CACHE_CHUNK_SIZE,
+      .idle_timeout_ms = PROXY_IDLE_TIMEOUT_MS,
+      .send_timeout_ms = PROXY_SEND_TIMEOUT_MS,
+      .max_body = CONFIG_BADGE_SHOW_MAX_SIZE,
+      .route = nixbadge_http_route,
+  };
+  http_proxy = nixbadge_proxy_new(&config);
+  if (!http_proxy) {
+    ESP_LOGE(TAG, "Failed to start the proxy: %s", strerror(errno));
+    ESP_ERROR_CHECK(ESP_FAIL);
+  }
+  nixbadge_task_create(nixbadge_http_proxy_task, "http_proxy",
+                       PROXY_STACK_SIZE, http_proxy, 5);
 }
@@ -1,3 +1,14 @@
 #pragma once
 
+#include <stdint.h>
+
+#include "nixbadge_narinfo_cache.h"
+#include "nixbadge_prefetch.h"
+
 void nixbadge_http_init();
+/**
+ * @return requests waiting for or running on a worker
+ */
+uint32_t nixbadge_http_get_load();
+void nixbadge_http_get_narinfo_stats(nixbadge_narinfo_cache_stats_t* stats);
+void nixbadge_http_get_prefetch_stats(nixbadge_prefetch_stats_t* stats);
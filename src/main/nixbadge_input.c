@@ -0,0 +1,175 @@
+#include "nixbadge_input.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nixbadge_gpio.h"
+#include "nixbadge_utils.h"
+
+/* Edges the interrupt can note before the task drains them, a power of 2. */
+#define INPUT_RING_SIZE 32
+#define INPUT_MAX_HANDLERS 8
+#define INPUT_STACK_SIZE 3072
+#define INPUT_PRIORITY 10
+
+static const char TAG[] = "nixbadge_input";
+
+typedef struct {
+  int64_t at_us;
+  bool level;
+} nixbadge_input_edge_t;
+
+/*
+ * Written by the interrupt at the head and read by the task at the tail,
+ * neither of which is written by the other, so the ring takes no lock.
+ */
+static nixbadge_input_edge_t input_ring[INPUT_RING_SIZE];
+static atomic_uint input_head;
+static atomic_uint input_tail;
+static atomic_uint input_dropped;
+
+/* Given by the interrupt and the timer to wake the task. */
+static SemaphoreHandle_t input_wake = NULL;
+static esp_timer_handle_t input_timer = NULL;
+static nixbadge_button_t* input_button = NULL;
+
+static struct {
+  nixbadge_input_handler_t handler;
+  void* arg;
+} input_handlers[INPUT_MAX_HANDLERS];
+/* Handlers filled in, published after them. */
+static atomic_uint input_nhandlers;
+
+static atomic_uint input_edges;
+static atomic_uint input_bounces;
+static atomic_uint input_events;
+
+static const char* const input_gestures[] = {"press", "long press",
+                                             "double click"};
+
+static void IRAM_ATTR nixbadge_input_isr(void* arg) {
+  unsigned int head = atomic_load_explicit(&input_head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&input_tail, memory_order_acquire);
+  if (head - tail == INPUT_RING_SIZE) {
+    atomic_fetch_add_explicit(&input_dropped, 1, memory_order_relaxed);
+  } else {
+    input_ring[head % INPUT_RING_SIZE] = (nixbadge_input_edge_t){
+        .at_us = esp_timer_get_time(),
+        .level = gpio_get_level(GPIO_INPUT_PIN),
+    };
+    atomic_store_explicit(&input_head, head + 1, memory_order_release);
+  }
+
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(input_wake, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+static void nixbadge_input_due(void* arg) { xSemaphoreGive(input_wake); }
+
+static void nixbadge_input_event(void* arg,
+                                 const nixbadge_button_event_t* event) {
+  ESP_LOGI(TAG, "Button %s, %" PRId64 " ms after it was pressed",
+           input_gestures[event->gesture],
+           (event->at_us - event->pressed_us) / 1000);
+  unsigned int count = atomic_load(&input_nhandlers);
+  for (unsigned int i = 0; i < count; i++) {
+    input_handlers[i].handler(input_handlers[i].arg, event);
+  }
+}
+
+static void nixbadge_input_task(void* arg) {
+  unsigned int dropped = 0;
+  while (true) {
+    xSemaphoreTake(input_wake, portMAX_DELAY);
+
+    unsigned int head =
+        atomic_load_explicit(&input_head, memory_order_acquire);
+    unsigned int tail =
+        atomic_load_explicit(&input_tail, memory_order_relaxed);
+    for (; tail != head; tail++) {
+      const nixbadge_input_edge_t* edge =
+          &input_ring[tail % INPUT_RING_SIZE];
+      nixbadge_button_edge(input_button, edge->level, edge->at_us);
+    }
+    atomic_store_explicit(&input_tail, tail, memory_order_release);
+
+    int64_t now = esp_timer_get_time();
+    // The pin as it is stands in for edges lost to a full ring.
+    if (atomic_load(&input_dropped) != dropped) {
+      dropped = atomic_load(&input_dropped);
+      nixbadge_button_edge(input_button, gpio_get_level(GPIO_INPUT_PIN),
+                           now);
+    }
+    nixbadge_button_advance(input_button, now);
+
+    esp_timer_stop(input_timer);
+    int64_t next = nixbadge_button_next_us(input_button);
+    if (next != INT64_MAX) {
+      esp_timer_start_once(input_timer, next > now ? next - now : 1);
+    }
+
+    nixbadge_button_stats_t stats;
+    nixbadge_button_get_stats(input_button, &stats);
+    atomic_store(&input_edges, stats.edges);
+    atomic_store(&input_bounces, stats.bounces);
+    atomic_store(&input_events, stats.events);
+  }
+}
+
+void nixbadge_input_init() {
+  nixbadge_button_config_t config = {
+      .debounce_us = CONFIG_BADGE_BUTTON_DEBOUNCE_MS * 1000,
+      .long_press_us = CONFIG_BADGE_BUTTON_LONG_PRESS_MS * 1000,
+      .double_click_us = CONFIG_BADGE_BUTTON_DOUBLE_CLICK_MS * 1000,
+      // Pulled down, and high while pressed.
+      .active_high = true,
+      .cb = nixbadge_input_event,
+  };
+  input_button = nixbadge_button_new(&config, gpio_get_level(GPIO_INPUT_PIN),
+                                     esp_timer_get_time());
+  input_wake = xSemaphoreCreateBinary();
+  if (!input_button || !input_wake) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+  esp_timer_create_args_t timer_args = {
+      .callback = nixbadge_input_due,
+      .name = "input",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &input_timer));
+  nixbadge_task_create(nixbadge_input_task, "input", INPUT_STACK_SIZE, NULL,
+                       INPUT_PRIORITY);
+  ESP_ERROR_CHECK(gpio_isr_handler_add(GPIO_INPUT_PIN, nixbadge_input_isr,
+                                       NULL));
+}
+
+esp_err_t nixbadge_input_subscribe(nixbadge_input_handler_t handler,
+                                   void* arg) {
+  static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+  esp_err_t err = ESP_OK;
+  taskENTER_CRITICAL(&lock);
+  unsigned int count = atomic_load(&input_nhandlers);
+  if (count == INPUT_MAX_HANDLERS) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    input_handlers[count].handler = handler;
+    input_handlers[count].arg = arg;
+    atomic_store(&input_nhandlers, count + 1);
+  }
+  taskEXIT_CRITICAL(&lock);
+  return err;
+}
+
+void nixbadge_input_get_stats(nixbadge_input_stats_t* stats) {
+  *stats = (nixbadge_input_stats_t){
+      .edges = atomic_load(&input_edges),
+      .bounces = atomic_load(&input_bounces),
+      .dropped = atomic_load(&input_dropped),
+      .events = atomic_load(&input_events),
+  };
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdint.h>
+
+#include "nixbadge_button.h"
+
+/*
+ * The button on the badge, as presses, long presses and double clicks for
+ * other modules to act on, see nixbadge_button.h.
+ *
+ * The interrupt only notes each edge and when it came into a ring that the
+ * input task drains, and a timer wakes the task when a level has held long
+ * enough or a gesture is due, so bounces cost an edge each and nothing
+ * polls the pin.
+ */
+
+typedef struct {
+  uint32_t edges;
+  uint32_t bounces;
+  /* Edges lost to a full ring. */
+  uint32_t dropped;
+  uint32_t events;
+} nixbadge_input_stats_t;
+
+typedef void (*nixbadge_input_handler_t)(void* arg,
+                                         const nixbadge_button_event_t* event);
+
+/**
+ * Starts taking edges of the button. Must be called after the GPIO
+ * interrupt service is installed, see nixbadge_leds_setup_gpios.
+ */
+void nixbadge_input_init();
+
+/**
+ * Calls `handler` with every gesture, from the input task, which is to be
+ * kept short.
+ * @return ESP_ERR_NO_MEM when 8 handlers are subscribed already
+ */
+esp_err_t nixbadge_input_subscribe(nixbadge_input_handler_t handler,
+                                   void* arg);
+
+void nixbadge_input_get_stats(nixbadge_input_stats_t* stats);
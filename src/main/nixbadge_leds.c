@@ -1,16 +1,23 @@
 #include "nixbadge_leds.h"
 
-#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "driver/gpio.h"
 #include "driver/rmt_tx.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include "led_strip_encoder.h"
+#include "nixbadge_config.h"
 #include "nixbadge_mesh.h"
 #include "nixbadge_gpio.h"
+#include "nixbadge_input.h"
+#include "nixbadge_show.h"
+#include "nixbadge_utils.h"
 
 #define GPIO_INPUT_PIN_SEL (1ULL << GPIO_INPUT_PIN)
 
@@ -20,12 +27,38 @@
   10000000  // 10MHz resolution, 1 tick = 0.1us (led strip needs a high
             // resolution)
 
-#define EXAMPLE_LED_NUMBERS 12
-#define EXAMPLE_ANGLE_INC_LED 0.3
+/* The renderer writes channels in the order the strip takes them. */
+#define LEDS_ORDER NIXBADGE_WS2812_RGB
+#define LEDS_CHANNELS 3
+/* The ring on the badge, when NVS sets no other. */
+#define LEDS_DEFAULT_COUNT 12
+/* Round trip time that turns the colour of a link a third of the way. */
+#define LEDS_SLOW_LINK_US 100000
+/* A thousandth of a third of a turn, in the phase the renderer takes. */
+#define LEDS_THIRD_PERMILLE 1431655
+
+#define LEDS_FRAME_MS 20
+#define LEDS_STACK_SIZE 3072
+#define LEDS_PRIORITY 5
+
+#ifdef CONFIG_BADGE_LEDS_GAMMA
+#define LEDS_GAMMA true
+#else
+#define LEDS_GAMMA false
+#endif
 
 static const char TAG[] = "nixbadge_leds";
-static uint8_t led_strip_pixels[EXAMPLE_LED_NUMBERS * 3];
-static QueueHandle_t gpio_evt_queue = NULL;
+/* One frame is drawn while the other is sent, sized once at boot. */
+static uint8_t *led_strip_pixels[2];
+static size_t leds_len;
+/* At least LEDS_FRAME_MS, longer when a frame takes longer to send. */
+static uint32_t leds_frame_ms;
+/* Given when the RMT is done sending, and there is no frame in flight. */
+static SemaphoreHandle_t leds_sent = NULL;
+static atomic_uint leds_frames;
+static atomic_uint leds_dropped;
+static atomic_uint leds_jitter_us;
+static atomic_uint leds_max_jitter_us;
 static rmt_channel_handle_t led_chan = NULL;
 static rmt_encoder_handle_t led_encoder = NULL;
 static rmt_transmit_config_t tx_config = {
@@ -35,43 +68,25 @@ static rmt_transmit_config_t tx_config = {
 /* Zig functions */
 
 extern void nixbadge_leds_config_gpios();
+extern void nixbadge_leds_render_chase(uint8_t *pixels, uint32_t len,
+                                       bool gamma);
+extern void nixbadge_leds_render_links(uint8_t *pixels, uint32_t len,
+                                       const uint32_t *phases, uint32_t count,
+                                       bool gamma);
 
 /* C functions */
 
-/**
- * GPIO interrupt handler. Just takes the GPIO that was signaled
- * and queues it.
- * @param arg the GPIO number
- */
-static void IRAM_ATTR gpio_isr_handler(void *arg) {
-  uint32_t gpio_num = (uint32_t)arg;
-  xQueueSendFromISR(gpio_evt_queue, &gpio_num, NULL);
-}
-
-/**
- * Task that receives GPIO interrupts.
- * @param arg the GPIO number
- */
-static void gpio_task(void *arg) {
-  uint32_t io_num;
-  int cnt = 0;
-  while (true) {
-    if (xQueueReceive(gpio_evt_queue, &io_num, portMAX_DELAY)) {
-      ESP_LOGI(TAG, "GPIO[%" PRIu32 "] intr, val: %d", io_num,
-               gpio_get_level(io_num));
-      gpio_set_level(GPIO_OUTPUT_PIN, cnt++ % 2);
-    }
-  }
+/* Toggles the status LED on every gesture of the button. */
+static void nixbadge_leds_button(void *arg,
+                                 const nixbadge_button_event_t *event) {
+  static int cnt = 0;
+  gpio_set_level(GPIO_OUTPUT_PIN, cnt++ % 2);
 }
 
 void nixbadge_leds_setup_gpios() {
   ESP_LOGI(TAG, "Setting up gpios...");
   nixbadge_leds_config_gpios();
-
-  gpio_evt_queue = xQueueCreate(10, sizeof(uint32_t));
-  xTaskCreate(gpio_task, "gpio_task", 2048, NULL, 10, NULL);
-  gpio_isr_handler_add(GPIO_INPUT_PIN, gpio_isr_handler,
-                       (void *)GPIO_INPUT_PIN);
+  nixbadge_input_subscribe(nixbadge_leds_button, NULL);
 }
 
 void nixbadge_leds_setup_rmt() {
@@ -79,6 +94,8 @@ void nixbadge_leds_setup_rmt() {
   rmt_tx_channel_config_t tx_chan_config = {
       .clk_src = RMT_CLK_SRC_DEFAULT,  // select source clock
       .gpio_num = RMT_LED_STRIP_GPIO_NUM,
+      // The encoder refills half of this as it drains, so that frames of
+      // any length go out without a buffer of symbols for all of them.
       .mem_block_symbols =
           64,  // increase the block size can make the LED less flickering
       .resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ,
@@ -91,6 +108,7 @@ void nixbadge_leds_setup_rmt() {
 
   led_strip_encoder_config_t encoder_config = {
       .resolution = RMT_LED_STRIP_RESOLUTION_HZ,
+      .order = LEDS_ORDER,
   };
   ESP_ERROR_CHECK(rmt_new_led_strip_encoder(&encoder_config, &led_encoder));
 
@@ -98,55 +116,148 @@ void nixbadge_leds_setup_rmt() {
   ESP_ERROR_CHECK(rmt_enable(led_chan));
 }
 
-void nixbadge_leds_init() {
-  nixbadge_leds_setup_gpios();
-  nixbadge_leds_setup_rmt(&led_chan, &led_encoder);
+static bool IRAM_ATTR nixbadge_leds_sent(rmt_channel_handle_t channel,
+                                          const rmt_tx_done_event_data_t *data,
+                                          void *arg) {
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(leds_sent, &woken);
+  return woken == pdTRUE;
 }
 
-void nixbadge_leds_pulse(float offset) {
-  for (int led = 0; led < EXAMPLE_LED_NUMBERS; led++) {
-    // Build RGB pixels. Each color is an offset sine, which gives a
-    // hue-like effect.
-    float angle = offset + (led * EXAMPLE_ANGLE_INC_LED);
-    const float color_off = (M_PI * 2) / 3;
+static void nixbadge_leds_pulse(uint8_t *pixels, size_t len) {
+  nixbadge_leds_render_chase(pixels, len, LEDS_GAMMA);
+}
 
-    float mul = 64;
-    float off = 0;
+/* Shows a neighbouring badge on each LED, coloured by how its link does. */
+static void nixbadge_leds_pull(uint8_t *pixels, size_t len) {
+  nixbadge_link_t links[NIXBADGE_MESH_LINKS];
+  size_t nlinks = nixbadge_mesh_get_links(links, NIXBADGE_MESH_LINKS);
 
-    if (led == 4) {
-      mul = 127;
-      off = 128;
-    }
+  // A third of a turn for a slow link, and as much again for lost pings.
+  uint32_t phases[NIXBADGE_MESH_LINKS];
+  for (size_t i = 0; i < nlinks; i++) {
+    uint32_t slow = links[i].rtt_us >= LEDS_SLOW_LINK_US
+                        ? 1000
+                        : links[i].rtt_us * 1000ULL / LEDS_SLOW_LINK_US;
+    phases[i] = (slow + links[i].loss_permille) * LEDS_THIRD_PERMILLE;
+  }
+  nixbadge_leds_render_links(pixels, len, phases, nlinks, LEDS_GAMMA);
+}
 
-    led_strip_pixels[led * 3 + 0] = sinf(angle + color_off * 0) * mul + off;
-    led_strip_pixels[led * 3 + 1] = sinf(angle + color_off * 1) * mul + off;
-    led_strip_pixels[led * 3 + 2] = sinf(angle + color_off * 2) * mul + off;
+/* Notes how far a frame started from its deadline. */
+static void nixbadge_leds_observe(int64_t deadline_us) {
+  int64_t late = esp_timer_get_time() - deadline_us;
+  uint32_t jitter = late < 0 ? -late : late;
+  unsigned int mean = atomic_load(&leds_jitter_us);
+  atomic_store(&leds_jitter_us, mean + ((int64_t)jitter - mean) / 8);
+  if (jitter > atomic_load(&leds_max_jitter_us)) {
+    atomic_store(&leds_max_jitter_us, jitter);
   }
+  atomic_fetch_add(&leds_frames, 1);
 }
 
-void nixbadge_leds_pull() {
-  for (int led = 0; led < EXAMPLE_LED_NUMBERS; led++) {
-    float offset = nixbadge_mesh_ping_measure(led);
-    float angle = offset + (led * EXAMPLE_ANGLE_INC_LED);
-    const float color_off = (M_PI * 2) / 3;
+/*
+ * Draws a frame every leds_frame_ms, into the buffer not being sent, and
+ * hands it to the RMT once the last one went out. Frames are due at fixed
+ * times, and the ones that could not be drawn in time are dropped rather
+ * than drawn late.
+ */
+static void nixbadge_leds_task(void *arg) {
+  const TickType_t period = pdMS_TO_TICKS(leds_frame_ms);
+  TickType_t wake = xTaskGetTickCount();
+  int64_t deadline_us = esp_timer_get_time();
+  int back = 0;
+  while (true) {
+    nixbadge_leds_observe(deadline_us);
+    uint8_t *pixels = led_strip_pixels[back];
+    // An uploaded show takes the place of the built-in effects.
+    if (!nixbadge_show_render(pixels, leds_len)) {
+      if (nixbadge_has_mesh()) {
+        nixbadge_leds_pull(pixels, leds_len);
+      } else {
+        nixbadge_leds_pulse(pixels, leds_len);
+      }
+    }
 
-    float mul = 64;
-    float off = 0;
+    xSemaphoreTake(leds_sent, portMAX_DELAY);
+    esp_err_t err =
+        rmt_transmit(led_chan, led_encoder, pixels, leds_len, &tx_config);
+    if (err == ESP_OK) {
+      back = !back;
+    } else {
+      ESP_LOGW(TAG, "Failed to send a frame: %s", esp_err_to_name(err));
+      xSemaphoreGive(leds_sent);
+    }
 
-    if (led == 4) {
-      mul = 127;
-      off = 128;
+    TickType_t late = xTaskGetTickCount() - wake;
+    if (late >= 2 * period) {
+      TickType_t missed = late / period - 1;
+      atomic_fetch_add(&leds_dropped, missed);
+      wake += missed * period;
+      deadline_us += missed * leds_frame_ms * 1000LL;
     }
+    xTaskDelayUntil(&wake, period);
+    deadline_us += leds_frame_ms * 1000LL;
+  }
+}
 
-    led_strip_pixels[led * 3 + 0] = sinf(angle + color_off * 0) * mul + off;
-    led_strip_pixels[led * 3 + 1] = sinf(angle + color_off * 1) * mul + off;
-    led_strip_pixels[led * 3 + 2] = sinf(angle + color_off * 2) * mul + off;
+/*
+ * Sizes the frames for the LEDs set in NVS, and the time between them so
+ * that each is out before the next is due.
+ */
+static void nixbadge_leds_alloc() {
+  const nixbadge_config_t* config = nixbadge_config_get();
+  uint32_t count = config->leds_count;
+  nixbadge_config_unref(config);
+  if (count == 0) count = LEDS_DEFAULT_COUNT;
+  if (count > CONFIG_BADGE_LEDS_MAX) {
+    ESP_LOGW(TAG, "%" PRIu32 " LEDs are too many, driving %d", count,
+             CONFIG_BADGE_LEDS_MAX);
+    count = CONFIG_BADGE_LEDS_MAX;
+  }
+  leds_len = count * LEDS_CHANNELS;
+  for (int i = 0; i < 2; i++) {
+    led_strip_pixels[i] = calloc(leds_len, 1);
+    if (!led_strip_pixels[i]) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
   }
+
+  nixbadge_ws2812_config_t config = {
+      .resolution_hz = RMT_LED_STRIP_RESOLUTION_HZ,
+      .order = LEDS_ORDER,
+  };
+  // A millisecond more covers the refills being held up by other interrupts.
+  uint32_t frame_ms = nixbadge_ws2812_frame_us(&config, leds_len) / 1000 + 1;
+  if (frame_ms < LEDS_FRAME_MS) frame_ms = LEDS_FRAME_MS;
+  // Whole ticks, or frames would be due before they are out.
+  leds_frame_ms = (frame_ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS *
+                  portTICK_PERIOD_MS;
+  ESP_LOGI(TAG, "Driving %" PRIu32 " LEDs, a frame every %" PRIu32 " ms",
+           count, leds_frame_ms);
 }
 
-void nixbadge_leds_sync() {
-  // Flush RGB values to LEDs
-  ESP_ERROR_CHECK(rmt_transmit(led_chan, led_encoder, led_strip_pixels,
-                               sizeof(led_strip_pixels), &tx_config));
-  ESP_ERROR_CHECK(rmt_tx_wait_all_done(led_chan, portMAX_DELAY));
+void nixbadge_leds_init() {
+  nixbadge_leds_alloc();
+  nixbadge_leds_setup_gpios();
+  nixbadge_leds_setup_rmt(&led_chan, &led_encoder);
+
+  leds_sent = xSemaphoreCreateBinary();
+  if (!leds_sent) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  xSemaphoreGive(leds_sent);
+  rmt_tx_event_callbacks_t callbacks = {
+      .on_trans_done = nixbadge_leds_sent,
+  };
+  ESP_ERROR_CHECK(rmt_tx_register_event_callbacks(led_chan, &callbacks, NULL));
+  nixbadge_task_create(nixbadge_leds_task, "leds", LEDS_STACK_SIZE, NULL,
+                       LEDS_PRIORITY);
+}
+
+void nixbadge_leds_get_stats(nixbadge_leds_stats_t *stats) {
+  *stats = (nixbadge_leds_stats_t){
+      .frames = atomic_load(&leds_frames),
+      .dropped = atomic_load(&leds_dropped),
+      .jitter_us = atomic_load(&leds_jitter_us),
+      .max_jitter_us = atomic_load(&leds_max_jitter_us),
+      .count = leds_len / LEDS_CHANNELS,
+      .frame_ms = leds_frame_ms,
+  };
 }
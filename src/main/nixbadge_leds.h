@@ -1,8 +1,25 @@
 #pragma once
 
+#include <stdint.h>
+
+typedef struct {
+  uint32_t frames;
+  /* Frames left out because the render task was held up past them. */
+  uint32_t dropped;
+  /* How far frames start from their deadlines, on average and at most. */
+  uint32_t jitter_us;
+  uint32_t max_jitter_us;
+  /* LEDs driven, and the time between their frames. */
+  uint32_t count;
+  uint32_t frame_ms;
+} nixbadge_leds_stats_t;
+
 void nixbadge_leds_setup_gpios();
 void nixbadge_leds_setup_rmt();
+/**
+ * Sets up the strip of as many LEDs as the configuration says and starts
+ * the task that draws it: the links to the neighbours with the mesh, the
+ * hue chase without. Must be called after nixbadge_config_init.
+ */
 void nixbadge_leds_init();
-void nixbadge_leds_pulse(float offset);
-void nixbadge_leds_pull();
-void nixbadge_leds_sync();
+void nixbadge_leds_get_stats(nixbadge_leds_stats_t* stats);
@@ -0,0 +1,172 @@
+#include "nixbadge_links.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Pings that weigh in on the loss of a peer. Older ones count half as much
+ * every time this many more have gone out.
+ */
+#define LINKS_LOSS_WINDOW 32
+
+typedef struct {
+  nixbadge_link_t link;
+  bool used;
+  /* Last ping answered, and pings expected and answered since it. */
+  uint32_t last_seq;
+  uint32_t expected;
+  uint32_t answered;
+} nixbadge_links_entry_t;
+
+struct nixbadge_links {
+  pthread_mutex_t lock;
+  nixbadge_links_entry_t* entries;
+  size_t len;
+  /* Last ping sent, and whether any was. */
+  uint32_t sent_seq;
+  bool sent;
+};
+
+nixbadge_links_t* nixbadge_links_new(size_t max_links) {
+  nixbadge_links_t* links = calloc(1, sizeof(*links));
+  if (!links) return NULL;
+
+  links->entries = calloc(max_links, sizeof(*links->entries));
+  if (!links->entries) {
+    free(links);
+    return NULL;
+  }
+  links->len = max_links;
+  pthread_mutex_init(&links->lock, NULL);
+  return links;
+}
+
+void nixbadge_links_free(nixbadge_links_t* links) {
+  if (!links) return;
+  pthread_mutex_destroy(&links->lock);
+  free(links->entries);
+  free(links);
+}
+
+void nixbadge_links_sent(nixbadge_links_t* links, uint32_t seq) {
+  pthread_mutex_lock(&links->lock);
+  links->sent_seq = seq;
+  links->sent = true;
+  pthread_mutex_unlock(&links->lock);
+}
+
+/*
+ * Finds the entry of a peer, or makes room for it in place of the one not
+ * heard from for the longest, with the lock held.
+ */
+static nixbadge_links_entry_t* nixbadge_links_entry(
+    nixbadge_links_t* links, const uint8_t addr[NIXBADGE_LINK_ADDR_LEN]) {
+  nixbadge_links_entry_t* oldest = NULL;
+  for (size_t i = 0; i < links->len; i++) {
+    nixbadge_links_entry_t* entry = &links->entries[i];
+    if (entry->used &&
+        memcmp(entry->link.addr, addr, NIXBADGE_LINK_ADDR_LEN) == 0) {
+      return entry;
+    }
+    if (!oldest || (oldest->used && (!entry->used ||
+                                     entry->link.last_seen_ms <
+                                         oldest->link.last_seen_ms))) {
+      oldest = entry;
+    }
+  }
+  if (!oldest) return NULL;
+
+  memset(oldest, 0, sizeof(*oldest));
+  memcpy(oldest->link.addr, addr, NIXBADGE_LINK_ADDR_LEN);
+  return oldest;
+}
+
+void nixbadge_links_reply(nixbadge_links_t* links,
+                          const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                          uint32_t seq, uint32_t rtt_us, int64_t now_ms) {
+  pthread_mutex_lock(&links->lock);
+  nixbadge_links_entry_t* entry = nixbadge_links_entry(links, addr);
+  if (!entry) {
+    pthread_mutex_unlock(&links->lock);
+    return;
+  }
+
+  nixbadge_link_t* link = &entry->link;
+  if (!entry->used) {
+    entry->used = true;
+    entry->expected = 1;
+    link->rtt_us = rtt_us;
+    link->jitter_us = rtt_us / 2;
+  } else if ((int32_t)(seq - entry->last_seq) > 0) {
+    entry->expected += seq - entry->last_seq;
+    int64_t delta = (int64_t)rtt_us - link->rtt_us;
+    int64_t deviation = delta < 0 ? -delta : delta;
+    link->jitter_us += (deviation - (int64_t)link->jitter_us) / 4;
+    link->rtt_us += delta / 8;
+  } else {
+    pthread_mutex_unlock(&links->lock);
+    return;
+  }
+
+  entry->answered++;
+  while (entry->expected > LINKS_LOSS_WINDOW) {
+    entry->expected /= 2;
+    entry->answered /= 2;
+  }
+  entry->last_seq = seq;
+  link->replies++;
+  link->last_seen_ms = now_ms;
+  pthread_mutex_unlock(&links->lock);
+}
+
+/*
+ * Fills in the loss of a peer, counting the pings sent since its last
+ * reply other than the latest, which may still be answered, with the lock
+ * held.
+ */
+static void nixbadge_links_copy(nixbadge_links_t* links,
+                                const nixbadge_links_entry_t* entry,
+                                nixbadge_link_t* out) {
+  *out = entry->link;
+
+  uint32_t expected = entry->expected, answered = entry->answered;
+  int32_t missed = (int32_t)(links->sent_seq - entry->last_seq) - 1;
+  if (links->sent && missed > 0) expected += missed;
+  while (expected > LINKS_LOSS_WINDOW) {
+    expected /= 2;
+    answered /= 2;
+  }
+  out->loss_permille =
+      expected ? 1000 - (uint64_t)answered * 1000 / expected : 0;
+}
+
+size_t nixbadge_links_get(nixbadge_links_t* links, nixbadge_link_t* out,
+                          size_t max) {
+  pthread_mutex_lock(&links->lock);
+  size_t n = 0;
+  for (size_t i = 0; i < links->len && n < max; i++) {
+    if (links->entries[i].used) {
+      nixbadge_links_copy(links, &links->entries[i], &out[n++]);
+    }
+  }
+  pthread_mutex_unlock(&links->lock);
+  return n;
+}
+
+bool nixbadge_links_find(nixbadge_links_t* links,
+                         const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                         nixbadge_link_t* out) {
+  pthread_mutex_lock(&links->lock);
+  bool found = false;
+  for (size_t i = 0; i < links->len && !found; i++) {
+    nixbadge_links_entry_t* entry = &links->entries[i];
+    if (entry->used &&
+        memcmp(entry->link.addr, addr, NIXBADGE_LINK_ADDR_LEN) == 0) {
+      nixbadge_links_copy(links, entry, out);
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&links->lock);
+  return found;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * How well the links to neighbouring badges are doing, from the replies to
+ * the pings this badge sends over the mesh.
+ *
+ * Every ping has a sequence number, and each badge that gets it answers
+ * with its MAC address and the ping's send time. The round trip time is
+ * smoothed as TCP does (RFC 6298), the jitter is the mean deviation of it,
+ * and the loss is the share of pings a peer did not answer, counting the
+ * recent ones more. The table has a fixed number of peers, one not heard
+ * from for the longest makes room for a new one.
+ */
+
+#define NIXBADGE_LINK_ADDR_LEN 6
+
+typedef struct nixbadge_links nixbadge_links_t;
+
+typedef struct {
+  uint8_t addr[NIXBADGE_LINK_ADDR_LEN];
+  /* Smoothed round trip time and its mean deviation. */
+  uint32_t rtt_us;
+  uint32_t jitter_us;
+  /* Pings not answered, in thousandths. */
+  uint16_t loss_permille;
+  uint32_t replies;
+  int64_t last_seen_ms;
+} nixbadge_link_t;
+
+/**
+ * @param max_links number of peers to keep track of
+ */
+nixbadge_links_t* nixbadge_links_new(size_t max_links);
+void nixbadge_links_free(nixbadge_links_t* links);
+
+/**
+ * Records that ping `seq` went out, which peers that do not answer it
+ * count as lost. Sequence numbers go up by one for every ping.
+ */
+void nixbadge_links_sent(nixbadge_links_t* links, uint32_t seq);
+/**
+ * Records a peer's reply to ping `seq`. Replies to a ping that was already
+ * answered, by a peer reached both ways, are ignored.
+ */
+void nixbadge_links_reply(nixbadge_links_t* links,
+                          const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                          uint32_t seq, uint32_t rtt_us, int64_t now_ms);
+
+/**
+ * Copies up to `max` links. Peers stay in the same place until they are
+ * replaced, so that what shows them does not reshuffle.
+ * @return the number of links copied
+ */
+size_t nixbadge_links_get(nixbadge_links_t* links, nixbadge_link_t* out,
+                          size_t max);
+/**
+ * @return whether the peer is in the table
+ */
+bool nixbadge_links_find(nixbadge_links_t* links,
+                         const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                         nixbadge_link_t* out);
@@ -1,14 +1,25 @@
 #include "nixbadge_mesh.h"
 
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
 #include "esp_bridge.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_mesh.h"
 #include "esp_mesh_internal.h"
 #include "esp_mesh_lite.h"
+#include "esp_netif_sntp.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "nixbadge_clock.h"
+#include "nixbadge_config.h"
+#include "nixbadge_http.h"
+#include "nixbadge_links.h"
+#include "nixbadge_topology.h"
 #include "nixbadge_utils.h"
-#include "nvs_flash.h"
 
 #define CONFIG_MESH_AP_CONNECTIONS 10
 #define CONFIG_MESH_ROUTE_TABLE_SIZE 12
@@ -20,10 +31,54 @@ static const char TAG[] = "nixbadge_mesh";
 
 static esp_netif_t *netif_sta = NULL;
 static bool is_meshing = false;
-int64_t last_ping_timestamp = 0;
+static nixbadge_links_t *mesh_links = NULL;
+static uint8_t mesh_mac[NIXBADGE_LINK_ADDR_LEN];
+static uint32_t mesh_ping_seq = 0;
+
+/* Retries of a broadcast that no badge answered. */
+#define MESH_MAX_RETRY 3
+/* Longest mesh-lite waits before resending a message. */
+#define MESH_RESEND_MS 1000
+
+/* Bounds of the interval between reports to the root. */
+#define TELEMETRY_MIN_INTERVAL_MS 5000
+#define TELEMETRY_MAX_INTERVAL_MS 300000
+/* Air time of a report on one hop, with the answer and mesh-lite's own. */
+#define TELEMETRY_AIRTIME_US 1000
+
+/* Kept by every badge, since any of them may become the root. */
+static nixbadge_topology_t *mesh_topology = NULL;
+static atomic_uint telemetry_interval_ms = TELEMETRY_MIN_INTERVAL_MS;
+static int64_t telemetry_sent_ms = 0;
+
+/* Mesh times after this are the time of day, from SNTP on the root. */
+#define TIME_EPOCH_MIN_US 1577836800000000LL
+/* Most the time of day may be off from the mesh time before it is set. */
+#define TIME_STEP_US 1000000
+
+static nixbadge_clock_t *mesh_clock = NULL;
+static bool mesh_sntp = false;
 
 /* Zig functions */
-extern uint8_t *nixbadge_mesh_create_packet(uint8_t, uint32_t *);
+extern const uint8_t *nixbadge_mesh_create_packet(uint8_t, uint32_t *);
+extern const uint8_t *nixbadge_mesh_create_digest_packet(uint32_t ip,
+                                                         uint32_t generation,
+                                                         uint32_t count,
+                                                         uint32_t *size);
+extern const uint8_t *nixbadge_mesh_create_show_packet(
+    uint32_t ip, uint32_t seq, uint32_t id, int64_t start_ms, uint32_t size,
+    uint32_t *out_size);
+extern const uint8_t *nixbadge_mesh_create_ping_packet(uint32_t seq,
+                                                       const uint8_t *origin,
+                                                       uint32_t sent_us,
+                                                       uint32_t *size);
+extern const uint8_t *nixbadge_mesh_create_time_request_packet(
+    uint32_t sent_us, uint32_t *size);
+extern const uint8_t *nixbadge_mesh_create_telemetry_packet(
+    const nixbadge_telemetry_t *telemetry, uint32_t *size);
+extern void nixbadge_mesh_tx_retain(const uint8_t *data);
+extern void nixbadge_mesh_tx_release(const uint8_t *data);
+extern void nixbadge_mesh_tx_lease(const uint8_t *data, uint32_t ms);
 
 extern esp_err_t nixbadge_mesh_action_cb(uint8_t *data, uint32_t len,
                                          uint8_t **out_data, uint32_t *out_len,
@@ -31,48 +86,347 @@ extern esp_err_t nixbadge_mesh_action_cb(uint8_t *data, uint32_t len,
 
 /* C functions */
 
-esp_err_t nixbadge_mesh_broadcast(uint8_t kind) {
-  if (kind == 0) {
-    last_ping_timestamp = nixbadge_timestamp_now();
-  }
+/*
+ * Hands a packet to mesh-lite, holding a reference of its buffer while it
+ * does. mesh-lite keeps the pointer to resend until a badge answers, which
+ * it does not tell about, so the buffer is leased for as long as the
+ * retries can take.
+ */
+static esp_err_t nixbadge_mesh_send_raw(esp_mesh_lite_msg_config_t *config) {
+  const uint8_t *data = config->raw_msg.data;
+  nixbadge_mesh_tx_retain(data);
+  nixbadge_mesh_tx_lease(data,
+                         (config->raw_msg.max_retry + 1) * MESH_RESEND_MS);
+  esp_err_t err = esp_mesh_lite_send_msg(ESP_MESH_LITE_RAW_MSG, config);
+  nixbadge_mesh_tx_release(data);
+  return err;
+}
 
-  uint32_t size = 0;
-  uint8_t *data = nixbadge_mesh_create_packet(kind, &size);
+/* Sends a packet to the children and the parent, and releases it. */
+static esp_err_t nixbadge_mesh_broadcast_data(const uint8_t *data,
+                                              uint32_t size) {
+  if (!data) return ESP_ERR_NO_MEM;
 
   esp_mesh_lite_msg_config_t child_config = {
     .raw_msg = {
       .msg_id = MESSAGE_ID,
       .expect_resp_msg_id = RESP_MESSAGE_ID,
-      .max_retry = 3,
-      .data = data,
+      .max_retry = MESH_MAX_RETRY,
+      .data = (uint8_t *)data,
       .size = size,
       .raw_resend = esp_mesh_lite_send_broadcast_raw_msg_to_child,
     },
   };
-
-  esp_mesh_lite_send_msg(ESP_MESH_LITE_RAW_MSG, &child_config);
+  esp_err_t err = nixbadge_mesh_send_raw(&child_config);
 
   if (esp_mesh_lite_get_level() != ROOT) {
     esp_mesh_lite_msg_config_t parent_config = {
       .raw_msg = {
         .msg_id = MESSAGE_ID,
         .expect_resp_msg_id = RESP_MESSAGE_ID,
-        .max_retry = 3,
-        .data = data,
+        .max_retry = MESH_MAX_RETRY,
+        .data = (uint8_t *)data,
         .size = size,
         .raw_resend = esp_mesh_lite_send_broadcast_raw_msg_to_parent,
       },
     };
+    esp_err_t parent_err = nixbadge_mesh_send_raw(&parent_config);
+    if (err == ESP_OK) err = parent_err;
+  }
+
+  nixbadge_mesh_tx_release(data);
+  return err;
+}
+
+esp_err_t nixbadge_mesh_broadcast(uint8_t kind) {
+  uint32_t size = 0;
+  const uint8_t *data = nixbadge_mesh_create_packet(kind, &size);
+  return nixbadge_mesh_broadcast_data(data, size);
+}
+
+esp_err_t nixbadge_mesh_broadcast_digest(uint32_t ip, uint32_t generation,
+                                         uint32_t count) {
+  uint32_t size = 0;
+  const uint8_t *data =
+      nixbadge_mesh_create_digest_packet(ip, generation, count, &size);
+  return nixbadge_mesh_broadcast_data(data, size);
+}
+
+esp_err_t nixbadge_mesh_broadcast_show(uint32_t ip, uint32_t seq, uint32_t id,
+                                       int64_t start_ms, uint32_t size) {
+  uint32_t out_size = 0;
+  const uint8_t *data = nixbadge_mesh_create_show_packet(ip, seq, id, start_ms,
+                                                         size, &out_size);
+  return nixbadge_mesh_broadcast_data(data, out_size);
+}
+
+esp_err_t nixbadge_mesh_ping() {
+  uint32_t seq = ++mesh_ping_seq;
+  uint32_t size = 0;
+  const uint8_t *data = nixbadge_mesh_create_ping_packet(
+      seq, mesh_mac, (uint32_t)esp_timer_get_time(), &size);
+  if (mesh_links) nixbadge_links_sent(mesh_links, seq);
+  return nixbadge_mesh_broadcast_data(data, size);
+}
+
+void nixbadge_mesh_get_mac(uint8_t mac[NIXBADGE_LINK_ADDR_LEN]) {
+  memcpy(mac, mesh_mac, sizeof(mesh_mac));
+}
+
+/* Called from Zig with the answer to a ping. */
+void nixbadge_mesh_pong(const uint8_t origin[NIXBADGE_LINK_ADDR_LEN],
+                        const uint8_t responder[NIXBADGE_LINK_ADDR_LEN],
+                        uint32_t seq, uint32_t sent_us) {
+  // Answers to the pings of other badges are passed along by this one.
+  if (!mesh_links || memcmp(origin, mesh_mac, sizeof(mesh_mac)) != 0) return;
+
+  int64_t now_us = esp_timer_get_time();
+  nixbadge_links_reply(mesh_links, responder, seq, (uint32_t)now_us - sent_us,
+                       now_us / 1000);
+}
+
+size_t nixbadge_mesh_get_links(nixbadge_link_t *links, size_t max) {
+  if (!mesh_links) return 0;
+  return nixbadge_links_get(mesh_links, links, max);
+}
+
+bool nixbadge_mesh_find_link(const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                             nixbadge_link_t *link) {
+  return mesh_links && nixbadge_links_find(mesh_links, addr, link);
+}
+
+/* Fills in this badge's report to the root. */
+static void nixbadge_mesh_telemetry_fill(nixbadge_telemetry_t *telemetry) {
+  memset(telemetry, 0, sizeof(*telemetry));
+  memcpy(telemetry->mac, mesh_mac, sizeof(mesh_mac));
+  esp_wifi_get_mac(WIFI_IF_AP, telemetry->ap);
+  telemetry->ip = nixbadge_mesh_get_ip().addr;
+  telemetry->level = esp_mesh_lite_get_level();
+
+  wifi_ap_record_t parent;
+  if (telemetry->level != ROOT &&
+      esp_wifi_sta_get_ap_info(&parent) == ESP_OK) {
+    memcpy(telemetry->parent, parent.bssid, sizeof(telemetry->parent));
+    telemetry->rssi = parent.rssi;
+  }
+  wifi_sta_list_t children;
+  if (esp_wifi_ap_get_sta_list(&children) == ESP_OK) {
+    telemetry->children = children.num;
+  }
+
+  uint32_t load = nixbadge_http_get_load();
+  telemetry->load = load > UINT8_MAX ? UINT8_MAX : load;
+  uint32_t heap_kib = esp_get_free_heap_size() / 1024;
+  telemetry->heap_kib = heap_kib > UINT16_MAX ? UINT16_MAX : heap_kib;
+}
+
+esp_err_t nixbadge_mesh_telemetry() {
+  int64_t now = esp_timer_get_time() / 1000;
+  if (telemetry_sent_ms &&
+      now - telemetry_sent_ms < atomic_load(&telemetry_interval_ms)) {
+    return ESP_OK;
+  }
+  telemetry_sent_ms = now;
+
+  nixbadge_telemetry_t telemetry;
+  nixbadge_mesh_telemetry_fill(&telemetry);
+  if (telemetry.level == ROOT) {
+    if (mesh_topology) {
+      atomic_store(&telemetry_interval_ms,
+                   nixbadge_topology_report(mesh_topology, &telemetry, now));
+    }
+    return ESP_OK;
+  }
+
+  uint32_t size = 0;
+  const uint8_t *data =
+      nixbadge_mesh_create_telemetry_packet(&telemetry, &size);
+  if (!data) return ESP_ERR_NO_MEM;
+
+  // A lost report is made up for by the next one.
+  esp_mesh_lite_msg_config_t config = {
+    .raw_msg = {
+      .msg_id = MESSAGE_ID,
+      .expect_resp_msg_id = RESP_MESSAGE_ID,
+      .max_retry = 0,
+      .data = (uint8_t *)data,
+      .size = size,
+      .raw_resend = esp_mesh_lite_send_raw_msg_to_root,
+    },
+  };
+  esp_err_t err = nixbadge_mesh_send_raw(&config);
+  nixbadge_mesh_tx_release(data);
+  return err;
+}
 
-    esp_mesh_lite_send_msg(ESP_MESH_LITE_RAW_MSG, &parent_config);
+/* Called from Zig with a report from another badge. */
+uint32_t nixbadge_mesh_telemetry_received(
+    const nixbadge_telemetry_t *telemetry) {
+  if (!mesh_topology || esp_mesh_lite_get_level() != ROOT) return 0;
+  return nixbadge_topology_report(mesh_topology, telemetry,
+                                  esp_timer_get_time() / 1000);
+}
+
+/* Called from Zig with the root's answer to this badge's report. */
+void nixbadge_mesh_telemetry_ack(uint32_t interval_ms) {
+  if (interval_ms < TELEMETRY_MIN_INTERVAL_MS) {
+    interval_ms = TELEMETRY_MIN_INTERVAL_MS;
+  } else if (interval_ms > TELEMETRY_MAX_INTERVAL_MS) {
+    interval_ms = TELEMETRY_MAX_INTERVAL_MS;
+  }
+  atomic_store(&telemetry_interval_ms, interval_ms);
+}
+
+bool nixbadge_mesh_write_topology(nixbadge_metrics_writer_t *writer) {
+  if (!mesh_topology || esp_mesh_lite_get_level() != ROOT) return false;
+  nixbadge_topology_write_json(mesh_topology, esp_timer_get_time() / 1000,
+                               writer);
+  return true;
+}
+
+bool nixbadge_mesh_time_now(int64_t *mesh_us, uint32_t *error_us) {
+  int64_t now = esp_timer_get_time();
+  if (!mesh_clock) {
+    *mesh_us = now;
+    *error_us = UINT32_MAX;
+    return false;
+  }
+  return nixbadge_clock_now(mesh_clock, now, mesh_us, error_us);
+}
+
+void nixbadge_mesh_get_time_stats(nixbadge_clock_stats_t *stats) {
+  if (mesh_clock) {
+    nixbadge_clock_get_stats(mesh_clock, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+uint32_t nixbadge_mesh_time_epoch() {
+  return mesh_clock ? nixbadge_clock_epoch(mesh_clock) : 0;
+}
+
+/*
+ * Called by SNTP, on the root, with the time of day it just set. Every
+ * step starts a new epoch, which the children start over in, so those of
+ * the resyncs that only correct the mesh time by a little are left out.
+ */
+static void nixbadge_mesh_sntp_synced(struct timeval *tv) {
+  int64_t now_us = tv->tv_sec * 1000000LL + tv->tv_usec;
+  int64_t mesh_us;
+  uint32_t error_us;
+  nixbadge_mesh_time_now(&mesh_us, &error_us);
+  int64_t off = now_us - mesh_us;
+  if (mesh_us >= TIME_EPOCH_MIN_US && off > -TIME_STEP_US &&
+      off < TIME_STEP_US) {
+    return;
+  }
+  if (nixbadge_clock_set(mesh_clock, esp_timer_get_time(), now_us, 0)) {
+    ESP_LOGI(TAG, "Mesh time set by SNTP, epoch %" PRIu32,
+             nixbadge_clock_epoch(mesh_clock));
+  }
+}
+
+/*
+ * Sets the time of day from the mesh time, once it follows the time of day
+ * of the root and is off from it by more than it may be.
+ */
+static void nixbadge_mesh_time_settle() {
+  int64_t mesh_us;
+  uint32_t error_us;
+  if (!nixbadge_mesh_time_now(&mesh_us, &error_us) ||
+      mesh_us < TIME_EPOCH_MIN_US || error_us > TIME_STEP_US) {
+    return;
+  }
+
+  struct timeval today;
+  gettimeofday(&today, NULL);
+  int64_t off = today.tv_sec * 1000000LL + today.tv_usec - mesh_us;
+  if (off > -TIME_STEP_US && off < TIME_STEP_US) return;
+
+  today.tv_sec = mesh_us / 1000000;
+  today.tv_usec = mesh_us % 1000000;
+  settimeofday(&today, NULL);
+  ESP_LOGI(TAG, "Time of day set from the mesh, it was %lld ms off",
+           off / 1000);
+}
+
+esp_err_t nixbadge_mesh_time_sync() {
+  if (!mesh_clock) return ESP_ERR_INVALID_STATE;
+
+  if (esp_mesh_lite_get_level() == ROOT) {
+    nixbadge_clock_lead(mesh_clock, esp_timer_get_time());
+    // Only the root has an uplink to reach a time server over.
+    if (!mesh_sntp) {
+      esp_sntp_config_t config =
+          ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_BADGE_TIME_SNTP_SERVER);
+      config.sync_cb = nixbadge_mesh_sntp_synced;
+      mesh_sntp = esp_netif_sntp_init(&config) == ESP_OK;
+    }
+    return ESP_OK;
+  }
+  nixbadge_clock_follow(mesh_clock);
+
+  uint32_t size = 0;
+  const uint8_t *data = nixbadge_mesh_create_time_request_packet(
+      (uint32_t)esp_timer_get_time(), &size);
+  if (!data) return ESP_ERR_NO_MEM;
+
+  // An exchange that was lost is made up for by the next one, one that is
+  // resent would have a round trip too long to be of use.
+  esp_mesh_lite_msg_config_t config = {
+    .raw_msg = {
+      .msg_id = MESSAGE_ID,
+      .expect_resp_msg_id = RESP_MESSAGE_ID,
+      .max_retry = 0,
+      .data = (uint8_t *)data,
+      .size = size,
+      .raw_resend = esp_mesh_lite_send_raw_msg_to_parent,
+    },
+  };
+  esp_err_t err = nixbadge_mesh_send_raw(&config);
+  nixbadge_mesh_tx_release(data);
+  return err;
+}
+
+/*
+ * Called from Zig with the parent's answer to a time request, which echoes
+ * the wrapping time it was sent.
+ */
+void nixbadge_mesh_time_answer(uint32_t sent_us, int64_t received_us,
+                               int64_t answered_us, uint32_t error_us,
+                               uint32_t epoch) {
+  if (!mesh_clock) return;
+  int64_t returned_us = esp_timer_get_time();
+  nixbadge_clock_exchange_t exchange = {
+      .sent_us = returned_us - (uint32_t)((uint32_t)returned_us - sent_us),
+      .received_us = received_us,
+      .answered_us = answered_us,
+      .returned_us = returned_us,
+      .error_us = error_us,
+      .epoch = epoch,
+  };
+  if (nixbadge_clock_exchange(mesh_clock, &exchange)) {
+    nixbadge_mesh_time_settle();
   }
-  return ESP_OK;
 }
 
-static const esp_mesh_lite_raw_msg_action_t nixbadge_mesh_action = {
-    .msg_id = MESSAGE_ID,
-    .resp_msg_id = RESP_MESSAGE_ID,
-    .raw_process = nixbadge_mesh_action_cb,
+/*
+ * Requests, and the answers to them, which carry pings, report intervals
+ * and the mesh time back.
+ */
+static const esp_mesh_lite_raw_msg_action_t nixbadge_mesh_actions[] = {
+    {
+        .msg_id = MESSAGE_ID,
+        .resp_msg_id = RESP_MESSAGE_ID,
+        .raw_process = nixbadge_mesh_action_cb,
+    },
+    {
+        .msg_id = RESP_MESSAGE_ID,
+        .resp_msg_id = 0,
+        .raw_process = nixbadge_mesh_action_cb,
+    },
+    {0},
 };
 
 void nixbadge_mesh_set_softap_info() {
@@ -106,39 +460,38 @@ void nixbadge_mesh_set_softap_info() {
   esp_mesh_lite_set_softap_info(softap_ssid, softap_psw);
 }
 
-static uint8_t *nixbadge_mesh_read_nvs(const char *key, size_t *len) {
-  nvs_handle flashcfg_handle;
-  ESP_ERROR_CHECK(nvs_open("config", NVS_READONLY, &flashcfg_handle));
-
-  uint8_t *value = malloc(*len);
-  ESP_ERROR_CHECK(nvs_get_str(flashcfg_handle, key, (char *)value, len));
-
-  nvs_close(flashcfg_handle);
-  return value;
-}
-
 esp_ip4_addr_t nixbadge_mesh_get_gateway() {
   esp_netif_ip_info_t ip_info;
   esp_netif_get_ip_info(netif_sta, &ip_info);
   return ip_info.gw;
 }
 
+esp_ip4_addr_t nixbadge_mesh_get_ip() {
+  esp_netif_ip_info_t ip_info = {0};
+  if (netif_sta) esp_netif_get_ip_info(netif_sta, &ip_info);
+  return ip_info.ip;
+}
+
 bool nixbadge_has_mesh() { return is_meshing; }
 
 void nixbadge_mesh_init() {
   is_meshing = true;
+  mesh_links = nixbadge_links_new(NIXBADGE_MESH_LINKS);
+  nixbadge_topology_config_t topology_config = {
+      .max_badges = CONFIG_BADGE_TELEMETRY_BADGES,
+      .airtime_us = TELEMETRY_AIRTIME_US,
+      .share_permille = CONFIG_BADGE_TELEMETRY_AIRTIME,
+      .min_interval_ms = TELEMETRY_MIN_INTERVAL_MS,
+      .max_interval_ms = TELEMETRY_MAX_INTERVAL_MS,
+  };
+  mesh_topology = nixbadge_topology_new(&topology_config);
+  mesh_clock = nixbadge_clock_new();
 
   // Load configuration
   esp_bridge_create_softap_netif(NULL, NULL, true, true);
   netif_sta = esp_bridge_create_station_netif(NULL, NULL, false, false);
 
-  size_t router_ssid_len = 32;
-  uint8_t *router_ssid =
-      nixbadge_mesh_read_nvs("router_ssid", &router_ssid_len);
-
-  size_t router_passwd_len = 64;
-  uint8_t *router_passwd =
-      nixbadge_mesh_read_nvs("router_passwd", &router_passwd_len);
+  const nixbadge_config_t *config = nixbadge_config_get();
 
   wifi_config_t wifi_config = {
       .sta =
@@ -149,8 +502,11 @@ void nixbadge_mesh_init() {
                   },
           },
   };
-  memcpy(&wifi_config.sta.ssid, router_ssid, router_ssid_len);
-  memcpy(&wifi_config.sta.password, router_passwd, router_passwd_len);
+  memcpy(&wifi_config.sta.ssid, config->router_ssid,
+         sizeof(wifi_config.sta.ssid));
+  memcpy(&wifi_config.sta.password, config->router_passwd,
+         sizeof(wifi_config.sta.password));
+  nixbadge_config_unref(config);
   esp_bridge_wifi_set_config(WIFI_IF_STA, &wifi_config);
 
   wifi_config_t wifi_softap_config = {
@@ -166,9 +522,10 @@ void nixbadge_mesh_init() {
   esp_mesh_lite_init(&mesh_lite_config);
 
   nixbadge_mesh_set_softap_info();
+  ESP_ERROR_CHECK(esp_wifi_get_mac(WIFI_IF_STA, mesh_mac));
 
   ESP_ERROR_CHECK(
-      esp_mesh_lite_raw_msg_action_list_register(&nixbadge_mesh_action));
+      esp_mesh_lite_raw_msg_action_list_register(nixbadge_mesh_actions));
 
   esp_mesh_lite_start();
 }
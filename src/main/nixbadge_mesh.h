@@ -2,10 +2,86 @@
 
 #include "esp_wifi.h"
 #include "esp_mesh.h"
+#include "nixbadge_clock.h"
+#include "nixbadge_links.h"
+#include "nixbadge_metrics.h"
 
+/* Neighbouring badges whose links are kept track of. */
+#define NIXBADGE_MESH_LINKS 16
+
+/* Packet kinds, matching proto.Tag. */
+#define NIXBADGE_MESH_PING 0
+#define NIXBADGE_MESH_REQ_PING 1
+#define NIXBADGE_MESH_RELOAD_CONFIG 2
+#define NIXBADGE_MESH_DIGEST 3
+
+typedef struct {
+  uint32_t slots;
+  /* Referenced, or leased to mesh-lite for its resends. */
+  uint32_t in_use;
+  uint32_t acquired;
+  /* Packets not sent because every buffer was in use. */
+  uint32_t exhausted;
+} nixbadge_mesh_tx_stats_t;
+
+/**
+ * Broadcasts a packet to the children and the parent.
+ * @return ESP_ERR_NO_MEM when every transmit buffer is still in use
+ */
 esp_err_t nixbadge_mesh_broadcast(uint8_t kind);
+/**
+ * Announces a new generation of this badge's cache digest.
+ */
+esp_err_t nixbadge_mesh_broadcast_digest(uint32_t ip, uint32_t generation,
+                                         uint32_t count);
+/**
+ * Announces the LED show this badge plays, see nixbadge_show.h.
+ */
+esp_err_t nixbadge_mesh_broadcast_show(uint32_t ip, uint32_t seq, uint32_t id,
+                                       int64_t start_ms, uint32_t size);
+/**
+ * Pings the neighbouring badges, whose answers go into the link table.
+ */
+esp_err_t nixbadge_mesh_ping();
+/**
+ * Copies the links to the badges that answered pings, see
+ * nixbadge_links_get. Last seen times are esp_timer milliseconds.
+ */
+size_t nixbadge_mesh_get_links(nixbadge_link_t* links, size_t max);
+bool nixbadge_mesh_find_link(const uint8_t addr[NIXBADGE_LINK_ADDR_LEN],
+                             nixbadge_link_t* link);
+/**
+ * Reports this badge's place in the mesh and load to the root, when the
+ * interval the root asked for has passed since the last report.
+ */
+esp_err_t nixbadge_mesh_telemetry();
+/**
+ * Writes the topology of the mesh as JSON, see nixbadge_topology.h.
+ * @return false unless this badge is the root, which keeps it
+ */
+bool nixbadge_mesh_write_topology(nixbadge_metrics_writer_t* writer);
+/**
+ * Takes the mesh time from the parent, or makes this badge the reference
+ * when it is the root, see nixbadge_clock.h.
+ */
+esp_err_t nixbadge_mesh_time_sync();
+/**
+ * Microseconds on the clock shared by the mesh, which never goes back. It
+ * is the time of day when the root got it by SNTP.
+ * @param error_us how far the mesh time may be off the root's
+ * @return false until the badge took the time from its parent, when it is
+ *         the time since boot
+ */
+bool nixbadge_mesh_time_now(int64_t* mesh_us, uint32_t* error_us);
+/**
+ * The epoch of the mesh time, which changes when the root steps it and
+ * times from before are no longer comparable, see nixbadge_clock.h.
+ */
+uint32_t nixbadge_mesh_time_epoch();
+void nixbadge_mesh_get_time_stats(nixbadge_clock_stats_t* stats);
 esp_ip4_addr_t nixbadge_mesh_get_gateway();
-float nixbadge_mesh_ping_measure(uint8_t);
+esp_ip4_addr_t nixbadge_mesh_get_ip();
+void nixbadge_mesh_get_tx_stats(nixbadge_mesh_tx_stats_t* stats);
 
 bool nixbadge_has_mesh();
 void nixbadge_mesh_init();
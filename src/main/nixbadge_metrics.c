@@ -0,0 +1,125 @@
+#include "nixbadge_metrics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define WRITER_INITIAL_SIZE 2048
+
+const uint32_t nixbadge_histogram_bounds_ms[NIXBADGE_HISTOGRAM_BUCKETS] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000,
+};
+
+uint64_t nixbadge_counter64_get(nixbadge_counter64_t* counter) {
+  uint32_t hi, lo;
+  do {
+    hi = atomic_load_explicit(&counter->hi, memory_order_relaxed);
+    lo = atomic_load_explicit(&counter->lo, memory_order_relaxed);
+  } while (hi != atomic_load_explicit(&counter->hi, memory_order_relaxed));
+  return (uint64_t)hi << 32 | lo;
+}
+
+void nixbadge_metrics_writer_init(nixbadge_metrics_writer_t* writer) {
+  writer->buf = NULL;
+  writer->len = 0;
+  writer->size = 0;
+  writer->failed = false;
+}
+
+char* nixbadge_metrics_writer_finish(nixbadge_metrics_writer_t* writer,
+                                     size_t* len) {
+  if (writer->failed) {
+    free(writer->buf);
+    writer->buf = NULL;
+  }
+  *len = writer->len;
+  return writer->buf;
+}
+
+void nixbadge_metrics_printf(nixbadge_metrics_writer_t* writer,
+                             const char* format, ...) {
+  if (writer->failed) return;
+
+  while (true) {
+    va_list args;
+    va_start(args, format);
+    size_t room = writer->size - writer->len;
+    int n = vsnprintf(writer->buf ? writer->buf + writer->len : NULL, room,
+                      format, args);
+    va_end(args);
+    if (n < 0) {
+      writer->failed = true;
+      return;
+    }
+    if ((size_t)n < room) {
+      writer->len += n;
+      return;
+    }
+
+    size_t size = writer->size ? writer->size * 2 : WRITER_INITIAL_SIZE;
+    while (size - writer->len <= (size_t)n) size *= 2;
+    char* buf = realloc(writer->buf, size);
+    if (!buf) {
+      writer->failed = true;
+      return;
+    }
+    writer->buf = buf;
+    writer->size = size;
+  }
+}
+
+void nixbadge_metrics_family(nixbadge_metrics_writer_t* writer,
+                             const char* name, const char* type,
+                             const char* help) {
+  nixbadge_metrics_printf(writer, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+                          name, type);
+}
+
+void nixbadge_metrics_sample(nixbadge_metrics_writer_t* writer,
+                             const char* name, const char* labels,
+                             int64_t value) {
+  if (labels) {
+    nixbadge_metrics_printf(writer, "%s{%s} %lld\n", name, labels,
+                            (long long)value);
+  } else {
+    nixbadge_metrics_printf(writer, "%s %lld\n", name, (long long)value);
+  }
+}
+
+void nixbadge_metrics_value(nixbadge_metrics_writer_t* writer,
+                            const char* name, const char* type,
+                            const char* help, int64_t value) {
+  nixbadge_metrics_family(writer, name, type, help);
+  nixbadge_metrics_sample(writer, name, NULL, value);
+}
+
+void nixbadge_metrics_histogram(nixbadge_metrics_writer_t* writer,
+                                const char* name, const char* labels,
+                                nixbadge_histogram_t* histogram) {
+  const char* sep = labels ? "," : "";
+  labels = labels ? labels : "";
+
+  uint64_t count = 0;
+  for (size_t i = 0; i <= NIXBADGE_HISTOGRAM_BUCKETS; i++) {
+    count += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    if (i < NIXBADGE_HISTOGRAM_BUCKETS) {
+      uint32_t bound = nixbadge_histogram_bounds_ms[i];
+      nixbadge_metrics_printf(writer, "%s_bucket{%s%sle=\"%u.%03u\"} %llu\n",
+                              name, labels, sep, (unsigned)(bound / 1000),
+                              (unsigned)(bound % 1000),
+                              (unsigned long long)count);
+    } else {
+      nixbadge_metrics_printf(writer, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                              name, labels, sep, (unsigned long long)count);
+    }
+  }
+
+  uint64_t sum_ms = nixbadge_counter64_get(&histogram->sum_ms);
+  const char* open = labels[0] ? "{" : "";
+  const char* close = labels[0] ? "}" : "";
+  nixbadge_metrics_printf(writer, "%s_sum%s%s%s %llu.%03u\n", name, open,
+                          labels, close, (unsigned long long)(sum_ms / 1000),
+                          (unsigned)(sum_ms % 1000));
+  nixbadge_metrics_printf(writer, "%s_count%s%s%s %llu\n", name, open, labels,
+                          close, (unsigned long long)count);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms cheap enough to update on every request,
+ * and their rendering in the Prometheus text format.
+ *
+ * Updates are single relaxed atomic adds, so nothing is ever locked on the
+ * hot path. Readers may see one metric a little ahead of another, which is
+ * fine for scraping. Metrics are meant to be statically allocated and
+ * zero-initialized.
+ */
+
+typedef struct {
+  atomic_uint value;
+} nixbadge_counter_t;
+
+/**
+ * 64 bits out of two 32 bit words, since the badge has no 64 bit atomics.
+ * A reader racing the carry may see a low value once every 4 GiB.
+ */
+typedef struct {
+  atomic_uint lo;
+  atomic_uint hi;
+} nixbadge_counter64_t;
+
+/* Upper bounds of the histogram buckets in milliseconds, then +Inf. */
+#define NIXBADGE_HISTOGRAM_BUCKETS 12
+extern const uint32_t nixbadge_histogram_bounds_ms[NIXBADGE_HISTOGRAM_BUCKETS];
+
+typedef struct {
+  /* Not cumulative, that is done when rendering. */
+  atomic_uint counts[NIXBADGE_HISTOGRAM_BUCKETS + 1];
+  nixbadge_counter64_t sum_ms;
+} nixbadge_histogram_t;
+
+static inline void nixbadge_counter_add(nixbadge_counter_t* counter,
+                                        uint32_t n) {
+  atomic_fetch_add_explicit(&counter->value, n, memory_order_relaxed);
+}
+
+static inline uint32_t nixbadge_counter_get(nixbadge_counter_t* counter) {
+  return atomic_load_explicit(&counter->value, memory_order_relaxed);
+}
+
+static inline void nixbadge_counter64_add(nixbadge_counter64_t* counter,
+                                          uint32_t n) {
+  uint32_t lo = atomic_fetch_add_explicit(&counter->lo, n,
+                                          memory_order_relaxed);
+  if (lo + n < lo) {
+    atomic_fetch_add_explicit(&counter->hi, 1, memory_order_relaxed);
+  }
+}
+
+uint64_t nixbadge_counter64_get(nixbadge_counter64_t* counter);
+
+static inline void nixbadge_histogram_observe(nixbadge_histogram_t* histogram,
+                                              uint32_t ms) {
+  size_t i = 0;
+  while (i < NIXBADGE_HISTOGRAM_BUCKETS &&
+         ms > nixbadge_histogram_bounds_ms[i]) {
+    i++;
+  }
+  atomic_fetch_add_explicit(&histogram->counts[i], 1, memory_order_relaxed);
+  nixbadge_counter64_add(&histogram->sum_ms, ms);
+}
+
+/**
+ * Builds a metrics page in a buffer that grows as needed. Running out of
+ * memory is remembered and reported by nixbadge_metrics_writer_finish.
+ */
+typedef struct {
+  char* buf;
+  size_t len;
+  size_t size;
+  bool failed;
+} nixbadge_metrics_writer_t;
+
+void nixbadge_metrics_writer_init(nixbadge_metrics_writer_t* writer);
+/**
+ * @return the page, which the caller frees, or NULL if it did not fit in
+ *         memory
+ */
+char* nixbadge_metrics_writer_finish(nixbadge_metrics_writer_t* writer,
+                                     size_t* len);
+
+/**
+ * Appends text as printf does, for other pages built the same way.
+ */
+void nixbadge_metrics_printf(nixbadge_metrics_writer_t* writer,
+                             const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Starts a metric family.
+ * @param type "counter", "gauge" or "histogram"
+ */
+void nixbadge_metrics_family(nixbadge_metrics_writer_t* writer,
+                             const char* name, const char* type,
+                             const char* help);
+/**
+ * Writes a sample of the current family.
+ * @param labels like `class="nar"`, or NULL
+ */
+void nixbadge_metrics_sample(nixbadge_metrics_writer_t* writer,
+                             const char* name, const char* labels,
+                             int64_t value);
+/**
+ * Writes a family with a single sample without labels.
+ */
+void nixbadge_metrics_value(nixbadge_metrics_writer_t* writer,
+                            const char* name, const char* type,
+                            const char* help, int64_t value);
+/**
+ * Writes the buckets, sum and count of a histogram, in seconds.
+ */
+void nixbadge_metrics_histogram(nixbadge_metrics_writer_t* writer,
+                                const char* name, const char* labels,
+                                nixbadge_histogram_t* histogram);
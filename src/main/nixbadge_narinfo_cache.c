@@ -0,0 +1,265 @@
+#include "nixbadge_narinfo_cache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_hash.h"
+
+#define SLOT_NONE 0xffff
+
+enum {
+  SLOT_FREE = 0,
+  SLOT_POSITIVE,
+  SLOT_NEGATIVE,
+};
+
+typedef struct {
+  char key[NIXBADGE_NARINFO_KEY_MAX + 1];
+  int64_t expires_ms;
+  uint32_t hash;
+  uint16_t len;
+  uint8_t state;
+  uint8_t referenced;
+} nixbadge_narinfo_slot_t;
+
+struct nixbadge_narinfo_cache {
+  nixbadge_narinfo_cache_config_t config;
+  pthread_mutex_t lock;
+
+  nixbadge_narinfo_slot_t* slots;
+  uint8_t* bodies;
+  size_t clock_hand;
+
+  // Open addressing index of slot numbers, SLOT_NONE when empty.
+  uint16_t* index;
+  size_t index_mask;
+
+  nixbadge_narinfo_cache_stats_t stats;
+};
+
+/* Returns the index position holding `key`, or the empty position where it
+ * would be inserted. */
+static size_t nixbadge_narinfo_probe(nixbadge_narinfo_cache_t* cache,
+                                     const char* key, uint32_t hash) {
+  size_t pos = hash & cache->index_mask;
+  while (cache->index[pos] != SLOT_NONE) {
+    nixbadge_narinfo_slot_t* slot = &cache->slots[cache->index[pos]];
+    if (slot->hash == hash && strcmp(slot->key, key) == 0) break;
+    pos = (pos + 1) & cache->index_mask;
+  }
+  return pos;
+}
+
+/* Backward shift deletion keeps probe sequences intact without
+ * tombstones. */
+static void nixbadge_narinfo_unindex(nixbadge_narinfo_cache_t* cache,
+                                     size_t pos) {
+  size_t mask = cache->index_mask;
+  size_t next = pos;
+  while (true) {
+    next = (next + 1) & mask;
+    uint16_t moved = cache->index[next];
+    if (moved == SLOT_NONE) break;
+
+    size_t home = cache->slots[moved].hash & mask;
+    // Shift back unless the entry's home lies cyclically in (pos, next].
+    bool stays = (pos <= next) ? (pos < home && home <= next)
+                               : (pos < home || home <= next);
+    if (!stays) {
+      cache->index[pos] = moved;
+      pos = next;
+    }
+  }
+  cache->index[pos] = SLOT_NONE;
+}
+
+static void nixbadge_narinfo_release(nixbadge_narinfo_cache_t* cache,
+                                     uint16_t slot_num) {
+  nixbadge_narinfo_slot_t* slot = &cache->slots[slot_num];
+  size_t pos = nixbadge_narinfo_probe(cache, slot->key, slot->hash);
+  if (cache->index[pos] == slot_num) nixbadge_narinfo_unindex(cache, pos);
+  slot->state = SLOT_FREE;
+}
+
+/* Picks a slot to (re)use with the CLOCK algorithm, preferring free and
+ * expired slots over recently referenced ones. */
+static uint16_t nixbadge_narinfo_victim(nixbadge_narinfo_cache_t* cache,
+                                        int64_t now_ms) {
+  size_t entries = cache->config.entries;
+  for (size_t i = 0; i < entries * 2; i++) {
+    uint16_t slot_num = cache->clock_hand;
+    nixbadge_narinfo_slot_t* slot = &cache->slots[slot_num];
+    cache->clock_hand = (cache->clock_hand + 1) % entries;
+
+    if (slot->state == SLOT_FREE) return slot_num;
+    if (slot->expires_ms <= now_ms) {
+      cache->stats.expirations++;
+      nixbadge_narinfo_release(cache, slot_num);
+      return slot_num;
+    }
+    if (slot->referenced) {
+      slot->referenced = 0;
+      continue;
+    }
+
+    cache->stats.evictions++;
+    nixbadge_narinfo_release(cache, slot_num);
+    return slot_num;
+  }
+
+  // Unreachable: the second sweep finds every reference bit cleared.
+  return SLOT_NONE;
+}
+
+nixbadge_narinfo_cache_t* nixbadge_narinfo_cache_new(
+    const nixbadge_narinfo_cache_config_t* config) {
+  if (config->entries == 0 || config->entries >= SLOT_NONE ||
+      config->slot_size > UINT16_MAX)
+    return NULL;
+
+  nixbadge_narinfo_cache_t* cache = calloc(1, sizeof(*cache));
+  if (!cache) return NULL;
+
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->config = *config;
+
+  // Keep the load factor at or below one half.
+  size_t index_size = 1;
+  while (index_size < config->entries * 2) index_size <<= 1;
+  cache->index_mask = index_size - 1;
+
+  cache->slots = calloc(config->entries, sizeof(nixbadge_narinfo_slot_t));
+  cache->bodies = malloc(config->entries * config->slot_size);
+  cache->index = malloc(index_size * sizeof(uint16_t));
+  if (!cache->slots || !cache->bodies || !cache->index) {
+    nixbadge_narinfo_cache_free(cache);
+    return NULL;
+  }
+
+  memset(cache->index, 0xff, index_size * sizeof(uint16_t));
+  return cache;
+}
+
+void nixbadge_narinfo_cache_free(nixbadge_narinfo_cache_t* cache) {
+  if (!cache) return;
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->index);
+  free(cache->bodies);
+  free(cache->slots);
+  free(cache);
+}
+
+size_t nixbadge_narinfo_cache_slot_size(nixbadge_narinfo_cache_t* cache) {
+  return cache->config.slot_size;
+}
+
+nixbadge_narinfo_result_t nixbadge_narinfo_cache_lookup(
+    nixbadge_narinfo_cache_t* cache, const char* key, int64_t now_ms,
+    char* body, size_t* len) {
+  uint32_t hash = nixbadge_hash_str(key);
+  nixbadge_narinfo_result_t result = NIXBADGE_NARINFO_MISS;
+
+  pthread_mutex_lock(&cache->lock);
+  size_t pos = nixbadge_narinfo_probe(cache, key, hash);
+  uint16_t slot_num = cache->index[pos];
+
+  if (slot_num != SLOT_NONE) {
+    nixbadge_narinfo_slot_t* slot = &cache->slots[slot_num];
+    if (slot->expires_ms <= now_ms) {
+      cache->stats.expirations++;
+      nixbadge_narinfo_unindex(cache, pos);
+      slot->state = SLOT_FREE;
+    } else if (slot->state == SLOT_NEGATIVE) {
+      slot->referenced = 1;
+      result = NIXBADGE_NARINFO_NEGATIVE;
+    } else {
+      slot->referenced = 1;
+      memcpy(body, cache->bodies + slot_num * cache->config.slot_size,
+             slot->len);
+      *len = slot->len;
+      result = NIXBADGE_NARINFO_HIT;
+    }
+  }
+
+  switch (result) {
+    case NIXBADGE_NARINFO_HIT:
+      cache->stats.hits++;
+      break;
+    case NIXBADGE_NARINFO_NEGATIVE:
+      cache->stats.negative_hits++;
+      break;
+    default:
+      cache->stats.misses++;
+      break;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return result;
+}
+
+static bool nixbadge_narinfo_store(nixbadge_narinfo_cache_t* cache,
+                                   const char* key, uint8_t state,
+                                   const char* body, size_t len,
+                                   int64_t expires_ms, int64_t now_ms) {
+  size_t key_len = strlen(key);
+  if (key_len > NIXBADGE_NARINFO_KEY_MAX) return false;
+
+  uint32_t hash = nixbadge_hash_str(key);
+
+  pthread_mutex_lock(&cache->lock);
+  size_t pos = nixbadge_narinfo_probe(cache, key, hash);
+  uint16_t slot_num = cache->index[pos];
+
+  if (slot_num == SLOT_NONE) {
+    slot_num = nixbadge_narinfo_victim(cache, now_ms);
+    if (slot_num == SLOT_NONE) {
+      pthread_mutex_unlock(&cache->lock);
+      return false;
+    }
+    // Releasing the victim may have shifted the index.
+    pos = nixbadge_narinfo_probe(cache, key, hash);
+    cache->index[pos] = slot_num;
+  }
+
+  nixbadge_narinfo_slot_t* slot = &cache->slots[slot_num];
+  memcpy(slot->key, key, key_len + 1);
+  slot->hash = hash;
+  slot->state = state;
+  slot->expires_ms = expires_ms;
+  slot->referenced = 0;
+  slot->len = len;
+  if (len > 0)
+    memcpy(cache->bodies + slot_num * cache->config.slot_size, body, len);
+
+  cache->stats.insertions++;
+  pthread_mutex_unlock(&cache->lock);
+  return true;
+}
+
+bool nixbadge_narinfo_cache_insert(nixbadge_narinfo_cache_t* cache,
+                                   const char* key, const char* body,
+                                   size_t len, int64_t now_ms) {
+  if (len > cache->config.slot_size) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.oversized++;
+    pthread_mutex_unlock(&cache->lock);
+    return false;
+  }
+
+  return nixbadge_narinfo_store(cache, key, SLOT_POSITIVE, body, len,
+                                now_ms + cache->config.ttl_ms, now_ms);
+}
+
+void nixbadge_narinfo_cache_insert_negative(nixbadge_narinfo_cache_t* cache,
+                                            const char* key, int64_t now_ms) {
+  nixbadge_narinfo_store(cache, key, SLOT_NEGATIVE, NULL, 0,
+                         now_ms + cache->config.negative_ttl_ms, now_ms);
+}
+
+void nixbadge_narinfo_cache_get_stats(nixbadge_narinfo_cache_t* cache,
+                                      nixbadge_narinfo_cache_stats_t* stats) {
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  pthread_mutex_unlock(&cache->lock);
+}
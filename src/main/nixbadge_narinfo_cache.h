@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded in-memory cache of narinfo bodies and 404s.
+ *
+ * Entries live in a fixed slab of equally sized slots indexed by an open
+ * addressing hash table, so the cache never allocates after creation.
+ * Replacement uses the CLOCK algorithm and entries expire after a TTL,
+ * with a separate (usually much shorter) TTL for negative results.
+ */
+
+#define NIXBADGE_NARINFO_KEY_MAX 47
+
+typedef struct nixbadge_narinfo_cache nixbadge_narinfo_cache_t;
+
+typedef struct {
+  size_t entries;
+  size_t slot_size;
+  uint32_t ttl_ms;
+  uint32_t negative_ttl_ms;
+} nixbadge_narinfo_cache_config_t;
+
+typedef struct {
+  uint32_t hits;
+  uint32_t negative_hits;
+  uint32_t misses;
+  uint32_t insertions;
+  uint32_t evictions;
+  uint32_t expirations;
+  uint32_t oversized;
+} nixbadge_narinfo_cache_stats_t;
+
+typedef enum {
+  NIXBADGE_NARINFO_MISS,
+  NIXBADGE_NARINFO_HIT,
+  NIXBADGE_NARINFO_NEGATIVE,
+} nixbadge_narinfo_result_t;
+
+nixbadge_narinfo_cache_t* nixbadge_narinfo_cache_new(
+    const nixbadge_narinfo_cache_config_t* config);
+void nixbadge_narinfo_cache_free(nixbadge_narinfo_cache_t* cache);
+
+size_t nixbadge_narinfo_cache_slot_size(nixbadge_narinfo_cache_t* cache);
+
+/**
+ * Looks up a narinfo. On a hit the body is copied into `body`, which must
+ * hold at least nixbadge_narinfo_cache_slot_size bytes.
+ */
+nixbadge_narinfo_result_t nixbadge_narinfo_cache_lookup(
+    nixbadge_narinfo_cache_t* cache, const char* key, int64_t now_ms,
+    char* body, size_t* len);
+
+/**
+ * Stores a narinfo body. Bodies larger than a slot are not cached.
+ * @return whether the body was stored
+ */
+bool nixbadge_narinfo_cache_insert(nixbadge_narinfo_cache_t* cache,
+                                   const char* key, const char* body,
+                                   size_t len, int64_t now_ms);
+void nixbadge_narinfo_cache_insert_negative(nixbadge_narinfo_cache_t* cache,
+                                            const char* key, int64_t now_ms);
+
+void nixbadge_narinfo_cache_get_stats(nixbadge_narinfo_cache_t* cache,
+                                      nixbadge_narinfo_cache_stats_t* stats);
@@ -0,0 +1,208 @@
+#include "nixbadge_p2p.h"
+
+#include <esp_http_client.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <string.h>
+
+#include "nixbadge_cache.h"
+#include "nixbadge_mesh.h"
+#include "nixbadge_peers.h"
+#include "nixbadge_storage.h"
+#include "nixbadge_utils.h"
+
+#define P2P_STACK_SIZE 4096
+#define P2P_QUEUE_SIZE 8
+#define P2P_PULL_TIMEOUT_MS 3000
+
+static const char TAG[] = "nixbadge_p2p";
+
+typedef struct {
+  uint32_t ip;
+  uint32_t generation;
+} nixbadge_p2p_pull_t;
+
+static nixbadge_peers_t* peers = NULL;
+static QueueHandle_t pulls = NULL;
+
+static SemaphoreHandle_t digest_lock = NULL;
+static uint8_t* digest = NULL;
+static uint8_t* digest_scratch = NULL;
+static uint32_t digest_generation = 0;
+static uint32_t digest_count = 0;
+static uint32_t digest_scratch_count = 0;
+
+static int64_t nixbadge_p2p_now_ms() { return esp_timer_get_time() / 1000; }
+
+static void nixbadge_p2p_add_key(void* arg, const char* key, uint64_t size) {
+  // Narinfos are answered from the upstream set, only NARs are shared.
+  size_t len = strlen(key);
+  if (len >= 8 && strcmp(key + len - 8, ".narinfo") == 0) return;
+
+  nixbadge_bloom_add(digest_scratch, CONFIG_BADGE_P2P_BLOOM_SIZE, key);
+  digest_scratch_count++;
+}
+
+/**
+ * Rebuilds the own filter when the cache changed since the last time.
+ * @return whether it was rebuilt
+ */
+static bool nixbadge_p2p_rebuild() {
+  nixbadge_cache_t* cache = nixbadge_storage_nar_cache();
+  if (!cache) return false;
+
+  nixbadge_cache_stats_t stats;
+  nixbadge_cache_get_stats(cache, &stats);
+  uint32_t generation = stats.insertions + stats.evictions + 1;
+  if (generation == digest_generation) return false;
+
+  memset(digest_scratch, 0, CONFIG_BADGE_P2P_BLOOM_SIZE);
+  digest_scratch_count = 0;
+  nixbadge_cache_foreach(cache, nixbadge_p2p_add_key, NULL);
+
+  xSemaphoreTake(digest_lock, portMAX_DELAY);
+  uint8_t* old = digest;
+  digest = digest_scratch;
+  digest_scratch = old;
+  digest_generation = generation;
+  digest_count = digest_scratch_count;
+  xSemaphoreGive(digest_lock);
+  return true;
+}
+
+static esp_err_t nixbadge_p2p_pull(const nixbadge_p2p_pull_t* pull,
+                                   uint8_t* bloom) {
+  char url[48];
+  esp_ip4_addr_t addr = {.addr = pull->ip};
+  snprintf(url, sizeof(url), "http://" IPSTR ":1008/badge/digest",
+           IP2STR(&addr));
+
+  esp_http_client_config_t config = {
+      .url = url,
+      .timeout_ms = P2P_PULL_TIMEOUT_MS,
+  };
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (!client) return ESP_ERR_NO_MEM;
+
+  int64_t started = nixbadge_p2p_now_ms();
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err == ESP_OK &&
+      (esp_http_client_fetch_headers(client) != CONFIG_BADGE_P2P_BLOOM_SIZE ||
+       esp_http_client_get_status_code(client) != 200)) {
+    err = ESP_ERR_INVALID_RESPONSE;
+  }
+
+  int len = 0;
+  while (err == ESP_OK && len < CONFIG_BADGE_P2P_BLOOM_SIZE) {
+    int n = esp_http_client_read(client, (char*)bloom + len,
+                                 CONFIG_BADGE_P2P_BLOOM_SIZE - len);
+    if (n <= 0) err = ESP_FAIL;
+    len += n;
+  }
+  esp_http_client_cleanup(client);
+
+  if (err == ESP_OK) {
+    int64_t now = nixbadge_p2p_now_ms();
+    nixbadge_peers_update(peers, pull->ip, pull->generation, bloom,
+                          now - started, now);
+  }
+  return err;
+}
+
+static void nixbadge_p2p_task(void* arg) {
+  uint8_t* bloom = malloc(CONFIG_BADGE_P2P_BLOOM_SIZE);
+  if (!bloom) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+  while (true) {
+    nixbadge_p2p_pull_t pull;
+    if (xQueueReceive(pulls, &pull, pdMS_TO_TICKS(1000))) {
+      esp_err_t err = nixbadge_p2p_pull(&pull, bloom);
+      if (err != ESP_OK) {
+        esp_ip4_addr_t addr = {.addr = pull.ip};
+        ESP_LOGW(TAG, "Failed to pull the digest of " IPSTR ": %s",
+                 IP2STR(&addr), esp_err_to_name(err));
+        nixbadge_peers_failed(peers, pull.ip);
+      }
+    }
+
+    // Changes are announced right away, nixbadge_p2p_gossip repeats them
+    // for peers that joined since.
+    if (nixbadge_p2p_rebuild()) nixbadge_p2p_gossip();
+  }
+}
+
+void nixbadge_p2p_init() {
+  peers = nixbadge_peers_new(CONFIG_BADGE_P2P_MAX_PEERS,
+                             CONFIG_BADGE_P2P_BLOOM_SIZE,
+                             CONFIG_BADGE_P2P_ANNOUNCE_INTERVAL * 3000);
+  pulls = xQueueCreate(P2P_QUEUE_SIZE, sizeof(nixbadge_p2p_pull_t));
+  digest_lock = xSemaphoreCreateMutex();
+  digest = calloc(1, CONFIG_BADGE_P2P_BLOOM_SIZE);
+  digest_scratch = calloc(1, CONFIG_BADGE_P2P_BLOOM_SIZE);
+  if (!peers || !pulls || !digest_lock || !digest || !digest_scratch) {
+    ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+  }
+
+  nixbadge_task_create(nixbadge_p2p_task, "p2p", P2P_STACK_SIZE, NULL, 3);
+}
+
+void nixbadge_p2p_gossip() {
+  if (!digest_lock) return;
+  esp_ip4_addr_t ip = nixbadge_mesh_get_ip();
+  if (ip.addr == 0) return;
+
+  xSemaphoreTake(digest_lock, portMAX_DELAY);
+  uint32_t generation = digest_generation, count = digest_count;
+  xSemaphoreGive(digest_lock);
+  nixbadge_mesh_broadcast_digest(ip.addr, generation, count);
+}
+
+size_t nixbadge_p2p_lookup(const char* key, uint32_t* ips, size_t max) {
+  if (!peers) return 0;
+  return nixbadge_peers_lookup(peers, key, nixbadge_p2p_now_ms(), ips, max);
+}
+
+void nixbadge_p2p_failed(uint32_t ip) {
+  if (peers) nixbadge_peers_fetch_failed(peers, ip);
+}
+
+void nixbadge_p2p_get_stats(nixbadge_peers_stats_t* stats) {
+  if (peers) {
+    nixbadge_peers_get_stats(peers, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
+esp_err_t nixbadge_p2p_get_digest(uint8_t** bloom, size_t* len) {
+  if (!digest) return ESP_ERR_INVALID_STATE;
+
+  *bloom = malloc(CONFIG_BADGE_P2P_BLOOM_SIZE);
+  if (!*bloom) return ESP_ERR_NO_MEM;
+
+  xSemaphoreTake(digest_lock, portMAX_DELAY);
+  memcpy(*bloom, digest, CONFIG_BADGE_P2P_BLOOM_SIZE);
+  xSemaphoreGive(digest_lock);
+  *len = CONFIG_BADGE_P2P_BLOOM_SIZE;
+  return ESP_OK;
+}
+
+void nixbadge_p2p_announce(uint32_t ip, uint32_t generation, uint32_t count) {
+  if (!peers || ip == nixbadge_mesh_get_ip().addr) return;
+
+  esp_ip4_addr_t addr = {.addr = ip};
+  ESP_LOGD(TAG, IPSTR " holds %lu objects (generation %lu)", IP2STR(&addr),
+           count, generation);
+  if (nixbadge_peers_announce(peers, ip, generation, nixbadge_p2p_now_ms())) {
+    nixbadge_p2p_pull_t pull = {
+        .ip = ip,
+        .generation = generation,
+    };
+    // Dropped when busy, the next announcement asks again.
+    xQueueSend(pulls, &pull, 0);
+  }
+}
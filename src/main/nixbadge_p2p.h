@@ -0,0 +1,49 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nixbadge_peers.h"
+
+/*
+ * Mesh-wide index of what the badges have cached, so that NARs can be
+ * fetched from a sibling instead of going through the root's uplink.
+ *
+ * Every badge keeps a Bloom filter of its cached NARs and announces its
+ * generation over the mesh; the filters are pulled over HTTP from
+ * /badge/digest by the badges that hear about them.
+ */
+
+void nixbadge_p2p_init();
+/**
+ * Announces the current generation of the own filter, which is to be done
+ * every CONFIG_BADGE_P2P_ANNOUNCE_INTERVAL for badges that join the mesh.
+ */
+void nixbadge_p2p_gossip();
+
+/**
+ * Finds the peers that probably have `key`, nearest first.
+ * @return the number of IPv4 addresses (network order) written to `ips`
+ */
+size_t nixbadge_p2p_lookup(const char* key, uint32_t* ips, size_t max);
+/**
+ * Reports that a peer did not answer, so it is skipped until it announces
+ * itself again.
+ */
+void nixbadge_p2p_failed(uint32_t ip);
+
+/**
+ * Copies the counters of the peers' filters, zeroed before the mesh is up.
+ */
+void nixbadge_p2p_get_stats(nixbadge_peers_stats_t* stats);
+
+/**
+ * Copies this badge's own filter into a newly allocated buffer.
+ */
+esp_err_t nixbadge_p2p_get_digest(uint8_t** bloom, size_t* len);
+
+/**
+ * Called from the mesh when a peer announces its filter.
+ */
+void nixbadge_p2p_announce(uint32_t ip, uint32_t generation, uint32_t count);
@@ -0,0 +1,238 @@
+#include "nixbadge_peers.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t ip;
+  uint32_t generation;
+  /* Generation of the filter we hold, which may lag behind. */
+  uint32_t pulled_generation;
+  bool pulled;
+  bool failed;
+  uint32_t rtt_ms;
+  int64_t seen_ms;
+  uint8_t* bloom;
+} nixbadge_peer_t;
+
+struct nixbadge_peers {
+  pthread_mutex_t lock;
+  nixbadge_peer_t* peers;
+  size_t max_peers;
+  size_t bloom_len;
+  uint32_t expiry_ms;
+  nixbadge_peers_stats_t stats;
+};
+
+/**
+ * Two independent hashes of the key for double hashing.
+ */
+static void nixbadge_bloom_hash(const char* key, uint32_t* h1, uint32_t* h2) {
+  uint64_t hash = 14695981039346656037ull;
+  for (const char* c = key; *c; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211ull;
+  }
+  *h1 = (uint32_t)hash;
+  *h2 = (uint32_t)(hash >> 32) | 1;
+}
+
+void nixbadge_bloom_add(uint8_t* bloom, size_t len, const char* key) {
+  uint32_t h1, h2;
+  nixbadge_bloom_hash(key, &h1, &h2);
+
+  size_t bits = len * 8;
+  for (int i = 0; i < NIXBADGE_PEERS_HASHES; i++) {
+    size_t bit = (h1 + i * h2) % bits;
+    bloom[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+bool nixbadge_bloom_contains(const uint8_t* bloom, size_t len,
+                             const char* key) {
+  uint32_t h1, h2;
+  nixbadge_bloom_hash(key, &h1, &h2);
+
+  size_t bits = len * 8;
+  for (int i = 0; i < NIXBADGE_PEERS_HASHES; i++) {
+    size_t bit = (h1 + i * h2) % bits;
+    if (!(bloom[bit / 8] & (1 << (bit % 8)))) return false;
+  }
+  return true;
+}
+
+nixbadge_peers_t* nixbadge_peers_new(size_t max_peers, size_t bloom_len,
+                                     uint32_t expiry_ms) {
+  nixbadge_peers_t* peers = calloc(1, sizeof(*peers));
+  if (!peers) return NULL;
+  pthread_mutex_init(&peers->lock, NULL);
+  peers->max_peers = max_peers;
+  peers->bloom_len = bloom_len;
+  peers->expiry_ms = expiry_ms;
+
+  peers->peers = calloc(max_peers, sizeof(nixbadge_peer_t));
+  if (!peers->peers) {
+    nixbadge_peers_free(peers);
+    return NULL;
+  }
+  for (size_t i = 0; i < max_peers; i++) {
+    peers->peers[i].bloom = calloc(1, bloom_len);
+    if (!peers->peers[i].bloom) {
+      nixbadge_peers_free(peers);
+      return NULL;
+    }
+  }
+  return peers;
+}
+
+void nixbadge_peers_free(nixbadge_peers_t* peers) {
+  if (!peers) return;
+  if (peers->peers) {
+    for (size_t i = 0; i < peers->max_peers; i++) free(peers->peers[i].bloom);
+  }
+  free(peers->peers);
+  pthread_mutex_destroy(&peers->lock);
+  free(peers);
+}
+
+size_t nixbadge_peers_bloom_len(nixbadge_peers_t* peers) {
+  return peers->bloom_len;
+}
+
+/**
+ * Called with the lock held.
+ */
+static void nixbadge_peers_expire(nixbadge_peers_t* peers, int64_t now_ms) {
+  for (size_t i = 0; i < peers->max_peers; i++) {
+    nixbadge_peer_t* peer = &peers->peers[i];
+    if (peer->ip && now_ms - peer->seen_ms > peers->expiry_ms) {
+      peer->ip = 0;
+      peers->stats.expired++;
+    }
+  }
+}
+
+/**
+ * Called with the lock held.
+ */
+static nixbadge_peer_t* nixbadge_peers_find(nixbadge_peers_t* peers,
+                                            uint32_t ip) {
+  for (size_t i = 0; i < peers->max_peers; i++) {
+    if (peers->peers[i].ip == ip) return &peers->peers[i];
+  }
+  return NULL;
+}
+
+bool nixbadge_peers_announce(nixbadge_peers_t* peers, uint32_t ip,
+                             uint32_t generation, int64_t now_ms) {
+  if (ip == 0) return false;
+
+  pthread_mutex_lock(&peers->lock);
+  peers->stats.announcements++;
+  nixbadge_peers_expire(peers, now_ms);
+
+  nixbadge_peer_t* peer = nixbadge_peers_find(peers, ip);
+  if (!peer) {
+    // Take a free slot, or the one heard from the longest ago.
+    for (size_t i = 0; i < peers->max_peers; i++) {
+      nixbadge_peer_t* slot = &peers->peers[i];
+      if (!peer || !slot->ip ||
+          (peer->ip && slot->seen_ms < peer->seen_ms)) {
+        peer = slot;
+        if (!slot->ip) break;
+      }
+    }
+
+    uint8_t* bloom = peer->bloom;
+    memset(peer, 0, sizeof(*peer));
+    peer->bloom = bloom;
+    peer->ip = ip;
+  }
+
+  bool pull = !peer->pulled || peer->pulled_generation != generation ||
+              peer->failed;
+  peer->generation = generation;
+  peer->seen_ms = now_ms;
+  pthread_mutex_unlock(&peers->lock);
+  return pull;
+}
+
+void nixbadge_peers_update(nixbadge_peers_t* peers, uint32_t ip,
+                           uint32_t generation, const uint8_t* bloom,
+                           uint32_t rtt_ms, int64_t now_ms) {
+  pthread_mutex_lock(&peers->lock);
+  peers->stats.pulls++;
+  nixbadge_peer_t* peer = nixbadge_peers_find(peers, ip);
+  if (peer) {
+    memcpy(peer->bloom, bloom, peers->bloom_len);
+    peer->pulled = true;
+    peer->pulled_generation = generation;
+    peer->failed = false;
+    // Smooth out the odd slow pull.
+    peer->rtt_ms = peer->rtt_ms ? (peer->rtt_ms * 3 + rtt_ms) / 4 : rtt_ms;
+    peer->seen_ms = now_ms;
+  }
+  pthread_mutex_unlock(&peers->lock);
+}
+
+/* Leaves a peer out of lookups, with the lock held. */
+static void nixbadge_peers_skip(nixbadge_peers_t* peers, uint32_t ip) {
+  nixbadge_peer_t* peer = nixbadge_peers_find(peers, ip);
+  if (peer) peer->failed = true;
+}
+
+void nixbadge_peers_failed(nixbadge_peers_t* peers, uint32_t ip) {
+  pthread_mutex_lock(&peers->lock);
+  peers->stats.pull_failures++;
+  nixbadge_peers_skip(peers, ip);
+  pthread_mutex_unlock(&peers->lock);
+}
+
+void nixbadge_peers_fetch_failed(nixbadge_peers_t* peers, uint32_t ip) {
+  pthread_mutex_lock(&peers->lock);
+  peers->stats.fetch_failures++;
+  nixbadge_peers_skip(peers, ip);
+  pthread_mutex_unlock(&peers->lock);
+}
+
+size_t nixbadge_peers_lookup(nixbadge_peers_t* peers, const char* key,
+                             int64_t now_ms, uint32_t* ips, size_t max) {
+  uint32_t rtts[max > 0 ? max : 1];
+  size_t count = 0;
+
+  pthread_mutex_lock(&peers->lock);
+  peers->stats.lookups++;
+  nixbadge_peers_expire(peers, now_ms);
+
+  for (size_t i = 0; i < peers->max_peers; i++) {
+    nixbadge_peer_t* peer = &peers->peers[i];
+    if (!peer->ip || !peer->pulled || peer->failed) continue;
+    if (!nixbadge_bloom_contains(peer->bloom, peers->bloom_len, key)) continue;
+
+    // Insertion sort by round trip time, keeping the nearest `max`.
+    size_t j = count < max ? count++ : max;
+    while (j > 0 && rtts[j - 1] > peer->rtt_ms) {
+      if (j < max) {
+        ips[j] = ips[j - 1];
+        rtts[j] = rtts[j - 1];
+      }
+      j--;
+    }
+    if (j < max) {
+      ips[j] = peer->ip;
+      rtts[j] = peer->rtt_ms;
+    }
+  }
+
+  if (count > 0) peers->stats.matches++;
+  pthread_mutex_unlock(&peers->lock);
+  return count;
+}
+
+void nixbadge_peers_get_stats(nixbadge_peers_t* peers,
+                              nixbadge_peers_stats_t* stats) {
+  pthread_mutex_lock(&peers->lock);
+  *stats = peers->stats;
+  pthread_mutex_unlock(&peers->lock);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * What other badges on the mesh have in their caches.
+ *
+ * Every badge summarizes the keys of its cache in a Bloom filter. Peers
+ * announce a new generation of their filter over the mesh, the filter
+ * itself is pulled over HTTP, and lookups return the peers that probably
+ * have a key, nearest (by round trip time) first. False positives just
+ * cost a request that the peer answers with a 404.
+ */
+
+#define NIXBADGE_PEERS_HASHES 4
+
+typedef struct nixbadge_peers nixbadge_peers_t;
+
+typedef struct {
+  uint32_t announcements;
+  uint32_t pulls;
+  /* Filters that could not be pulled. */
+  uint32_t pull_failures;
+  /* NARs a peer's filter promised and that could not be fetched from it. */
+  uint32_t fetch_failures;
+  uint32_t lookups;
+  uint32_t matches;
+  uint32_t expired;
+} nixbadge_peers_stats_t;
+
+void nixbadge_bloom_add(uint8_t* bloom, size_t len, const char* key);
+bool nixbadge_bloom_contains(const uint8_t* bloom, size_t len,
+                             const char* key);
+
+/**
+ * @param max_peers number of peers to keep track of
+ * @param bloom_len size of every filter in bytes
+ * @param expiry_ms how long a peer is kept without hearing from it
+ */
+nixbadge_peers_t* nixbadge_peers_new(size_t max_peers, size_t bloom_len,
+                                     uint32_t expiry_ms);
+void nixbadge_peers_free(nixbadge_peers_t* peers);
+size_t nixbadge_peers_bloom_len(nixbadge_peers_t* peers);
+
+/**
+ * Records an announcement of a peer's filter generation.
+ * @return whether the filter should be pulled
+ */
+bool nixbadge_peers_announce(nixbadge_peers_t* peers, uint32_t ip,
+                             uint32_t generation, int64_t now_ms);
+/**
+ * Stores a pulled filter, which has to be nixbadge_peers_bloom_len bytes.
+ */
+void nixbadge_peers_update(nixbadge_peers_t* peers, uint32_t ip,
+                           uint32_t generation, const uint8_t* bloom,
+                           uint32_t rtt_ms, int64_t now_ms);
+/**
+ * Records that a peer's filter could not be pulled; it is skipped in
+ * lookups until it announces a new filter.
+ */
+void nixbadge_peers_failed(nixbadge_peers_t* peers, uint32_t ip);
+/**
+ * Records that a NAR could not be fetched from a peer, which is skipped
+ * like one whose filter could not be pulled.
+ */
+void nixbadge_peers_fetch_failed(nixbadge_peers_t* peers, uint32_t ip);
+
+/**
+ * Finds the peers that probably have `key`, nearest first.
+ * @return the number of addresses written to `ips`
+ */
+size_t nixbadge_peers_lookup(nixbadge_peers_t* peers, const char* key,
+                             int64_t now_ms, uint32_t* ips, size_t max);
+
+void nixbadge_peers_get_stats(nixbadge_peers_t* peers,
+                              nixbadge_peers_stats_t* stats);
@@ -0,0 +1,236 @@
+#include "nixbadge_periodic.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* Longest the loop sleeps while there are no jobs. */
+#define PERIODIC_IDLE_MS 1000
+
+typedef struct {
+  nixbadge_periodic_job_t job;
+  int64_t deadline_ms;
+  nixbadge_periodic_stats_t stats;
+} nixbadge_periodic_entry_t;
+
+struct nixbadge_periodic {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  nixbadge_periodic_entry_t* entries;
+  size_t len;
+  size_t max_jobs;
+
+  /* Indices into `entries`, a min-heap by deadline. */
+  size_t* heap;
+  size_t heap_len;
+  /* Whether a job was added since the loop last looked at the heap. */
+  bool added;
+
+  uint32_t random;
+};
+
+int64_t nixbadge_periodic_clock_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+nixbadge_periodic_t* nixbadge_periodic_new(size_t max_jobs, uint32_t seed) {
+  nixbadge_periodic_t* periodic = calloc(1, sizeof(*periodic));
+  if (!periodic) return NULL;
+
+  periodic->entries = calloc(max_jobs, sizeof(*periodic->entries));
+  periodic->heap = calloc(max_jobs, sizeof(*periodic->heap));
+  if (!periodic->entries || !periodic->heap) {
+    free(periodic->entries);
+    free(periodic->heap);
+    free(periodic);
+    return NULL;
+  }
+
+  pthread_mutex_init(&periodic->lock, NULL);
+  pthread_cond_init(&periodic->cond, NULL);
+  periodic->max_jobs = max_jobs;
+  periodic->random = seed ? seed : 1;
+  return periodic;
+}
+
+void nixbadge_periodic_free(nixbadge_periodic_t* periodic) {
+  if (!periodic) return;
+  pthread_cond_destroy(&periodic->cond);
+  pthread_mutex_destroy(&periodic->lock);
+  free(periodic->entries);
+  free(periodic->heap);
+  free(periodic);
+}
+
+/* A number from 0 to `max`, with the lock held. */
+static uint32_t nixbadge_periodic_random(nixbadge_periodic_t* periodic,
+                                         uint32_t max) {
+  uint32_t x = periodic->random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  periodic->random = x;
+  return max ? x % (max + 1) : 0;
+}
+
+static bool nixbadge_periodic_before(nixbadge_periodic_t* periodic, size_t a,
+                                     size_t b) {
+  return periodic->entries[periodic->heap[a]].deadline_ms <
+         periodic->entries[periodic->heap[b]].deadline_ms;
+}
+
+static void nixbadge_periodic_swap(nixbadge_periodic_t* periodic, size_t a,
+                                   size_t b) {
+  size_t tmp = periodic->heap[a];
+  periodic->heap[a] = periodic->heap[b];
+  periodic->heap[b] = tmp;
+}
+
+/* Adds an entry to the heap, with the lock held. */
+static void nixbadge_periodic_push(nixbadge_periodic_t* periodic,
+                                   size_t entry) {
+  size_t i = periodic->heap_len++;
+  periodic->heap[i] = entry;
+  while (i > 0 && nixbadge_periodic_before(periodic, i, (i - 1) / 2)) {
+    nixbadge_periodic_swap(periodic, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+/*
+ * Takes the entry with the earliest deadline off the heap, with the lock
+ * held.
+ */
+static size_t nixbadge_periodic_pop(nixbadge_periodic_t* periodic) {
+  size_t entry = periodic->heap[0];
+  periodic->heap[0] = periodic->heap[--periodic->heap_len];
+
+  size_t i = 0;
+  while (true) {
+    size_t least = i, left = 2 * i + 1, right = 2 * i + 2;
+    if (left < periodic->heap_len &&
+        nixbadge_periodic_before(periodic, left, least)) {
+      least = left;
+    }
+    if (right < periodic->heap_len &&
+        nixbadge_periodic_before(periodic, right, least)) {
+      least = right;
+    }
+    if (least == i) break;
+    nixbadge_periodic_swap(periodic, i, least);
+    i = least;
+  }
+  return entry;
+}
+
+int nixbadge_periodic_add(nixbadge_periodic_t* periodic,
+                          const nixbadge_periodic_job_t* job, int64_t now_ms) {
+  if (!job->period_ms || job->jitter_ms >= job->period_ms) return -1;
+
+  pthread_mutex_lock(&periodic->lock);
+  if (periodic->len == periodic->max_jobs) {
+    pthread_mutex_unlock(&periodic->lock);
+    return -1;
+  }
+
+  size_t i = periodic->len++;
+  nixbadge_periodic_entry_t* entry = &periodic->entries[i];
+  entry->job = *job;
+  entry->deadline_ms =
+      now_ms + nixbadge_periodic_random(periodic, job->jitter_ms);
+  nixbadge_periodic_push(periodic, i);
+  // The loop may be asleep until a later deadline.
+  periodic->added = true;
+  pthread_cond_signal(&periodic->cond);
+  pthread_mutex_unlock(&periodic->lock);
+  return i;
+}
+
+/*
+ * Sets the deadline after the one that was just run, with the lock held.
+ * Periods that already went by are skipped.
+ */
+static void nixbadge_periodic_reschedule(nixbadge_periodic_t* periodic,
+                                         nixbadge_periodic_entry_t* entry,
+                                         int64_t now_ms) {
+  const nixbadge_periodic_job_t* job = &entry->job;
+  int64_t period = job->period_ms;
+  if (now_ms - entry->deadline_ms >= period) {
+    int64_t missed = (now_ms - entry->deadline_ms) / period;
+    entry->stats.skipped += missed;
+    entry->deadline_ms += missed * period;
+  }
+
+  int64_t jitter = (int64_t)nixbadge_periodic_random(periodic,
+                                                     2 * job->jitter_ms) -
+                   job->jitter_ms;
+  entry->deadline_ms += period + jitter;
+  if (entry->deadline_ms <= now_ms) entry->deadline_ms = now_ms + 1;
+}
+
+uint32_t nixbadge_periodic_run(nixbadge_periodic_t* periodic, int64_t now_ms) {
+  pthread_mutex_lock(&periodic->lock);
+  periodic->added = false;
+  while (periodic->heap_len &&
+         periodic->entries[periodic->heap[0]].deadline_ms <= now_ms) {
+    size_t i = nixbadge_periodic_pop(periodic);
+    nixbadge_periodic_entry_t* entry = &periodic->entries[i];
+    uint32_t late = now_ms - entry->deadline_ms;
+    if (late > entry->stats.max_late_ms) entry->stats.max_late_ms = late;
+    entry->stats.runs++;
+    nixbadge_periodic_reschedule(periodic, entry, now_ms);
+    nixbadge_periodic_job_t job = entry->job;
+
+    // Jobs may add others, and take their time without holding up adding.
+    pthread_mutex_unlock(&periodic->lock);
+    job.fn(job.arg);
+    pthread_mutex_lock(&periodic->lock);
+    nixbadge_periodic_push(periodic, i);
+  }
+
+  uint32_t wait = PERIODIC_IDLE_MS;
+  if (periodic->heap_len) {
+    int64_t next = periodic->entries[periodic->heap[0]].deadline_ms - now_ms;
+    if (next < wait) wait = next;
+  }
+  pthread_mutex_unlock(&periodic->lock);
+  return wait;
+}
+
+void nixbadge_periodic_loop(nixbadge_periodic_t* periodic) {
+  while (true) {
+    int64_t now = nixbadge_periodic_clock_ms();
+    uint32_t wait = nixbadge_periodic_run(periodic, now);
+    int64_t ran = nixbadge_periodic_clock_ms() - now;
+    if (ran >= wait) continue;
+
+    // Condition variables wait for the time of day, which may be set while
+    // jobs are due on the monotonic clock.
+    struct timeval today;
+    gettimeofday(&today, NULL);
+    int64_t deadline = today.tv_sec * 1000LL + today.tv_usec / 1000 +
+                       (wait - ran);
+    struct timespec abstime = {
+        .tv_sec = deadline / 1000,
+        .tv_nsec = (deadline % 1000) * 1000000LL,
+    };
+    pthread_mutex_lock(&periodic->lock);
+    if (!periodic->added) {
+      pthread_cond_timedwait(&periodic->cond, &periodic->lock, &abstime);
+    }
+    pthread_mutex_unlock(&periodic->lock);
+  }
+}
+
+bool nixbadge_periodic_get_stats(nixbadge_periodic_t* periodic, int job,
+                                 nixbadge_periodic_stats_t* stats) {
+  pthread_mutex_lock(&periodic->lock);
+  bool found = job >= 0 && (size_t)job < periodic->len;
+  if (found) *stats = periodic->entries[job].stats;
+  pthread_mutex_unlock(&periodic->lock);
+  return found;
+}
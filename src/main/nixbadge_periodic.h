@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Runs jobs that come back periodically, like pinging the mesh or drawing
+ * the next LED frame, from one task.
+ *
+ * Jobs are kept in a min-heap by deadline, and the task sleeps until the
+ * earliest one. Every period may be made a little longer or shorter at
+ * random, so that badges switched on together don't keep sending at the
+ * same time. A job that fell behind by more than a period skips the ones
+ * it missed rather than running for each of them.
+ *
+ * nixbadge_periodic_run takes the time, so that jobs can be driven by a
+ * fake clock, and only nixbadge_periodic_loop looks at the real one, the
+ * monotonic clock of nixbadge_periodic_clock_ms.
+ */
+
+typedef struct nixbadge_periodic nixbadge_periodic_t;
+
+typedef void (*nixbadge_periodic_fn_t)(void* arg);
+
+typedef struct {
+  const char* name;
+  uint32_t period_ms;
+  /*
+   * Each period is up to this much longer or shorter, and the first run
+   * comes up to this much after the job was added. Less than the period.
+   */
+  uint32_t jitter_ms;
+  nixbadge_periodic_fn_t fn;
+  void* arg;
+} nixbadge_periodic_job_t;
+
+typedef struct {
+  uint32_t runs;
+  /* Periods left out because the job was that far behind. */
+  uint32_t skipped;
+  /* Most a run started after its deadline. */
+  uint32_t max_late_ms;
+} nixbadge_periodic_stats_t;
+
+/**
+ * @param max_jobs number of jobs that can be added
+ * @param seed of the jitter, which should differ between badges
+ */
+nixbadge_periodic_t* nixbadge_periodic_new(size_t max_jobs, uint32_t seed);
+void nixbadge_periodic_free(nixbadge_periodic_t* periodic);
+
+/**
+ * Adds a job, which may be done from a job or from another task.
+ * @return the index of the job, or -1 when there is no room for it or its
+ *         period is 0 or not longer than the jitter
+ */
+int nixbadge_periodic_add(nixbadge_periodic_t* periodic,
+                          const nixbadge_periodic_job_t* job, int64_t now_ms);
+
+/**
+ * Runs the jobs that are due, in the order of their deadlines.
+ * @return how long until the next deadline
+ */
+uint32_t nixbadge_periodic_run(nixbadge_periodic_t* periodic, int64_t now_ms);
+
+/**
+ * Milliseconds on the monotonic clock, for adding jobs to be run by
+ * nixbadge_periodic_loop.
+ */
+int64_t nixbadge_periodic_clock_ms();
+
+/**
+ * Runs jobs as they come due, never returns.
+ */
+void nixbadge_periodic_loop(nixbadge_periodic_t* periodic);
+
+/**
+ * @return false if there is no such job
+ */
+bool nixbadge_periodic_get_stats(nixbadge_periodic_t* periodic, int job,
+                                 nixbadge_periodic_stats_t* stats);
@@ -0,0 +1,249 @@
+#include "nixbadge_pipe.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+enum {
+  PIPE_RUNNING = 0,
+  PIPE_DONE,
+  PIPE_FAILED,
+};
+
+struct nixbadge_pipe {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  uint8_t* data;
+  size_t* lens;
+  size_t buffers;
+  size_t buffer_size;
+
+  /*
+   * Buffers are used in turn: the producer fills number `committed`, the
+   * consumer reads number `released`, and those in between are waiting.
+   */
+  uint64_t committed;
+  uint64_t released;
+  size_t fill;
+  uint8_t state;
+  bool aborted;
+  bool copying;
+  bool consumer_waiting;
+
+  nixbadge_pipe_notify_t notify;
+  void* notify_arg;
+
+  nixbadge_pipe_stats_t stats;
+};
+
+nixbadge_pipe_t* nixbadge_pipe_new(size_t buffers, size_t buffer_size) {
+  nixbadge_pipe_t* pipe = calloc(1, sizeof(*pipe));
+  if (!pipe) return NULL;
+
+  pipe->data = malloc(buffers * buffer_size);
+  pipe->lens = calloc(buffers, sizeof(size_t));
+  if (!pipe->data || !pipe->lens) {
+    free(pipe->data);
+    free(pipe->lens);
+    free(pipe);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->cond, NULL);
+  pipe->buffers = buffers;
+  pipe->buffer_size = buffer_size;
+  pipe->stats.buffers = buffers;
+  return pipe;
+}
+
+void nixbadge_pipe_free(nixbadge_pipe_t* pipe) {
+  if (!pipe) return;
+  pthread_cond_destroy(&pipe->cond);
+  pthread_mutex_destroy(&pipe->lock);
+  free(pipe->data);
+  free(pipe->lens);
+  free(pipe);
+}
+
+void nixbadge_pipe_reset(nixbadge_pipe_t* pipe) {
+  pthread_mutex_lock(&pipe->lock);
+  pipe->committed = 0;
+  pipe->released = 0;
+  pipe->fill = 0;
+  pipe->state = PIPE_RUNNING;
+  pipe->aborted = false;
+  pipe->consumer_waiting = false;
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+void nixbadge_pipe_set_notify(nixbadge_pipe_t* pipe,
+                              nixbadge_pipe_notify_t notify, void* arg) {
+  pthread_mutex_lock(&pipe->lock);
+  pipe->notify = notify;
+  pipe->notify_arg = arg;
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Hands the producer's buffer over, with the lock held. */
+static void nixbadge_pipe_commit(nixbadge_pipe_t* pipe) {
+  pipe->lens[pipe->committed % pipe->buffers] = pipe->fill;
+  pipe->committed++;
+  pipe->fill = 0;
+  pthread_cond_broadcast(&pipe->cond);
+}
+
+/* Unlocks, then lets the consumer know if anything changed for it. */
+static void nixbadge_pipe_unlock_notify(nixbadge_pipe_t* pipe,
+                                        uint64_t committed) {
+  bool changed = pipe->committed != committed || pipe->state != PIPE_RUNNING;
+  nixbadge_pipe_notify_t notify = pipe->notify;
+  void* arg = pipe->notify_arg;
+  pthread_mutex_unlock(&pipe->lock);
+  if (changed && notify) notify(arg);
+}
+
+static int nixbadge_pipe_put(nixbadge_pipe_t* pipe, const void* data,
+                             size_t len, bool more) {
+  const uint8_t* bytes = data;
+
+  pthread_mutex_lock(&pipe->lock);
+  uint64_t committed = pipe->committed;
+  while (len > 0) {
+    if (pipe->committed - pipe->released >= pipe->buffers) {
+      pipe->stats.producer_waits++;
+      while (pipe->committed - pipe->released >= pipe->buffers &&
+             !pipe->aborted) {
+        pthread_cond_wait(&pipe->cond, &pipe->lock);
+      }
+    }
+    if (pipe->aborted) break;
+
+    // The buffer being filled is ours alone, copy without the lock.
+    uint8_t* buffer =
+        pipe->data + (pipe->committed % pipe->buffers) * pipe->buffer_size;
+    size_t fill = pipe->fill;
+    size_t n = pipe->buffer_size - fill;
+    if (n > len) n = len;
+    pipe->copying = true;
+    pthread_mutex_unlock(&pipe->lock);
+    memcpy(buffer + fill, bytes, n);
+    pthread_mutex_lock(&pipe->lock);
+    pipe->copying = false;
+
+    pipe->fill += n;
+    bytes += n;
+    len -= n;
+    if (pipe->fill == pipe->buffer_size) nixbadge_pipe_commit(pipe);
+  }
+
+  // Don't sit on data the consumer could already be sending.
+  if (pipe->fill > 0 && pipe->consumer_waiting && !more) {
+    nixbadge_pipe_commit(pipe);
+  }
+
+  int err = pipe->aborted ? -EPIPE : 0;
+  nixbadge_pipe_unlock_notify(pipe, committed);
+  return err;
+}
+
+int nixbadge_pipe_write(nixbadge_pipe_t* pipe, const void* data, size_t len) {
+  return nixbadge_pipe_put(pipe, data, len, false);
+}
+
+int nixbadge_pipe_write_more(nixbadge_pipe_t* pipe, const void* data,
+                             size_t len) {
+  return nixbadge_pipe_put(pipe, data, len, true);
+}
+
+size_t nixbadge_pipe_room(nixbadge_pipe_t* pipe) {
+  pthread_mutex_lock(&pipe->lock);
+  size_t room = SIZE_MAX;
+  if (!pipe->aborted) {
+    uint64_t waiting = pipe->committed - pipe->released;
+    room = waiting < pipe->buffers
+               ? (pipe->buffers - waiting) * pipe->buffer_size - pipe->fill
+               : 0;
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return room;
+}
+
+void nixbadge_pipe_close(nixbadge_pipe_t* pipe, bool ok) {
+  pthread_mutex_lock(&pipe->lock);
+  uint64_t committed = pipe->committed;
+  // A partial buffer is always ours, everything before it was handed over.
+  if (pipe->fill > 0 && !pipe->aborted) nixbadge_pipe_commit(pipe);
+  pipe->state = ok ? PIPE_DONE : PIPE_FAILED;
+  pthread_cond_broadcast(&pipe->cond);
+  nixbadge_pipe_unlock_notify(pipe, committed);
+}
+
+ssize_t nixbadge_pipe_read(nixbadge_pipe_t* pipe, const uint8_t** data,
+                           int timeout_ms) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  int64_t nsec = now.tv_usec * 1000LL + (timeout_ms % 1000) * 1000000LL;
+  struct timespec deadline = {
+      .tv_sec = now.tv_sec + timeout_ms / 1000 + nsec / 1000000000LL,
+      .tv_nsec = nsec % 1000000000LL,
+  };
+
+  ssize_t ret = -ETIMEDOUT;
+  pthread_mutex_lock(&pipe->lock);
+  if (pipe->committed == pipe->released && pipe->state == PIPE_RUNNING) {
+    if (!pipe->consumer_waiting) pipe->stats.consumer_waits++;
+    pipe->consumer_waiting = true;
+    // Hand over whatever the producer has so far rather than wait for more.
+    if (pipe->fill > 0 && !pipe->copying) nixbadge_pipe_commit(pipe);
+  }
+  while (pipe->committed == pipe->released && pipe->state == PIPE_RUNNING) {
+    if (timeout_ms == 0) {
+      pthread_mutex_unlock(&pipe->lock);
+      return -EAGAIN;
+    }
+    if (pthread_cond_timedwait(&pipe->cond, &pipe->lock, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+  pipe->consumer_waiting = false;
+
+  if (pipe->committed > pipe->released) {
+    size_t index = pipe->released % pipe->buffers;
+    *data = pipe->data + index * pipe->buffer_size;
+    ret = pipe->lens[index];
+  } else if (pipe->state == PIPE_DONE) {
+    ret = 0;
+  } else if (pipe->state == PIPE_FAILED) {
+    ret = -EIO;
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return ret;
+}
+
+void nixbadge_pipe_release(nixbadge_pipe_t* pipe) {
+  pthread_mutex_lock(&pipe->lock);
+  pipe->released++;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+void nixbadge_pipe_abort(nixbadge_pipe_t* pipe) {
+  pthread_mutex_lock(&pipe->lock);
+  pipe->aborted = true;
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+void nixbadge_pipe_get_stats(nixbadge_pipe_t* pipe,
+                             nixbadge_pipe_stats_t* stats) {
+  pthread_mutex_lock(&pipe->lock);
+  *stats = pipe->stats;
+  pthread_mutex_unlock(&pipe->lock);
+}
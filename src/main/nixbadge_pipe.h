@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Bounded single-producer, single-consumer pipe over a fixed set of
+ * buffers, so that receiving from upstream and sending to the client can
+ * overlap instead of taking turns.
+ *
+ * The producer copies into the buffer it owns and hands it over once it is
+ * full, or right away while the consumer sits idle. The consumer gets whole
+ * buffers without another copy and hands them back when it is done. With
+ * every buffer handed over the producer waits, which is the backpressure
+ * that slows down the upstream to the pace of the client.
+ */
+
+typedef struct nixbadge_pipe nixbadge_pipe_t;
+
+typedef void (*nixbadge_pipe_notify_t)(void* arg);
+
+typedef struct {
+  uint32_t buffers;
+  /* Times either side had to wait for the other. */
+  uint32_t producer_waits;
+  uint32_t consumer_waits;
+} nixbadge_pipe_stats_t;
+
+nixbadge_pipe_t* nixbadge_pipe_new(size_t buffers, size_t buffer_size);
+void nixbadge_pipe_free(nixbadge_pipe_t* pipe);
+/**
+ * Empties the pipe for the next transfer. Neither side may be using it.
+ */
+void nixbadge_pipe_reset(nixbadge_pipe_t* pipe);
+/**
+ * Sets a function called from the producer whenever a buffer is handed over
+ * or the pipe is closed, for consumers that wait on something else.
+ */
+void nixbadge_pipe_set_notify(nixbadge_pipe_t* pipe,
+                              nixbadge_pipe_notify_t notify, void* arg);
+
+/**
+ * Copies data into the pipe, waiting for buffers to come back as needed.
+ * @return 0 or -EPIPE once the consumer gave up
+ */
+int nixbadge_pipe_write(nixbadge_pipe_t* pipe, const void* data, size_t len);
+/**
+ * Like nixbadge_pipe_write, for data that is followed right away by more:
+ * a partly filled buffer is kept back even from an idle consumer.
+ */
+int nixbadge_pipe_write_more(nixbadge_pipe_t* pipe, const void* data,
+                             size_t len);
+/**
+ * @return how much nixbadge_pipe_write takes without waiting, or SIZE_MAX
+ *         once the consumer gave up, as writes fail right away then
+ */
+size_t nixbadge_pipe_room(nixbadge_pipe_t* pipe);
+/**
+ * Hands over what is left and ends the transfer.
+ * @param ok whether everything the consumer should get was written
+ */
+void nixbadge_pipe_close(nixbadge_pipe_t* pipe, bool ok);
+
+/**
+ * Waits for the next buffer, which stays valid until nixbadge_pipe_release.
+ * With a timeout of 0 it does not wait, and the consumer counts as idle
+ * until the next read so the producer hands over without delay.
+ * @return its length, 0 once the producer closed the pipe successfully,
+ *         -EIO if it failed, -ETIMEDOUT or -EAGAIN without a timeout
+ */
+ssize_t nixbadge_pipe_read(nixbadge_pipe_t* pipe, const uint8_t** data,
+                           int timeout_ms);
+void nixbadge_pipe_release(nixbadge_pipe_t* pipe);
+/**
+ * Stops the transfer from the consumer side.
+ */
+void nixbadge_pipe_abort(nixbadge_pipe_t* pipe);
+
+void nixbadge_pipe_get_stats(nixbadge_pipe_t* pipe,
+                             nixbadge_pipe_stats_t* stats);
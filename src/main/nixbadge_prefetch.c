@@ -0,0 +1,341 @@
+#include "nixbadge_prefetch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "nixbadge_hash.h"
+
+/* Length of the hash at the start of a store path's name. */
+#define STORE_HASH_LEN 32
+
+enum {
+  SEEN_FREE = 0,
+  SEEN_QUEUED,
+  SEEN_FETCHED,
+  SEEN_USED,
+  /* Failed, or at hand already: just not to be queued again. */
+  SEEN_DONE,
+};
+
+typedef struct {
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  uint32_t hash;
+  uint8_t state;
+} nixbadge_prefetch_seen_t;
+
+struct nixbadge_prefetch {
+  nixbadge_prefetch_config_t config;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  nixbadge_prefetch_item_t* queue;
+  size_t queue_len;
+
+  /* Replaced oldest first. */
+  nixbadge_prefetch_seen_t* seen;
+  size_t seen_next;
+
+  uint32_t foreground;
+  int64_t resume_ms;
+
+  /* May go below zero, a prefetch is charged once it is done. */
+  int64_t tokens;
+  int64_t refilled_ms;
+
+  nixbadge_prefetch_stats_t stats;
+};
+
+static int64_t nixbadge_prefetch_now_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+static const char* nixbadge_prefetch_key(const char* uri) {
+  const char* key = strrchr(uri, '/');
+  return key ? key + 1 : uri;
+}
+
+nixbadge_prefetch_t* nixbadge_prefetch_new(
+    const nixbadge_prefetch_config_t* config) {
+  nixbadge_prefetch_t* prefetch = calloc(1, sizeof(*prefetch));
+  if (!prefetch) return NULL;
+
+  prefetch->queue = calloc(config->queue_len, sizeof(*prefetch->queue));
+  prefetch->seen = calloc(config->entries, sizeof(*prefetch->seen));
+  if (!prefetch->queue || !prefetch->seen) {
+    free(prefetch->queue);
+    free(prefetch->seen);
+    free(prefetch);
+    return NULL;
+  }
+
+  pthread_mutex_init(&prefetch->lock, NULL);
+  pthread_cond_init(&prefetch->cond, NULL);
+  prefetch->config = *config;
+  prefetch->tokens = config->burst;
+  prefetch->refilled_ms = nixbadge_prefetch_now_ms();
+  return prefetch;
+}
+
+void nixbadge_prefetch_free(nixbadge_prefetch_t* prefetch) {
+  if (!prefetch) return;
+  pthread_cond_destroy(&prefetch->cond);
+  pthread_mutex_destroy(&prefetch->lock);
+  free(prefetch->queue);
+  free(prefetch->seen);
+  free(prefetch);
+}
+
+/* Finds a remembered key, with the lock held. */
+static nixbadge_prefetch_seen_t* nixbadge_prefetch_find(
+    nixbadge_prefetch_t* prefetch, const char* key) {
+  uint32_t hash = nixbadge_hash_str(key);
+  for (size_t i = 0; i < prefetch->config.entries; i++) {
+    nixbadge_prefetch_seen_t* seen = &prefetch->seen[i];
+    if (seen->state != SEEN_FREE && seen->hash == hash &&
+        strcmp(seen->key, key) == 0) {
+      return seen;
+    }
+  }
+  return NULL;
+}
+
+/* Remembers a key in place of the oldest one, with the lock held. */
+static void nixbadge_prefetch_remember(nixbadge_prefetch_t* prefetch,
+                                       const char* key, uint8_t state) {
+  nixbadge_prefetch_seen_t* seen = &prefetch->seen[prefetch->seen_next];
+  prefetch->seen_next = (prefetch->seen_next + 1) % prefetch->config.entries;
+
+  if (seen->state == SEEN_FETCHED) prefetch->stats.unused++;
+  snprintf(seen->key, sizeof(seen->key), "%s", key);
+  seen->hash = nixbadge_hash_str(key);
+  seen->state = state;
+}
+
+/* Queues an item unless its key was seen before, with the lock held. */
+static void nixbadge_prefetch_push(nixbadge_prefetch_t* prefetch,
+                                   const char* uri, uint8_t depth, bool nar) {
+  const char* key = nixbadge_prefetch_key(uri);
+  if (strlen(uri) > NIXBADGE_PREFETCH_URI_MAX ||
+      !nixbadge_cache_key_valid(key)) {
+    return;
+  }
+  if (nixbadge_prefetch_find(prefetch, key)) {
+    prefetch->stats.duplicates++;
+    return;
+  }
+  if (prefetch->queue_len == prefetch->config.queue_len) {
+    prefetch->stats.dropped++;
+    return;
+  }
+
+  nixbadge_prefetch_item_t* item = &prefetch->queue[prefetch->queue_len++];
+  snprintf(item->uri, sizeof(item->uri), "%s", uri);
+  item->depth = depth;
+  item->nar = nar;
+  nixbadge_prefetch_remember(prefetch, key, SEEN_QUEUED);
+  prefetch->stats.queued++;
+  pthread_cond_broadcast(&prefetch->cond);
+}
+
+/* Queues the narinfos of the store paths in a "References:" line. */
+static void nixbadge_prefetch_references(nixbadge_prefetch_t* prefetch,
+                                         const char* refs, const char* end,
+                                         uint8_t depth) {
+  while (refs < end) {
+    while (refs < end && *refs == ' ') refs++;
+    const char* name = refs;
+    while (refs < end && *refs != ' ') refs++;
+
+    // Names are "<hash>-<name>", and the narinfo is "/<hash>.narinfo".
+    if (refs - name <= STORE_HASH_LEN || name[STORE_HASH_LEN] != '-') continue;
+    char uri[NIXBADGE_PREFETCH_URI_MAX + 1];
+    snprintf(uri, sizeof(uri), "/%.*s.narinfo", STORE_HASH_LEN, name);
+    nixbadge_prefetch_push(prefetch, uri, depth, false);
+  }
+}
+
+void nixbadge_prefetch_narinfo(nixbadge_prefetch_t* prefetch, const char* key,
+                               const char* body, size_t len, uint8_t depth) {
+  const char* nar = NULL;
+  size_t nar_len = 0;
+  const char* refs = NULL;
+  const char* refs_end = NULL;
+  uint64_t size = UINT64_MAX;
+
+  const char* end = body + len;
+  for (const char* line = body; line < end;) {
+    const char* eol = memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+
+    size_t line_len = eol - line;
+    if (line_len > 12 && memcmp(line, "References: ", 12) == 0) {
+      refs = line + 12;
+      refs_end = eol;
+    } else if (line_len > 5 && memcmp(line, "URL: ", 5) == 0) {
+      nar = line + 5;
+      nar_len = line_len - 5;
+    } else if (line_len > 10 && memcmp(line, "FileSize: ", 10) == 0) {
+      char* size_end;
+      size = strtoull(line + 10, &size_end, 10);
+      if (size_end == line + 10) size = UINT64_MAX;
+    }
+    line = eol + 1;
+  }
+
+  pthread_mutex_lock(&prefetch->lock);
+  // A narinfo references its own path more often than not.
+  nixbadge_prefetch_seen_t* self = nixbadge_prefetch_find(prefetch, key);
+  if (!self) nixbadge_prefetch_remember(prefetch, key, SEEN_DONE);
+
+  if (refs && depth < prefetch->config.max_depth) {
+    nixbadge_prefetch_references(prefetch, refs, refs_end, depth + 1);
+  }
+  if (nar && nar_len > 0 && size <= prefetch->config.nar_max) {
+    char uri[NIXBADGE_PREFETCH_URI_MAX + 2];
+    if (nar_len < sizeof(uri) - 1) {
+      uri[0] = '/';
+      memcpy(uri + 1, nar, nar_len);
+      uri[nar_len + 1] = 0;
+      nixbadge_prefetch_push(prefetch, uri, depth, true);
+    }
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+/* Adds what was earned since the last refill, with the lock held. */
+static void nixbadge_prefetch_refill(nixbadge_prefetch_t* prefetch,
+                                     int64_t now) {
+  int64_t elapsed = now - prefetch->refilled_ms;
+  if (elapsed <= 0) return;
+  prefetch->refilled_ms = now;
+  prefetch->tokens += elapsed * prefetch->config.rate / 1000;
+  if (prefetch->tokens > prefetch->config.burst) {
+    prefetch->tokens = prefetch->config.burst;
+  }
+}
+
+/*
+ * How long to wait before handing out an item, with the lock held. -1 is
+ * until something changes.
+ */
+static int64_t nixbadge_prefetch_delay(nixbadge_prefetch_t* prefetch,
+                                       int64_t now) {
+  if (prefetch->queue_len == 0) return -1;
+  if (prefetch->foreground >= prefetch->config.max_foreground) return -1;
+  if (now < prefetch->resume_ms) return prefetch->resume_ms - now;
+  if (prefetch->config.rate == 0) return 0;
+
+  nixbadge_prefetch_refill(prefetch, now);
+  if (prefetch->tokens >= 0) return 0;
+  return (-prefetch->tokens * 1000 + prefetch->config.rate - 1) /
+         prefetch->config.rate;
+}
+
+bool nixbadge_prefetch_next(nixbadge_prefetch_t* prefetch,
+                            nixbadge_prefetch_item_t* item, int timeout_ms) {
+  int64_t deadline = nixbadge_prefetch_now_ms() + timeout_ms;
+  bool yielded = false;
+
+  pthread_mutex_lock(&prefetch->lock);
+  while (true) {
+    int64_t now = nixbadge_prefetch_now_ms();
+    int64_t delay = nixbadge_prefetch_delay(prefetch, now);
+    if (delay == 0) break;
+
+    if (prefetch->queue_len > 0 && !yielded) {
+      prefetch->stats.yields++;
+      yielded = true;
+    }
+    if (now >= deadline) {
+      pthread_mutex_unlock(&prefetch->lock);
+      return false;
+    }
+
+    int64_t until = now + delay;
+    if (delay < 0 || until > deadline) until = deadline;
+    struct timespec abstime = {
+        .tv_sec = until / 1000,
+        .tv_nsec = (until % 1000) * 1000000LL,
+    };
+    pthread_cond_timedwait(&prefetch->cond, &prefetch->lock, &abstime);
+  }
+
+  // Breadth first, and all narinfos before any NAR since those are what
+  // clients wait on one after the other.
+  size_t index = 0;
+  for (size_t i = 0; i < prefetch->queue_len; i++) {
+    if (!prefetch->queue[i].nar) {
+      index = i;
+      break;
+    }
+  }
+  *item = prefetch->queue[index];
+  memmove(&prefetch->queue[index], &prefetch->queue[index + 1],
+          (--prefetch->queue_len - index) * sizeof(*prefetch->queue));
+  pthread_mutex_unlock(&prefetch->lock);
+  return true;
+}
+
+void nixbadge_prefetch_done(nixbadge_prefetch_t* prefetch,
+                            const nixbadge_prefetch_item_t* item,
+                            nixbadge_prefetch_result_t result,
+                            uint64_t bytes) {
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->tokens -= bytes;
+  prefetch->stats.bytes += bytes;
+  switch (result) {
+    case NIXBADGE_PREFETCH_FETCHED:
+      prefetch->stats.fetched++;
+      break;
+    case NIXBADGE_PREFETCH_FAILED:
+      prefetch->stats.failed++;
+      break;
+    default:
+      prefetch->stats.skipped++;
+      break;
+  }
+
+  nixbadge_prefetch_seen_t* seen =
+      nixbadge_prefetch_find(prefetch, nixbadge_prefetch_key(item->uri));
+  if (seen && seen->state == SEEN_QUEUED) {
+    seen->state =
+        result == NIXBADGE_PREFETCH_FETCHED ? SEEN_FETCHED : SEEN_DONE;
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+void nixbadge_prefetch_foreground(nixbadge_prefetch_t* prefetch, int delta) {
+  pthread_mutex_lock(&prefetch->lock);
+  bool busy = prefetch->foreground >= prefetch->config.max_foreground;
+  prefetch->foreground += delta;
+  if (busy && prefetch->foreground < prefetch->config.max_foreground) {
+    prefetch->resume_ms = nixbadge_prefetch_now_ms() + prefetch->config.idle_ms;
+    pthread_cond_broadcast(&prefetch->cond);
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+}
+
+bool nixbadge_prefetch_used(nixbadge_prefetch_t* prefetch, const char* key) {
+  pthread_mutex_lock(&prefetch->lock);
+  nixbadge_prefetch_seen_t* seen = nixbadge_prefetch_find(prefetch, key);
+  bool hit = seen && seen->state == SEEN_FETCHED;
+  if (hit) {
+    seen->state = SEEN_USED;
+    prefetch->stats.hits++;
+  }
+  pthread_mutex_unlock(&prefetch->lock);
+  return hit;
+}
+
+void nixbadge_prefetch_get_stats(nixbadge_prefetch_t* prefetch,
+                                 nixbadge_prefetch_stats_t* stats) {
+  pthread_mutex_lock(&prefetch->lock);
+  *stats = prefetch->stats;
+  pthread_mutex_unlock(&prefetch->lock);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nixbadge_cache.h"
+
+/*
+ * Predictive prefetching of the closure of narinfos that clients fetch.
+ *
+ * A narinfo names the store paths its path references, and Nix asks for
+ * the narinfos of those next, one round trip at a time. The prefetcher
+ * queues them, up to a maximum depth from the narinfo a client asked for,
+ * along with the NARs of narinfos that are small enough. Items are handed
+ * out breadth first, narinfos before NARs, and only while the foreground
+ * leaves room for them and the bandwidth budget allows.
+ *
+ * Keys that were queued are remembered in a bounded table, both to not
+ * queue them again and to tell how many prefetched objects were asked for
+ * afterwards.
+ */
+
+#define NIXBADGE_PREFETCH_URI_MAX (NIXBADGE_CACHE_KEY_MAX + 8)
+
+typedef struct nixbadge_prefetch nixbadge_prefetch_t;
+
+typedef struct {
+  /* Narinfo levels below the one a client fetched. */
+  uint8_t max_depth;
+  /* Largest NAR prefetched, 0 for narinfos only. */
+  uint64_t nar_max;
+  size_t queue_len;
+  /* Keys remembered, for deduplication and hit counting. */
+  size_t entries;
+  /* Bytes per second prefetches may use on average, and in one burst. */
+  uint32_t rate;
+  uint32_t burst;
+  /* Foreground requests in progress at which prefetching pauses. */
+  uint32_t max_foreground;
+  /* How long the foreground has to be below that before it resumes. */
+  uint32_t idle_ms;
+} nixbadge_prefetch_config_t;
+
+typedef enum {
+  NIXBADGE_PREFETCH_FETCHED,
+  NIXBADGE_PREFETCH_FAILED,
+  /* At hand already, or being fetched for a client. */
+  NIXBADGE_PREFETCH_SKIPPED,
+} nixbadge_prefetch_result_t;
+
+typedef struct {
+  char uri[NIXBADGE_PREFETCH_URI_MAX + 1];
+  uint8_t depth;
+  bool nar;
+} nixbadge_prefetch_item_t;
+
+typedef struct {
+  uint32_t queued;
+  /* References already queued or fetched. */
+  uint32_t duplicates;
+  /* Items that found the queue full. */
+  uint32_t dropped;
+  uint32_t fetched;
+  uint32_t failed;
+  uint32_t skipped;
+  uint64_t bytes;
+  /* Prefetched objects that a client asked for afterwards. */
+  uint32_t hits;
+  /* Prefetched objects forgotten before anybody asked for them. */
+  uint32_t unused;
+  /* Times prefetching waited for the foreground or the budget. */
+  uint32_t yields;
+} nixbadge_prefetch_stats_t;
+
+nixbadge_prefetch_t* nixbadge_prefetch_new(
+    const nixbadge_prefetch_config_t* config);
+void nixbadge_prefetch_free(nixbadge_prefetch_t* prefetch);
+
+/**
+ * Queues what a narinfo references and the NAR it describes.
+ * @param key cache key of the narinfo
+ * @param depth levels below the narinfo a client fetched, 0 for that one
+ */
+void nixbadge_prefetch_narinfo(nixbadge_prefetch_t* prefetch, const char* key,
+                               const char* body, size_t len, uint8_t depth);
+
+/**
+ * Waits for the next item to prefetch.
+ * @return false on timeout
+ */
+bool nixbadge_prefetch_next(nixbadge_prefetch_t* prefetch,
+                            nixbadge_prefetch_item_t* item, int timeout_ms);
+/**
+ * Reports how an item handed out by nixbadge_prefetch_next went.
+ * @param bytes what it took from the budget
+ */
+void nixbadge_prefetch_done(nixbadge_prefetch_t* prefetch,
+                            const nixbadge_prefetch_item_t* item,
+                            nixbadge_prefetch_result_t result, uint64_t bytes);
+
+/**
+ * Counts a foreground request starting (1) or ending (-1). Prefetching
+ * pauses while enough of them are running.
+ */
+void nixbadge_prefetch_foreground(nixbadge_prefetch_t* prefetch, int delta);
+
+/**
+ * Notes that a client was served `key` without going upstream.
+ * @return whether it was there thanks to a prefetch
+ */
+bool nixbadge_prefetch_used(nixbadge_prefetch_t* prefetch, const char* key);
+
+void nixbadge_prefetch_get_stats(nixbadge_prefetch_t* prefetch,
+                                 nixbadge_prefetch_stats_t* stats);
@@ -0,0 +1,993 @@
+#include "nixbadge_proxy.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nixbadge_pipe.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define PROXY_HEAD_MAX 2048
+#define PROXY_URI_MAX 512
+#define PROXY_STATUS_MAX 48
+#define PROXY_RESP_HEADERS_MAX 512
+#define PROXY_TICK_MS 1000
+
+enum {
+  CONN_FREE = 0,
+  CONN_READING,
+  /* Reading the body of a request into `req.body`. */
+  CONN_BODY,
+  CONN_RESPONDING,
+  /* The client is gone but a deferred request still owns the pipe. */
+  CONN_ZOMBIE,
+};
+
+typedef struct nixbadge_proxy_conn nixbadge_proxy_conn_t;
+
+typedef struct {
+  nixbadge_pipe_t* pipe;
+  bool used;
+} nixbadge_proxy_slot_t;
+
+struct nixbadge_proxy_req {
+  nixbadge_proxy_t* proxy;
+  nixbadge_proxy_conn_t* conn;
+
+  char uri[PROXY_URI_MAX];
+  nixbadge_proxy_method_t method;
+  const char* headers;
+  size_t headers_len;
+  bool http10;
+  bool keep_alive;
+  uint8_t* body;
+  size_t body_len;
+
+  char status[PROXY_STATUS_MAX];
+  char resp_headers[PROXY_RESP_HEADERS_MAX];
+  size_t resp_headers_len;
+  /* A header did not fit, which turns the response into a 500. */
+  bool resp_headers_full;
+  bool head_sent;
+  bool chunked;
+  bool finished;
+
+  /* Where the response goes: the pipe when deferred, `out` otherwise. */
+  nixbadge_proxy_slot_t* slot;
+  uint8_t* out;
+  size_t out_len;
+  size_t out_cap;
+  size_t out_off;
+
+  /* The pipe buffer being sent by the loop. */
+  const uint8_t* pipe_data;
+  size_t pipe_len;
+  size_t pipe_off;
+};
+
+struct nixbadge_proxy_conn {
+  int fd;
+  /* IPv4 address of the client, in network byte order. */
+  uint32_t addr;
+  uint8_t state;
+  bool want_write;
+  int64_t active_ms;
+
+  char in[PROXY_HEAD_MAX];
+  size_t in_len;
+  /* Length of the current request head in `in`. */
+  size_t head_len;
+  /* Request body bytes still to be skipped. */
+  uint64_t discard;
+  /* Request body bytes read so far. */
+  size_t body_off;
+
+  nixbadge_proxy_req_t req;
+};
+
+struct nixbadge_proxy {
+  nixbadge_proxy_config_t config;
+  int listen_fd;
+  int wake_fd;
+  struct sockaddr_in wake_addr;
+  atomic_bool wake_pending;
+
+  nixbadge_proxy_conn_t* conns;
+  nixbadge_proxy_slot_t* slots;
+
+  /* The fields of nixbadge_proxy_stats_t, counted from any task. */
+  struct {
+    atomic_uint accepted;
+    atomic_uint rejected;
+    atomic_uint requests;
+    atomic_uint deferred;
+    atomic_uint busy;
+    atomic_uint timeouts;
+    atomic_uint conns;
+  } stats;
+};
+
+static int64_t nixbadge_proxy_now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static int nixbadge_proxy_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -errno;
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -errno;
+  return 0;
+}
+
+#define nixbadge_proxy_count(proxy, field) \
+  atomic_fetch_add_explicit(&(proxy)->stats.field, 1, memory_order_relaxed)
+
+/**
+ * Wakes the loop up from select(), from any task. Wakeups are coalesced
+ * until the loop gets around to them.
+ */
+static void nixbadge_proxy_wake(void* arg) {
+  nixbadge_proxy_t* proxy = arg;
+  if (atomic_exchange(&proxy->wake_pending, true)) return;
+  sendto(proxy->wake_fd, "", 1, MSG_DONTWAIT,
+         (struct sockaddr*)&proxy->wake_addr, sizeof(proxy->wake_addr));
+}
+
+static int nixbadge_proxy_open_wake(nixbadge_proxy_t* proxy) {
+  proxy->wake_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (proxy->wake_fd < 0) return -errno;
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t len = sizeof(addr);
+  if (bind(proxy->wake_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      getsockname(proxy->wake_fd, (struct sockaddr*)&proxy->wake_addr,
+                  &len) < 0) {
+    return -errno;
+  }
+  return nixbadge_proxy_set_nonblocking(proxy->wake_fd);
+}
+
+static int nixbadge_proxy_open_listen(nixbadge_proxy_t* proxy) {
+  proxy->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (proxy->listen_fd < 0) return -errno;
+
+  int on = 1;
+  setsockopt(proxy->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(proxy->config.port),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(proxy->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      // Clients connecting in a burst wait in the backlog, not in SYN
+      // retries, until the loop gets to accept them.
+      listen(proxy->listen_fd, proxy->config.max_conns) < 0) {
+    return -errno;
+  }
+  return nixbadge_proxy_set_nonblocking(proxy->listen_fd);
+}
+
+static void nixbadge_proxy_free(nixbadge_proxy_t* proxy) {
+  if (proxy->listen_fd >= 0) close(proxy->listen_fd);
+  if (proxy->wake_fd >= 0) close(proxy->wake_fd);
+  if (proxy->slots) {
+    for (size_t i = 0; i < proxy->config.max_deferred; i++) {
+      nixbadge_pipe_free(proxy->slots[i].pipe);
+    }
+  }
+  free(proxy->slots);
+  free(proxy->conns);
+  free(proxy);
+}
+
+nixbadge_proxy_t* nixbadge_proxy_new(const nixbadge_proxy_config_t* config) {
+  nixbadge_proxy_t* proxy = calloc(1, sizeof(*proxy));
+  if (!proxy) return NULL;
+  proxy->config = *config;
+  proxy->listen_fd = -1;
+  proxy->wake_fd = -1;
+
+  proxy->conns = calloc(config->max_conns, sizeof(nixbadge_proxy_conn_t));
+  proxy->slots = calloc(config->max_deferred, sizeof(nixbadge_proxy_slot_t));
+  if (!proxy->conns || !proxy->slots) {
+    nixbadge_proxy_free(proxy);
+    errno = ENOMEM;
+    return NULL;
+  }
+  for (size_t i = 0; i < config->max_deferred; i++) {
+    proxy->slots[i].pipe =
+        nixbadge_pipe_new(config->pipe_buffers, config->buffer_size);
+    if (!proxy->slots[i].pipe) {
+      nixbadge_proxy_free(proxy);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  int err = nixbadge_proxy_open_wake(proxy);
+  if (err == 0) err = nixbadge_proxy_open_listen(proxy);
+  if (err < 0) {
+    nixbadge_proxy_free(proxy);
+    errno = -err;
+    return NULL;
+  }
+  return proxy;
+}
+
+void nixbadge_proxy_get_stats(nixbadge_proxy_t* proxy,
+                              nixbadge_proxy_stats_t* stats) {
+  stats->accepted =
+      atomic_load_explicit(&proxy->stats.accepted, memory_order_relaxed);
+  stats->rejected =
+      atomic_load_explicit(&proxy->stats.rejected, memory_order_relaxed);
+  stats->requests =
+      atomic_load_explicit(&proxy->stats.requests, memory_order_relaxed);
+  stats->deferred =
+      atomic_load_explicit(&proxy->stats.deferred, memory_order_relaxed);
+  stats->busy = atomic_load_explicit(&proxy->stats.busy, memory_order_relaxed);
+  stats->timeouts =
+      atomic_load_explicit(&proxy->stats.timeouts, memory_order_relaxed);
+  stats->conns =
+      atomic_load_explicit(&proxy->stats.conns, memory_order_relaxed);
+}
+
+/*
+ * Requests.
+ */
+
+const char* nixbadge_proxy_req_uri(nixbadge_proxy_req_t* req) {
+  return req->uri;
+}
+
+nixbadge_proxy_method_t nixbadge_proxy_req_method(nixbadge_proxy_req_t* req) {
+  return req->method;
+}
+
+uint32_t nixbadge_proxy_req_client(nixbadge_proxy_req_t* req) {
+  return req->conn->addr;
+}
+
+const uint8_t* nixbadge_proxy_req_body(nixbadge_proxy_req_t* req,
+                                       size_t* len) {
+  *len = req->body_len;
+  return req->body;
+}
+
+int nixbadge_proxy_req_get_hdr(nixbadge_proxy_req_t* req, const char* name,
+                               char* value, size_t len) {
+  size_t name_len = strlen(name);
+  const char* end = req->headers + req->headers_len;
+  for (const char* line = req->headers; line < end;) {
+    const char* eol = memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+
+    if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+        strncasecmp(line, name, name_len) == 0) {
+      const char* start = line + name_len + 1;
+      const char* stop = eol;
+      while (start < stop && (*start == ' ' || *start == '\t')) start++;
+      while (stop > start && (stop[-1] == '\r' || stop[-1] == ' ')) stop--;
+
+      if ((size_t)(stop - start) >= len) return -ENOSPC;
+      memcpy(value, start, stop - start);
+      value[stop - start] = 0;
+      return 0;
+    }
+    line = eol + 1;
+  }
+  return -ENOENT;
+}
+
+bool nixbadge_proxy_req_defer(nixbadge_proxy_req_t* req) {
+  nixbadge_proxy_t* proxy = req->proxy;
+  for (size_t i = 0; i < proxy->config.max_deferred; i++) {
+    nixbadge_proxy_slot_t* slot = &proxy->slots[i];
+    if (slot->used) continue;
+
+    slot->used = true;
+    nixbadge_pipe_reset(slot->pipe);
+    nixbadge_pipe_set_notify(slot->pipe, nixbadge_proxy_wake, proxy);
+    req->slot = slot;
+    nixbadge_proxy_count(proxy, deferred);
+    return true;
+  }
+
+  nixbadge_proxy_count(proxy, busy);
+  return false;
+}
+
+void nixbadge_proxy_req_complete(nixbadge_proxy_req_t* req, bool ok) {
+  if (ok && !req->head_sent) {
+    nixbadge_proxy_resp_send_err(req, "500 Internal Server Error",
+                                 "No response\n");
+  }
+  // Closing hands the request back to the loop, it is not ours after that.
+  nixbadge_pipe_close(req->slot->pipe, ok && req->finished);
+}
+
+/*
+ * Responses.
+ */
+
+/**
+ * Queues response bytes for the client.
+ * @param more whether more follows right away, so that framing does not go
+ *        out in packets of its own
+ */
+static int nixbadge_proxy_write(nixbadge_proxy_req_t* req, const void* data,
+                                size_t len, bool more) {
+  if (req->slot) {
+    return more ? nixbadge_pipe_write_more(req->slot->pipe, data, len)
+                : nixbadge_pipe_write(req->slot->pipe, data, len);
+  }
+
+  if (req->out_len + len > req->out_cap) {
+    size_t cap = req->out_cap ? req->out_cap : 256;
+    while (cap < req->out_len + len) cap *= 2;
+    uint8_t* out = realloc(req->out, cap);
+    if (!out) return -ENOMEM;
+    req->out = out;
+    req->out_cap = cap;
+  }
+  memcpy(req->out + req->out_len, data, len);
+  req->out_len += len;
+  return 0;
+}
+
+static int nixbadge_proxy_write_head(nixbadge_proxy_req_t* req,
+                                     const char* framing, bool more) {
+  if (req->head_sent) return -EINVAL;
+  req->head_sent = true;
+
+  // Sending the rest would leave the client without, say, the Content-Range
+  // of the body that follows.
+  if (req->resp_headers_full) {
+    static const char error[] =
+        "HTTP/1.1 500 Internal Server Error\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    req->keep_alive = false;
+    int err = nixbadge_proxy_write(req, error, strlen(error), false);
+    if (err == 0) req->finished = true;
+    return -ENOSPC;
+  }
+
+  char head[PROXY_STATUS_MAX + PROXY_RESP_HEADERS_MAX + 96];
+  int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n%.*s%s%s\r\n",
+                     req->status[0] ? req->status : "200 OK",
+                     (int)req->resp_headers_len, req->resp_headers, framing,
+                     req->keep_alive ? "" : "Connection: close\r\n");
+  return nixbadge_proxy_write(req, head, len, more);
+}
+
+void nixbadge_proxy_resp_set_status(nixbadge_proxy_req_t* req,
+                                    const char* status) {
+  snprintf(req->status, sizeof(req->status), "%s", status);
+}
+
+int nixbadge_proxy_resp_set_hdr(nixbadge_proxy_req_t* req, const char* key,
+                                const char* value) {
+  size_t room = sizeof(req->resp_headers) - req->resp_headers_len;
+  int len = snprintf(req->resp_headers + req->resp_headers_len, room,
+                     "%s: %s\r\n", key, value);
+  if (len < 0 || (size_t)len >= room) {
+    req->resp_headers_full = true;
+    return -ENOSPC;
+  }
+  req->resp_headers_len += len;
+  return 0;
+}
+
+int nixbadge_proxy_resp_send(nixbadge_proxy_req_t* req, const void* data,
+                             size_t len) {
+  char framing[48];
+  snprintf(framing, sizeof(framing), "Content-Length: %zu\r\n", len);
+  int err = nixbadge_proxy_write_head(req, framing, len > 0);
+  if (err == 0 && len > 0) err = nixbadge_proxy_write(req, data, len, false);
+  if (err == 0) req->finished = true;
+  return err;
+}
+
+int nixbadge_proxy_resp_send_chunk(nixbadge_proxy_req_t* req,
+                                   const void* data, size_t len) {
+  int err = 0;
+  if (!req->head_sent) {
+    // HTTP/1.0 has no chunks, the end of the body is the end of the
+    // connection.
+    req->chunked = !req->http10;
+    if (!req->chunked) req->keep_alive = false;
+    err = nixbadge_proxy_write_head(
+        req, req->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+        req->chunked || len > 0);
+    if (err < 0) return err;
+  }
+
+  if (!data || len == 0) {
+    if (req->chunked) err = nixbadge_proxy_write(req, "0\r\n\r\n", 5, false);
+    if (err == 0) req->finished = true;
+    return err;
+  }
+
+  if (req->chunked) {
+    char size[16];
+    int size_len = snprintf(size, sizeof(size), "%zx\r\n", len);
+    err = nixbadge_proxy_write(req, size, size_len, true);
+  }
+  if (err == 0) err = nixbadge_proxy_write(req, data, len, req->chunked);
+  if (err == 0 && req->chunked) {
+    err = nixbadge_proxy_write(req, "\r\n", 2, false);
+  }
+  return err;
+}
+
+size_t nixbadge_proxy_resp_room(nixbadge_proxy_req_t* req) {
+  if (!req->slot) return SIZE_MAX;
+
+  // Leave room for the chunk size and its CRLFs, and the head before the
+  // first chunk.
+  size_t framing = 16 + 2;
+  if (!req->head_sent) {
+    framing += PROXY_STATUS_MAX + req->resp_headers_len + 96;
+  }
+  size_t room = nixbadge_pipe_room(req->slot->pipe);
+  return room > framing ? room - framing : 0;
+}
+
+int nixbadge_proxy_resp_send_cache(nixbadge_proxy_req_t* req,
+                                   nixbadge_cache_reader_t* reader,
+                                   uint64_t len) {
+  char framing[48];
+  snprintf(framing, sizeof(framing), "Content-Length: %llu\r\n",
+           (unsigned long long)len);
+  // Storage may block, which the loop must not.
+  int err = req->slot ? nixbadge_proxy_write_head(req, framing, len > 0)
+                      : -EINVAL;
+  if (err < 0) {
+    nixbadge_cache_close(reader);
+    return err;
+  }
+
+  size_t size = req->proxy->config.buffer_size;
+  uint8_t* buf = malloc(size);
+  if (!buf) {
+    nixbadge_cache_close(reader);
+    return -ENOMEM;
+  }
+  while (len > 0 && err == 0) {
+    ssize_t n = nixbadge_cache_read(reader, buf, len < size ? len : size);
+    if (n <= 0) {
+      err = n < 0 ? n : -EIO;
+      break;
+    }
+    len -= n;
+    err = nixbadge_proxy_write(req, buf, n, false);
+  }
+  free(buf);
+  nixbadge_cache_close(reader);
+  if (err == 0) req->finished = true;
+  return err;
+}
+
+int nixbadge_proxy_resp_send_err(nixbadge_proxy_req_t* req,
+                                 const char* status, const char* message) {
+  nixbadge_proxy_resp_set_status(req, status);
+  nixbadge_proxy_resp_set_hdr(req, "Content-Type", "text/plain");
+  return nixbadge_proxy_resp_send(req, message, strlen(message));
+}
+
+/*
+ * Connections.
+ */
+
+static void nixbadge_proxy_req_reset(nixbadge_proxy_req_t* req) {
+  free(req->out);
+  free(req->body);
+
+  nixbadge_proxy_t* proxy = req->proxy;
+  nixbadge_proxy_conn_t* conn = req->conn;
+  memset(req, 0, sizeof(*req));
+  req->proxy = proxy;
+  req->conn = conn;
+}
+
+static void nixbadge_proxy_conn_free(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn) {
+  if (conn->fd >= 0) close(conn->fd);
+  conn->fd = -1;
+  if (conn->req.slot) conn->req.slot->used = false;
+  nixbadge_proxy_req_reset(&conn->req);
+  conn->state = CONN_FREE;
+
+  atomic_fetch_sub_explicit(&proxy->stats.conns, 1, memory_order_relaxed);
+}
+
+/**
+ * Drops a connection. A deferred request keeps it around until its task is
+ * done with it.
+ */
+static void nixbadge_proxy_conn_drop(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  if (!req->slot) {
+    nixbadge_proxy_conn_free(proxy, conn);
+    return;
+  }
+
+  if (req->pipe_data) {
+    nixbadge_pipe_release(req->slot->pipe);
+    req->pipe_data = NULL;
+  }
+  nixbadge_pipe_abort(req->slot->pipe);
+  close(conn->fd);
+  conn->fd = -1;
+  conn->state = CONN_ZOMBIE;
+}
+
+static void nixbadge_proxy_conn_parse(nixbadge_proxy_t* proxy,
+                                      nixbadge_proxy_conn_t* conn);
+
+/**
+ * Finishes the response and waits for the next request, or closes the
+ * connection if that is not possible.
+ */
+static void nixbadge_proxy_conn_done(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn, bool ok) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  if (!ok || !req->keep_alive) {
+    nixbadge_proxy_conn_free(proxy, conn);
+    return;
+  }
+
+  if (req->slot) req->slot->used = false;
+  nixbadge_proxy_req_reset(req);
+
+  // Keep whatever the client already sent of its next request.
+  memmove(conn->in, conn->in + conn->head_len, conn->in_len - conn->head_len);
+  conn->in_len -= conn->head_len;
+  conn->head_len = 0;
+  conn->state = CONN_READING;
+  nixbadge_proxy_conn_parse(proxy, conn);
+}
+
+/**
+ * Sends as much of the response as the socket takes.
+ */
+static void nixbadge_proxy_conn_send(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn,
+                                     int64_t now) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  conn->want_write = false;
+
+  while (true) {
+    const uint8_t* data;
+    size_t* off;
+    size_t len;
+    if (req->out_off < req->out_len) {
+      data = req->out;
+      off = &req->out_off;
+      len = req->out_len;
+    } else if (req->pipe_data && req->pipe_off < req->pipe_len) {
+      data = req->pipe_data;
+      off = &req->pipe_off;
+      len = req->pipe_len;
+    } else if (req->slot) {
+      if (req->pipe_data) {
+        nixbadge_pipe_release(req->slot->pipe);
+        req->pipe_data = NULL;
+      }
+      ssize_t n = nixbadge_pipe_read(req->slot->pipe, &req->pipe_data, 0);
+      if (n == -EAGAIN) return;
+      if (n <= 0) {
+        req->pipe_data = NULL;
+        nixbadge_proxy_conn_done(proxy, conn, n == 0);
+        // A pipelined request may be ready to go already.
+        if (conn->state != CONN_RESPONDING) return;
+        continue;
+      }
+      req->pipe_len = n;
+      req->pipe_off = 0;
+      continue;
+    } else {
+      nixbadge_proxy_conn_done(proxy, conn, req->finished);
+      if (conn->state != CONN_RESPONDING) return;
+      continue;
+    }
+
+    ssize_t sent =
+        send(conn->fd, data + *off, len - *off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        conn->want_write = true;
+        return;
+      }
+      nixbadge_proxy_conn_drop(proxy, conn);
+      return;
+    }
+    *off += sent;
+    conn->active_ms = now;
+  }
+}
+
+/**
+ * Waits for a deferred request on a closed connection to finish.
+ */
+static void nixbadge_proxy_conn_reap(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn) {
+  nixbadge_pipe_t* pipe = conn->req.slot->pipe;
+  const uint8_t* data;
+  ssize_t n;
+  while ((n = nixbadge_pipe_read(pipe, &data, 0)) > 0) {
+    nixbadge_pipe_release(pipe);
+  }
+  if (n != -EAGAIN) nixbadge_proxy_conn_free(proxy, conn);
+}
+
+static void nixbadge_proxy_conn_route(nixbadge_proxy_t* proxy,
+                                      nixbadge_proxy_conn_t* conn);
+
+/**
+ * Keeps the body of a POST for the route, taking what came with the head
+ * and reading the rest in CONN_BODY. Bodies larger than max_body are
+ * refused, and the connection closed rather than reading them.
+ */
+static void nixbadge_proxy_conn_body(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn,
+                                     uint64_t len) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  if (len > proxy->config.max_body) {
+    req->keep_alive = false;
+    nixbadge_proxy_resp_send_err(req, "413 Content Too Large",
+                                 "Request body too large\n");
+    return;
+  }
+  req->body = malloc(len);
+  if (!req->body) {
+    req->keep_alive = false;
+    nixbadge_proxy_resp_send_err(req, "503 Service Unavailable",
+                                 "Out of memory\n");
+    return;
+  }
+  req->body_len = len;
+
+  size_t buffered = conn->in_len - conn->head_len;
+  size_t n = buffered < len ? buffered : len;
+  memcpy(req->body, conn->in + conn->head_len, n);
+  conn->head_len += n;
+  conn->body_off = n;
+  if (n < len) {
+    conn->state = CONN_BODY;
+    return;
+  }
+  nixbadge_proxy_conn_route(proxy, conn);
+}
+
+static void nixbadge_proxy_conn_read_body(nixbadge_proxy_t* proxy,
+                                          nixbadge_proxy_conn_t* conn,
+                                          int64_t now) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  ssize_t n = recv(conn->fd, req->body + conn->body_off,
+                   req->body_len - conn->body_off, MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (n <= 0) {
+    nixbadge_proxy_conn_free(proxy, conn);
+    return;
+  }
+
+  conn->body_off += n;
+  conn->active_ms = now;
+  if (conn->body_off == req->body_len) nixbadge_proxy_conn_route(proxy, conn);
+}
+
+static bool nixbadge_proxy_parse_request_line(nixbadge_proxy_req_t* req,
+                                              const char* line,
+                                              size_t len) {
+  const char* end = line + len;
+  const char* sp = memchr(line, ' ', len);
+  if (!sp) return false;
+
+  size_t method_len = sp - line;
+  if (method_len == 3 && memcmp(line, "GET", 3) == 0) {
+    req->method = NIXBADGE_PROXY_GET;
+  } else if (method_len == 4 && memcmp(line, "POST", 4) == 0) {
+    req->method = NIXBADGE_PROXY_POST;
+  } else {
+    req->method = NIXBADGE_PROXY_OTHER;
+  }
+
+  const char* uri = sp + 1;
+  const char* uri_end = memchr(uri, ' ', end - uri);
+  if (!uri_end || uri_end == uri) return false;
+  if ((size_t)(uri_end - uri) >= sizeof(req->uri)) {
+    req->uri[0] = 0;
+    return true;
+  }
+  memcpy(req->uri, uri, uri_end - uri);
+  req->uri[uri_end - uri] = 0;
+
+  const char* version = uri_end + 1;
+  if (end - version < 8 || memcmp(version, "HTTP/1.", 7) != 0) return false;
+  req->http10 = version[7] == '0';
+  return true;
+}
+
+/**
+ * Handles a complete request head, if there is one yet.
+ */
+static void nixbadge_proxy_conn_parse(nixbadge_proxy_t* proxy,
+                                      nixbadge_proxy_conn_t* conn) {
+  nixbadge_proxy_req_t* req = &conn->req;
+
+  // Skip what is left of the previous request's body.
+  if (conn->discard > 0) {
+    size_t n = conn->discard < conn->in_len ? conn->discard : conn->in_len;
+    memmove(conn->in, conn->in + n, conn->in_len - n);
+    conn->in_len -= n;
+    conn->discard -= n;
+    if (conn->discard > 0) return;
+  }
+
+  const char* end = NULL;
+  for (size_t i = 3; i < conn->in_len; i++) {
+    if (memcmp(conn->in + i - 3, "\r\n\r\n", 4) == 0) {
+      end = conn->in + i + 1;
+      break;
+    }
+  }
+  if (!end) {
+    if (conn->in_len == sizeof(conn->in)) {
+      req->keep_alive = false;
+      nixbadge_proxy_resp_send_err(req, "431 Request Header Fields Too Large",
+                                   "Request head too large\n");
+      conn->head_len = conn->in_len;
+      conn->state = CONN_RESPONDING;
+    }
+    return;
+  }
+
+  conn->head_len = end - conn->in;
+  conn->state = CONN_RESPONDING;
+  nixbadge_proxy_count(proxy, requests);
+
+  const char* eol = memchr(conn->in, '\n', conn->head_len);
+  size_t line_len = eol - conn->in;
+  if (line_len > 0 && conn->in[line_len - 1] == '\r') line_len--;
+  req->headers = eol + 1;
+  req->headers_len = end - req->headers;
+
+  if (!nixbadge_proxy_parse_request_line(req, conn->in, line_len)) {
+    req->keep_alive = false;
+    nixbadge_proxy_resp_send_err(req, "400 Bad Request", "Bad request\n");
+    return;
+  }
+
+  char value[32];
+  req->keep_alive = !req->http10;
+  if (nixbadge_proxy_req_get_hdr(req, "Connection", value, sizeof(value)) ==
+      0) {
+    if (strcasecmp(value, "close") == 0) req->keep_alive = false;
+    if (strcasecmp(value, "keep-alive") == 0) req->keep_alive = true;
+  }
+
+  if (nixbadge_proxy_req_get_hdr(req, "Content-Length", value,
+                                 sizeof(value)) == 0) {
+    uint64_t body = strtoull(value, NULL, 10);
+    size_t buffered = conn->in_len - conn->head_len;
+    if (body > 0 && req->method == NIXBADGE_PROXY_POST &&
+        proxy->config.max_body > 0) {
+      nixbadge_proxy_conn_body(proxy, conn, body);
+      return;
+    }
+    if (body <= buffered) {
+      conn->head_len += body;
+    } else {
+      conn->head_len = conn->in_len;
+      conn->discard = body - buffered;
+    }
+  } else if (nixbadge_proxy_req_get_hdr(req, "Transfer-Encoding", value,
+                                        sizeof(value)) == 0) {
+    // Nothing here takes a request body of unknown length.
+    req->keep_alive = false;
+    nixbadge_proxy_resp_send_err(req, "411 Length Required",
+                                 "Length required\n");
+    return;
+  }
+
+  nixbadge_proxy_conn_route(proxy, conn);
+}
+
+/**
+ * Hands a request to the route function, once its body is in.
+ */
+static void nixbadge_proxy_conn_route(nixbadge_proxy_t* proxy,
+                                      nixbadge_proxy_conn_t* conn) {
+  nixbadge_proxy_req_t* req = &conn->req;
+  conn->state = CONN_RESPONDING;
+  if (!req->uri[0]) {
+    req->keep_alive = false;
+    nixbadge_proxy_resp_send_err(req, "414 URI Too Long", "URI too long\n");
+    return;
+  }
+
+  proxy->config.route(proxy->config.ctx, req);
+  if (!req->slot && !req->finished) {
+    if (!req->head_sent) {
+      nixbadge_proxy_resp_send_err(req, "500 Internal Server Error",
+                                   "No response\n");
+    } else {
+      req->keep_alive = false;
+    }
+  }
+}
+
+static void nixbadge_proxy_conn_read(nixbadge_proxy_t* proxy,
+                                     nixbadge_proxy_conn_t* conn,
+                                     int64_t now) {
+  ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                   sizeof(conn->in) - conn->in_len, MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  if (n <= 0) {
+    nixbadge_proxy_conn_free(proxy, conn);
+    return;
+  }
+
+  conn->in_len += n;
+  conn->active_ms = now;
+  nixbadge_proxy_conn_parse(proxy, conn);
+}
+
+static void nixbadge_proxy_accept(nixbadge_proxy_t* proxy, int64_t now) {
+  while (true) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept(proxy->listen_fd, (struct sockaddr*)&addr, &addr_len);
+    if (fd < 0) return;
+
+    nixbadge_proxy_conn_t* conn = NULL;
+    nixbadge_proxy_conn_t* idle = NULL;
+    for (size_t i = 0; i < proxy->config.max_conns; i++) {
+      nixbadge_proxy_conn_t* c = &proxy->conns[i];
+      if (c->state == CONN_FREE) {
+        conn = c;
+        break;
+      }
+      if (c->state == CONN_READING && c->in_len == 0 &&
+          (!idle || c->active_ms < idle->active_ms)) {
+        idle = c;
+      }
+    }
+    // Make room by closing the connection idle for the longest.
+    if (!conn && idle) {
+      nixbadge_proxy_conn_free(proxy, idle);
+      conn = idle;
+    }
+    if (!conn || nixbadge_proxy_set_nonblocking(fd) < 0) {
+      close(fd);
+      nixbadge_proxy_count(proxy, rejected);
+      continue;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->addr = addr.sin_addr.s_addr;
+    conn->state = CONN_READING;
+    conn->active_ms = now;
+    conn->req.proxy = proxy;
+    conn->req.conn = conn;
+
+    nixbadge_proxy_count(proxy, accepted);
+    nixbadge_proxy_count(proxy, conns);
+  }
+}
+
+void nixbadge_proxy_run(nixbadge_proxy_t* proxy) {
+  while (true) {
+    fd_set readable, writable;
+    FD_ZERO(&readable);
+    FD_ZERO(&writable);
+    FD_SET(proxy->listen_fd, &readable);
+    FD_SET(proxy->wake_fd, &readable);
+    int max_fd = proxy->listen_fd > proxy->wake_fd ? proxy->listen_fd
+                                                   : proxy->wake_fd;
+
+    for (size_t i = 0; i < proxy->config.max_conns; i++) {
+      nixbadge_proxy_conn_t* conn = &proxy->conns[i];
+      if (conn->state == CONN_READING || conn->state == CONN_BODY) {
+        FD_SET(conn->fd, &readable);
+      } else if (conn->state == CONN_RESPONDING && conn->want_write) {
+        FD_SET(conn->fd, &writable);
+      } else {
+        continue;
+      }
+      if (conn->fd > max_fd) max_fd = conn->fd;
+    }
+
+    struct timeval timeout = {
+        .tv_sec = PROXY_TICK_MS / 1000,
+        .tv_usec = (PROXY_TICK_MS % 1000) * 1000,
+    };
+    int ready = select(max_fd + 1, &readable, &writable, NULL, &timeout);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      FD_ZERO(&readable);
+      FD_ZERO(&writable);
+    }
+
+    int64_t now = nixbadge_proxy_now_ms();
+    if (FD_ISSET(proxy->wake_fd, &readable)) {
+      // Drain before clearing: a wakeup sent in between would be drained
+      // with the flag still set, and no wakeup would ever be sent again.
+      // Anything signalled before the flag is cleared is seen below.
+      char drain[16];
+      while (recv(proxy->wake_fd, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+      }
+      atomic_store(&proxy->wake_pending, false);
+    }
+    if (FD_ISSET(proxy->listen_fd, &readable)) {
+      nixbadge_proxy_accept(proxy, now);
+    }
+
+    for (size_t i = 0; i < proxy->config.max_conns; i++) {
+      nixbadge_proxy_conn_t* conn = &proxy->conns[i];
+      switch (conn->state) {
+        case CONN_READING:
+          if (FD_ISSET(conn->fd, &readable)) {
+            nixbadge_proxy_conn_read(proxy, conn, now);
+          } else if (now - conn->active_ms > proxy->config.idle_timeout_ms) {
+            nixbadge_proxy_conn_free(proxy, conn);
+          }
+          // A request may have come in with the head already.
+          if (conn->state == CONN_RESPONDING) {
+            nixbadge_proxy_conn_send(proxy, conn, now);
+          }
+          break;
+        case CONN_BODY:
+          if (FD_ISSET(conn->fd, &readable)) {
+            nixbadge_proxy_conn_read_body(proxy, conn, now);
+          } else if (now - conn->active_ms > proxy->config.idle_timeout_ms) {
+            nixbadge_proxy_conn_free(proxy, conn);
+          }
+          if (conn->state == CONN_RESPONDING) {
+            nixbadge_proxy_conn_send(proxy, conn, now);
+          }
+          break;
+        case CONN_RESPONDING:
+          // Deferred responses are checked every time around, as the
+          // wakeups are not per connection.
+          nixbadge_proxy_conn_send(proxy, conn, now);
+          if (conn->state == CONN_RESPONDING && conn->want_write &&
+              now - conn->active_ms > proxy->config.send_timeout_ms) {
+            nixbadge_proxy_count(proxy, timeouts);
+            nixbadge_proxy_conn_drop(proxy, conn);
+          }
+          break;
+        case CONN_ZOMBIE:
+          nixbadge_proxy_conn_reap(proxy, conn);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
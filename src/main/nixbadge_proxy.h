@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nixbadge_cache.h"
+
+/*
+ * Event-driven HTTP/1.1 front end that serves every client connection from
+ * a single task with select().
+ *
+ * Each connection is a small state machine: it reads a request head, hands
+ * it to the route function and then sends the response, and goes back to
+ * reading when the client keeps the connection alive. Responses that are
+ * at hand in memory are sent from the loop as the socket takes them.
+ * Everything else, cached objects included since storage may block, is
+ * deferred to another task, which writes the response through a
+ * nixbadge_pipe while the loop sends it on, so a slow download or a slow
+ * card never holds up anybody else.
+ *
+ * Only plain sockets and pthreads are used, so the engine runs on Linux as
+ * well as on the badge.
+ */
+
+typedef struct nixbadge_proxy nixbadge_proxy_t;
+typedef struct nixbadge_proxy_req nixbadge_proxy_req_t;
+
+typedef enum {
+  NIXBADGE_PROXY_GET,
+  NIXBADGE_PROXY_POST,
+  NIXBADGE_PROXY_OTHER,
+} nixbadge_proxy_method_t;
+
+/**
+ * Called on the loop task for every request. It must not block: either
+ * respond right away or call nixbadge_proxy_req_defer and have another task
+ * respond. Returning without doing either sends a 500.
+ */
+typedef void (*nixbadge_proxy_route_t)(void* ctx, nixbadge_proxy_req_t* req);
+
+typedef struct {
+  uint16_t port;
+  /* Client connections served at once. */
+  size_t max_conns;
+  /* Requests deferred at once, each with its own pipe. */
+  size_t max_deferred;
+  size_t pipe_buffers;
+  size_t buffer_size;
+  /* How long an idle keep-alive connection stays open. */
+  uint32_t idle_timeout_ms;
+  /* How long a client may take to accept more of a response. */
+  uint32_t send_timeout_ms;
+  /*
+   * Largest POST body read for the route, larger ones are refused. At 0
+   * request bodies are skipped.
+   */
+  size_t max_body;
+
+  nixbadge_proxy_route_t route;
+  void* ctx;
+} nixbadge_proxy_config_t;
+
+typedef struct {
+  uint32_t accepted;
+  uint32_t rejected;
+  uint32_t requests;
+  uint32_t deferred;
+  /* Requests that found every pipe in use. */
+  uint32_t busy;
+  uint32_t timeouts;
+  uint32_t conns;
+} nixbadge_proxy_stats_t;
+
+/**
+ * Creates the engine and starts listening.
+ * @return NULL on failure, with errno set
+ */
+nixbadge_proxy_t* nixbadge_proxy_new(const nixbadge_proxy_config_t* config);
+/**
+ * Runs the event loop on the calling task, forever.
+ */
+void nixbadge_proxy_run(nixbadge_proxy_t* proxy);
+void nixbadge_proxy_get_stats(nixbadge_proxy_t* proxy,
+                              nixbadge_proxy_stats_t* stats);
+
+const char* nixbadge_proxy_req_uri(nixbadge_proxy_req_t* req);
+nixbadge_proxy_method_t nixbadge_proxy_req_method(nixbadge_proxy_req_t* req);
+/**
+ * @return the IPv4 address of the client, in network byte order
+ */
+uint32_t nixbadge_proxy_req_client(nixbadge_proxy_req_t* req);
+/**
+ * The body of a POST, which is kept until the response is done.
+ * @return NULL when there is none, or max_body is 0
+ */
+const uint8_t* nixbadge_proxy_req_body(nixbadge_proxy_req_t* req,
+                                       size_t* len);
+/**
+ * Copies the value of a request header.
+ * @return 0, -ENOENT if there is none or -ENOSPC if it does not fit
+ */
+int nixbadge_proxy_req_get_hdr(nixbadge_proxy_req_t* req, const char* name,
+                               char* value, size_t len);
+
+/**
+ * Takes the request off the loop. The caller has to respond from another
+ * task and then call nixbadge_proxy_req_complete.
+ * @return false if too many requests are deferred already
+ */
+bool nixbadge_proxy_req_defer(nixbadge_proxy_req_t* req);
+/**
+ * Ends a deferred request. The request must not be used afterwards.
+ * @param ok false to drop the connection, e.g. after a partial response
+ */
+void nixbadge_proxy_req_complete(nixbadge_proxy_req_t* req, bool ok);
+
+/*
+ * Response functions, usable from the route function and from the task a
+ * request was deferred to. Those that send return 0 or a negative errno,
+ * -EPIPE once the client has gone away.
+ */
+
+/**
+ * Sets the status line, like "404 Not Found". Defaults to "200 OK".
+ */
+void nixbadge_proxy_resp_set_status(nixbadge_proxy_req_t* req,
+                                    const char* status);
+/**
+ * Adds a response header, copying it. If it does not fit, the head is sent
+ * as a bodiless 500 instead and the send functions return -ENOSPC.
+ * @return 0 or -ENOSPC if the headers are full
+ */
+int nixbadge_proxy_resp_set_hdr(nixbadge_proxy_req_t* req, const char* key,
+                                const char* value);
+/**
+ * Sends a whole response body.
+ */
+int nixbadge_proxy_resp_send(nixbadge_proxy_req_t* req, const void* data,
+                             size_t len);
+/**
+ * Sends part of a response body of unknown length. A length of 0 ends it.
+ */
+int nixbadge_proxy_resp_send_chunk(nixbadge_proxy_req_t* req,
+                                   const void* data, size_t len);
+/**
+ * @return how much body nixbadge_proxy_resp_send_chunk takes right now
+ *         without waiting for the client
+ */
+size_t nixbadge_proxy_resp_room(nixbadge_proxy_req_t* req);
+/**
+ * Sends `len` bytes from a cache reader, which is closed afterwards. Only
+ * for deferred requests, the reader is read on the calling task.
+ * @return -EINVAL on the loop
+ */
+int nixbadge_proxy_resp_send_cache(nixbadge_proxy_req_t* req,
+                                   nixbadge_cache_reader_t* reader,
+                                   uint64_t len);
+/**
+ * Sends a plain text error.
+ */
+int nixbadge_proxy_resp_send_err(nixbadge_proxy_req_t* req,
+                                 const char* status, const char* message);
@@ -0,0 +1,386 @@
+#include "nixbadge_sched.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+/*
+ * How long a client that was turned away still counts for splitting the
+ * bulk lane, which it has to retry within to get its share.
+ */
+#define SCHED_DEMAND_MS 5000
+
+typedef struct {
+  uint32_t addr;
+  bool used;
+  uint16_t waiting;
+  uint16_t running;
+  /* When a bulk request was last turned away, 0 if never. */
+  int64_t turned_away_ms;
+  /* May go below zero, a piece of a body is charged before it is sent. */
+  int64_t tokens;
+  /* 0 until the first piece of a body is charged. */
+  int64_t refilled_ms;
+} nixbadge_sched_client_t;
+
+typedef struct {
+  void* arg;
+  uint32_t client;
+} nixbadge_sched_entry_t;
+
+struct nixbadge_sched {
+  nixbadge_sched_config_t config;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  nixbadge_sched_entry_t* fast;
+  size_t fast_head;
+  size_t fast_len;
+
+  /* In arrival order, `client` is an index into `clients`. */
+  nixbadge_sched_entry_t* bulk;
+  size_t bulk_len;
+
+  nixbadge_sched_client_t* clients;
+  /* Client that last had its turn. */
+  size_t turn;
+  /* Time of the latest submit or pick, which demand is measured against. */
+  int64_t now_ms;
+
+  nixbadge_sched_stats_t stats;
+};
+
+static int64_t nixbadge_sched_now_ms() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000LL + now.tv_usec / 1000;
+}
+
+void nixbadge_sched_policy_defaults(nixbadge_sched_policy_t* policy,
+                                    uint32_t workers) {
+  if (!policy->fast_slots) policy->fast_slots = workers;
+  if (!policy->bulk_slots) policy->bulk_slots = workers > 1 ? workers - 1 : 1;
+  if (!policy->bulk_queue) policy->bulk_queue = workers;
+  if (!policy->client_burst) policy->client_burst = policy->client_rate;
+}
+
+nixbadge_sched_t* nixbadge_sched_new(const nixbadge_sched_config_t* config) {
+  nixbadge_sched_t* sched = calloc(1, sizeof(*sched));
+  if (!sched) return NULL;
+
+  sched->fast = calloc(config->queue_len, sizeof(*sched->fast));
+  sched->bulk = calloc(config->queue_len, sizeof(*sched->bulk));
+  sched->clients = calloc(config->clients, sizeof(*sched->clients));
+  if (!sched->fast || !sched->bulk || !sched->clients) {
+    free(sched->fast);
+    free(sched->bulk);
+    free(sched->clients);
+    free(sched);
+    return NULL;
+  }
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->cond, NULL);
+  sched->config = *config;
+  return sched;
+}
+
+void nixbadge_sched_free(nixbadge_sched_t* sched) {
+  if (!sched) return;
+  pthread_cond_destroy(&sched->cond);
+  pthread_mutex_destroy(&sched->lock);
+  free(sched->fast);
+  free(sched->bulk);
+  free(sched->clients);
+  free(sched);
+}
+
+void nixbadge_sched_set_policy(nixbadge_sched_t* sched,
+                               const nixbadge_sched_policy_t* policy) {
+  pthread_mutex_lock(&sched->lock);
+  sched->config.policy = *policy;
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+/*
+ * Finds the entry of a client, with the lock held. Idle entries are kept
+ * for their bandwidth budget and demand until the room is needed for
+ * another client.
+ */
+static nixbadge_sched_client_t* nixbadge_sched_client(nixbadge_sched_t* sched,
+                                                      uint32_t addr,
+                                                      bool create) {
+  nixbadge_sched_client_t* idle = NULL;
+  for (size_t i = 0; i < sched->config.clients; i++) {
+    nixbadge_sched_client_t* client = &sched->clients[i];
+    if (client->used && client->addr == addr) return client;
+    if (!client->waiting && !client->running &&
+        (!idle || (idle->used && !client->used))) {
+      idle = client;
+    }
+  }
+  if (!create || !idle) return NULL;
+
+  memset(idle, 0, sizeof(*idle));
+  idle->addr = addr;
+  idle->used = true;
+  idle->tokens = sched->config.policy.client_burst;
+  return idle;
+}
+
+/* Whether a client has bulk requests in, or wanted to recently. */
+static bool nixbadge_sched_wanting(const nixbadge_sched_client_t* client,
+                                   int64_t now_ms) {
+  if (!client->used) return false;
+  if (client->waiting || client->running) return true;
+  return client->turned_away_ms &&
+         now_ms - client->turned_away_ms < SCHED_DEMAND_MS;
+}
+
+/*
+ * Whether a client may have another bulk request admitted: while the lane
+ * has room and the client has less than its share of it, with the lock
+ * held. Clients turned away recently count as well, so that those already
+ * in cannot keep taking back every slot that frees up.
+ */
+static bool nixbadge_sched_admit(nixbadge_sched_t* sched,
+                                 nixbadge_sched_client_t* client,
+                                 int64_t now_ms) {
+  uint32_t admitted = sched->stats.waiting[NIXBADGE_SCHED_BULK] +
+                      sched->stats.running[NIXBADGE_SCHED_BULK];
+  uint32_t queue = sched->config.policy.bulk_queue;
+  if (admitted >= queue || sched->bulk_len == sched->config.queue_len) {
+    return false;
+  }
+
+  uint32_t wanting = 1;
+  for (size_t i = 0; i < sched->config.clients; i++) {
+    nixbadge_sched_client_t* other = &sched->clients[i];
+    if (other != client && nixbadge_sched_wanting(other, now_ms)) wanting++;
+  }
+  uint32_t share = queue / wanting;
+  return client->waiting + client->running < (share ? share : 1);
+}
+
+bool nixbadge_sched_submit(nixbadge_sched_t* sched, nixbadge_sched_lane_t lane,
+                           uint32_t client, void* arg, int64_t now_ms) {
+  pthread_mutex_lock(&sched->lock);
+  if (now_ms > sched->now_ms) sched->now_ms = now_ms;
+  bool queued = false;
+  if (lane == NIXBADGE_SCHED_FAST) {
+    if (sched->fast_len < sched->config.queue_len) {
+      size_t i = (sched->fast_head + sched->fast_len) % sched->config.queue_len;
+      sched->fast[i].arg = arg;
+      sched->fast[i].client = client;
+      sched->fast_len++;
+      queued = true;
+    }
+  } else {
+    nixbadge_sched_client_t* entry =
+        nixbadge_sched_client(sched, client, true);
+    if (entry && nixbadge_sched_admit(sched, entry, now_ms)) {
+      entry->waiting++;
+      sched->bulk[sched->bulk_len].arg = arg;
+      sched->bulk[sched->bulk_len].client = entry - sched->clients;
+      sched->bulk_len++;
+      queued = true;
+    } else if (entry) {
+      entry->turned_away_ms = now_ms;
+    }
+  }
+
+  if (queued) {
+    sched->stats.waiting[lane]++;
+    pthread_cond_signal(&sched->cond);
+  } else {
+    sched->stats.rejected[lane]++;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return queued;
+}
+
+/*
+ * Bulk requests a client may run at once without going past its share,
+ * with the lock held.
+ * @param owed set when a client wanting bulk requests runs fewer
+ */
+static uint32_t nixbadge_sched_share(nixbadge_sched_t* sched, bool* owed) {
+  const nixbadge_sched_policy_t* policy = &sched->config.policy;
+  *owed = false;
+  if (policy->client_slots) return policy->client_slots;
+  uint32_t wanting = 0;
+  for (size_t i = 0; i < sched->config.clients; i++) {
+    if (nixbadge_sched_wanting(&sched->clients[i], sched->now_ms)) wanting++;
+  }
+  uint32_t share = wanting ? policy->bulk_slots / wanting : 0;
+  if (!share) share = 1;
+  for (size_t i = 0; i < sched->config.clients; i++) {
+    nixbadge_sched_client_t* client = &sched->clients[i];
+    if (nixbadge_sched_wanting(client, sched->now_ms) &&
+        client->running < share) {
+      *owed = true;
+    }
+  }
+  return share;
+}
+
+/*
+ * Takes the next bulk request, from the client after the one that had the
+ * last turn among those below their share, with the lock held. Without a
+ * limit set in the policy, a client at its share gets a slot that no other
+ * client is owed. One turned away keeps its claim for a while, so that the
+ * slot is still free when it asks again.
+ */
+static bool nixbadge_sched_pick_bulk(nixbadge_sched_t* sched,
+                                     nixbadge_sched_job_t* job) {
+  size_t clients = sched->config.clients;
+  bool owed;
+  uint32_t share = nixbadge_sched_share(sched, &owed);
+  size_t i = clients;
+  for (size_t n = 1; n <= clients; n++) {
+    size_t next = (sched->turn + n) % clients;
+    nixbadge_sched_client_t* client = &sched->clients[next];
+    if (!client->waiting) continue;
+    if (client->running < share) {
+      i = next;
+      break;
+    }
+    if (!owed && !sched->config.policy.client_slots && i == clients) {
+      i = next;
+    }
+  }
+  if (i == clients) return false;
+
+  nixbadge_sched_client_t* client = &sched->clients[i];
+  size_t j = 0;
+  while (sched->bulk[j].client != i) j++;
+  if (j > 0) sched->stats.passed_over++;
+
+  job->arg = sched->bulk[j].arg;
+  job->client = client->addr;
+  job->lane = NIXBADGE_SCHED_BULK;
+  memmove(&sched->bulk[j], &sched->bulk[j + 1],
+          (sched->bulk_len - j - 1) * sizeof(*sched->bulk));
+  sched->bulk_len--;
+  client->waiting--;
+  client->running++;
+  sched->turn = i;
+  return true;
+}
+
+/* Takes the next request that may run, with the lock held. */
+static bool nixbadge_sched_pick(nixbadge_sched_t* sched,
+                                nixbadge_sched_job_t* job) {
+  const nixbadge_sched_policy_t* policy = &sched->config.policy;
+  nixbadge_sched_stats_t* stats = &sched->stats;
+
+  if (sched->fast_len &&
+      stats->running[NIXBADGE_SCHED_FAST] < policy->fast_slots) {
+    nixbadge_sched_entry_t* entry = &sched->fast[sched->fast_head];
+    job->arg = entry->arg;
+    job->client = entry->client;
+    job->lane = NIXBADGE_SCHED_FAST;
+    sched->fast_head = (sched->fast_head + 1) % sched->config.queue_len;
+    sched->fast_len--;
+  } else if (!sched->bulk_len ||
+             stats->running[NIXBADGE_SCHED_BULK] >= policy->bulk_slots ||
+             !nixbadge_sched_pick_bulk(sched, job)) {
+    return false;
+  }
+
+  stats->waiting[job->lane]--;
+  stats->running[job->lane]++;
+  stats->started[job->lane]++;
+  return true;
+}
+
+bool nixbadge_sched_next(nixbadge_sched_t* sched, nixbadge_sched_job_t* job,
+                         int64_t now_ms, int timeout_ms) {
+  int64_t started = nixbadge_sched_now_ms();
+  int64_t deadline = started + timeout_ms;
+
+  pthread_mutex_lock(&sched->lock);
+  while (true) {
+    // Time goes on in the caller's clock while waiting.
+    int64_t waited = nixbadge_sched_now_ms() - started;
+    if (now_ms + waited > sched->now_ms) sched->now_ms = now_ms + waited;
+    if (nixbadge_sched_pick(sched, job)) break;
+    if (started + waited >= deadline) {
+      pthread_mutex_unlock(&sched->lock);
+      return false;
+    }
+    struct timespec abstime = {
+        .tv_sec = deadline / 1000,
+        .tv_nsec = (deadline % 1000) * 1000000LL,
+    };
+    pthread_cond_timedwait(&sched->cond, &sched->lock, &abstime);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return true;
+}
+
+void nixbadge_sched_done(nixbadge_sched_t* sched,
+                         const nixbadge_sched_job_t* job) {
+  pthread_mutex_lock(&sched->lock);
+  sched->stats.running[job->lane]--;
+  if (job->lane == NIXBADGE_SCHED_BULK) {
+    nixbadge_sched_client_t* client =
+        nixbadge_sched_client(sched, job->client, false);
+    if (client) client->running--;
+  }
+  // Another worker may be waiting for this slot, or for the client's.
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+uint32_t nixbadge_sched_throttle(nixbadge_sched_t* sched, uint32_t addr,
+                                 size_t len, int64_t now_ms) {
+  pthread_mutex_lock(&sched->lock);
+  const nixbadge_sched_policy_t* policy = &sched->config.policy;
+  nixbadge_sched_client_t* client = nixbadge_sched_client(sched, addr, false);
+  if (!policy->client_rate || !client || !client->running) {
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+  }
+
+  if (client->refilled_ms) {
+    int64_t elapsed = now_ms - client->refilled_ms;
+    if (elapsed > 0) {
+      client->tokens += elapsed * policy->client_rate / 1000;
+      client->refilled_ms = now_ms;
+    }
+  } else {
+    client->refilled_ms = now_ms;
+  }
+  if (client->tokens > policy->client_burst) {
+    client->tokens = policy->client_burst;
+  }
+
+  client->tokens -= len;
+  uint32_t delay = 0;
+  if (client->tokens < 0) {
+    delay = (-client->tokens * 1000 + policy->client_rate - 1) /
+            policy->client_rate;
+    sched->stats.throttled++;
+    sched->stats.throttled_ms += delay;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return delay;
+}
+
+void nixbadge_sched_get_stats(nixbadge_sched_t* sched,
+                              nixbadge_sched_stats_t* stats) {
+  pthread_mutex_lock(&sched->lock);
+  *stats = sched->stats;
+  stats->clients = 0;
+  for (size_t i = 0; i < sched->config.clients; i++) {
+    nixbadge_sched_client_t* client = &sched->clients[i];
+    if (client->used && (client->waiting || client->running)) {
+      stats->clients++;
+    }
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decides which deferred request a worker takes on next.
+ *
+ * Nix substitutes one narinfo lookup after the other, so their latency is
+ * what makes it fast or slow, while a NAR download may hold a worker for a
+ * minute. Requests therefore go into one of two lanes. The fast lane, for
+ * narinfos and /nix-cache-info, is served first in arrival order. The bulk
+ * lane, for NARs, may only use some of the workers, which leaves the rest
+ * free for lookups, and takes turns between clients so that one of them
+ * asking for dozens of NARs at once doesn't shut out everybody else. It
+ * also only admits so many requests, which keeps room for lookups among
+ * the requests the proxy can defer, and splits those evenly between the
+ * clients that want them. Bulk bodies coming from upstream can
+ * additionally be held to a per-client bandwidth.
+ *
+ * Nothing here blocks other than nixbadge_sched_next, so that the same code
+ * drives the host simulation in virtual time.
+ */
+
+typedef struct nixbadge_sched nixbadge_sched_t;
+
+typedef enum {
+  NIXBADGE_SCHED_FAST,
+  NIXBADGE_SCHED_BULK,
+  NIXBADGE_SCHED_LANES,
+} nixbadge_sched_lane_t;
+
+typedef struct {
+  /* Requests running at once in each lane. */
+  uint32_t fast_slots;
+  uint32_t bulk_slots;
+  /* Bulk requests waiting or running at once, shared between clients. */
+  uint32_t bulk_queue;
+  /*
+   * Bulk requests one client may run at once, 0 for an even split of the
+   * bulk slots between the clients with bulk requests in, which a client
+   * only goes past while nobody else has one waiting.
+   */
+  uint32_t client_slots;
+  /* Bytes per second of bulk bodies for each client, 0 for no limit. */
+  uint32_t client_rate;
+  uint32_t client_burst;
+} nixbadge_sched_policy_t;
+
+typedef struct {
+  /* Requests that can wait in each lane. */
+  size_t queue_len;
+  /* Clients with bulk requests waiting or running at once. */
+  size_t clients;
+  nixbadge_sched_policy_t policy;
+} nixbadge_sched_config_t;
+
+typedef struct {
+  void* arg;
+  uint32_t client;
+  nixbadge_sched_lane_t lane;
+} nixbadge_sched_job_t;
+
+typedef struct {
+  uint32_t waiting[NIXBADGE_SCHED_LANES];
+  uint32_t running[NIXBADGE_SCHED_LANES];
+  uint32_t started[NIXBADGE_SCHED_LANES];
+  /* Requests that found their lane full, or their client's share. */
+  uint32_t rejected[NIXBADGE_SCHED_LANES];
+  /* Bulk requests passed over for another client's. */
+  uint32_t passed_over;
+  uint32_t clients;
+  /* Times a bulk body was held back, and for how long in total. */
+  uint32_t throttled;
+  uint64_t throttled_ms;
+} nixbadge_sched_stats_t;
+
+/**
+ * Fills in what a policy leaves at 0 as the badge does with `workers`
+ * workers: every worker for lookups, all but one for NARs, as many NARs
+ * admitted as there are workers, and a burst of one second at the rate.
+ */
+void nixbadge_sched_policy_defaults(nixbadge_sched_policy_t* policy,
+                                    uint32_t workers);
+
+nixbadge_sched_t* nixbadge_sched_new(const nixbadge_sched_config_t* config);
+void nixbadge_sched_free(nixbadge_sched_t* sched);
+
+/**
+ * Replaces the policy. Requests running already are not affected, and
+ * slots freed by lowering the limits become usable once enough of them are
+ * done.
+ */
+void nixbadge_sched_set_policy(nixbadge_sched_t* sched,
+                               const nixbadge_sched_policy_t* policy);
+
+/**
+ * Queues a request.
+ * @param client identifies who asked, like the IPv4 address
+ * @return false if its lane is full, or for a bulk request, if the client
+ *         has its share of the lane already
+ */
+bool nixbadge_sched_submit(nixbadge_sched_t* sched, nixbadge_sched_lane_t lane,
+                           uint32_t client, void* arg, int64_t now_ms);
+
+/**
+ * Waits for the next request a worker may run.
+ * @param now_ms the time in the clock given to nixbadge_sched_submit
+ * @return false on timeout
+ */
+bool nixbadge_sched_next(nixbadge_sched_t* sched, nixbadge_sched_job_t* job,
+                         int64_t now_ms, int timeout_ms);
+/**
+ * Frees the slot of a request handed out by nixbadge_sched_next.
+ */
+void nixbadge_sched_done(nixbadge_sched_t* sched,
+                         const nixbadge_sched_job_t* job);
+
+/**
+ * Charges part of a bulk body to the bandwidth of the client, which must
+ * have a bulk request running.
+ * @return how long to wait before sending it, in milliseconds
+ */
+uint32_t nixbadge_sched_throttle(nixbadge_sched_t* sched, uint32_t client,
+                                 size_t len, int64_t now_ms);
+
+void nixbadge_sched_get_stats(nixbadge_sched_t* sched,
+                              nixbadge_sched_stats_t* stats);
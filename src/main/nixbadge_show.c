@@ -0,0 +1,367 @@
+#include "nixbadge_show.h"
+
+#include <esp_http_client.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <inttypes.h>
+#include <nvs_flash.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_anim.h"
+#include "nixbadge_mesh.h"
+#include "nixbadge_utils.h"
+
+#define SHOW_STACK_SIZE 4096
+#define SHOW_QUEUE_SIZE 4
+#define SHOW_PULL_TIMEOUT_MS 3000
+
+static const char TAG[] = "nixbadge_show";
+
+typedef struct {
+  uint32_t ip;
+  uint32_t seq;
+  uint32_t id;
+  int64_t start_ms;
+  uint32_t size;
+} nixbadge_show_pull_t;
+
+static QueueHandle_t pulls = NULL;
+
+/* The show playing, held while it is drawn. */
+static SemaphoreHandle_t show_lock = NULL;
+static nixbadge_anim_t* show_anim = NULL;
+static uint8_t* show_data = NULL;
+static size_t show_len = 0;
+/* Bumped by every upload, 0 until there was one. */
+static uint32_t show_seq = 0;
+static uint32_t show_id = 0;
+static int64_t show_start_ms = 0;
+/* Mesh time epoch the start is in. */
+static uint32_t show_epoch = 0;
+static uint32_t show_pulls = 0;
+static uint32_t show_pull_failures = 0;
+
+/* FNV-1a, which tells a pulled show from one that changed in between. */
+static uint32_t nixbadge_show_hash(const uint8_t* data, size_t len) {
+  if (len == 0) return 0;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  // 0 is no show.
+  return hash ? hash : 1;
+}
+
+static int64_t nixbadge_show_now_ms() {
+  int64_t mesh_us;
+  uint32_t error_us;
+  nixbadge_mesh_time_now(&mesh_us, &error_us);
+  return mesh_us / 1000;
+}
+
+/*
+ * Shows uploaded later are newer, the hash breaks ties between two
+ * uploaded at once. Their starts are not compared, since the mesh time
+ * starts over when a root without the time of day does.
+ */
+static bool nixbadge_show_newer_locked(uint32_t seq, uint32_t id) {
+  return seq > show_seq || (seq == show_seq && id > show_id);
+}
+
+static bool nixbadge_show_newer(uint32_t seq, uint32_t id) {
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  bool newer = nixbadge_show_newer_locked(seq, id);
+  xSemaphoreGive(show_lock);
+  return newer;
+}
+
+/*
+ * Keeps the show for the next boot, an empty one clears it. Its start is
+ * left out, being on the mesh clock of this boot.
+ */
+static void nixbadge_show_store(const uint8_t* data, size_t len, uint32_t seq) {
+  nvs_handle handle;
+  esp_err_t err = nvs_open("show", NVS_READWRITE, &handle);
+  if (err == ESP_OK) {
+    err = len ? nvs_set_blob(handle, "data", data, len)
+              : nvs_erase_key(handle, "data");
+    if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+    if (err == ESP_OK) err = nvs_set_u32(handle, "seq", seq);
+    if (err == ESP_OK) err = nvs_commit(handle);
+    nvs_close(handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to store the show, it plays until reboot: %s",
+             esp_err_to_name(err));
+  }
+}
+
+/*
+ * Plays a show from `start_ms` on the mesh clock, in place of the one
+ * playing, and stores it when `store` is set.
+ * @return ESP_ERR_INVALID_STATE if the one playing is as new
+ */
+static esp_err_t nixbadge_show_apply(const uint8_t* data, size_t len,
+                                     uint32_t seq, int64_t start_ms,
+                                     bool store, const char** error) {
+  nixbadge_anim_t* anim = NULL;
+  uint8_t* copy = NULL;
+  if (len) {
+    anim = nixbadge_anim_new(data, len, error);
+    if (!anim) return ESP_ERR_INVALID_ARG;
+    copy = malloc(len);
+    if (!copy) {
+      nixbadge_anim_free(anim);
+      if (error) *error = "out of memory";
+      return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, data, len);
+  }
+
+  uint32_t id = nixbadge_show_hash(data, len);
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  bool newer = nixbadge_show_newer_locked(seq, id);
+  if (newer) {
+    nixbadge_anim_t* old_anim = show_anim;
+    uint8_t* old_data = show_data;
+    show_anim = anim;
+    show_data = copy;
+    show_len = len;
+    show_seq = seq;
+    show_id = id;
+    show_start_ms = start_ms;
+    show_epoch = nixbadge_mesh_time_epoch();
+    anim = old_anim;
+    copy = old_data;
+  }
+  xSemaphoreGive(show_lock);
+
+  if (anim) nixbadge_anim_free(anim);
+  free(copy);
+  if (!newer) {
+    if (error) *error = "a newer show is playing";
+    return ESP_ERR_INVALID_STATE;
+  }
+  ESP_LOGI(TAG, "Playing show %" PRIu32 " of %zu bytes from %" PRId64, seq,
+           len, start_ms);
+  if (store) nixbadge_show_store(data, len, seq);
+  return ESP_OK;
+}
+
+static void nixbadge_show_load() {
+  nvs_handle handle;
+  if (nvs_open("show", NVS_READONLY, &handle) != ESP_OK) return;
+
+  uint32_t seq;
+  size_t len = 0;
+  uint8_t* data = NULL;
+  esp_err_t err = nvs_get_u32(handle, "seq", &seq);
+  if (err == ESP_OK && nvs_get_blob(handle, "data", NULL, &len) == ESP_OK) {
+    data = malloc(len);
+    err = data ? nvs_get_blob(handle, "data", data, &len) : ESP_ERR_NO_MEM;
+  }
+  nvs_close(handle);
+
+  // It starts over, as if just uploaded.
+  int64_t start_ms = nixbadge_show_now_ms() + CONFIG_BADGE_SHOW_LEAD_MS;
+  const char* error = "";
+  if (err == ESP_OK) {
+    err = nixbadge_show_apply(data, data ? len : 0, seq, start_ms, false,
+                              &error);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to load the stored show: %s %s",
+             esp_err_to_name(err), error);
+  }
+  free(data);
+}
+
+static esp_err_t nixbadge_show_pull(const nixbadge_show_pull_t* pull,
+                                    uint8_t* data) {
+  char url[48];
+  esp_ip4_addr_t addr = {.addr = pull->ip};
+  snprintf(url, sizeof(url), "http://" IPSTR ":1008/badge/show",
+           IP2STR(&addr));
+
+  esp_http_client_config_t config = {
+      .url = url,
+      .timeout_ms = SHOW_PULL_TIMEOUT_MS,
+  };
+  esp_http_client_handle_t client = esp_http_client_init(&config);
+  if (!client) return ESP_ERR_NO_MEM;
+
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err == ESP_OK &&
+      (esp_http_client_fetch_headers(client) != pull->size ||
+       esp_http_client_get_status_code(client) != 200)) {
+    err = ESP_ERR_INVALID_RESPONSE;
+  }
+
+  uint32_t len = 0;
+  while (err == ESP_OK && len < pull->size) {
+    int n = esp_http_client_read(client, (char*)data + len, pull->size - len);
+    if (n <= 0) {
+      err = ESP_FAIL;
+      break;
+    }
+    len += n;
+  }
+  esp_http_client_cleanup(client);
+
+  // The peer may have moved on to another show since it announced this.
+  if (err == ESP_OK && nixbadge_show_hash(data, len) != pull->id) {
+    err = ESP_ERR_INVALID_CRC;
+  }
+  if (err == ESP_OK) {
+    err = nixbadge_show_apply(data, len, pull->seq, pull->start_ms, true,
+                              NULL);
+  }
+  return err;
+}
+
+static void nixbadge_show_task(void* arg) {
+  uint8_t* data = malloc(CONFIG_BADGE_SHOW_MAX_SIZE);
+  if (!data) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+  while (true) {
+    nixbadge_show_pull_t pull;
+    xQueueReceive(pulls, &pull, portMAX_DELAY);
+    // Several badges announce the same show, it is pulled from the first.
+    if (!nixbadge_show_newer(pull.seq, pull.id)) continue;
+    if (pull.size == 0) {
+      // Nothing to pull, the mesh went back to the built-in effects.
+      nixbadge_show_apply(NULL, 0, pull.seq, pull.start_ms, true, NULL);
+      continue;
+    }
+
+    show_pulls++;
+    esp_err_t err = nixbadge_show_pull(&pull, data);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+      esp_ip4_addr_t addr = {.addr = pull.ip};
+      ESP_LOGW(TAG, "Failed to pull the show of " IPSTR ": %s",
+               IP2STR(&addr), esp_err_to_name(err));
+      show_pull_failures++;
+    }
+  }
+}
+
+void nixbadge_show_init() {
+  show_lock = xSemaphoreCreateMutex();
+  pulls = xQueueCreate(SHOW_QUEUE_SIZE, sizeof(nixbadge_show_pull_t));
+  if (!show_lock || !pulls) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+
+  nixbadge_show_load();
+  nixbadge_task_create(nixbadge_show_task, "show", SHOW_STACK_SIZE, NULL, 3);
+}
+
+esp_err_t nixbadge_show_upload(const uint8_t* data, size_t len,
+                               const char** error) {
+  if (len > CONFIG_BADGE_SHOW_MAX_SIZE) {
+    if (error) *error = "larger than CONFIG_BADGE_SHOW_MAX_SIZE";
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // Long enough for the rest of the mesh to pull it before it starts.
+  int64_t start_ms = nixbadge_show_now_ms() + CONFIG_BADGE_SHOW_LEAD_MS;
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  uint32_t seq = show_seq + 1;
+  xSemaphoreGive(show_lock);
+  esp_err_t err = nixbadge_show_apply(data, len, seq, start_ms, true, error);
+  if (err == ESP_OK) nixbadge_show_gossip();
+  return err;
+}
+
+esp_err_t nixbadge_show_get(uint8_t** data, size_t* len) {
+  if (!show_lock) return ESP_ERR_INVALID_STATE;
+
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  esp_err_t err = ESP_OK;
+  if (!show_anim) {
+    err = ESP_ERR_NOT_FOUND;
+  } else if (!(*data = malloc(show_len))) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    memcpy(*data, show_data, show_len);
+    *len = show_len;
+  }
+  xSemaphoreGive(show_lock);
+  return err;
+}
+
+bool nixbadge_show_render(uint8_t* pixels, size_t len) {
+  if (!show_lock) return false;
+
+  // Before the start, a looping show is drawn as far back in its loop, so
+  // that badges are in step even when the mesh time started over.
+  int64_t now_ms = nixbadge_show_now_ms();
+  uint32_t epoch = nixbadge_mesh_time_epoch();
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  // A start from before the root stepped the mesh time says nothing about
+  // the time now, so the show starts over as if just uploaded.
+  if (epoch != show_epoch) {
+    show_epoch = epoch;
+    show_start_ms = now_ms + CONFIG_BADGE_SHOW_LEAD_MS;
+  }
+  bool playing = show_anim != NULL;
+  if (playing) {
+    nixbadge_anim_render(show_anim, now_ms - show_start_ms, pixels, len);
+  }
+  xSemaphoreGive(show_lock);
+  return playing;
+}
+
+void nixbadge_show_gossip() {
+  if (!show_lock || !nixbadge_has_mesh()) return;
+  esp_ip4_addr_t ip = nixbadge_mesh_get_ip();
+  if (ip.addr == 0) return;
+
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  uint32_t seq = show_seq, id = show_id, size = show_len;
+  int64_t start_ms = show_start_ms;
+  xSemaphoreGive(show_lock);
+  // Badges that never had a show have nothing to tell.
+  if (seq == 0) return;
+  nixbadge_mesh_broadcast_show(ip.addr, seq, id, start_ms, size);
+}
+
+void nixbadge_show_announce(uint32_t ip, uint32_t seq, uint32_t id,
+                            int64_t start_ms, uint32_t size) {
+  if (!pulls || ip == nixbadge_mesh_get_ip().addr) return;
+  if (!nixbadge_show_newer(seq, id)) return;
+
+  esp_ip4_addr_t addr = {.addr = ip};
+  ESP_LOGD(TAG, IPSTR " plays show %" PRIu32 " of %" PRIu32 " bytes",
+           IP2STR(&addr), seq, size);
+  if (size > CONFIG_BADGE_SHOW_MAX_SIZE) {
+    ESP_LOGW(TAG, "Ignoring a show of %" PRIu32 " bytes from " IPSTR, size,
+             IP2STR(&addr));
+    return;
+  }
+
+  nixbadge_show_pull_t pull = {
+      .ip = ip,
+      .seq = seq,
+      .id = id,
+      .start_ms = start_ms,
+      .size = size,
+  };
+  // Dropped when busy, the next announcement asks again.
+  xQueueSend(pulls, &pull, 0);
+}
+
+void nixbadge_show_get_stats(nixbadge_show_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!show_lock) return;
+
+  xSemaphoreTake(show_lock, portMAX_DELAY);
+  stats->seq = show_seq;
+  stats->id = show_id;
+  stats->size = show_len;
+  xSemaphoreGive(show_lock);
+  stats->pulls = show_pulls;
+  stats->pull_failures = show_pull_failures;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The animation the LEDs of the whole mesh play, see nixbadge_anim.h.
+ *
+ * A badge it is uploaded to starts it a moment later on the mesh clock,
+ * stores it in NVS and announces it over the mesh. Badges that hear of a
+ * newer show than theirs pull it over HTTP from /badge/show, like the
+ * cache digests, and play it from the same start, so that the mesh is in
+ * step without anything sent per frame. Every upload makes a newer show
+ * than the one it replaces, and every badge announces its own now and then
+ * for those that join.
+ * Uploading an empty show goes back to the built-in effects.
+ */
+
+typedef struct {
+  /* Uploads the show playing is from, 0 when there was none. */
+  uint32_t seq;
+  /* Hash of the show playing, 0 when there is none. */
+  uint32_t id;
+  uint32_t size;
+  uint32_t pulls;
+  uint32_t pull_failures;
+} nixbadge_show_stats_t;
+
+/**
+ * Loads the stored show. Must be called after nixbadge_config_init, and
+ * before the LEDs start.
+ */
+void nixbadge_show_init();
+
+/**
+ * Plays an animation on this badge and the rest of the mesh, from a
+ * moment from now.
+ * @param error set to why it was rejected, when it was
+ * @return ESP_ERR_INVALID_ARG if it is not a valid animation
+ */
+esp_err_t nixbadge_show_upload(const uint8_t* data, size_t len,
+                               const char** error);
+
+/**
+ * Copies the show playing into a newly allocated buffer.
+ * @return ESP_ERR_NOT_FOUND when there is none
+ */
+esp_err_t nixbadge_show_get(uint8_t** data, size_t* len);
+
+/**
+ * Draws the show at the mesh time into the pixels, three bytes a LED.
+ * @return false when there is no show, and the pixels were left alone
+ */
+bool nixbadge_show_render(uint8_t* pixels, size_t len);
+
+/**
+ * Announces the show playing, which is to be done every
+ * CONFIG_BADGE_P2P_ANNOUNCE_INTERVAL for badges that join the mesh.
+ */
+void nixbadge_show_gossip();
+
+/**
+ * Called from the mesh when a badge announces its show.
+ */
+void nixbadge_show_announce(uint32_t ip, uint32_t seq, uint32_t id,
+                            int64_t start_ms, uint32_t size);
+
+void nixbadge_show_get_stats(nixbadge_show_stats_t* stats);
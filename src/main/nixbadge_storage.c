@@ -0,0 +1,104 @@
+#include "nixbadge_storage.h"
+
+#include <esp_log.h>
+#include <esp_vfs_fat.h>
+
+#include "nixbadge_cache_posix.h"
+#include "nixbadge_gpio.h"
+
+#ifdef CONFIG_BADGE_CACHE_SDCARD
+#include <driver/sdspi_host.h>
+#include <driver/spi_common.h>
+#endif
+
+#define STORAGE_MOUNT_POINT "/cache"
+#define STORAGE_NAR_DIR STORAGE_MOUNT_POINT "/nar"
+#define STORAGE_PARTITION "cache"
+
+static const char TAG[] = "nixbadge_storage";
+
+static nixbadge_cache_backend_t nar_backend;
+static nixbadge_cache_t* nar_cache = NULL;
+
+#ifdef CONFIG_BADGE_CACHE_SDCARD
+static esp_err_t nixbadge_storage_mount() {
+  esp_vfs_fat_sdmmc_mount_config_t mount_config = {
+      .format_if_mount_failed = false,
+      .max_files = 8,
+      .allocation_unit_size = 16 * 1024,
+  };
+
+  sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+  spi_bus_config_t bus_config = {
+      .mosi_io_num = GPIO_SD_MOSI_PIN,
+      .miso_io_num = GPIO_SD_MISO_PIN,
+      .sclk_io_num = GPIO_SD_CLK_PIN,
+      .quadwp_io_num = -1,
+      .quadhd_io_num = -1,
+      .max_transfer_sz = 4000,
+  };
+  esp_err_t err =
+      spi_bus_initialize(host.slot, &bus_config, SDSPI_DEFAULT_DMA);
+  if (err != ESP_OK) return err;
+
+  sdspi_device_config_t slot_config = SDSPI_DEVICE_CONFIG_DEFAULT();
+  slot_config.gpio_cs = GPIO_SD_CS_PIN;
+  slot_config.host_id = host.slot;
+
+  sdmmc_card_t* card;
+  ESP_LOGI(TAG, "Mounting sdcard at %s", STORAGE_MOUNT_POINT);
+  return esp_vfs_fat_sdspi_mount(STORAGE_MOUNT_POINT, &host, &slot_config,
+                                 &mount_config, &card);
+}
+#else
+static esp_err_t nixbadge_storage_mount() {
+  esp_vfs_fat_mount_config_t mount_config = {
+      .format_if_mount_failed = true,
+      .max_files = 8,
+      .allocation_unit_size = CONFIG_WL_SECTOR_SIZE,
+  };
+
+  wl_handle_t wl_handle;
+  ESP_LOGI(TAG, "Mounting flash partition %s at %s", STORAGE_PARTITION,
+           STORAGE_MOUNT_POINT);
+  return esp_vfs_fat_spiflash_mount_rw_wl(STORAGE_MOUNT_POINT,
+                                          STORAGE_PARTITION, &mount_config,
+                                          &wl_handle);
+}
+#endif
+
+void nixbadge_storage_init() {
+  esp_err_t err = nixbadge_storage_mount();
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "No cache storage available (%s), serving uncached",
+             esp_err_to_name(err));
+    return;
+  }
+
+  uint64_t total_bytes = 0;
+  uint64_t free_bytes = 0;
+  ESP_ERROR_CHECK(
+      esp_vfs_fat_info(STORAGE_MOUNT_POINT, &total_bytes, &free_bytes));
+
+  int ret = nixbadge_cache_posix_init(&nar_backend, STORAGE_NAR_DIR);
+  if (ret < 0) {
+    ESP_LOGW(TAG, "Failed to open %s: %d", STORAGE_NAR_DIR, ret);
+    return;
+  }
+
+  // Leave some slack for FAT metadata and partially written objects.
+  uint64_t budget = total_bytes - total_bytes / 16;
+  nar_cache = nixbadge_cache_new(&nar_backend, budget,
+                                 CONFIG_BADGE_CACHE_MAX_ENTRIES);
+  if (!nar_cache) {
+    ESP_LOGW(TAG, "Failed to create the NAR cache");
+    return;
+  }
+
+  nixbadge_cache_stats_t stats;
+  nixbadge_cache_get_stats(nar_cache, &stats);
+  ESP_LOGI(TAG, "NAR cache holds %lu objects, %llu of %llu bytes used",
+           stats.entries, stats.used, stats.budget);
+}
+
+nixbadge_cache_t* nixbadge_storage_nar_cache() { return nar_cache; }
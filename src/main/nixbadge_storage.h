@@ -0,0 +1,6 @@
+#pragma once
+
+#include "nixbadge_cache.h"
+
+void nixbadge_storage_init();
+nixbadge_cache_t* nixbadge_storage_nar_cache();
@@ -0,0 +1,140 @@
+#include "nixbadge_topology.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reports a badge may miss before it is dropped. */
+#define TOPOLOGY_MISSED_REPORTS 3
+
+typedef struct {
+  nixbadge_telemetry_t telemetry;
+  int64_t reported_ms;
+  /* Dropped after this, some reports after the interval it was given. */
+  int64_t expires_ms;
+} nixbadge_topology_entry_t;
+
+struct nixbadge_topology {
+  nixbadge_topology_config_t config;
+  pthread_mutex_t lock;
+  nixbadge_topology_entry_t* entries;
+};
+
+nixbadge_topology_t* nixbadge_topology_new(
+    const nixbadge_topology_config_t* config) {
+  nixbadge_topology_t* topology = calloc(1, sizeof(*topology));
+  if (!topology) return NULL;
+
+  topology->entries = calloc(config->max_badges, sizeof(*topology->entries));
+  if (!topology->entries) {
+    free(topology);
+    return NULL;
+  }
+  topology->config = *config;
+  pthread_mutex_init(&topology->lock, NULL);
+  return topology;
+}
+
+void nixbadge_topology_free(nixbadge_topology_t* topology) {
+  if (!topology) return;
+  pthread_mutex_destroy(&topology->lock);
+  free(topology->entries);
+  free(topology);
+}
+
+static bool nixbadge_topology_live(const nixbadge_topology_entry_t* entry,
+                                   int64_t now_ms) {
+  return entry->reported_ms && now_ms < entry->expires_ms;
+}
+
+/*
+ * The interval at which the live badges' reports, each crossing the hops
+ * between the badge and the root, stay within the share of air time, with
+ * the lock held.
+ */
+static uint32_t nixbadge_topology_interval(nixbadge_topology_t* topology,
+                                           int64_t now_ms) {
+  const nixbadge_topology_config_t* config = &topology->config;
+  uint64_t hops = 0;
+  for (size_t i = 0; i < config->max_badges; i++) {
+    const nixbadge_topology_entry_t* entry = &topology->entries[i];
+    if (nixbadge_topology_live(entry, now_ms) && entry->telemetry.level > 1) {
+      hops += entry->telemetry.level - 1;
+    }
+  }
+
+  uint64_t interval = config->share_permille
+                          ? hops * config->airtime_us / config->share_permille
+                          : config->max_interval_ms;
+  if (interval < config->min_interval_ms) interval = config->min_interval_ms;
+  if (interval > config->max_interval_ms) interval = config->max_interval_ms;
+  return interval;
+}
+
+uint32_t nixbadge_topology_report(nixbadge_topology_t* topology,
+                                  const nixbadge_telemetry_t* telemetry,
+                                  int64_t now_ms) {
+  pthread_mutex_lock(&topology->lock);
+  nixbadge_topology_entry_t* found = NULL;
+  nixbadge_topology_entry_t* oldest = NULL;
+  for (size_t i = 0; i < topology->config.max_badges && !found; i++) {
+    nixbadge_topology_entry_t* entry = &topology->entries[i];
+    if (entry->reported_ms &&
+        memcmp(entry->telemetry.mac, telemetry->mac,
+               NIXBADGE_TOPOLOGY_ADDR_LEN) == 0) {
+      found = entry;
+    } else if (!oldest || entry->reported_ms < oldest->reported_ms) {
+      oldest = entry;
+    }
+  }
+
+  nixbadge_topology_entry_t* entry = found ? found : oldest;
+  uint32_t interval = topology->config.max_interval_ms;
+  if (entry) {
+    entry->telemetry = *telemetry;
+    entry->reported_ms = now_ms;
+    interval = nixbadge_topology_interval(topology, now_ms);
+    entry->expires_ms = now_ms + (int64_t)interval * TOPOLOGY_MISSED_REPORTS;
+  }
+  pthread_mutex_unlock(&topology->lock);
+  return interval;
+}
+
+static void nixbadge_topology_write_addr(nixbadge_metrics_writer_t* writer,
+                                         const char* name,
+                                         const uint8_t* addr) {
+  nixbadge_metrics_printf(writer, "\"%s\":\"%02x:%02x:%02x:%02x:%02x:%02x\",",
+                          name, addr[0], addr[1], addr[2], addr[3], addr[4],
+                          addr[5]);
+}
+
+void nixbadge_topology_write_json(nixbadge_topology_t* topology,
+                                  int64_t now_ms,
+                                  nixbadge_metrics_writer_t* writer) {
+  pthread_mutex_lock(&topology->lock);
+  nixbadge_metrics_printf(writer, "{\"interval_ms\":%lu,\"badges\":[",
+                          (unsigned long)nixbadge_topology_interval(
+                              topology, now_ms));
+
+  bool first = true;
+  for (size_t i = 0; i < topology->config.max_badges; i++) {
+    const nixbadge_topology_entry_t* entry = &topology->entries[i];
+    if (!nixbadge_topology_live(entry, now_ms)) continue;
+
+    const nixbadge_telemetry_t* t = &entry->telemetry;
+    const uint8_t* ip = (const uint8_t*)&t->ip;
+    nixbadge_metrics_printf(writer, first ? "{" : ",{");
+    first = false;
+    nixbadge_topology_write_addr(writer, "mac", t->mac);
+    nixbadge_topology_write_addr(writer, "ap", t->ap);
+    nixbadge_topology_write_addr(writer, "parent", t->parent);
+    nixbadge_metrics_printf(
+        writer,
+        "\"ip\":\"%u.%u.%u.%u\",\"level\":%u,\"children\":%u,\"rssi\":%d,"
+        "\"load\":%u,\"heap_kib\":%u,\"age_s\":%lld}",
+        ip[0], ip[1], ip[2], ip[3], t->level, t->children, t->rssi, t->load,
+        t->heap_kib, (long long)(now_ms - entry->reported_ms) / 1000);
+  }
+  nixbadge_metrics_printf(writer, "]}\n");
+  pthread_mutex_unlock(&topology->lock);
+}
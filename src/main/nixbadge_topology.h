@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nixbadge_metrics.h"
+
+/*
+ * The shape of the mesh as the root sees it, from the reports every badge
+ * sends it: where it hangs in the tree, the signal to its parent, and how
+ * busy it is.
+ *
+ * Reports cross every hop between a badge and the root, so the root works
+ * out how often badges may report from how many there are and how deep
+ * they sit, for reports to take no more than a fixed share of air time,
+ * and tells them in its answers. Badges that miss three reports in a row
+ * are dropped.
+ */
+
+#define NIXBADGE_TOPOLOGY_ADDR_LEN 6
+
+/* Laid out like proto.Telemetry, which is passed in from Zig. */
+typedef struct {
+  /*
+   * Station and SoftAP MAC of the badge, and the SoftAP MAC of its parent,
+   * which is all zeros at the root.
+   */
+  uint8_t mac[NIXBADGE_TOPOLOGY_ADDR_LEN];
+  uint8_t ap[NIXBADGE_TOPOLOGY_ADDR_LEN];
+  uint8_t parent[NIXBADGE_TOPOLOGY_ADDR_LEN];
+  /* Network order. */
+  uint32_t ip;
+  /* 1 at the root. */
+  uint8_t level;
+  uint8_t children;
+  /* Signal of the link to the parent in dBm, 0 at the root. */
+  int8_t rssi;
+  /* Requests waiting for or running on a worker. */
+  uint8_t load;
+  uint16_t heap_kib;
+} nixbadge_telemetry_t;
+
+typedef struct {
+  size_t max_badges;
+  /* Air time a report takes on each hop. */
+  uint32_t airtime_us;
+  /* Share of the air time reports may take, in thousandths. */
+  uint32_t share_permille;
+  uint32_t min_interval_ms;
+  uint32_t max_interval_ms;
+} nixbadge_topology_config_t;
+
+typedef struct nixbadge_topology nixbadge_topology_t;
+
+nixbadge_topology_t* nixbadge_topology_new(
+    const nixbadge_topology_config_t* config);
+void nixbadge_topology_free(nixbadge_topology_t* topology);
+
+/**
+ * Records a report, replacing the badge's previous one. When the table is
+ * full, the badge heard from the longest ago makes room.
+ * @return how long the badge should wait before its next report
+ */
+uint32_t nixbadge_topology_report(nixbadge_topology_t* topology,
+                                  const nixbadge_telemetry_t* telemetry,
+                                  int64_t now_ms);
+
+/**
+ * Writes the table as compact JSON: the report interval, and the badges
+ * with their MACs as strings, the IP in dotted form and the age of their
+ * report in seconds.
+ */
+void nixbadge_topology_write_json(nixbadge_topology_t* topology,
+                                  int64_t now_ms,
+                                  nixbadge_metrics_writer_t* writer);
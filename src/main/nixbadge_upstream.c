@@ -0,0 +1,287 @@
+#include "nixbadge_upstream.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nixbadge_cache.h"
+
+#define LATENCY_SAMPLES 32
+#define LATENCY_MIN_SAMPLES 4
+
+typedef struct {
+  char host[NIXBADGE_UPSTREAM_HOST_MAX];
+  int port;
+
+  float score;
+  int64_t scored_at;
+
+  uint32_t latencies[LATENCY_SAMPLES];
+  size_t latency_count;
+  size_t latency_next;
+
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t hedges;
+} nixbadge_upstream_t;
+
+typedef struct {
+  char key[NIXBADGE_CACHE_KEY_MAX + 1];
+  uint8_t upstream;
+} nixbadge_upstream_route_t;
+
+struct nixbadge_upstream_set {
+  pthread_mutex_t lock;
+  atomic_int refs;
+  nixbadge_upstream_config_t config;
+
+  nixbadge_upstream_t upstreams[NIXBADGE_UPSTREAM_MAX];
+  size_t count;
+
+  nixbadge_upstream_route_t* routes;
+  size_t route_next;
+};
+
+static bool nixbadge_upstream_parse(nixbadge_upstream_t* upstream,
+                                    const char* entry, size_t len) {
+  while (len > 0 && (*entry == ' ' || *entry == '\t')) {
+    entry++;
+    len--;
+  }
+  while (len > 0 && (entry[len - 1] == ' ' || entry[len - 1] == '\t')) len--;
+  if (len == 0 || len >= sizeof(upstream->host)) return false;
+
+  memcpy(upstream->host, entry, len);
+  upstream->host[len] = 0;
+  upstream->port = 0;
+
+  char* port = strchr(upstream->host, ':');
+  if (port) {
+    *port = 0;
+    upstream->port = atoi(port + 1);
+    if (upstream->port <= 0 || upstream->port > 65535) return false;
+  }
+  return upstream->host[0] != 0;
+}
+
+nixbadge_upstream_set_t* nixbadge_upstream_set_new(
+    const char* list, const nixbadge_upstream_config_t* config) {
+  nixbadge_upstream_set_t* set = calloc(1, sizeof(*set));
+  if (!set) return NULL;
+  pthread_mutex_init(&set->lock, NULL);
+  atomic_init(&set->refs, 1);
+  set->config = *config;
+
+  while (*list && set->count < NIXBADGE_UPSTREAM_MAX) {
+    size_t len = strcspn(list, ",");
+    if (nixbadge_upstream_parse(&set->upstreams[set->count], list, len)) {
+      set->count++;
+    }
+    list += len;
+    if (*list == ',') list++;
+  }
+
+  if (config->nar_routes > 0) {
+    set->routes = calloc(config->nar_routes, sizeof(*set->routes));
+  }
+
+  if (set->count == 0 || (config->nar_routes > 0 && !set->routes)) {
+    nixbadge_upstream_set_unref(set);
+    return NULL;
+  }
+  return set;
+}
+
+nixbadge_upstream_set_t* nixbadge_upstream_set_ref(
+    nixbadge_upstream_set_t* set) {
+  atomic_fetch_add(&set->refs, 1);
+  return set;
+}
+
+void nixbadge_upstream_set_unref(nixbadge_upstream_set_t* set) {
+  if (!set || atomic_fetch_sub(&set->refs, 1) != 1) return;
+
+  pthread_mutex_destroy(&set->lock);
+  free(set->routes);
+  free(set);
+}
+
+size_t nixbadge_upstream_set_count(nixbadge_upstream_set_t* set) {
+  return set->count;
+}
+
+const char* nixbadge_upstream_set_host(nixbadge_upstream_set_t* set,
+                                       size_t index, int* port) {
+  *port = set->upstreams[index].port;
+  return set->upstreams[index].host;
+}
+
+/**
+ * Brings the failure score up to date. Called with the lock held.
+ */
+static float nixbadge_upstream_decay(nixbadge_upstream_set_t* set,
+                                     nixbadge_upstream_t* upstream,
+                                     int64_t now_ms) {
+  if (upstream->score > 0 && now_ms > upstream->scored_at &&
+      set->config.health_half_life_ms > 0) {
+    float half_lives = (float)(now_ms - upstream->scored_at) /
+                       set->config.health_half_life_ms;
+    upstream->score *= exp2f(-half_lives);
+    if (upstream->score < 0.01f) upstream->score = 0;
+  }
+  upstream->scored_at = now_ms;
+  return upstream->score;
+}
+
+size_t nixbadge_upstream_set_order(nixbadge_upstream_set_t* set, int first,
+                                   int64_t now_ms, size_t* order) {
+  float scores[NIXBADGE_UPSTREAM_MAX];
+  size_t count = 0;
+
+  pthread_mutex_lock(&set->lock);
+  for (size_t i = 0; i < set->count; i++) {
+    scores[i] = nixbadge_upstream_decay(set, &set->upstreams[i], now_ms);
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  if (first >= 0 && (size_t)first < set->count) order[count++] = first;
+
+  for (size_t i = 0; i < set->count; i++) {
+    if ((int)i != first && scores[i] < set->config.down_score) {
+      order[count++] = i;
+    }
+  }
+
+  size_t down = count;
+  for (size_t i = 0; i < set->count; i++) {
+    if ((int)i == first || scores[i] < set->config.down_score) continue;
+
+    size_t j = count++;
+    while (j > down && scores[order[j - 1]] > scores[i]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+  return count;
+}
+
+static int nixbadge_upstream_compare(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Called with the lock held.
+ */
+static uint32_t nixbadge_upstream_percentile(nixbadge_upstream_t* upstream,
+                                             uint8_t percentile) {
+  uint32_t sorted[LATENCY_SAMPLES];
+  size_t count = upstream->latency_count;
+  memcpy(sorted, upstream->latencies, count * sizeof(uint32_t));
+  qsort(sorted, count, sizeof(uint32_t), nixbadge_upstream_compare);
+
+  size_t rank = (count * percentile + 99) / 100;
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+uint32_t nixbadge_upstream_set_hedge_delay(nixbadge_upstream_set_t* set,
+                                           size_t index) {
+  nixbadge_upstream_t* upstream = &set->upstreams[index];
+  uint32_t delay = set->config.hedge_initial_ms;
+
+  pthread_mutex_lock(&set->lock);
+  if (upstream->latency_count >= LATENCY_MIN_SAMPLES) {
+    delay = nixbadge_upstream_percentile(upstream,
+                                         set->config.hedge_percentile);
+  }
+  pthread_mutex_unlock(&set->lock);
+
+  return delay < set->config.hedge_min_ms ? set->config.hedge_min_ms : delay;
+}
+
+void nixbadge_upstream_set_report(nixbadge_upstream_set_t* set, size_t index,
+                                  bool ok, uint32_t latency_ms,
+                                  int64_t now_ms) {
+  nixbadge_upstream_t* upstream = &set->upstreams[index];
+
+  pthread_mutex_lock(&set->lock);
+  nixbadge_upstream_decay(set, upstream, now_ms);
+  if (ok) {
+    upstream->successes++;
+    upstream->score /= 2;
+    upstream->latencies[upstream->latency_next] = latency_ms;
+    upstream->latency_next = (upstream->latency_next + 1) % LATENCY_SAMPLES;
+    if (upstream->latency_count < LATENCY_SAMPLES) upstream->latency_count++;
+  } else {
+    upstream->failures++;
+    upstream->score += 1;
+  }
+  pthread_mutex_unlock(&set->lock);
+}
+
+void nixbadge_upstream_set_count_hedge(nixbadge_upstream_set_t* set,
+                                       size_t index) {
+  pthread_mutex_lock(&set->lock);
+  set->upstreams[index].hedges++;
+  pthread_mutex_unlock(&set->lock);
+}
+
+void nixbadge_upstream_set_route(nixbadge_upstream_set_t* set,
+                                 const char* nar_key, size_t index) {
+  if (!set->routes || strlen(nar_key) > NIXBADGE_CACHE_KEY_MAX) return;
+
+  pthread_mutex_lock(&set->lock);
+  nixbadge_upstream_route_t* route = NULL;
+  for (size_t i = 0; i < set->config.nar_routes; i++) {
+    if (strcmp(set->routes[i].key, nar_key) == 0) {
+      route = &set->routes[i];
+      break;
+    }
+  }
+
+  if (!route) {
+    route = &set->routes[set->route_next];
+    set->route_next = (set->route_next + 1) % set->config.nar_routes;
+    snprintf(route->key, sizeof(route->key), "%s", nar_key);
+  }
+  route->upstream = index;
+  pthread_mutex_unlock(&set->lock);
+}
+
+int nixbadge_upstream_set_lookup_route(nixbadge_upstream_set_t* set,
+                                       const char* nar_key) {
+  if (!set->routes || !nar_key[0]) return -1;
+
+  int index = -1;
+  pthread_mutex_lock(&set->lock);
+  for (size_t i = 0; i < set->config.nar_routes; i++) {
+    if (strcmp(set->routes[i].key, nar_key) == 0) {
+      index = set->routes[i].upstream;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&set->lock);
+  return index;
+}
+
+void nixbadge_upstream_set_get_stats(nixbadge_upstream_set_t* set,
+                                     size_t index, int64_t now_ms,
+                                     nixbadge_upstream_stats_t* stats) {
+  nixbadge_upstream_t* upstream = &set->upstreams[index];
+
+  pthread_mutex_lock(&set->lock);
+  stats->successes = upstream->successes;
+  stats->failures = upstream->failures;
+  stats->hedges = upstream->hedges;
+  stats->latency_ms =
+      upstream->latency_count > 0 ? nixbadge_upstream_percentile(upstream, 50)
+                                  : 0;
+  stats->score = nixbadge_upstream_decay(set, upstream, now_ms);
+  stats->down = stats->score >= set->config.down_score;
+  pthread_mutex_unlock(&set->lock);
+}
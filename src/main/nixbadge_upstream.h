@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ordered list of upstream caches with health and latency tracking.
+ *
+ * Every answer (or failure) of an upstream is reported back. Failures add
+ * to a score that decays with a half-life, so an upstream that went down
+ * is moved to the back of the order and comes back once it has been quiet
+ * for a while. Recent latencies give the delay after which a lookup should
+ * be hedged to the next upstream. The set also remembers which upstream
+ * answered the narinfo of a NAR, so the NAR is fetched from the same one.
+ */
+
+#define NIXBADGE_UPSTREAM_MAX 4
+#define NIXBADGE_UPSTREAM_HOST_MAX 64
+
+typedef struct nixbadge_upstream_set nixbadge_upstream_set_t;
+
+typedef struct {
+  /* Percentile of recent latencies to wait for before hedging. */
+  uint8_t hedge_percentile;
+  uint32_t hedge_min_ms;
+  /* Used until enough latencies have been seen. */
+  uint32_t hedge_initial_ms;
+  uint32_t health_half_life_ms;
+  /* Decayed failure score at which an upstream counts as down. */
+  float down_score;
+  /* Number of NAR to upstream mappings to remember. */
+  size_t nar_routes;
+} nixbadge_upstream_config_t;
+
+typedef struct {
+  uint32_t successes;
+  uint32_t failures;
+  uint32_t hedges;
+  uint32_t latency_ms;
+  float score;
+  bool down;
+} nixbadge_upstream_stats_t;
+
+/**
+ * Creates a set from a comma separated list of "host" or "host:port".
+ * @return the set, or NULL if the list is empty or out of memory
+ */
+nixbadge_upstream_set_t* nixbadge_upstream_set_new(
+    const char* list, const nixbadge_upstream_config_t* config);
+/**
+ * Takes and drops references; the set is freed with its last reference.
+ * nixbadge_upstream_set_new returns the first one.
+ */
+nixbadge_upstream_set_t* nixbadge_upstream_set_ref(nixbadge_upstream_set_t* set);
+void nixbadge_upstream_set_unref(nixbadge_upstream_set_t* set);
+
+size_t nixbadge_upstream_set_count(nixbadge_upstream_set_t* set);
+/**
+ * @param port set to the port, or 0 for the default one
+ */
+const char* nixbadge_upstream_set_host(nixbadge_upstream_set_t* set,
+                                       size_t index, int* port);
+
+/**
+ * Orders the upstreams to try: the healthy ones in configured order,
+ * followed by the ones that are down, least failing first.
+ * @param first upstream to put in front regardless, or -1
+ * @return the number of indices written to `order`
+ */
+size_t nixbadge_upstream_set_order(nixbadge_upstream_set_t* set, int first,
+                                   int64_t now_ms, size_t* order);
+/**
+ * How long to wait for an upstream before asking the next one.
+ */
+uint32_t nixbadge_upstream_set_hedge_delay(nixbadge_upstream_set_t* set,
+                                           size_t index);
+void nixbadge_upstream_set_report(nixbadge_upstream_set_t* set, size_t index,
+                                  bool ok, uint32_t latency_ms,
+                                  int64_t now_ms);
+void nixbadge_upstream_set_count_hedge(nixbadge_upstream_set_t* set,
+                                       size_t index);
+
+/**
+ * Remembers which upstream a NAR, named by its cache key, comes from.
+ */
+void nixbadge_upstream_set_route(nixbadge_upstream_set_t* set,
+                                 const char* nar_key, size_t index);
+/**
+ * @return the upstream a NAR was routed to, or -1
+ */
+int nixbadge_upstream_set_lookup_route(nixbadge_upstream_set_t* set,
+                                       const char* nar_key);
+
+void nixbadge_upstream_set_get_stats(nixbadge_upstream_set_t* set,
+                                     size_t index, int64_t now_ms,
+                                     nixbadge_upstream_stats_t* stats);
@@ -0,0 +1,265 @@
+#include "nixbadge_upstream_pool.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#define POOL_HOST_MAX 64
+#define POOL_CONNS_MAX \
+  (CONFIG_BADGE_UPSTREAM_POOL_HOSTS * CONFIG_BADGE_UPSTREAM_POOL_SIZE)
+#define POOL_BUFFER_SIZE (16 * 1024)
+#define POOL_STATS_INTERVAL 32
+#define POOL_TIMEOUT_MS 3000000
+
+static const char TAG[] = "nixbadge_upstream";
+
+struct nixbadge_upstream_conn {
+  char host[POOL_HOST_MAX];
+  int port;
+  bool https;
+  /* Holds the certificate the client was set up with. */
+  const nixbadge_config_t* config;
+
+  esp_http_client_handle_t client;
+  bool pooled;
+  bool borrowed;
+  bool connected;
+  uint32_t connects;
+  uint32_t borrow_connects;
+  int64_t last_used_us;
+
+  http_event_handle_cb handler;
+  void* user_data;
+};
+
+static SemaphoreHandle_t pool_lock = NULL;
+static nixbadge_upstream_conn_t pool[POOL_CONNS_MAX];
+static nixbadge_upstream_pool_stats_t pool_stats;
+
+/**
+ * Sits between esp_http_client and the borrower's event handler to keep
+ * track of when connections are really (re)established.
+ */
+static esp_err_t nixbadge_upstream_event(esp_http_client_event_t* evt) {
+  nixbadge_upstream_conn_t* conn = evt->user_data;
+
+  switch (evt->event_id) {
+    case HTTP_EVENT_ON_CONNECTED:
+      conn->connected = true;
+      conn->connects++;
+      conn->borrow_connects++;
+      xSemaphoreTake(pool_lock, portMAX_DELAY);
+      pool_stats.connects++;
+      if (conn->https && conn->connects > 1) pool_stats.tls_reconnects++;
+      xSemaphoreGive(pool_lock);
+      break;
+    case HTTP_EVENT_DISCONNECTED:
+      conn->connected = false;
+      break;
+    default:
+      break;
+  }
+
+  if (!conn->handler) return ESP_OK;
+  evt->user_data = conn->user_data;
+  esp_err_t err = conn->handler(evt);
+  evt->user_data = conn;
+  return err;
+}
+
+static bool nixbadge_upstream_conn_open(
+    nixbadge_upstream_conn_t* conn, const nixbadge_upstream_target_t* target) {
+  strlcpy(conn->host, target->host, sizeof(conn->host));
+  conn->port = target->port;
+  conn->https = target->https;
+  conn->connects = 0;
+  conn->connected = false;
+  conn->config = NULL;
+
+  esp_http_client_config_t config = {
+      .host = conn->host,
+      .path = "/",
+      .port = conn->port,
+      .event_handler = nixbadge_upstream_event,
+      .user_data = conn,
+      .buffer_size = POOL_BUFFER_SIZE,
+      .is_async = false,
+      .timeout_ms = POOL_TIMEOUT_MS,
+  };
+
+  if (conn->https) {
+    config.transport_type = HTTP_TRANSPORT_OVER_SSL;
+    config.save_client_session = true;
+    // Not copied by the client, so the snapshot is held until it is
+    // cleaned up.
+    conn->config = target->config ? nixbadge_config_ref(target->config) : NULL;
+    if (conn->config && conn->config->cache_cert) {
+      config.cert_pem = conn->config->cache_cert;
+      config.cert_len = conn->config->cache_cert_len;
+    }
+  }
+
+  conn->client = esp_http_client_init(&config);
+  if (conn->client) return true;
+
+  nixbadge_config_unref(conn->config);
+  conn->config = NULL;
+  return false;
+}
+
+static void nixbadge_upstream_conn_destroy(nixbadge_upstream_conn_t* conn) {
+  esp_http_client_cleanup(conn->client);
+  conn->client = NULL;
+  conn->connected = false;
+  nixbadge_config_unref(conn->config);
+  conn->config = NULL;
+}
+
+/* A reload that changes the certificate leaves old connections unmatched. */
+static bool nixbadge_upstream_conn_matches(
+    nixbadge_upstream_conn_t* conn, const nixbadge_upstream_target_t* target) {
+  if (!conn->client || conn->port != target->port ||
+      conn->https != target->https || strcmp(conn->host, target->host) != 0) {
+    return false;
+  }
+  return !conn->https ||
+         nixbadge_config_same_cert(conn->config, target->config);
+}
+
+static nixbadge_upstream_conn_t* nixbadge_upstream_conn_unpooled(
+    const nixbadge_upstream_target_t* target) {
+  nixbadge_upstream_conn_t* conn = calloc(1, sizeof(nixbadge_upstream_conn_t));
+  if (!conn || !nixbadge_upstream_conn_open(conn, target)) {
+    free(conn);
+    return NULL;
+  }
+  conn->borrowed = true;
+  return conn;
+}
+
+void nixbadge_upstream_pool_init() {
+  pool_lock = xSemaphoreCreateMutex();
+  if (!pool_lock) ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+}
+
+nixbadge_upstream_conn_t* nixbadge_upstream_pool_borrow(
+    const nixbadge_upstream_target_t* target, http_event_handle_cb handler,
+    void* user_data) {
+  if (target->oneshot) {
+    nixbadge_upstream_conn_t* conn = nixbadge_upstream_conn_unpooled(target);
+    if (!conn) return NULL;
+    conn->handler = handler;
+    conn->user_data = user_data;
+    return conn;
+  }
+
+  int64_t now = esp_timer_get_time();
+  int64_t idle_timeout = CONFIG_BADGE_UPSTREAM_IDLE_TIMEOUT * 1000000LL;
+  nixbadge_upstream_conn_t* found = NULL;
+  nixbadge_upstream_conn_t* spare = NULL;
+  nixbadge_upstream_conn_t* stale = NULL;
+  int per_host = 0;
+
+  xSemaphoreTake(pool_lock, portMAX_DELAY);
+  pool_stats.borrows++;
+
+  for (int i = 0; i < POOL_CONNS_MAX; i++) {
+    nixbadge_upstream_conn_t* conn = &pool[i];
+    if (!conn->client) {
+      if (!spare) spare = conn;
+      continue;
+    }
+    if (conn->borrowed) {
+      if (nixbadge_upstream_conn_matches(conn, target)) per_host++;
+      continue;
+    }
+
+    // Drop idle connections before the upstream silently does.
+    if (conn->connected && now - conn->last_used_us > idle_timeout) {
+      esp_http_client_close(conn->client);
+      conn->connected = false;
+      pool_stats.idle_closes++;
+    }
+
+    if (nixbadge_upstream_conn_matches(conn, target)) {
+      per_host++;
+      // Prefer connections that are still open.
+      if (!found || (conn->connected && !found->connected)) found = conn;
+    } else if (!stale || conn->last_used_us < stale->last_used_us) {
+      stale = conn;
+    }
+  }
+
+  if (!found && per_host < CONFIG_BADGE_UPSTREAM_POOL_SIZE) {
+    if (!spare && stale) {
+      // Make room by dropping the least recently used other host.
+      nixbadge_upstream_conn_destroy(stale);
+      spare = stale;
+    }
+    if (spare && nixbadge_upstream_conn_open(spare, target)) {
+      spare->pooled = true;
+      found = spare;
+    }
+  }
+
+  if (found) found->borrowed = true;
+  else pool_stats.overflows++;
+  xSemaphoreGive(pool_lock);
+
+  if (!found) found = nixbadge_upstream_conn_unpooled(target);
+  if (!found) return NULL;
+
+  found->handler = handler;
+  found->user_data = user_data;
+  found->borrow_connects = 0;
+  return found;
+}
+
+esp_http_client_handle_t nixbadge_upstream_conn_client(
+    nixbadge_upstream_conn_t* conn) {
+  return conn->client;
+}
+
+bool nixbadge_upstream_conn_reused(nixbadge_upstream_conn_t* conn) {
+  return conn->borrow_connects == 0;
+}
+
+void nixbadge_upstream_pool_return(nixbadge_upstream_conn_t* conn, bool ok) {
+  if (!conn->pooled) {
+    nixbadge_upstream_conn_destroy(conn);
+    free(conn);
+    return;
+  }
+
+  if (!ok && conn->connected) {
+    esp_http_client_close(conn->client);
+    conn->connected = false;
+  }
+  // Borrowers may shorten it for a single request.
+  esp_http_client_set_timeout_ms(conn->client, POOL_TIMEOUT_MS);
+
+  xSemaphoreTake(pool_lock, portMAX_DELAY);
+  if (ok && nixbadge_upstream_conn_reused(conn)) pool_stats.reuses++;
+  conn->handler = NULL;
+  conn->user_data = NULL;
+  conn->last_used_us = esp_timer_get_time();
+  conn->borrowed = false;
+  nixbadge_upstream_pool_stats_t stats = pool_stats;
+  xSemaphoreGive(pool_lock);
+
+  if (stats.borrows % POOL_STATS_INTERVAL == 0) {
+    ESP_LOGI(TAG,
+             "%lu borrows, %lu reuses, %lu connects (%lu TLS reconnects), "
+             "%lu idle closes, %lu overflows",
+             stats.borrows, stats.reuses, stats.connects, stats.tls_reconnects,
+             stats.idle_closes, stats.overflows);
+  }
+}
+
+void nixbadge_upstream_pool_get_stats(nixbadge_upstream_pool_stats_t* stats) {
+  xSemaphoreTake(pool_lock, portMAX_DELAY);
+  *stats = pool_stats;
+  xSemaphoreGive(pool_lock);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <esp_http_client.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nixbadge_config.h"
+
+/*
+ * Pool of persistent upstream HTTP clients, kept per upstream host so that
+ * requests reuse HTTP/1.1 keep-alive connections and, over HTTPS, offer
+ * the server the TLS session of the last connection when opening another.
+ */
+
+typedef struct nixbadge_upstream_conn nixbadge_upstream_conn_t;
+
+typedef struct {
+  const char* host;
+  int port;
+  bool https;
+  /*
+   * The snapshot whose upstream certificate HTTPS trusts, which every
+   * connection made for it holds a reference to.
+   */
+  const nixbadge_config_t* config;
+  /* Skip the pool, for hosts that are only talked to once in a while. */
+  bool oneshot;
+} nixbadge_upstream_target_t;
+
+typedef struct {
+  uint32_t borrows;
+  uint32_t reuses;
+  /* Connections opened, over TLS or not. */
+  uint32_t connects;
+  /*
+   * HTTPS connections opened by a client that was connected before, which
+   * offers the server its saved session. Whether the server took it up is
+   * not known.
+   */
+  uint32_t tls_reconnects;
+  uint32_t idle_closes;
+  uint32_t overflows;
+} nixbadge_upstream_pool_stats_t;
+
+void nixbadge_upstream_pool_init();
+
+/**
+ * Borrows a client connected (or ready to connect) to `target`. Events of
+ * the next request are delivered to `handler` with `user_data`. When the
+ * pool for the host is exhausted an unpooled client is returned instead,
+ * so borrowing never blocks.
+ */
+nixbadge_upstream_conn_t* nixbadge_upstream_pool_borrow(
+    const nixbadge_upstream_target_t* target, http_event_handle_cb handler,
+    void* user_data);
+esp_http_client_handle_t nixbadge_upstream_conn_client(
+    nixbadge_upstream_conn_t* conn);
+/**
+ * Whether the last request on this connection went over a connection that
+ * was already open rather than a fresh one.
+ */
+bool nixbadge_upstream_conn_reused(nixbadge_upstream_conn_t* conn);
+/**
+ * Returns a borrowed connection. Connections that saw an error are closed
+ * so the next borrower starts from a clean state.
+ */
+void nixbadge_upstream_pool_return(nixbadge_upstream_conn_t* conn, bool ok);
+
+void nixbadge_upstream_pool_get_stats(nixbadge_upstream_pool_stats_t* stats);
@@ -1,10 +1,74 @@
 #include "nixbadge_utils.h"
 
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <stdio.h>
 #include <sys/time.h>
 #include <time.h>
 
+#define TASKS_MAX 24
+
+/* Only ever appended to, a slot still NULL is being filled in. */
+static TaskHandle_t tasks[TASKS_MAX];
+static atomic_uint tasks_len;
+
+/* Taken by nixbadge_system_sample. */
+static atomic_uint heap_largest_block;
+static atomic_uint tasks_stack_free[TASKS_MAX];
+
 int64_t nixbadge_timestamp_now() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
   return (tv.tv_sec * 1000LL + (tv.tv_usec / 1000LL));
 }
+
+int64_t nixbadge_uptime_ms() { return esp_timer_get_time() / 1000; }
+
+void nixbadge_task_register(TaskHandle_t task) {
+  unsigned int index = atomic_fetch_add(&tasks_len, 1);
+  if (index < TASKS_MAX) tasks[index] = task;
+}
+
+BaseType_t nixbadge_task_create(TaskFunction_t fn, const char* name,
+                                uint32_t stack_size, void* arg,
+                                UBaseType_t priority) {
+  TaskHandle_t task;
+  BaseType_t ret = xTaskCreate(fn, name, stack_size, arg, priority, &task);
+  if (ret == pdPASS) nixbadge_task_register(task);
+  return ret;
+}
+
+void nixbadge_system_sample() {
+  atomic_store(&heap_largest_block,
+               heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  unsigned int len = atomic_load(&tasks_len);
+  for (unsigned int i = 0; i < len && i < TASKS_MAX; i++) {
+    if (!tasks[i]) continue;
+    atomic_store(&tasks_stack_free[i], uxTaskGetStackHighWaterMark(tasks[i]));
+  }
+}
+
+void nixbadge_system_write_metrics(nixbadge_metrics_writer_t* writer) {
+  nixbadge_metrics_value(writer, "nixbadge_heap_free_bytes", "gauge",
+                         "Free heap.", esp_get_free_heap_size());
+  nixbadge_metrics_value(writer, "nixbadge_heap_min_free_bytes", "gauge",
+                         "Lowest the free heap has been since boot.",
+                         esp_get_minimum_free_heap_size());
+  nixbadge_metrics_value(writer, "nixbadge_heap_largest_free_block_bytes",
+                         "gauge", "Largest block that can be allocated.",
+                         atomic_load(&heap_largest_block));
+
+  nixbadge_metrics_family(writer, "nixbadge_task_stack_free_bytes", "gauge",
+                          "Least stack a task has had left since it started.");
+  unsigned int len = atomic_load(&tasks_len);
+  for (unsigned int i = 0; i < len && i < TASKS_MAX; i++) {
+    // Not sampled yet.
+    unsigned int stack_free = atomic_load(&tasks_stack_free[i]);
+    if (!tasks[i] || stack_free == 0) continue;
+    char labels[48];
+    snprintf(labels, sizeof(labels), "task=\"%s\"", pcTaskGetName(tasks[i]));
+    nixbadge_metrics_sample(writer, "nixbadge_task_stack_free_bytes", labels,
+                            stack_free);
+  }
+}
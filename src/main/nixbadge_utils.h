@@ -1,5 +1,40 @@
 #pragma once
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <stdint.h>
 
+#include "nixbadge_metrics.h"
+
+/**
+ * Milliseconds since the epoch, once the time of day was set: by SNTP on
+ * the root, and from the mesh time on the other badges.
+ */
 int64_t nixbadge_timestamp_now();
+/**
+ * Milliseconds since boot, which never jump.
+ */
+int64_t nixbadge_uptime_ms();
+
+/**
+ * Keeps track of a task that runs for as long as the badge does, so that
+ * its stack usage shows up in the metrics.
+ */
+void nixbadge_task_register(TaskHandle_t task);
+/**
+ * Creates a task with xTaskCreate and registers it.
+ */
+BaseType_t nixbadge_task_create(TaskFunction_t fn, const char* name,
+                                uint32_t stack_size, void* arg,
+                                UBaseType_t priority);
+
+/**
+ * Samples the largest free heap block and the stack high-water marks of the
+ * registered tasks, which takes a walk over both, for the metrics to report.
+ * Run periodically.
+ */
+void nixbadge_system_sample();
+/**
+ * Writes the heap and the stack high-water marks as last sampled.
+ */
+void nixbadge_system_write_metrics(nixbadge_metrics_writer_t* writer);
@@ -0,0 +1,126 @@
+#include "nixbadge_ws2812.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Timings of a WS2812 in tenths of a microsecond. */
+#define WS2812_SHORT_TENTHS_US 3
+#define WS2812_LONG_TENTHS_US 9
+/* Low for this long latches the frame. */
+#define WS2812_RESET_US 50
+
+struct nixbadge_ws2812 {
+  /* The symbols of every byte, most significant bit first. */
+  uint32_t table[256][NIXBADGE_WS2812_BITS];
+  uint32_t bits[2];
+  uint32_t reset_code;
+  /* Where each channel the strip takes is in a pixel given. */
+  const uint8_t* order;
+  size_t channels;
+};
+
+static const uint8_t ws2812_orders[][4] = {
+    [NIXBADGE_WS2812_RGB] = {0, 1, 2},
+    [NIXBADGE_WS2812_GRB] = {1, 0, 2},
+    [NIXBADGE_WS2812_RGBW] = {0, 1, 2, 3},
+    [NIXBADGE_WS2812_GRBW] = {1, 0, 2, 3},
+};
+
+static uint32_t nixbadge_ws2812_symbol(uint32_t level0, uint32_t duration0,
+                                       uint32_t level1, uint32_t duration1) {
+  return duration0 | level0 << 15 | duration1 << 16 | level1 << 31;
+}
+
+static uint32_t nixbadge_ws2812_ticks(uint32_t resolution_hz,
+                                      uint32_t tenths_us) {
+  return (uint64_t)resolution_hz * tenths_us / 10000000;
+}
+
+/* Ticks of each half of the reset code. */
+static uint32_t nixbadge_ws2812_reset_ticks(uint32_t resolution_hz) {
+  return resolution_hz / 1000000 * WS2812_RESET_US / 2;
+}
+
+static size_t nixbadge_ws2812_order_channels(nixbadge_ws2812_order_t order) {
+  return order >= NIXBADGE_WS2812_RGBW ? 4 : 3;
+}
+
+nixbadge_ws2812_t* nixbadge_ws2812_new(const nixbadge_ws2812_config_t* config) {
+  if (config->order > NIXBADGE_WS2812_GRBW) return NULL;
+  nixbadge_ws2812_t* ws2812 = calloc(1, sizeof(*ws2812));
+  if (!ws2812) return NULL;
+
+  uint32_t short_ticks =
+      nixbadge_ws2812_ticks(config->resolution_hz, WS2812_SHORT_TENTHS_US);
+  uint32_t long_ticks =
+      nixbadge_ws2812_ticks(config->resolution_hz, WS2812_LONG_TENTHS_US);
+  ws2812->bits[0] = nixbadge_ws2812_symbol(1, short_ticks, 0, long_ticks);
+  ws2812->bits[1] = nixbadge_ws2812_symbol(1, long_ticks, 0, short_ticks);
+  uint32_t reset_ticks = nixbadge_ws2812_reset_ticks(config->resolution_hz);
+  ws2812->reset_code = nixbadge_ws2812_symbol(0, reset_ticks, 0, reset_ticks);
+
+  for (int byte = 0; byte < 256; byte++) {
+    for (int bit = 0; bit < NIXBADGE_WS2812_BITS; bit++) {
+      ws2812->table[byte][bit] =
+          ws2812->bits[(byte >> (NIXBADGE_WS2812_BITS - 1 - bit)) & 1];
+    }
+  }
+  ws2812->order = ws2812_orders[config->order];
+  ws2812->channels = nixbadge_ws2812_order_channels(config->order);
+  return ws2812;
+}
+
+void nixbadge_ws2812_free(nixbadge_ws2812_t* ws2812) { free(ws2812); }
+
+uint32_t nixbadge_ws2812_frame_us(const nixbadge_ws2812_config_t* config,
+                                  size_t len) {
+  size_t channels = nixbadge_ws2812_order_channels(config->order);
+  uint64_t bits = (uint64_t)(len - len % channels) * NIXBADGE_WS2812_BITS;
+  // Either bit is a short and a long half.
+  uint64_t bit_ticks =
+      nixbadge_ws2812_ticks(config->resolution_hz, WS2812_SHORT_TENTHS_US) +
+      nixbadge_ws2812_ticks(config->resolution_hz, WS2812_LONG_TENTHS_US);
+  uint64_t ticks =
+      bits * bit_ticks + 2 * nixbadge_ws2812_reset_ticks(config->resolution_hz);
+  return ticks * 1000000 / config->resolution_hz;
+}
+
+size_t nixbadge_ws2812_channels(const nixbadge_ws2812_t* ws2812) {
+  return ws2812->channels;
+}
+
+uint32_t nixbadge_ws2812_bit(const nixbadge_ws2812_t* ws2812, bool one) {
+  return ws2812->bits[one];
+}
+
+uint32_t nixbadge_ws2812_reset_code(const nixbadge_ws2812_t* ws2812) {
+  return ws2812->reset_code;
+}
+
+size_t nixbadge_ws2812_encode(const nixbadge_ws2812_t* ws2812,
+                              const uint8_t* pixels, size_t len,
+                              size_t written, uint32_t* symbols, size_t space,
+                              bool* done) {
+  size_t channels = ws2812->channels;
+  len -= len % channels;
+  size_t byte = written / NIXBADGE_WS2812_BITS;
+  size_t bytes = space / NIXBADGE_WS2812_BITS;
+  if (bytes > len - byte) bytes = len - byte;
+
+  size_t pixel = byte / channels, channel = byte % channels;
+  uint32_t* out = symbols;
+  for (size_t i = 0; i < bytes; i++) {
+    uint8_t value = pixels[pixel * channels + ws2812->order[channel]];
+    memcpy(out, ws2812->table[value], sizeof(ws2812->table[value]));
+    out += NIXBADGE_WS2812_BITS;
+    if (++channel == channels) {
+      channel = 0;
+      pixel++;
+    }
+  }
+
+  size_t count = out - symbols;
+  *done = byte + bytes == len && count < space;
+  if (*done) symbols[count++] = ws2812->reset_code;
+  return count;
+}
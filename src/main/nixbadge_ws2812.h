@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Turns pixels into the RMT symbols of a WS2812 strip, one symbol a bit,
+ * followed by the reset code that latches the frame.
+ *
+ * Every byte maps to its eight symbols through a table built once for the
+ * resolution of the channel, so that a refill is a copy of eight words per
+ * byte rather than a decision per bit. Refills start at the symbols written
+ * so far and hold no other state, so the same frame can be sent again.
+ *
+ * Symbols are words laid out like rmt_symbol_word_t: the duration and level
+ * of the high half in the low 16 bits, then those of the low half. Nothing
+ * here depends on ESP-IDF, so it builds and runs on the host too.
+ */
+
+#define NIXBADGE_WS2812_BITS 8
+
+/*
+ * The order the strip takes the channels of a pixel in. Pixels are given
+ * red, green, blue and white.
+ */
+typedef enum {
+  NIXBADGE_WS2812_RGB,
+  NIXBADGE_WS2812_GRB,
+  NIXBADGE_WS2812_RGBW,
+  NIXBADGE_WS2812_GRBW,
+} nixbadge_ws2812_order_t;
+
+typedef struct {
+  uint32_t resolution_hz;
+  nixbadge_ws2812_order_t order;
+} nixbadge_ws2812_config_t;
+
+typedef struct nixbadge_ws2812 nixbadge_ws2812_t;
+
+nixbadge_ws2812_t* nixbadge_ws2812_new(const nixbadge_ws2812_config_t* config);
+void nixbadge_ws2812_free(nixbadge_ws2812_t* ws2812);
+
+/**
+ * @param len bytes of pixels
+ * @return how long a frame takes on the wire, reset code included
+ */
+uint32_t nixbadge_ws2812_frame_us(const nixbadge_ws2812_config_t* config,
+                                  size_t len);
+
+/**
+ * @return channels of a pixel, 3 or 4
+ */
+size_t nixbadge_ws2812_channels(const nixbadge_ws2812_t* ws2812);
+
+/**
+ * @return the symbol of a bit
+ */
+uint32_t nixbadge_ws2812_bit(const nixbadge_ws2812_t* ws2812, bool one);
+uint32_t nixbadge_ws2812_reset_code(const nixbadge_ws2812_t* ws2812);
+
+/**
+ * Writes the next symbols of a frame, as many whole bytes as there is room
+ * for, and the reset code after the last.
+ * @param len bytes of pixels, of which a partial pixel at the end is left
+ *            out
+ * @param written symbols of the frame written before
+ * @param done set once the reset code was written
+ * @return symbols written, 0 when less than a byte's fits
+ */
+size_t nixbadge_ws2812_encode(const nixbadge_ws2812_t* ws2812,
+                              const uint8_t* pixels, size_t len,
+                              size_t written, uint32_t* symbols, size_t space,
+                              bool* done);
@@ -1,74 +1,326 @@
 const std = @import("std");
-const esp_idf = @import("esp-idf");
-const utils = @import("utils.zig");
-const Allocator = std.mem.Allocator;
-const der = std.crypto.asn1.der;
 
-pub const packet_size = 18;
+/// Largest packet sent over the mesh.
+pub const packet_size = 32;
+
+/// Bumped whenever the layout of a tag changes. Fields may be appended to
+/// the end of a tag without a bump, older badges skip what they don't know.
+pub const version = 3;
+
+/// Version, tag and the length of the payload, which follows.
+pub const header_size = 4;
 
 pub const Tag = enum(u8) {
     ping,
     req_ping,
+    reload_config,
+    digest,
+    telemetry,
+    telemetry_ack,
+    req_time,
+    time,
+    show,
+};
+
+/// Sent out to measure the links to the badges that answer it.
+pub const PingRequest = struct {
+    /// Goes up by one for every ping a badge sends.
+    seq: u32,
+    /// Station MAC of the badge that sent the ping.
+    origin: [6]u8,
+    /// Microseconds on the clock of the origin, wrapping.
+    sent_us: u32,
+
+    pub fn init() PingRequest {
+        return .{
+            .seq = 0,
+            .origin = [_]u8{0} ** 6,
+            .sent_us = 0,
+        };
+    }
+};
+
+/// The answer to a ping, which echoes it for the origin to match it up.
+pub const Ping = struct {
+    seq: u32,
+    origin: [6]u8,
+    sent_us: u32,
+    /// Station MAC of the badge that answered.
+    responder: [6]u8,
+
+    pub fn init() Ping {
+        return .{
+            .seq = 0,
+            .origin = [_]u8{0} ** 6,
+            .sent_us = 0,
+            .responder = [_]u8{0} ** 6,
+        };
+    }
+};
+
+/// Announces a new generation of a badge's cache digest, which peers then
+/// pull over HTTP since it does not fit in a packet.
+pub const Digest = struct {
+    ip: u32,
+    generation: u32,
+    count: u32,
+
+    pub fn init() Digest {
+        return .{
+            .ip = 0,
+            .generation = 0,
+            .count = 0,
+        };
+    }
+};
+
+/// Sent to the root now and then, which puts the mesh together from them.
+/// Laid out like nixbadge_telemetry_t, so that it can be passed to C.
+pub const Telemetry = extern struct {
+    mac: [6]u8,
+    ap: [6]u8,
+    parent: [6]u8,
+    ip: u32,
+    level: u8,
+    children: u8,
+    rssi: i8,
+    load: u8,
+    heap_kib: u16,
+
+    pub fn init() Telemetry {
+        return std.mem.zeroes(Telemetry);
+    }
+};
+
+/// The root's answer to a report, with when to send the next one.
+pub const TelemetryAck = struct {
+    interval_ms: u32,
+
+    pub fn init() TelemetryAck {
+        return .{ .interval_ms = 0 };
+    }
+};
+
+/// Sent to the parent to take the mesh time from it.
+pub const TimeRequest = struct {
+    /// Microseconds on the clock of the badge that asks, wrapping.
+    sent_us: u32,
+
+    pub fn init() TimeRequest {
+        return .{ .sent_us = 0 };
+    }
+};
+
+/// The answer to a time request, with the mesh time the parent got it and
+/// answered it, and how far that may be off.
+pub const Time = struct {
+    sent_us: u32,
+    received_us: i64,
+    answered_us: i64,
+    error_us: u32,
+    /// Bumped whenever the root steps the mesh time, which times from
+    /// before are then not comparable with.
+    epoch: u32,
+
+    pub fn init() Time {
+        return .{
+            .sent_us = 0,
+            .received_us = 0,
+            .answered_us = 0,
+            .error_us = 0,
+            .epoch = 0,
+        };
+    }
 };
 
+/// Announces the LED show a badge plays, which peers with an older one
+/// then pull over HTTP and play from the same start.
+pub const Show = struct {
+    ip: u32,
+    /// Bumped by every upload, so that the latest wins.
+    seq: u32,
+    /// Hash of the show, 0 for none.
+    id: u32,
+    /// Mesh time the show started, in milliseconds.
+    start_ms: i64,
+    size: u32,
+
+    pub fn init() Show {
+        return .{
+            .ip = 0,
+            .seq = 0,
+            .id = 0,
+            .start_ms = 0,
+            .size = 0,
+        };
+    }
+};
+
+pub const Error = error{
+    /// Shorter than its header or the payload it announces.
+    Truncated,
+    UnsupportedVersion,
+    UnknownTag,
+    /// Does not fit in a packet.
+    TooLarge,
+};
+
+/// Bytes a value takes on the wire, with byte slices counted as empty.
+///
+/// Integers, bools and enums are little endian and as wide as their type,
+/// arrays and structs are their elements in order, without padding, and
+/// byte slices are a length byte followed by the bytes.
+pub fn wireSize(comptime T: type) comptime_int {
+    return switch (@typeInfo(T)) {
+        .void => 0,
+        .bool => 1,
+        .int => |int| @divExact(int.bits, 8),
+        .@"enum" => |info| wireSize(info.tag_type),
+        .array => |array| array.len * wireSize(array.child),
+        .pointer => 1,
+        .@"struct" => |info| blk: {
+            comptime var size = 0;
+            inline for (info.fields) |f| size += wireSize(f.type);
+            break :blk size;
+        },
+        else => @compileError("No wire layout for " ++ @typeName(T)),
+    };
+}
+
+fn encodeValue(comptime T: type, value: T, buff: []u8, offset: usize) Error!usize {
+    switch (@typeInfo(T)) {
+        .void => return offset,
+        .bool => return encodeValue(u8, @intFromBool(value), buff, offset),
+        .int => {
+            const size = wireSize(T);
+            if (buff.len - offset < size) return error.TooLarge;
+            std.mem.writeInt(T, buff[offset..][0..size], value, .little);
+            return offset + size;
+        },
+        .@"enum" => |info| return encodeValue(info.tag_type, @intFromEnum(value), buff, offset),
+        .array => |array| {
+            var end = offset;
+            for (value) |item| end = try encodeValue(array.child, item, buff, end);
+            return end;
+        },
+        .pointer => |pointer| {
+            if (pointer.size != .slice or pointer.child != u8) {
+                @compileError("No wire layout for " ++ @typeName(T));
+            }
+            if (value.len > std.math.maxInt(u8) or buff.len - offset < 1 + value.len) {
+                return error.TooLarge;
+            }
+            buff[offset] = @intCast(value.len);
+            @memcpy(buff[offset + 1 ..][0..value.len], value);
+            return offset + 1 + value.len;
+        },
+        .@"struct" => |info| {
+            var end = offset;
+            inline for (info.fields) |f| end = try encodeValue(f.type, @field(value, f.name), buff, end);
+            return end;
+        },
+        else => @compileError("No wire layout for " ++ @typeName(T)),
+    }
+}
+
+/// Byte slices point into `buff`.
+fn decodeValue(comptime T: type, buff: []const u8, offset: *usize) Error!T {
+    switch (@typeInfo(T)) {
+        .void => return {},
+        .bool => return (try decodeValue(u8, buff, offset)) != 0,
+        .int => {
+            const size = wireSize(T);
+            if (buff.len - offset.* < size) return error.Truncated;
+            defer offset.* += size;
+            return std.mem.readInt(T, buff[offset.*..][0..size], .little);
+        },
+        .@"enum" => |info| {
+            const value = try decodeValue(info.tag_type, buff, offset);
+            return std.meta.intToEnum(T, value) catch return error.UnknownTag;
+        },
+        .array => |array| {
+            var value: T = undefined;
+            for (&value) |*item| item.* = try decodeValue(array.child, buff, offset);
+            return value;
+        },
+        .pointer => {
+            const len = try decodeValue(u8, buff, offset);
+            if (buff.len - offset.* < len) return error.Truncated;
+            defer offset.* += len;
+            return buff[offset.*..][0..len];
+        },
+        .@"struct" => |info| {
+            var value: T = undefined;
+            inline for (info.fields) |f| @field(value, f.name) = try decodeValue(f.type, buff, offset);
+            return value;
+        },
+        else => @compileError("No wire layout for " ++ @typeName(T)),
+    }
+}
+
+/// A mesh message: a header of the version, the tag and the length of the
+/// payload, then the fields of the payload laid out as by `wireSize`. The
+/// encoder and decoder for every tag are generated from its payload type,
+/// neither allocates.
 pub const Packet = union(Tag) {
-    ping: void,
-    req_ping: void,
+    ping: Ping,
+    req_ping: PingRequest,
+    reload_config: void,
+    digest: Digest,
+    telemetry: Telemetry,
+    telemetry_ack: TelemetryAck,
+    req_time: TimeRequest,
+    time: Time,
+    show: Show,
 
-    pub fn init(tag: std.meta.Tag(Packet)) Packet {
-        inline for (std.meta.fields(Packet)) |f| {
-            const expected: Tag = std.meta.stringToEnum(Tag, f.name) orelse unreachable;
-            if (tag == expected) {
-                return @unionInit(Packet, f.name, switch (f.type) {
-                    void => {},
-                    inline else => f.type.init(),
-                });
+    comptime {
+        for (std.meta.fields(Packet)) |f| {
+            if (header_size + wireSize(f.type) > packet_size) {
+                @compileError("Packet " ++ f.name ++ " does not fit in packet_size");
             }
         }
-        unreachable;
     }
 
-    pub fn decodeDer(decoder: *der.Decoder) !Packet {
-        const tag: Tag = try decoder.any(Tag);
-
+    pub fn init(tag: std.meta.Tag(Packet)) Packet {
         inline for (std.meta.fields(Packet)) |f| {
             const expected: Tag = std.meta.stringToEnum(Tag, f.name) orelse unreachable;
             if (tag == expected) {
                 return @unionInit(Packet, f.name, switch (f.type) {
                     void => {},
-                    inline else => try decoder.any(f.type),
+                    inline else => f.type.init(),
                 });
             }
         }
-        return error.Unexpected;
+        unreachable;
     }
 
-    pub fn encodeDer(self: Packet, encoder: *der.Encoder) !void {
-        switch (self) {
-            .req_ping, .ping => {},
-        }
+    /// Returns the part of `buff` that makes up the packet.
+    pub fn encode(self: Packet, buff: *[packet_size]u8) Error![]u8 {
+        const end = switch (self) {
+            inline else => |payload| try encodeValue(@TypeOf(payload), payload, buff, header_size),
+        };
 
-        try encoder.any(std.meta.activeTag(self));
+        buff[0] = version;
+        buff[1] = @intFromEnum(std.meta.activeTag(self));
+        std.mem.writeInt(u16, buff[2..header_size], @intCast(end - header_size), .little);
+        return buff[0..end];
     }
 
-    pub fn encode(self: Packet) ![packet_size]u8 {
-        var tmpbuff = [_]u8{0} ** (packet_size * 2);
-        var fba = std.heap.FixedBufferAllocator.init(&tmpbuff);
-
-        var encoder = der.Encoder.init(fba.allocator());
-        try encoder.buffer.ensureCapacity(packet_size);
-
-        try encoder.any(self);
-
-        var buff = [_]u8{0} ** packet_size;
-        const i: usize = @min(buff.len, encoder.buffer.data.len);
-        @memcpy(buff[0..i], encoder.buffer.data[0..i]);
+    /// Byte slices in the packet point into `buff`.
+    pub fn decode(buff: []const u8) Error!Packet {
+        if (buff.len < header_size) return error.Truncated;
+        if (buff[0] != version) return error.UnsupportedVersion;
+        const len = std.mem.readInt(u16, buff[2..header_size], .little);
+        if (buff.len - header_size < len) return error.Truncated;
+        const payload = buff[header_size..][0..len];
 
-        return buff;
-    }
-
-    pub fn decode(buff: []const u8) !Packet {
-        var decoder = der.Decoder{ .bytes = buff };
-        return try decoder.any(Packet);
+        const tag = std.meta.intToEnum(Tag, buff[1]) catch return error.UnknownTag;
+        switch (tag) {
+            inline else => |t| {
+                var offset: usize = 0;
+                const value = try decodeValue(std.meta.TagPayload(Packet, t), payload, &offset);
+                return @unionInit(Packet, @tagName(t), value);
+            },
+        }
     }
 };
@@ -1,2 +1,4 @@
 extern fn nixbadge_timestamp_now() callconv(.C) i64;
 pub const getTimestamp = nixbadge_timestamp_now;
+extern fn nixbadge_uptime_ms() callconv(.C) i64;
+pub const getUptime = nixbadge_uptime_ms;
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Serves a directory as a plain HTTP binary cache and drops connections.
+
+Point a badge at it with `gen_nvs.sh --cache-no-https
+--cache-upstream=HOST:PORT` to exercise resuming of interrupted NAR
+transfers. A store path can be pushed into the directory with
+`nix copy --to file://$PWD/cache /nix/store/...`.
+"""
+
+import argparse
+import http.server
+import os
+import re
+import threading
+
+RANGE_RE = re.compile(r"^bytes=(\d*)-(\d*)$")
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        path = os.path.join(self.server.root, self.path.split("?")[0].lstrip("/"))
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return
+
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        status = 200
+
+        match = RANGE_RE.match(self.headers.get("Range", ""))
+        if match and match.group(1) + match.group(2):
+            first, last = match.group(1), match.group(2)
+            if not first:
+                start = max(size - int(last), 0)
+            else:
+                start = int(first)
+                if last:
+                    end = min(int(last), size - 1)
+            if start >= size or start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", f"bytes */{size}")
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+
+        self.send_response(status)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", f'"{os.path.basename(path)}"')
+        if status == 206:
+            self.send_header("Content-Range", f"bytes {start}-{end}/{size}")
+        self.end_headers()
+
+        drop = self.server.should_drop() and status == 200
+        sent = 0
+        with open(path, "rb") as f:
+            f.seek(start)
+            remaining = end - start + 1
+            while remaining > 0:
+                chunk = f.read(min(remaining, 4096))
+                if not chunk:
+                    break
+                if drop and sent + len(chunk) > self.server.drop_after:
+                    chunk = chunk[: max(self.server.drop_after - sent, 0)]
+                    self.wfile.write(chunk)
+                    self.log_message("dropping %s after %d bytes", self.path,
+                                     sent + len(chunk))
+                    self.close_connection = True
+                    self.connection.shutdown(2)
+                    return
+                self.wfile.write(chunk)
+                sent += len(chunk)
+                remaining -= len(chunk)
+
+
+class Server(http.server.ThreadingHTTPServer):
+    def __init__(self, address, root, drop_every, drop_after):
+        super().__init__(address, Handler)
+        self.root = root
+        self.drop_every = drop_every
+        self.drop_after = drop_after
+        self.count = 0
+        self.lock = threading.Lock()
+
+    def should_drop(self):
+        if self.drop_every <= 0:
+            return False
+        with self.lock:
+            self.count += 1
+            return self.count % self.drop_every == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="directory laid out like a binary cache")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--drop-every", type=int, default=1,
+                        help="drop every Nth full response (0 to never drop)")
+    parser.add_argument("--drop-after", type=int, default=64 * 1024,
+                        help="bytes to send before dropping")
+    args = parser.parse_args()
+
+    server = Server(("", args.port), args.root, args.drop_every,
+                    args.drop_after)
+    print(f"Serving {args.root} on port {args.port}")
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
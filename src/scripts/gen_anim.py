@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""Compiles an LED animation from JSON to the format the badges play.
+
+The JSON has a palette, tracks of keyframes at absolute times and an
+optional loop, see main/nixbadge_anim.h for what they mean:
+
+    {
+      "loop": [0, 2000],
+      "palette": ["#000000", "#7e7ebf"],
+      "tracks": [
+        {"first": 0, "count": 0, "spread": -100, "keyframes": [
+          {"at": 0, "colour": 0},
+          {"at": 1000, "colour": 1, "easing": "ease-in-out"},
+          {"at": 2000, "colour": 0, "easing": "ease-in-out"}
+        ]}
+      ]
+    }
+
+    gen_anim.py wave.json --output wave.bin
+    curl --data-binary @wave.bin http://192.168.5.1:1008/badge/show
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+VERSION = 1
+EASINGS = ["step", "linear", "ease-in", "ease-out", "ease-in-out"]
+
+
+def colour(value):
+    value = value.lstrip("#")
+    if len(value) != 6:
+        raise ValueError(f"colour {value!r} is not #rrggbb")
+    return bytes.fromhex(value)
+
+
+def compile_anim(anim):
+    palette = [colour(c) for c in anim["palette"]]
+    if not 1 <= len(palette) <= 255:
+        raise ValueError("the palette takes 1 to 255 colours")
+    tracks = anim.get("tracks", [])
+    if len(tracks) > 32:
+        raise ValueError("at most 32 tracks")
+    loop_start, loop_end = anim.get("loop", [0, 0])
+    if loop_end and loop_end <= loop_start:
+        raise ValueError("the loop ends before it starts")
+
+    out = bytearray(b"NA")
+    out += struct.pack("<BBBBII", VERSION, len(palette), len(tracks), 0,
+                       loop_start, loop_end)
+    for c in palette:
+        out += c
+    for track in tracks:
+        keyframes = track["keyframes"]
+        if not 1 <= len(keyframes) <= 255:
+            raise ValueError("a track takes 1 to 255 keyframes")
+        out += struct.pack("<HHhBB", track.get("first", 0),
+                           track.get("count", 0), track.get("spread", 0),
+                           len(keyframes), 0)
+        at = 0
+        for key in keyframes:
+            delta = key["at"] - at
+            if not 0 <= delta <= 0xffff:
+                raise ValueError(f"keyframe at {key['at']} ms is out of order "
+                                 "or more than 65535 ms after the last")
+            if not 0 <= key["colour"] < len(palette):
+                raise ValueError(f"no colour {key['colour']} in the palette")
+            easing = EASINGS.index(key.get("easing", "linear"))
+            out += struct.pack("<HBB", delta, key["colour"], easing)
+            at = key["at"]
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="animation as JSON, - for stdin")
+    parser.add_argument("--output", default="anim.bin")
+    args = parser.parse_args()
+
+    with (sys.stdin if args.input == "-" else open(args.input)) as f:
+        anim = json.load(f)
+    data = compile_anim(anim)
+    with open(args.output, "wb") as f:
+        f.write(data)
+    print(f"{len(data)} bytes", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
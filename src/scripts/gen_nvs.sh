@@ -1,7 +1,7 @@
 #!/bin/sh
 
-cache_upstream=cache.nixos.lv
-cache_cert=$(dirname $0)/../../pkgs/nixbadge/cache.nixos.lv.pem
+cache_upstream=cache.nixos.lv,cache.nixos.org
+cache_certs=""
 cache_store=/nix/store
 cache_priority=40
 cache_use_https=1
@@ -12,7 +12,7 @@ output=nvs.bin
 while [[ $1 ]]; do
   case "$1" in
     --cache-cert=*)
-      cache_cert=${1#*=}
+      cache_certs="$cache_certs ${1#*=}"
       ;;
     --cache-upstream=*)
       cache_upstream=${1#*=}
@@ -41,13 +41,31 @@ while [[ $1 ]]; do
     --router-passwd=*)
       router_passwd=${1#*=}
       ;;
+    --sched-fast=*)
+      sched_fast=${1#*=}
+      ;;
+    --sched-bulk=*)
+      sched_bulk=${1#*=}
+      ;;
+    --sched-client=*)
+      sched_client=${1#*=}
+      ;;
+    --sched-rate=*)
+      sched_rate=${1#*=}
+      ;;
+    --leds=*)
+      leds_count=${1#*=}
+      ;;
+    --reload-token=*)
+      reload_token=${1#*=}
+      ;;
     --output=*)
       output=${1#*=}
       ;;
     --help|-h)
       echo "Options:"
-      echo "  --cache-cert=FILE     Certificate to use for connecting to the upstream cache"
-      echo "  --cache-upstream=DNS  Domain name for the upstream cache"
+      echo "  --cache-cert=FILE     Certificate to use for connecting to the upstream caches, can be repeated"
+      echo "  --cache-upstream=DNS  Comma separated domain names (and optionally :port) of the upstream caches, in order of preference"
       echo "  --cache-store=PATH    Path to say where the store is at"
       echo "  --cache-priority=PRI  Caching priority for substitution"
       echo "  --cache-use-https     Enable HTTPS with the upstream cache"
@@ -56,6 +74,12 @@ while [[ $1 ]]; do
       echo "  --boot-no-mesh        Disable ESP-MESH-LITE on boot"
       echo "  --router-ssid=SSID    Router SSID for ESP-MESH-LITE"
       echo "  --router-passwd=PSK   Password for the router for ESP-MESH-LITE"
+      echo "  --sched-fast=N        Workers that narinfo lookups may use at once (default all)"
+      echo "  --sched-bulk=N        Workers that NAR downloads may use at once (default all but one)"
+      echo "  --sched-client=N      NAR downloads one client may run at once (default an even split)"
+      echo "  --sched-rate=KIB      Bandwidth of NAR downloads from upstream per client in KiB/s (default no limit)"
+      echo "  --leds=N              LEDs on the strip, for one longer than the badge's own 12"
+      echo "  --reload-token=TOKEN  Bearer token for POST /badge/reload, up to 64 characters (default reloading is off)"
       echo "  --output=FILE         File path to output the generated NVS at"
       exit 0
       ;;
@@ -80,11 +104,19 @@ cache_store,data,string,$cache_store
 cache_upstream,data,string,$cache_upstream
 EOF
 
+if [ -z "$cache_certs" ]; then
+  cache_certs="$(dirname $0)/../../pkgs/nixbadge/cache.nixos.lv.pem $(dirname $0)/../../pkgs/nixbadge/cache.nixos.org.pem"
+fi
+
 if [ $cache_use_https -ne 0 ]; then
-  if [ ! -f "$cache_cert" ]; then
-    echo "Cache certificate is required!" >&1
-    exit 1
-  fi
+  cache_cert=$(mktemp)
+  for cert in $cache_certs; do
+    if [ ! -f "$cert" ]; then
+      echo "Cache certificate $cert is required!" >&1
+      exit 1
+    fi
+    cat "$cert" >>"$cache_cert"
+  done
 
   echo "cache_cert,file,string,$cache_cert" >>"$nvs_raw"
 fi
@@ -96,4 +128,23 @@ else
   echo "router_passwd,data,string,$router_passwd" >>"$nvs_raw"
 fi
 
+if [ -n "$sched_fast" ]; then
+  echo "sched_fast,data,u32,$sched_fast" >>"$nvs_raw"
+fi
+if [ -n "$sched_bulk" ]; then
+  echo "sched_bulk,data,u32,$sched_bulk" >>"$nvs_raw"
+fi
+if [ -n "$sched_client" ]; then
+  echo "sched_client,data,u32,$sched_client" >>"$nvs_raw"
+fi
+if [ -n "$sched_rate" ]; then
+  echo "sched_rate,data,u32,$sched_rate" >>"$nvs_raw"
+fi
+if [ -n "$leds_count" ]; then
+  echo "leds_count,data,u32,$leds_count" >>"$nvs_raw"
+fi
+if [ -n "$reload_token" ]; then
+  echo "reload_token,data,string,$reload_token" >>"$nvs_raw"
+fi
+
 python "$IDF_PATH"/components/nvs_flash/nvs_partition_generator/nvs_partition_gen.py generate "$nvs_raw" "$output" 0x3000
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Hammers a badge, or the proxy built with `zig build host`, with clients.
+
+Every client keeps its connection alive and fetches the given paths over
+and over until the time is up, then throughput and latency are reported.
+A path can be given more than once to weight it.
+
+    load_test.py --url http://192.168.4.1:1008 --clients 200 \\
+        /nix-cache-info /nar/0abc...nar.xz
+"""
+
+import argparse
+import asyncio
+import random
+import time
+from urllib.parse import urlsplit
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = []
+        self.bytes = 0
+        self.errors = 0
+        self.statuses = {}
+
+
+async def read_response(reader):
+    head = await reader.readuntil(b"\r\n\r\n")
+    lines = head.decode("latin-1").split("\r\n")
+    status = int(lines[0].split(" ", 2)[1])
+    headers = {}
+    for line in lines[1:]:
+        if ":" in line:
+            name, value = line.split(":", 1)
+            headers[name.strip().lower()] = value.strip()
+
+    size = 0
+    if "content-length" in headers:
+        size = int(headers["content-length"])
+        await reader.readexactly(size)
+    elif headers.get("transfer-encoding") == "chunked":
+        while True:
+            chunk = int((await reader.readline()).split(b";")[0], 16)
+            await reader.readexactly(chunk + 2)
+            size += chunk
+            if chunk == 0:
+                break
+    else:
+        size = len(await reader.read())
+
+    closed = headers.get("connection", "").lower() == "close"
+    return status, size, closed
+
+
+async def client(url, paths, deadline, stats):
+    reader = writer = None
+    while time.monotonic() < deadline:
+        path = random.choice(paths)
+        try:
+            if writer is None:
+                reader, writer = await asyncio.open_connection(
+                    url.hostname, url.port or 80
+                )
+            start = time.monotonic()
+            writer.write(
+                f"GET {path} HTTP/1.1\r\nHost: {url.netloc}\r\n\r\n".encode()
+            )
+            status, size, closed = await read_response(reader)
+            stats.latencies.append(time.monotonic() - start)
+            stats.bytes += size
+            stats.statuses[status] = stats.statuses.get(status, 0) + 1
+            if closed:
+                writer.close()
+                writer = None
+        except (OSError, asyncio.IncompleteReadError, ValueError):
+            stats.errors += 1
+            if writer is not None:
+                writer.close()
+            writer = None
+            await asyncio.sleep(0.1)
+    if writer is not None:
+        writer.close()
+
+
+def percentile(values, fraction):
+    return values[min(int(len(values) * fraction), len(values) - 1)]
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--url", default="http://127.0.0.1:8080")
+    parser.add_argument("--clients", type=int, default=100)
+    parser.add_argument("--duration", type=float, default=10)
+    parser.add_argument("paths", nargs="+")
+    args = parser.parse_args()
+
+    url = urlsplit(args.url)
+    stats = Stats()
+    deadline = time.monotonic() + args.duration
+    await asyncio.gather(
+        *(client(url, args.paths, deadline, stats) for _ in range(args.clients))
+    )
+
+    latencies = sorted(stats.latencies)
+    print(f"requests: {len(latencies)}  errors: {stats.errors}")
+    print(f"statuses: {dict(sorted(stats.statuses.items()))}")
+    print(
+        f"throughput: {len(latencies) / args.duration:.1f} req/s, "
+        f"{stats.bytes / args.duration / 1e6:.2f} MB/s"
+    )
+    if latencies:
+        print(
+            "latency: "
+            f"p50 {percentile(latencies, 0.5) * 1000:.1f} ms  "
+            f"p99 {percentile(latencies, 0.99) * 1000:.1f} ms  "
+            f"max {latencies[-1] * 1000:.1f} ms"
+        )
+
+
+if __name__ == "__main__":
+    asyncio.run(main())